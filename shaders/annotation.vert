@@ -0,0 +1,25 @@
+#version 330 core
+
+layout (location = 0) in vec2 pos;
+layout (location = 1) in vec2 offset;
+layout (location = 2) in float span;
+
+uniform mat4 projection_view_matrix;
+uniform float pixel_width; // world units per screen point
+uniform float line_thickness; // in screen points; zero for fill areas
+uniform float min_span_in_pixels; // smaller annotations are not drawn
+
+void main() {
+    float span_in_pixels = span / pixel_width;
+    float thickness = line_thickness;
+    if (span_in_pixels < 2.0f) {
+        // Zoomed out too far to make out any details: draw thinner lines
+        thickness = clamp(span_in_pixels, 1.0f, 2.0f) * 0.3f * thickness;
+    }
+    vec2 world_pos = pos + offset * (0.5f * thickness * pixel_width);
+    if (span_in_pixels < min_span_in_pixels) {
+        gl_Position = vec4(2.0f, 2.0f, 2.0f, 1.0f); // outside the clip volume -> discarded
+    } else {
+        gl_Position = projection_view_matrix * vec4(world_pos, 0.0f, 1.0f);
+    }
+}
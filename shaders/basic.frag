@@ -1,11 +1,19 @@
 #version 330 core
 
+// The tile shader uses this as well, with TEXTURE_ARRAY defined (tiles are stored as layers of texture arrays).
+#ifdef TEXTURE_ARRAY
+in VS_OUT {
+    vec3 tex_coord;
+} fs_in;
+uniform sampler2DArray the_texture;
+#else
 in VS_OUT {
     vec2 tex_coord;
 } fs_in;
+uniform sampler2D the_texture;
+#endif
 
 uniform vec3 bg_color;
-uniform sampler2D the_texture;
 uniform float black_level;
 uniform float white_level;
 uniform vec3 transparent_color;
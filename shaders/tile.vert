@@ -0,0 +1,27 @@
+#version 330 core
+
+layout (location = 0) in vec3 pos;
+layout (location = 1) in vec2 tex_coord;
+layout (location = 2) in vec2 tile_pos; // per instance: tile_x, tile_y
+layout (location = 3) in float layer; // per instance: layer in the texture array
+
+out VS_OUT {
+    vec3 tex_coord;
+} vs_out;
+
+uniform mat4 projection_view_matrix;
+uniform vec2 level_origin;
+uniform vec2 tile_side;
+uniform bool use_deformation;
+uniform sampler2D deformation_field; // displacement per grid point (in um)
+uniform vec2 deformation_field_extent; // grid size * grid spacing (in um)
+
+void main() {
+    vec2 world_pos = level_origin + (tile_pos + pos.xy) * tile_side;
+    if (use_deformation) {
+        // bilinear interpolation between the grid points (which sit at the texel centers)
+        world_pos += textureLod(deformation_field, world_pos / deformation_field_extent, 0.0f).xy;
+    }
+    gl_Position = projection_view_matrix * vec4(world_pos, pos.z, 1.0f);
+    vs_out.tex_coord = vec3(tex_coord, layer);
+}
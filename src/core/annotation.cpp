@@ -30,6 +30,8 @@
 static rgba_t default_group_color = RGBA(60, 220, 50, 255);
 
 #include "annotation_asap_xml.cpp"
+#include "annotation_binary.cpp"
+#include "annotation_spatial_index.cpp"
 
 i32 add_annotation_group(annotation_set_t* annotation_set, const char* name) {
 	annotation_group_t new_group = {};
@@ -349,12 +351,16 @@ void do_mouse_tool_create_freeform(app_state_t* app_state, input_t* input, scene
 					// add a point
 					arrput(freeform->coordinates, scene->mouse);
 					++freeform->coordinate_count;
+					annotation_invalidate_derived_calculations_from_coordinates(freeform);
+					notify_annotation_set_modified(annotation_set);
 				}
 			} else if (scene->is_dragging) {
 				// drop points along the way
 				if (distance_since_last_point > annotation_freeform_insert_interval_distance && distance_to_start_point > annotation_hover_distance) {
 					arrput(freeform->coordinates, scene->mouse);
 					++freeform->coordinate_count;
+					annotation_invalidate_derived_calculations_from_coordinates(freeform);
+					notify_annotation_set_modified(annotation_set);
 				}
 			} else if (scene->drag_ended) {
 
@@ -649,9 +655,11 @@ void interact_with_annotations(app_state_t* app_state, scene_t* scene, input_t*
 			annotation_set->is_split_mode = false;
 		} else if (scene->is_dragging && input->keyboard.key_ctrl.down && !scene->is_drag_vector_within_click_tolerance) {
 			// Multi-select by holding down Ctrl and dragging
+			// Only the hit test candidates can have an up-to-date distance to the cursor
 			float select_tolerance = 20.0f * scene->zoom.screen_point_width;
-			for (i32 i = 0; i < annotation_set->active_annotation_count; ++i) {
-				annotation_t* annotation = get_active_annotation(annotation_set, i);
+			i32 candidate_count = arrlen(annotation_set->spatial_index.hit_test_candidate_indices);
+			for (i32 i = 0; i < candidate_count; ++i) {
+				annotation_t* annotation = get_active_annotation(annotation_set, annotation_set->spatial_index.hit_test_candidate_indices[i]);
  				if (annotation->line_segment_distance_last_updated_frame == app_state->frame_counter && annotation->line_segment_distance_to_cursor < select_tolerance) {
 					bool did_select = false;
 					if (!annotation->selected) {
@@ -808,7 +816,13 @@ annotation_hit_result_t get_annotation_hit_result(app_state_t* app_state, annota
 	// Step 1: discard annotation if the point is outside the annotation's min/max coordinate bounds (plus a tolerance margin)
 	// Step 2: for the remaining annotations, calculate the distances from the point to each of the line segments between coordinates.
 	// Step 3: choose the annotation that has the closest distance.
-	for (i32 annotation_index = 0; annotation_index < annotation_set->active_annotation_count; ++annotation_index) {
+	// Only annotations near the point need to be checked; the spatial index tells us which ones those are.
+	bounds2f query_area = BOUNDS2F(point.x - bounds_check_tolerance, point.y - bounds_check_tolerance,
+	                               point.x + bounds_check_tolerance, point.y + bounds_check_tolerance);
+	annotation_spatial_index_query(annotation_set, query_area, &annotation_set->spatial_index.hit_test_candidate_indices);
+	i32 candidate_count = arrlen(annotation_set->spatial_index.hit_test_candidate_indices);
+	for (i32 candidate_index = 0; candidate_index < candidate_count; ++candidate_index) {
+		i32 annotation_index = annotation_set->spatial_index.hit_test_candidate_indices[candidate_index];
 		annotation_t* annotation = get_active_annotation(annotation_set, annotation_index);
 
         // Don't interact with hidden annotations (if the assingned group is flagged as hidden)
@@ -927,11 +941,14 @@ void deselect_annotation_coordinates(annotation_set_t* annotation_set) {
 
 void notify_annotation_set_modified(annotation_set_t* annotation_set) {
 	annotation_set->modified = true; // need to (auto-)save the changes
+	annotation_set->binary_store.need_save = true;
 	annotation_set->last_modification_time = get_clock();
+	annotation_set->spatial_index.need_check_invalidated = true; // coordinates of some annotations may have changed
+	annotation_set->gpu_buffers.need_check_invalidated = true;
 }
 
 void annotation_invalidate_derived_calculations_from_coordinates(annotation_t* annotation) {
-	u32 derived_calculation_flags_mask = (ANNOTATION_VALID_BOUNDS | ANNOTATION_VALID_TESSELATION | ANNOTATION_VALID_AREA | ANNOTATION_VALID_LENGTH);
+	u32 derived_calculation_flags_mask = (ANNOTATION_VALID_BOUNDS | ANNOTATION_VALID_TESSELATION | ANNOTATION_VALID_AREA | ANNOTATION_VALID_LENGTH | ANNOTATION_VALID_SPATIAL_INDEX | ANNOTATION_VALID_SIMPLIFICATION | ANNOTATION_VALID_GPU_BUFFERS);
 	annotation->fallback_valid_flags |= (annotation->valid_flags & derived_calculation_flags_mask);
 	annotation->valid_flags &= ~(derived_calculation_flags_mask);
 }
@@ -1094,6 +1111,8 @@ void delete_selected_annotations(app_state_t* app_state, annotation_set_t* annot
 			}
 		}
 		annotation_set->active_annotation_count = arrlen(annotation_set->active_annotation_indices);
+		annotation_spatial_index_invalidate(annotation_set);
+		annotation_gpu_buffers_invalidate(annotation_set);
 		notify_annotation_set_modified(annotation_set);
 		release_temp_memory(&temp_memory);
 	}
@@ -1106,6 +1125,8 @@ void delete_annotation(annotation_set_t* annotation_set, i32 active_annotation_i
 	destroy_annotation(annotation);
 	arrdel(annotation_set->active_annotation_indices, active_annotation_index);
 	--annotation_set->active_annotation_count;
+	annotation_spatial_index_invalidate(annotation_set);
+	annotation_gpu_buffers_invalidate(annotation_set);
 }
 
 void split_annotation(app_state_t* app_state, annotation_set_t* annotation_set, annotation_t* annotation, i32 first_coordinate_index, i32 second_coordinate_index) {
@@ -1270,15 +1291,6 @@ void annotation_draw_coordinate_dot(ImDrawList* draw_list, v2f point, float node
 	draw_list->AddCircleFilled(point, node_size, *(u32*)(&node_color), 12);
 }
 
-enum annotation_draw_condition_enum {
-	ANNOTATION_DRAW_NEVER = 0,
-	ANNOTATION_DRAW_ALWAYS = 1,
-	ANNOTATION_DRAW_IF_SELECTED = 2,
-	ANNOTATION_DRAW_IF_AT_LEAST_ONE_FEATURE_SET = 3,
-};
-
-annotation_draw_condition_enum annotation_draw_fill_area_condition = ANNOTATION_DRAW_IF_AT_LEAST_ONE_FEATURE_SET;
-
 bool annotation_need_draw_fill_area(annotation_t* annotation) {
 	if (annotation_highlight_inside_of_polygons && annotation->coordinate_count >= 3 && !annotation->is_open) {
 		switch(annotation_draw_fill_area_condition) {
@@ -1306,7 +1318,179 @@ bool annotation_need_draw_fill_area(annotation_t* annotation) {
 	return false;
 }
 
-static void draw_annotation_fill_area(temp_memory_t* temp_memory, app_state_t* app_state, scene_t* scene, v2f camera_min, annotation_t* annotation, rgba_t fill_color, ImDrawList* draw_list) {
+// Level of detail: when zoomed out, annotations with many coordinates are drawn using a simplified outline.
+// The simplification tolerance depends on the zoom level. To avoid recalculating the simplified outline every time
+// the zoom level changes a little, zoom levels are grouped into buckets (one bucket per power of two).
+static i32 annotation_get_lod_zoom_bucket(scene_t* scene) {
+	float tolerance_in_world_units = annotation_lod_simplification_tolerance * scene->zoom.pixel_width;
+	if (tolerance_in_world_units <= 0.0f) {
+		return INT32_MIN;
+	}
+	return (i32)floorf(log2f(tolerance_in_world_units));
+}
+
+// Douglas-Peucker polyline simplification.
+// Returns the number of coordinates in the simplified result, or -1 if the simplification could not be done.
+static i32 simplify_coordinates_douglas_peucker(v2f* coordinates, i32 coordinate_count, float tolerance, bool closed, v2f** result) {
+	if (coordinate_count < 3) {
+		return -1;
+	}
+	temp_memory_t temp_memory = begin_temp_memory_on_local_thread();
+	size_t bytes_needed = coordinate_count * (sizeof(bool) + 2 * sizeof(i32)) + 64;
+	if (arena_get_bytes_left(temp_memory.arena) < (i64)bytes_needed) {
+		release_temp_memory(&temp_memory);
+		return -1;
+	}
+	bool* keep = arena_push_array(temp_memory.arena, coordinate_count, bool);
+	memset(keep, 0, coordinate_count * sizeof(bool));
+	arena_align(temp_memory.arena, sizeof(i32));
+	i32* stack = arena_push_array(temp_memory.arena, coordinate_count * 2, i32);
+	i32 stack_size = 0;
+
+	// For closed polygons, index coordinate_count wraps around to the first coordinate.
+	// We split the polygon at the point farthest away from the first coordinate, so that neither half is degenerate.
+	keep[0] = true;
+	if (closed) {
+		i32 split_index = 1;
+		float max_distance_sq = -1.0f;
+		for (i32 i = 1; i < coordinate_count; ++i) {
+			float distance_sq = v2f_length_squared(v2f_subtract(coordinates[i], coordinates[0]));
+			if (distance_sq > max_distance_sq) {
+				max_distance_sq = distance_sq;
+				split_index = i;
+			}
+		}
+		keep[split_index] = true;
+		stack[stack_size++] = 0;
+		stack[stack_size++] = split_index;
+		stack[stack_size++] = split_index;
+		stack[stack_size++] = coordinate_count;
+	} else {
+		keep[coordinate_count - 1] = true;
+		stack[stack_size++] = 0;
+		stack[stack_size++] = coordinate_count - 1;
+	}
+
+	float tolerance_sq = SQUARE(tolerance);
+	while (stack_size > 0) {
+		i32 last = stack[--stack_size];
+		i32 first = stack[--stack_size];
+		if (last - first < 2) {
+			continue;
+		}
+		v2f line_start = coordinates[first];
+		v2f line_end = coordinates[last % coordinate_count];
+		i32 farthest_index = -1;
+		float max_distance_sq = tolerance_sq;
+		for (i32 i = first + 1; i < last; ++i) {
+			v2f projected = project_point_on_line_segment(coordinates[i], line_start, line_end, NULL);
+			float distance_sq = v2f_length_squared(v2f_subtract(coordinates[i], projected));
+			if (distance_sq > max_distance_sq) {
+				max_distance_sq = distance_sq;
+				farthest_index = i;
+			}
+		}
+		if (farthest_index >= 0) {
+			keep[farthest_index] = true;
+			// NOTE: each pop pushes at most two segments, and each segment contains at least one unique point,
+			// so the stack can never hold more than coordinate_count segments.
+			stack[stack_size++] = first;
+			stack[stack_size++] = farthest_index;
+			stack[stack_size++] = farthest_index;
+			stack[stack_size++] = last;
+		}
+	}
+
+	arrsetlen(*result, 0);
+	for (i32 i = 0; i < coordinate_count; ++i) {
+		if (keep[i]) {
+			arrput(*result, coordinates[i]);
+		}
+	}
+	release_temp_memory(&temp_memory);
+	return (i32)arrlen(*result);
+}
+
+static void annotation_update_simplified_coordinates_if_necessary(annotation_t* annotation, i32 zoom_bucket) {
+	if ((annotation->valid_flags & ANNOTATION_VALID_SIMPLIFICATION) && annotation->simplified_zoom_bucket == zoom_bucket) {
+		return;
+	}
+	float tolerance = exp2f((float)zoom_bucket);
+	i32 simplified_count = simplify_coordinates_douglas_peucker(annotation->coordinates, annotation->coordinate_count,
+	                                                           tolerance, !annotation->is_open, &annotation->simplified_coordinates);
+	if (simplified_count >= 2 && simplified_count < annotation->coordinate_count) {
+		annotation->simplified_coordinate_count = simplified_count;
+	} else {
+		// No improvement possible -> draw the original coordinates instead
+		arrfree(annotation->simplified_coordinates);
+		annotation->simplified_coordinate_count = 0;
+	}
+	annotation->simplified_zoom_bucket = zoom_bucket;
+	annotation->valid_flags |= ANNOTATION_VALID_SIMPLIFICATION;
+}
+
+// When zoomed out far, annotations smaller than a few pixels are not drawn individually. Instead, they are counted
+// in a coarse screen-space grid, and each occupied grid cell is drawn as a single small square (a 'density tile').
+typedef struct annotation_density_grid_t {
+	i32* counts;
+	u32* colors; // color of the first annotation counted in each cell
+	i32 width;
+	i32 height;
+	float cell_size;
+	bool is_active;
+} annotation_density_grid_t;
+
+static annotation_density_grid_t annotation_density_grid;
+
+static void annotation_density_grid_begin(scene_t* scene) {
+	annotation_density_grid_t* grid = &annotation_density_grid;
+	grid->cell_size = ATLEAST(1.0f, annotation_lod_density_cell_size);
+	grid->width = ATLEAST(1, (i32)ceilf(scene->viewport.w / grid->cell_size));
+	grid->height = ATLEAST(1, (i32)ceilf(scene->viewport.h / grid->cell_size));
+	i32 cell_count = grid->width * grid->height;
+	arrsetlen(grid->counts, cell_count);
+	arrsetlen(grid->colors, cell_count);
+	memset(grid->counts, 0, cell_count * sizeof(i32));
+	grid->is_active = true;
+}
+
+static void annotation_density_grid_add(v2f screen_pos, u32 color) {
+	annotation_density_grid_t* grid = &annotation_density_grid;
+	i32 cell_x = (i32)floorf(screen_pos.x / grid->cell_size);
+	i32 cell_y = (i32)floorf(screen_pos.y / grid->cell_size);
+	if (cell_x >= 0 && cell_x < grid->width && cell_y >= 0 && cell_y < grid->height) {
+		i32 cell_index = cell_y * grid->width + cell_x;
+		// Batches are drawn on several threads at once: only the first annotation in a cell sets the color of the cell.
+		if (atomic_increment((volatile i32*)(grid->counts + cell_index)) == 1) {
+			grid->colors[cell_index] = color;
+		}
+	}
+}
+
+static void annotation_density_grid_end_and_draw(ImDrawList* draw_list) {
+	annotation_density_grid_t* grid = &annotation_density_grid;
+	if (!grid->is_active) {
+		return;
+	}
+	for (i32 cell_y = 0; cell_y < grid->height; ++cell_y) {
+		for (i32 cell_x = 0; cell_x < grid->width; ++cell_x) {
+			i32 cell_index = cell_y * grid->width + cell_x;
+			i32 count = grid->counts[cell_index];
+			if (count > 0) {
+				// Denser cells are drawn more opaque
+				rgba_t color = *(rgba_t*)(grid->colors + cell_index);
+				float density_factor = CLAMP(0.4f + 0.2f * log2f((float)count), 0.4f, 1.0f);
+				color.a = (u8)(color.a * density_factor);
+				v2f p0 = V2F(cell_x * grid->cell_size, cell_y * grid->cell_size);
+				v2f p1 = V2F(p0.x + grid->cell_size, p0.y + grid->cell_size);
+				draw_list->AddRectFilled(p0, p1, *(u32*)(&color));
+			}
+		}
+	}
+	grid->is_active = false;
+}
+
+void annotation_tesselate_if_necessary(app_state_t* app_state, annotation_t* annotation) {
 	if (!(annotation->valid_flags & ANNOTATION_VALID_TESSELATION)) {
 		// Performance: don't tesselate large polygons too often (this is CPU intensive!)
 		if (annotation->coordinate_count < 10 || app_state->mouse_mode != MODE_DRAG_ANNOTATION_NODE) {
@@ -1321,6 +1505,10 @@ static void draw_annotation_fill_area(temp_memory_t* temp_memory, app_state_t* a
 			annotation->valid_flags |= ANNOTATION_VALID_TESSELATION;
 		}
 	}
+}
+
+static void draw_annotation_fill_area(temp_memory_t* temp_memory, app_state_t* app_state, scene_t* scene, v2f camera_min, annotation_t* annotation, rgba_t fill_color, ImDrawList* draw_list) {
+	annotation_tesselate_if_necessary(app_state, annotation);
 	if ((annotation->valid_flags | annotation->fallback_valid_flags) & ANNOTATION_VALID_TESSELATION) {
 		i32 triangle_count = arrlen(annotation->tesselated_trianges) / 3;
 		if (triangle_count > 0) {
@@ -1337,6 +1525,14 @@ static void draw_annotation_fill_area(temp_memory_t* temp_memory, app_state_t* a
 	}
 }
 
+static bool annotation_is_below_detail_threshold(scene_t* scene, annotation_t* annotation) {
+	if (!(annotation->valid_flags & ANNOTATION_VALID_BOUNDS) || annotation->is_open) {
+		return false;
+	}
+	float span = MAX(annotation->bounds.max.x - annotation->bounds.min.x, annotation->bounds.max.y - annotation->bounds.min.y);
+	return span / scene->zoom.pixel_width < ANNOTATION_MIN_SPAN_FOR_FULL_DRAW;
+}
+
 typedef struct annotation_batch_data_t {
 	i32 start_index;
 	i32 batch_size;
@@ -1351,16 +1547,31 @@ typedef struct annotation_batch_data_t {
 
 void draw_annotation_batch(app_state_t* app_state, scene_t* scene, annotation_set_t* annotation_set, v2f camera_min, i32 start_index, i32 batch_size, volatile i32* completion_counter, i32 logical_thread_index, i32 draw_list_index) {
 	ImDrawList* draw_list = gui_get_extra_drawlist(draw_list_index);
-	i32 end_index = MIN(start_index + batch_size, annotation_set->active_annotation_count);
-	for (i32 annotation_index = start_index; annotation_index < end_index; ++annotation_index) {
+	i32* visible_annotation_indices = annotation_set->spatial_index.visible_annotation_indices;
+	i32 end_index = MIN(start_index + batch_size, annotation_set->spatial_index.visible_annotation_count);
+	i32 lod_zoom_bucket = annotation_get_lod_zoom_bucket(scene);
+	for (i32 visible_index = start_index; visible_index < end_index; ++visible_index) {
+		i32 annotation_index = visible_annotation_indices[visible_index];
 		annotation_t* annotation = get_active_annotation(annotation_set, annotation_index);
 		annotation_group_t* group = annotation_set->stored_groups + annotation->group_id;
 		if (group->hidden) {
 			continue;
 		}
 
-		// Don't draw the annotation if it's out of view
+		// Most annotations are drawn from the GPU buffers. Selected annotations and annotations that are
+		// being edited are drawn here on top, because their appearance changes often.
+		// With level of detail enabled, the GPU buffers leave out annotations that are too small to make out;
+		// those are merged into the density tiles here instead.
 		annotation_recalculate_bounds_if_necessary(annotation);
+		bool is_filled_on_gpu = false;
+		if (annotation_gpu_buffers_contain(annotation_set, annotation_index, &is_filled_on_gpu)) {
+			if (!annotation->selected && annotation_index != annotation_set->editing_annotation_index &&
+			    !(annotation_density_grid.is_active && annotation_is_below_detail_threshold(scene, annotation))) {
+				continue;
+			}
+		}
+
+		// Don't draw the annotation if it's out of view
 		bounds2f extruded_camera_bounds = scene->camera_bounds;
 		float extrude_amount = 30.0f * scene->zoom.screen_point_width; // prevent pop-in at the edges e.g. due to the added thickness of the annotation outline
 		extruded_camera_bounds.min.x -= extrude_amount;
@@ -1386,15 +1597,20 @@ void draw_annotation_batch(app_state_t* app_state, scene_t* scene, annotation_se
 
 		// Decide whether we are zoomed in far enough to make out any details (if not, we'll skip full draw)
 		bool need_full_draw = true;
+		bool is_large_enough_to_fill = true;
 		if ((annotation->valid_flags & ANNOTATION_VALID_BOUNDS) && !annotation->is_open) {
 			float span_x = annotation->bounds.max.x - annotation->bounds.min.x;
 			float span_y = annotation->bounds.max.y - annotation->bounds.min.y;
 			float span = MAX(span_x, span_y);
 			float span_in_pixels = span / scene->zoom.pixel_width;
-			if (span_in_pixels < 2.0f) {
+			if (span_in_pixels < ANNOTATION_MIN_SPAN_FOR_FULL_DRAW) {
 				need_full_draw = false;
 				thickness = CLAMP(span_in_pixels, 1.0f, 2.0f) * 0.3f * thickness;
 			}
+			if (annotation_enable_level_of_detail && span_in_pixels < annotation_lod_min_fill_size) {
+				// Too small to make out the inside; also saves us the (CPU intensive) tesselation.
+				is_large_enough_to_fill = false;
+			}
 		}
 
 		if (annotation->coordinate_count > 0) {
@@ -1404,7 +1620,7 @@ void draw_annotation_batch(app_state_t* app_state, scene_t* scene, annotation_se
 			bool closed = !annotation->is_open;
 
 			// Draw the inside of the annotation
-			if (need_full_draw && annotation_need_draw_fill_area(annotation)) {
+			if (need_full_draw && is_large_enough_to_fill && !is_filled_on_gpu && annotation_need_draw_fill_area(annotation)) {
 				rgba_t fill_color = base_color;
 				fill_color.a = (u8)(annotation_highlight_opacity * 255.0f);
 				draw_annotation_fill_area(&temp_memory, app_state, scene, camera_min, annotation, fill_color, draw_list);
@@ -1423,21 +1639,31 @@ void draw_annotation_batch(app_state_t* app_state, scene_t* scene, annotation_se
 
 			// Draw the annotation in the background list (behind UI elements), as a thick colored line
 			if (need_full_draw) {
-				v2f* points = (v2f*) arena_push_size(temp_memory.arena, sizeof(v2f) * annotation->coordinate_count);
-				for (i32 i = 0; i < annotation->coordinate_count; ++i) {
-					points[i] = world_pos_to_screen_pos(scene, annotation->coordinates[i]);
+				// Use the simplified outline if the details would be lost at the current zoom level anyway
+				v2f* coordinates = annotation->coordinates;
+				i32 coordinate_count = annotation->coordinate_count;
+				if (annotation_enable_level_of_detail && !need_draw_nodes && coordinate_count > 8) {
+					annotation_update_simplified_coordinates_if_necessary(annotation, lod_zoom_bucket);
+					if (annotation->simplified_coordinate_count > 0) {
+						coordinates = annotation->simplified_coordinates;
+						coordinate_count = annotation->simplified_coordinate_count;
+					}
 				}
-				if (annotation->coordinate_count >= 4) {
-					gui_draw_polygon_outline(points, annotation->coordinate_count, line_color, closed, thickness, draw_list);
-				} else if (annotation->coordinate_count >= 2) {
+				v2f* points = (v2f*) arena_push_size(temp_memory.arena, sizeof(v2f) * coordinate_count);
+				for (i32 i = 0; i < coordinate_count; ++i) {
+					points[i] = world_pos_to_screen_pos(scene, coordinates[i]);
+				}
+				if (coordinate_count >= 4) {
+					gui_draw_polygon_outline(points, coordinate_count, line_color, closed, thickness, draw_list);
+				} else if (coordinate_count >= 2) {
 					draw_list->AddLine(points[0], points[1], *(u32*)(&line_color), thickness);
-					if (annotation->coordinate_count == 3) {
+					if (coordinate_count == 3) {
 						draw_list->AddLine(points[1], points[2], *(u32*)(&line_color), thickness);
 						if (closed) {
 							draw_list->AddLine(points[2], points[0], *(u32*)(&line_color), thickness);
 						}
 					}
-				} else if (annotation->coordinate_count == 1) {
+				} else if (coordinate_count == 1) {
 					// In this situation, need_draw_nodes is set to true (so we'll draw the node later)
 //				    annotation_draw_coordinate_dot(draw_list, points[0], annotation_node_size * 0.7f, base_color);
 				}
@@ -1448,7 +1674,12 @@ void draw_annotation_batch(app_state_t* app_state, scene_t* scene, annotation_se
 					float annotation_center_x = (annotation->bounds.max.x + annotation->bounds.min.x) * 0.5f;
 					float annotation_center_y = (annotation->bounds.max.y + annotation->bounds.min.y) * 0.5f;
 					v2f screen_pos = world_pos_to_screen_pos(scene, V2F(annotation_center_x, annotation_center_y));
-					draw_list->AddRectFilled(v2f_subtract(screen_pos, V2F(thickness, thickness)), v2f_add(screen_pos, V2F(thickness, thickness)), *(u32*)(&base_color));
+					if (annotation_density_grid.is_active) {
+						// Many annotations may end up on the same few pixels -> merge them into density tiles
+						annotation_density_grid_add(screen_pos, *(u32*)(&base_color));
+					} else {
+						draw_list->AddRectFilled(v2f_subtract(screen_pos, V2F(thickness, thickness)), v2f_add(screen_pos, V2F(thickness, thickness)), *(u32*)(&base_color));
+					}
 				}
 			}
 			release_temp_memory(&temp_memory);
@@ -1498,11 +1729,144 @@ void draw_annotation_batch_func(i32 logical_thread_index, void* userdata)  {
 }
 
 
+// Benchmark for drawing large annotation sets (console command: annotation_benchmark [count]).
+// While the benchmark is running, a synthetic annotation set is drawn instead of the loaded annotations.
+// The drawing time is measured over a number of frames, first with level of detail disabled and then enabled.
+// The level of detail only applies to the ImGui path, so the GPU buffers are switched off for the duration.
+#define ANNOTATION_BENCHMARK_FRAMES_PER_PASS 60
+
+typedef struct annotation_benchmark_t {
+	annotation_set_t annotation_set;
+	bool saved_enable_level_of_detail;
+	bool saved_draw_using_gpu_buffers;
+	i32 frame_index;
+	float total_draw_time[2];
+	i64 total_vertex_count[2];
+	bool is_active;
+} annotation_benchmark_t;
+
+static annotation_benchmark_t annotation_benchmark;
+
+static float annotation_benchmark_random_float(u32* rng_state) {
+	// xorshift32
+	u32 x = *rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*rng_state = x;
+	return (float)(x >> 8) / (float)(1 << 24);
+}
+
+void annotation_benchmark_begin(app_state_t* app_state, i32 annotation_count) {
+	if (annotation_benchmark.is_active) {
+		console_print_error("annotation_benchmark: a benchmark is already running\n");
+		return;
+	}
+	scene_t* scene = &app_state->scene;
+	annotation_set_t* annotation_set = &annotation_benchmark.annotation_set;
+	unload_and_reinit_annotations(annotation_set);
+	annotation_set->export_as_asap_xml = false;
+
+	// Scatter random polygons over the current view: mostly small ones (a few pixels across at the current zoom level),
+	// plus a few larger ones with many coordinates.
+	i64 start = get_clock();
+	u32 rng_state = 0x12345678;
+	bounds2f view = scene->camera_bounds;
+	float pixel_width = scene->zoom.screen_point_width;
+	arrsetcap(annotation_set->stored_annotations, annotation_count + 1);
+	arrsetcap(annotation_set->active_annotation_indices, annotation_count + 1);
+	for (i32 i = 0; i < annotation_count; ++i) {
+		annotation_t annotation = {};
+		annotation.type = ANNOTATION_POLYGON;
+		bool is_large = (i % 100) == 0;
+		i32 coordinate_count = is_large ? 200 : 8 + (i32)(annotation_benchmark_random_float(&rng_state) * 24.0f);
+		float radius = pixel_width * (is_large ? 20.0f + annotation_benchmark_random_float(&rng_state) * 200.0f : 0.2f + annotation_benchmark_random_float(&rng_state) * 10.0f);
+		v2f center = V2F(LERP(annotation_benchmark_random_float(&rng_state), view.min.x, view.max.x), LERP(annotation_benchmark_random_float(&rng_state), view.min.y, view.max.y));
+		arrsetlen(annotation.coordinates, coordinate_count);
+		for (i32 j = 0; j < coordinate_count; ++j) {
+			float angle = (2.0f * IM_PI * (float)j) / (float)coordinate_count;
+			float r = radius * (0.8f + 0.2f * annotation_benchmark_random_float(&rng_state));
+			annotation.coordinates[j] = V2F(center.x + r * cosf(angle), center.y + r * sinf(angle));
+		}
+		annotation.coordinate_count = coordinate_count;
+		annotation_set_automatic_name(&annotation, i);
+		arrput(annotation_set->stored_annotations, annotation);
+		arrput(annotation_set->active_annotation_indices, annotation_set->stored_annotation_count++);
+		annotation_set->active_annotation_count++;
+	}
+	console_print("annotation_benchmark: generated %d annotations in %g seconds\n", annotation_count, get_seconds_elapsed(start, get_clock()));
+
+	annotation_benchmark.saved_enable_level_of_detail = annotation_enable_level_of_detail;
+	annotation_benchmark.frame_index = 0;
+	memset(annotation_benchmark.total_draw_time, 0, sizeof(annotation_benchmark.total_draw_time));
+	memset(annotation_benchmark.total_vertex_count, 0, sizeof(annotation_benchmark.total_vertex_count));
+	annotation_benchmark.saved_draw_using_gpu_buffers = annotation_draw_using_gpu_buffers;
+	annotation_benchmark.is_active = true;
+	annotation_enable_level_of_detail = false;
+	annotation_draw_using_gpu_buffers = false;
+}
+
+// While the benchmark is running, draw the synthetic annotation set instead.
+annotation_set_t* annotation_get_set_to_draw(annotation_set_t* annotation_set) {
+	if (annotation_benchmark.is_active) {
+		return &annotation_benchmark.annotation_set;
+	}
+	return annotation_set;
+}
+
+static void annotation_benchmark_end_frame(float draw_time, i64 vertex_count) {
+	i32 pass = annotation_benchmark.frame_index / ANNOTATION_BENCHMARK_FRAMES_PER_PASS;
+	// Skip the first frame of each pass: this includes one-time costs (building the spatial index, simplification)
+	if (annotation_benchmark.frame_index % ANNOTATION_BENCHMARK_FRAMES_PER_PASS != 0) {
+		annotation_benchmark.total_draw_time[pass] += draw_time;
+		annotation_benchmark.total_vertex_count[pass] += vertex_count;
+	}
+	++annotation_benchmark.frame_index;
+	if (annotation_benchmark.frame_index == ANNOTATION_BENCHMARK_FRAMES_PER_PASS) {
+		annotation_enable_level_of_detail = true;
+	} else if (annotation_benchmark.frame_index == 2 * ANNOTATION_BENCHMARK_FRAMES_PER_PASS) {
+		i32 measured_frames = ANNOTATION_BENCHMARK_FRAMES_PER_PASS - 1;
+		for (i32 i = 0; i < 2; ++i) {
+			console_print("annotation_benchmark: level of detail %s: %.2f ms per frame, %lld vertices per frame\n",
+			              i == 0 ? "off" : "on ",
+			              annotation_benchmark.total_draw_time[i] * 1000.0f / measured_frames,
+			              (long long)(annotation_benchmark.total_vertex_count[i] / measured_frames));
+		}
+		annotation_enable_level_of_detail = annotation_benchmark.saved_enable_level_of_detail;
+		annotation_draw_using_gpu_buffers = annotation_benchmark.saved_draw_using_gpu_buffers;
+		destroy_annotation_set(&annotation_benchmark.annotation_set);
+		memset(&annotation_benchmark.annotation_set, 0, sizeof(annotation_set_t));
+		annotation_benchmark.is_active = false;
+	}
+}
+
 void draw_annotations(app_state_t* app_state, scene_t* scene, annotation_set_t* annotation_set, v2f camera_min) {
 	if (!scene->enable_annotations) return;
 
+	annotation_set = annotation_get_set_to_draw(annotation_set);
+	i64 draw_start = get_clock();
+	annotation_gpu_buffers_update(app_state, annotation_set);
+	i32 background_vertex_count_at_start = ImGui::GetBackgroundDrawList()->VtxBuffer.Size;
+
 	recount_selected_annotations(app_state, annotation_set);
 
+	// Find the annotations that might be in view
+	bounds2f extruded_camera_bounds = scene->camera_bounds;
+	float extrude_amount = 30.0f * scene->zoom.screen_point_width; // prevent pop-in at the edges e.g. due to the added thickness of the annotation outline
+	extruded_camera_bounds.min.x -= extrude_amount;
+	extruded_camera_bounds.min.y -= extrude_amount;
+	extruded_camera_bounds.max.x += extrude_amount;
+	extruded_camera_bounds.max.y += extrude_amount;
+	if (annotation_set->gpu_buffers.is_valid) {
+		// Most annotations are already drawn from the GPU buffers; only collect the ones that still need to be drawn here
+		float min_span = annotation_enable_level_of_detail ? ANNOTATION_MIN_SPAN_FOR_FULL_DRAW * scene->zoom.pixel_width : 0.0f;
+		annotation_gpu_buffers_collect_cpu_drawn(annotation_set, extruded_camera_bounds, min_span, &annotation_set->spatial_index.visible_annotation_indices);
+	} else {
+		annotation_spatial_index_query(annotation_set, extruded_camera_bounds, &annotation_set->spatial_index.visible_annotation_indices);
+	}
+	i32 visible_annotation_count = arrlen(annotation_set->spatial_index.visible_annotation_indices);
+	annotation_set->spatial_index.visible_annotation_count = visible_annotation_count;
+
 	// First, we do the noninteractive part of annotation drawing.
 	// This can be split into batches for multithreading. This improves performance for large annotation sets.
 	// Each batch must be drawn on a separate ImDrawList, because drawing in ImGui generally isn't thread-safe.
@@ -1511,20 +1875,23 @@ void draw_annotations(app_state_t* app_state, scene_t* scene, annotation_set_t*
 	// https://github.com/ocornut/imgui/issues/6167
 	// https://github.com/ocornut/imgui/issues/5776
 	i32 annotations_per_batch = 2000;
-	i32 annotation_batch_count = (annotation_set->active_annotation_count + annotations_per_batch - 1) / annotations_per_batch;
+	i32 annotation_batch_count = (visible_annotation_count + annotations_per_batch - 1) / annotations_per_batch;
 	global_active_extra_drawlists = MAX(annotation_batch_count, global_active_extra_drawlists);
 	if (global_active_extra_drawlists > MAX_EXTRA_DRAWLISTS) {
 		// If the number of annotations is extremely large, we don't have enough drawlists.
 		// In this case, we'll split evenly over the drawlists we have.
-		annotations_per_batch = (annotation_set->active_annotation_count + annotations_per_batch - 1) / MAX_EXTRA_DRAWLISTS;
+		annotations_per_batch = (visible_annotation_count + MAX_EXTRA_DRAWLISTS - 1) / MAX_EXTRA_DRAWLISTS;
 		annotation_batch_count = MAX_EXTRA_DRAWLISTS;
 		global_active_extra_drawlists = MAX_EXTRA_DRAWLISTS;
 	}
+	if (annotation_enable_level_of_detail) {
+		annotation_density_grid_begin(scene);
+	}
 	volatile i32 completion_counter = 0;
 	if (enable_multithreaded_annotation_drawing) {
 		for (i32 batch = 0; batch < annotation_batch_count; ++batch) {
 			i32 start_index = batch * annotations_per_batch;
-			i32 batch_size = MIN(annotation_set->active_annotation_count - start_index, annotations_per_batch);
+			i32 batch_size = MIN(visible_annotation_count - start_index, annotations_per_batch);
 			annotation_batch_data_t batch_data = {
 				.start_index = start_index,
 				.batch_size = batch_size,
@@ -1551,7 +1918,7 @@ void draw_annotations(app_state_t* app_state, scene_t* scene, annotation_set_t*
 	} else {
 		for (i32 batch = 0; batch < annotation_batch_count; ++batch) {
 			i32 start_index = batch * annotations_per_batch;
-			i32 batch_size = MIN(annotation_set->active_annotation_count - start_index, annotations_per_batch);
+			i32 batch_size = MIN(visible_annotation_count - start_index, annotations_per_batch);
 			draw_annotation_batch(app_state, scene, annotation_set, camera_min, start_index, batch_size, &completion_counter, 0, batch);
 		}
 	}
@@ -1560,6 +1927,7 @@ void draw_annotations(app_state_t* app_state, scene_t* scene, annotation_set_t*
 	// Second, do the interactive part of annotation drawing, which cannot be multithreaded.
 	bool did_popup = false;
 	ImDrawList* draw_list = ImGui::GetBackgroundDrawList();
+	annotation_density_grid_end_and_draw(draw_list);
 	// Prevent acute angles in annotations being drawn incorrectly (at least until ImGui bug is fixed):
 	// https://github.com/ocornut/imgui/issues/3366
 	// https://github.com/ocornut/imgui/pull/2964
@@ -1568,7 +1936,8 @@ void draw_annotations(app_state_t* app_state, scene_t* scene, annotation_set_t*
 
 	// TODO: test multithreaded annotation drawing on Linux
 	// TODO: create a separate work queue (and thread pool?) for IO tasks that may block (or alternative: use fibers that can be resumed?) - test with MMS test
-	for (i32 annotation_index = 0; annotation_index < annotation_set->active_annotation_count; ++annotation_index) {
+	for (i32 visible_index = 0; visible_index < visible_annotation_count; ++visible_index) {
+		i32 annotation_index = annotation_set->spatial_index.visible_annotation_indices[visible_index];
 		annotation_t* annotation = get_active_annotation(annotation_set, annotation_index);
         annotation_group_t* group = annotation_set->stored_groups + annotation->group_id;
         if (group->hidden) {
@@ -1578,12 +1947,6 @@ void draw_annotations(app_state_t* app_state, scene_t* scene, annotation_set_t*
 		// Don't draw the annotation if it's out of view
 		// TODO: Refactor (calculate drawing parameters)
 		annotation_recalculate_bounds_if_necessary(annotation);
-		bounds2f extruded_camera_bounds = scene->camera_bounds;
-		float extrude_amount = 30.0f * scene->zoom.screen_point_width; // prevent pop-in at the edges e.g. due to the added thickness of the annotation outline
-		extruded_camera_bounds.min.x -= extrude_amount;
-		extruded_camera_bounds.min.y -= extrude_amount;
-		extruded_camera_bounds.max.x += extrude_amount;
-		extruded_camera_bounds.max.y += extrude_amount;
 		if (!are_bounds2f_overlapping(extruded_camera_bounds, annotation->bounds)) {
 			continue;
 		}
@@ -1790,6 +2153,14 @@ void draw_annotations(app_state_t* app_state, scene_t* scene, annotation_set_t*
 			ImGui::EndPopup();
 		}
 	}
+
+	if (annotation_benchmark.is_active) {
+		i64 vertex_count = draw_list->VtxBuffer.Size - background_vertex_count_at_start;
+		for (i32 i = 0; i < annotation_batch_count; ++i) {
+			vertex_count += gui_get_extra_drawlist(i)->VtxBuffer.Size;
+		}
+		annotation_benchmark_end_frame(get_seconds_elapsed(draw_start, get_clock()), vertex_count);
+	}
 }
 
 void center_scene_on_annotation(scene_t* scene, annotation_t* annotation) {
@@ -2365,6 +2736,20 @@ void draw_annotations_window(app_state_t* app_state, input_t* input) {
 			ImGui::SliderFloat("Freeform node interval", &annotation_freeform_insert_interval_distance, 1.0f, 100.0f, "%.0f px");
 
 			ImGui::NewLine();
+			ImGui::Checkbox("Draw annotations using GPU vertex buffers", &annotation_draw_using_gpu_buffers);
+			ImGui::Checkbox("Simplify annotations when zoomed out (level of detail)", &annotation_enable_level_of_detail);
+			if (!annotation_enable_level_of_detail) {
+				ImGui::BeginDisabled();
+			}
+			ImGui::SliderFloat("Simplification tolerance", &annotation_lod_simplification_tolerance, 0.1f, 4.0f, "%.1f px");
+			ImGui::SliderFloat("Minimum size for highlighting", &annotation_lod_min_fill_size, 0.0f, 50.0f, "%.0f px");
+			ImGui::SliderFloat("Density tile size", &annotation_lod_density_cell_size, 1.0f, 16.0f, "%.0f px");
+			if (!annotation_enable_level_of_detail) {
+				ImGui::EndDisabled();
+			}
+
+			ImGui::NewLine();
+			ImGui::Checkbox("Autosave to binary annotation store (export XML only when saving or closing)", &annotation_autosave_to_binary_store);
 			ImGui::Checkbox("Save in both XML and JSON formats", &app_state->export_as_coco);
 		}
 
@@ -2730,6 +3115,8 @@ annotation_t duplicate_annotation(annotation_t* annotation) {
 	result.valid_flags = 0;
 	result.fallback_valid_flags = 0;
 	result.tesselated_trianges = NULL;
+	result.simplified_coordinates = NULL;
+	result.simplified_coordinate_count = 0;
 
 	return result;
 }
@@ -2738,6 +3125,7 @@ void destroy_annotation(annotation_t* annotation) {
 	if (annotation) {
 		arrfree(annotation->coordinates);
 		arrfree(annotation->tesselated_trianges);
+		arrfree(annotation->simplified_coordinates);
 	}
 }
 
@@ -2747,6 +3135,8 @@ void destroy_annotation_set(annotation_set_t* annotation_set) {
 		console_print("destroy_annotation_set(): failed to get an exclusive lock on the annotation set, retrying...\n");
 		platform_sleep(100);
 	}
+	cancel_loading_asap_xml_annotations(annotation_set);
+	cancel_loading_coco_annotations(annotation_set);
 	// destroy old state
 	for (i32 i = 0; i < annotation_set->stored_annotation_count; ++i) {
 		destroy_annotation(annotation_set->stored_annotations + i);
@@ -2757,6 +3147,9 @@ void destroy_annotation_set(annotation_set_t* annotation_set) {
 	arrfree(annotation_set->active_group_indices);
 	arrfree(annotation_set->stored_features);
 	arrfree(annotation_set->active_feature_indices);
+	arrfree(annotation_set->selected_annotation_indices);
+	annotation_spatial_index_destroy(&annotation_set->spatial_index);
+	annotation_gpu_buffers_destroy(&annotation_set->gpu_buffers);
 	if (annotation_set->coco.is_valid) coco_destroy(&annotation_set->coco);
 
 }
@@ -2837,6 +3230,11 @@ void save_geojson_annotations(annotation_set_t* annotation_set, const char* file
 annotation_set_t* duplicate_annotation_set(annotation_set_t* annotation_set) {
 	annotation_set_t* copy = (annotation_set_t*)malloc(sizeof(annotation_set_t));
 	*copy = *annotation_set;
+	memset(&copy->spatial_index, 0, sizeof(copy->spatial_index)); // not needed for the copy, don't share the arrays
+	memset(&copy->gpu_buffers, 0, sizeof(copy->gpu_buffers));
+	copy->asap_xml_loader = NULL;
+	copy->coco_loader = NULL;
+	copy->selected_annotation_indices = NULL;
 
 	copy->stored_annotations = NULL;
 	arrsetlen(copy->stored_annotations, copy->stored_annotation_count);
@@ -2910,7 +3308,10 @@ static void save_asap_xml_async_func(i32 logical_thread_id, void* userdata) {
 }
 
 void save_annotations(app_state_t* app_state, annotation_set_t* annotation_set, bool force_ignore_delay, bool async) {
-	if (!annotation_set->modified) return; // no changes, nothing to do
+	bool use_binary_store = annotation_autosave_to_binary_store;
+	bool binary_store_needs_save = use_binary_store && annotation_set->binary_store.need_save;
+	if (!annotation_set->modified && !binary_store_needs_save) return; // no changes, nothing to do
+	if (annotation_set->asap_xml_loader || annotation_set->coco_loader) return; // still loading; don't overwrite the file with an incomplete set
 
 	bool proceed = force_ignore_delay;
 	if (!force_ignore_delay) {
@@ -2936,8 +3337,14 @@ void save_annotations(app_state_t* app_state, annotation_set_t* annotation_set,
 				snprintf(annotation_set->asap_xml_filename, sizeof(annotation_set->asap_xml_filename), "%s%s", get_annotation_directory(app_state), image_name_buf);
 				annotation_set->asap_xml_filename[sizeof(annotation_set->asap_xml_filename)-1] = '\0';
 			}
+			if (annotation_set->binary_store.filename[0] == '\0') {
+				annotation_binary_store_set_filename(annotation_set, annotation_set->asap_xml_filename);
+			}
 
-			if (async) {
+			// With the binary store enabled, autosave only writes the changed annotations to the binary store.
+			// The XML file is exported only when saving explicitly, or when closing.
+			bool need_export_xml = annotation_set->modified && (force_ignore_delay || !use_binary_store);
+			if (need_export_xml && async) {
 				// Saving large annotation sets on the main thread may lead to annoying stalls.
 				// If the situation allows for it, we can save the annotations in the background.
 
@@ -2957,10 +3364,21 @@ void save_annotations(app_state_t* app_state, annotation_set_t* annotation_set,
 					destroy_annotation_set(copy);
 					free(copy);
 				}
-			} else {
+			} else if (need_export_xml) {
 				// Save annotations synchronously on the main thread
 				save_asap_xml_annotations_with_backup(app_state, annotation_set, annotation_set->asap_xml_filename);
 			}
+			if (need_export_xml) {
+				annotation_set->modified = false;
+			}
+			if (use_binary_store) {
+				// NOTE: this must happen after exporting the XML file, so that the binary store has the newer timestamp
+				// (if it fails because a previous write is still in progress, need_save stays set and we try again later)
+				save_annotation_binary_store(annotation_set, async);
+			}
+		} else {
+			annotation_set->modified = false;
+			annotation_set->binary_store.need_save = false;
 		}
 		// TODO: remove COCO support
 		/*if (app_state->export_as_coco && annotation_set->coco_filename) {
@@ -2979,8 +3397,6 @@ void save_annotations(app_state_t* app_state, annotation_set_t* annotation_set,
 			}
 			memrw_destroy(&out);
 		}*/
-		annotation_set->modified = false;
-
 
 	}
 }
@@ -2988,11 +3404,13 @@ void save_annotations(app_state_t* app_state, annotation_set_t* annotation_set,
 void recount_selected_annotations(app_state_t* app_state, annotation_set_t* annotation_set) {
 	i32 selection_count = 0;
 	annotation_set->selected_annotations = (annotation_t**) arena_current_pos(&app_state->temp_arena);
+	arrsetlen(annotation_set->selected_annotation_indices, 0);
 	for (i32 i = 0; i < annotation_set->active_annotation_count; ++i) {
 		annotation_t* annotation = get_active_annotation(annotation_set, i);
 		if (annotation->selected) {
 			arena_push_array(&app_state->temp_arena, 1, annotation_t*); // reserve
 			annotation_set->selected_annotations[selection_count] = annotation;
+			arrput(annotation_set->selected_annotation_indices, i);
 			++selection_count;
 		}
 	}
@@ -3024,9 +3442,11 @@ annotation_set_t create_offsetted_annotation_set_for_area(annotation_set_t* anno
 	float area_width = area.max.x - area.min.x;
 	float area_height = area.max.y - area.min.y;
 
-	// Copy annotations
-	for (i32 annotation_index = 0; annotation_index < annotation_set->active_annotation_count; ++annotation_index) {
-		annotation_t* annotation = get_active_annotation(annotation_set, annotation_index);
+	// Copy annotations (only the ones that might overlap with the area need to be checked)
+	i32* candidate_indices = NULL;
+	annotation_spatial_index_query(annotation_set, area, &candidate_indices);
+	for (i32 candidate_index = 0; candidate_index < arrlen(candidate_indices); ++candidate_index) {
+		annotation_t* annotation = get_active_annotation(annotation_set, candidate_indices[candidate_index]);
 
 		// check bounds
 		annotation_recalculate_bounds_if_necessary(annotation);
@@ -3055,6 +3475,7 @@ annotation_set_t create_offsetted_annotation_set_for_area(annotation_set_t* anno
 
 		}
 	}
+	arrfree(candidate_indices);
 
 	return result_set;
 }
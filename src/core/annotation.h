@@ -30,6 +30,8 @@ extern "C" {
 #endif
 
 typedef struct scene_t scene_t;
+typedef struct asap_xml_loader_t asap_xml_loader_t;
+typedef struct coco_loader_t coco_loader_t;
 
 typedef enum annotation_type_enum {
 	ANNOTATION_UNKNOWN_TYPE = 0,
@@ -46,12 +48,22 @@ typedef enum annotation_type_enum {
 
 #define MAX_ANNOTATION_FEATURES 64
 
+typedef enum annotation_draw_condition_enum {
+	ANNOTATION_DRAW_NEVER = 0,
+	ANNOTATION_DRAW_ALWAYS = 1,
+	ANNOTATION_DRAW_IF_SELECTED = 2,
+	ANNOTATION_DRAW_IF_AT_LEAST_ONE_FEATURE_SET = 3,
+} annotation_draw_condition_enum;
+
 enum annotation_valid_flags_enum {
 	ANNOTATION_VALID_BOUNDS = 1,
 	ANNOTATION_VALID_TESSELATION = 2,
 	ANNOTATION_VALID_AREA = 4,
 	ANNOTATION_VALID_LENGTH = 8,
 	ANNOTATION_VALID_NONZERO_FEATURE_COUNT = 0x10,
+	ANNOTATION_VALID_SPATIAL_INDEX = 0x20,
+	ANNOTATION_VALID_SIMPLIFICATION = 0x40,
+	ANNOTATION_VALID_GPU_BUFFERS = 0x80,
 };
 
 typedef struct annotation_t {
@@ -66,12 +78,16 @@ typedef struct annotation_t {
 	// 'Derived' calculations
 	bounds2f bounds;
 	v2f* tesselated_trianges;
+	v2f* simplified_coordinates; // level of detail version of the coordinates, for drawing while zoomed out
+	i32 simplified_coordinate_count;
+	i32 simplified_zoom_bucket; // the zoom bucket that the simplified coordinates were calculated for
 	bool is_complex_polygon; // meaning tesselation failed, most likely due to the polygon intersection itself
 	float area;
 	float length;
 	u32 nonzero_feature_count;
 	u32 valid_flags; // keeps track of whether derived calculations are valid
 	u32 fallback_valid_flags; // if invalidated, keep track of whether an old/outdated derived calculation exists
+	u64 saved_hash; // content hash at the time of the last write to the binary annotation store (0 if never written)
 
 	// Volatile parameters that change every frame
 	float line_segment_distance_to_cursor;
@@ -124,6 +140,76 @@ typedef struct annotation_hit_result_t {
 	bool is_valid;
 } annotation_hit_result_t;
 
+// Uniform grid over the annotation bounds, used to quickly find the annotations that might overlap a region
+// (e.g. the camera bounds or the area around the mouse cursor) without iterating over every annotation.
+// Cells store active annotation indices. Queries return a superset of the overlapping annotations: when an annotation
+// is moved its old cell entries are left in place, so callers still need to check the actual bounds.
+typedef struct annotation_spatial_index_t {
+	i32** cells; // array of arrays (one for each cell) of active annotation indices
+	i32* oversized_annotation_indices; // array; annotations spanning too many cells, or having no coordinates
+	bounds2f grid_bounds;
+	v2f cell_size;
+	i32 cell_count_x;
+	i32 cell_count_y;
+	i32 indexed_annotation_count;
+	i32 annotation_count_at_rebuild;
+	i64 entry_count;
+	i64 stale_entry_count;
+	i32* visible_annotation_indices; // array, recreated every frame
+	i32 visible_annotation_count;
+	i32* hit_test_candidate_indices; // array, recreated every frame
+	bool need_check_invalidated;
+	bool is_valid;
+} annotation_spatial_index_t;
+
+// Closed annotations smaller than this (in pixels) are not drawn in full, but as a dot or as part of a density tile
+#define ANNOTATION_MIN_SPAN_FOR_FULL_DRAW 2.0f
+
+// Static vertex/index buffers for drawing annotations on the GPU (see viewer_opengl_annotations.cpp).
+// Annotations are grouped into chunks that each contain annotations of only one group, so that the group color
+// can be set per draw call. When annotations are modified, only the chunks they belong to are uploaded again.
+typedef struct annotation_gpu_chunk_t {
+	i32 group_id;
+	i32* annotation_indices; // active annotation indices (array)
+	bounds2f bounds;
+	u32 vao;
+	u32 vbo;
+	u32 ebo;
+	i32 fill_index_count;
+	i32 outline_index_count;
+	float min_span; // size of the smallest closed annotation in the chunk (in world units)
+	struct annotation_gpu_tesselation_job_t* tesselation_job; // in flight on a worker thread, if not NULL
+	bool need_upload;
+	bool is_drawn_on_cpu; // all annotations in the chunk are passed to draw_annotations() this frame
+} annotation_gpu_chunk_t;
+
+typedef struct annotation_gpu_buffers_t {
+	annotation_gpu_chunk_t* chunks; // array
+	i32* chunk_index_for_annotation; // indexed by active annotation index (array)
+	u8* is_filled_for_annotation; // indexed by active annotation index (array)
+	i32* open_chunk_index_for_group; // the chunk that new annotations are added to, indexed by group (array)
+	i32* cpu_drawn_annotation_indices; // annotations without geometry in the buffers, e.g. points (array)
+	i32 indexed_annotation_count;
+	u32 fill_settings_at_build;
+	bool need_check_invalidated;
+	bool is_valid;
+} annotation_gpu_buffers_t;
+
+// Autosave state for the binary annotation store (see annotation_binary.cpp).
+// The file is append-only: each save appends records for only the annotations that changed, followed by a commit
+// record. When the file has accumulated too many outdated records, a complete snapshot is written instead.
+typedef struct annotation_binary_store_t {
+	char filename[512];
+	i64 file_size;
+	u64 groups_hash;
+	u64 features_hash;
+	u64 active_indices_hash;
+	bool need_save;
+	bool is_valid; // false if the next save needs to be a complete snapshot
+	bool xml_export_was_current; // as recorded in the last commit record
+	volatile i32 write_failed;
+} annotation_binary_store_t;
+
 typedef struct annotation_set_t {
 	annotation_t* stored_annotations; // array
 	i32 stored_annotation_count;
@@ -154,6 +240,7 @@ typedef struct annotation_set_t {
 	bool is_split_mode;
 	i32 selection_count;
 	annotation_t** selected_annotations; // recreated every frame
+	i32* selected_annotation_indices; // active indices of the selected annotations (array), recreated every frame
 	i32 selected_coordinate_annotation_index; // which annotation the currently selected coordinate belongs to; invalid if -1
 	i32 selected_coordinate_index;
 	//annotation_t* annotation_belonging_to_selected_coordinate; // TODO: implement; recalculate together with active_annotations?
@@ -167,6 +254,11 @@ typedef struct annotation_set_t {
 	volatile i32 is_saving_in_progress;
 	bool export_as_asap_xml;
 	bool annotations_were_loaded_from_file;
+	annotation_spatial_index_t spatial_index;
+	annotation_gpu_buffers_t gpu_buffers;
+	asap_xml_loader_t* asap_xml_loader; // non-NULL while annotations are being loaded in the background
+	coco_loader_t* coco_loader; // same, for COCO JSON files
+	annotation_binary_store_t binary_store;
 } annotation_set_t;
 
 typedef struct annotation_set_template_t {
@@ -224,6 +316,8 @@ i32 project_point_onto_annotation(annotation_set_t* annotation_set, annotation_t
 void deselect_annotation_coordinates(annotation_set_t* annotation_set);
 void notify_annotation_set_modified(annotation_set_t* annotation_set);
 void annotation_invalidate_derived_calculations_from_coordinates(annotation_t* annotation);
+bool annotation_need_draw_fill_area(annotation_t* annotation);
+void annotation_tesselate_if_necessary(app_state_t* app_state, annotation_t* annotation);
 void insert_coordinate(app_state_t* app_state, annotation_set_t* annotation_set, annotation_t* annotation, i32 insert_at_index, v2f new_coordinate);
 void delete_coordinate(annotation_set_t* annotation_set, i32 annotation_index, i32 coordinate_index);
 void delete_selected_annotations(app_state_t* app_state, annotation_set_t* annotation_set);
@@ -235,6 +329,8 @@ void set_region_for_whole_slide(scene_t* scene, image_t* image);
 void set_region_encompassing_selected_annotations(annotation_set_t* annotation_set, scene_t* scene);
 void center_scene_on_annotation(scene_t* scene, annotation_t* annotation);
 void draw_annotations(app_state_t* app_state, scene_t* scene, annotation_set_t* annotation_set, v2f camera_min);
+void annotation_benchmark_begin(app_state_t* app_state, i32 annotation_count);
+annotation_set_t* annotation_get_set_to_draw(annotation_set_t* annotation_set);
 void draw_annotations_window(app_state_t* app_state, input_t* input);
 void annotation_modal_dialog(app_state_t* app_state, annotation_set_t* annotation_set);
 void draw_annotation_palette_window();
@@ -244,9 +340,29 @@ void destroy_annotation(annotation_t* annotation);
 void destroy_annotation_set(annotation_set_t* annotation_set);
 void unload_and_reinit_annotations(annotation_set_t* annotation_set);
 bool load_asap_xml_annotations(app_state_t* app_state, const char* filename);
+void update_loading_asap_xml_annotations(annotation_set_t* annotation_set);
+void cancel_loading_asap_xml_annotations(annotation_set_t* annotation_set);
 void save_asap_xml_annotations(annotation_set_t* annotation_set, const char* filename_out);
+bool load_coco_annotations(app_state_t* app_state, const char* filename);
+void update_loading_coco_annotations(annotation_set_t* annotation_set);
+void cancel_loading_coco_annotations(annotation_set_t* annotation_set);
+void annotation_binary_store_set_filename(annotation_set_t* annotation_set, const char* xml_filename);
+bool annotation_binary_store_is_newer_than(const char* binary_store_filename, const char* other_filename);
+bool load_annotation_binary_store(annotation_set_t* annotation_set, const char* filename);
+bool save_annotation_binary_store(annotation_set_t* annotation_set, bool async);
 void save_annotations(app_state_t* app_state, annotation_set_t* annotation_set, bool force_ignore_delay, bool async);
 void recount_selected_annotations(app_state_t* app_state, annotation_set_t* annotation_set);
+void annotation_spatial_index_invalidate(annotation_set_t* annotation_set);
+void annotation_spatial_index_update(annotation_set_t* annotation_set);
+void annotation_spatial_index_query(annotation_set_t* annotation_set, bounds2f area, i32** result_indices);
+void annotation_spatial_index_destroy(annotation_spatial_index_t* spatial_index);
+
+// viewer_opengl_annotations.cpp
+void annotation_gpu_buffers_invalidate(annotation_set_t* annotation_set);
+void annotation_gpu_buffers_update(app_state_t* app_state, annotation_set_t* annotation_set);
+bool annotation_gpu_buffers_contain(annotation_set_t* annotation_set, i32 annotation_index, bool* is_filled);
+void annotation_gpu_buffers_collect_cpu_drawn(annotation_set_t* annotation_set, bounds2f camera_bounds, float min_span, i32** annotation_indices);
+void annotation_gpu_buffers_destroy(annotation_gpu_buffers_t* gpu_buffers);
 annotation_set_t create_offsetted_annotation_set_for_area(annotation_set_t* annotation_set, bounds2f area, bool push_coordinates_inward);
 annotation_set_template_t create_annotation_set_template(annotation_set_t* annotation_set);
 void annotation_set_template_destroy(annotation_set_template_t* template_);
@@ -22,10 +22,16 @@
 // https://dev.yorhel.nl/yxml/man
 #define YXML_STACK_BUFFER_SIZE KILOBYTES(32)
 
-enum {
-	ASAP_XML_PARSE_GROUPS_AND_FEATURES = 0,
-	ASAP_XML_PARSE_ANNOTATIONS = 1,
-};
+// Large annotation files (hundreds of MB) are loaded in the background, without reading the whole file into memory.
+// The file is read in chunks. Each <Annotation> element is independent of the others, so we cut them out of the
+// document and parse them in batches on the worker threads. The rest of the document (the group and feature
+// definitions) is parsed sequentially on the loader thread. The parsed batches are handed over to the main thread
+// in the order in which they appear in the file, so annotations become visible while the rest is still loading.
+#define ASAP_XML_LOAD_CHUNK_SIZE MEGABYTES(8)
+#define ASAP_XML_LOAD_BATCH_SIZE MEGABYTES(1)
+#define ASAP_XML_LOAD_TAIL_SIZE MEGABYTES(1)
+#define ASAP_XML_LOAD_MAX_PENDING_BATCHES 64
+#define ASAP_XML_PARSER_MAX_STACK 16
 
 typedef enum asap_xml_element_enum {
 	ASAP_XML_ELEMENT_NONE = 0,               // for unhandled elements
@@ -50,6 +56,57 @@ typedef enum asap_xml_attribute_enum {
 	ASAP_XML_ATTRIBUTE_Y = 6,                // Y="12345" (for <Coordinate>)
 } asap_xml_attribute_enum;
 
+enum asap_xml_batch_state_enum {
+	ASAP_XML_BATCH_EMPTY = 0,   // slot is free
+	ASAP_XML_BATCH_PARSING = 1, // submitted to a worker thread
+	ASAP_XML_BATCH_DONE = 2,    // ready to be merged into the annotation set by the main thread
+};
+
+// Annotations and definitions parsed from a part of the file.
+// Worker threads can't touch the annotation set, so groups and features are collected in local arrays.
+// The group_id and features[] of the parsed annotations refer to these local arrays; they are translated when the
+// batch is merged into the annotation set. Local group 0 is always the "None" group.
+typedef struct asap_xml_batch_t {
+	volatile i32 state;
+	char* text;
+	size_t text_length;
+	annotation_t* annotations; // array
+	annotation_group_t* groups; // array
+	annotation_feature_t* features; // array
+	bool failed;
+} asap_xml_batch_t;
+
+struct asap_xml_loader_t {
+	char filename[512];
+	file_stream_t fp;
+	v2f mpp;
+	asap_xml_batch_t batches[ASAP_XML_LOAD_MAX_PENDING_BATCHES]; // ring buffer, indexed by sequence number
+	i32 submitted_batch_count; // only accessed by the loader thread
+	i32 merged_batch_count; // only accessed by the main thread
+	volatile i32 refcount; // the loader task and all batches that are still being parsed
+	semaphore_handle_t free_batch_semaphore; // counts the free slots in the ring buffer
+	semaphore_handle_t done_semaphore; // posted when the refcount drops to zero
+	volatile i32 need_cancel;
+	bool failed;
+	bool is_synchronous; // no worker thread available: everything happens on the main thread
+	annotation_set_t* annotation_set; // only used if is_synchronous
+	i64 start;
+};
+
+typedef struct asap_xml_parser_t {
+	yxml_t* x;
+	asap_xml_batch_t* batch; // destination for the parsed annotations and definitions
+	v2f mpp;
+	asap_xml_element_enum element_stack[ASAP_XML_PARSER_MAX_STACK];
+	i32 element_stack_index;
+	bool is_within_annotationfeatures_tag;
+	annotation_group_t current_group;
+	annotation_feature_t current_feature;
+	v2f* coordinates; // array; scratch space, reused for each annotation
+	char attrbuf[128];
+	char* attrcur;
+} asap_xml_parser_t;
+
 static rgba_t asap_xml_parse_color(const char* value) {
 	rgba_t rgba = {0, 0, 0, 255};
 	if (strlen(value) != 7 || value[0] != '#') {
@@ -69,14 +126,59 @@ static rgba_t asap_xml_parse_color(const char* value) {
 	return rgba;
 }
 
-static void annotation_set_attribute(annotation_set_t* annotation_set, annotation_t* annotation, const char* attr,
+static i32 asap_xml_batch_find_group_or_create_if_not_found(asap_xml_batch_t* batch, const char* group_name) {
+	for (i32 i = 0; i < arrlen(batch->groups); ++i) {
+		if (strcmp(batch->groups[i].name, group_name) == 0) {
+			return i;
+		}
+	}
+	annotation_group_t new_group = {};
+	snprintf(new_group.name, sizeof(new_group.name), "%s", group_name);
+	arrput(batch->groups, new_group);
+	return arrlen(batch->groups) - 1;
+}
+
+static i32 asap_xml_batch_find_feature_or_create_if_not_found(asap_xml_batch_t* batch, const char* feature_name) {
+	for (i32 i = 0; i < arrlen(batch->features); ++i) {
+		if (strcmp(batch->features[i].name, feature_name) == 0) {
+			return i;
+		}
+	}
+	annotation_feature_t new_feature = {};
+	snprintf(new_feature.name, sizeof(new_feature.name), "%s", feature_name);
+	arrput(batch->features, new_feature);
+	return arrlen(batch->features) - 1;
+}
+
+static void asap_xml_batch_reset(asap_xml_batch_t* batch) {
+	batch->annotations = NULL;
+	batch->groups = NULL;
+	batch->features = NULL;
+	batch->failed = false;
+	asap_xml_batch_find_group_or_create_if_not_found(batch, "None");
+}
+
+static void asap_xml_batch_destroy(asap_xml_batch_t* batch) {
+	for (i32 i = 0; i < arrlen(batch->annotations); ++i) {
+		destroy_annotation(batch->annotations + i);
+	}
+	arrfree(batch->annotations);
+	arrfree(batch->groups);
+	arrfree(batch->features);
+	if (batch->text) {
+		free(batch->text);
+		batch->text = NULL;
+	}
+}
+
+static void annotation_set_attribute(asap_xml_parser_t* parser, annotation_t* annotation, const char* attr,
                               const char* value) {
 	if (strcmp(attr, "Color") == 0) {
 		annotation->color = asap_xml_parse_color(value);
 	} else if (strcmp(attr, "Name") == 0) {
-		strncpy(annotation->name, value, sizeof(annotation->name));
+		strncpy(annotation->name, value, sizeof(annotation->name)-1);
 	} else if (strcmp(attr, "PartOfGroup") == 0) {
-		annotation->group_id = find_annotation_group_or_create_if_not_found(annotation_set, value);
+		annotation->group_id = asap_xml_batch_find_group_or_create_if_not_found(parser->batch, value);
 	} else if (strcmp(attr, "Type") == 0) {
 		if (strcmp(value, "Rectangle") == 0) {
 			annotation->type = ANNOTATION_RECTANGLE;
@@ -93,15 +195,14 @@ static void annotation_set_attribute(annotation_set_t* annotation_set, annotatio
 	}
 }
 
-static void coordinate_set_attribute(annotation_set_t* annotation_set, annotation_t* annotation, v2f* coordinate, const char* attr,
-                              const char* value) {
+static void coordinate_set_attribute(asap_xml_parser_t* parser, v2f* coordinate, const char* attr, const char* value) {
 	if (strcmp(attr, "Order") == 0) {
 		// ignored
 //		coordinate->order = atoi(value);
 	} else if (strcmp(attr, "X") == 0) {
-		coordinate->x = (float)atof(value) * annotation_set->mpp.x;
+		coordinate->x = (float)atof(value) * parser->mpp.x;
 	} else if (strcmp(attr, "Y") == 0) {
-		coordinate->y = (float)atof(value) * annotation_set->mpp.y;
+		coordinate->y = (float)atof(value) * parser->mpp.y;
 	}
 }
 
@@ -109,19 +210,19 @@ static void group_set_attribute(annotation_group_t* group, const char* attr, con
 	if (strcmp(attr, "Color") == 0) {
 		group->color = asap_xml_parse_color(value);
 	} else if (strcmp(attr, "Name") == 0) {
-		strncpy(group->name, value, sizeof(group->name));
+		strncpy(group->name, value, sizeof(group->name)-1);
 	} else if (strcmp(attr, "PartOfGroup") == 0) {
 		// TODO: allow nested groups?
 	}
 }
 
-static void feature_set_attribute(annotation_set_t* annotation_set, annotation_feature_t* feature, const char* attr, const char* value) {
+static void feature_set_attribute(asap_xml_parser_t* parser, annotation_feature_t* feature, const char* attr, const char* value) {
 	if (strcmp(attr, "Value") == 0) {
 		feature->value = (float)atof(value);
 	} else if (strcmp(attr, "Name") == 0) {
-		strncpy(feature->name, value, sizeof(feature->name));
+		strncpy(feature->name, value, sizeof(feature->name)-1);
 	} else if (strcmp(attr, "RestrictToGroup") == 0) {
-		feature->group_id = find_annotation_group_or_create_if_not_found(annotation_set, value);
+		feature->group_id = asap_xml_batch_find_group_or_create_if_not_found(parser->batch, value);
 		feature->restrict_to_group = true;
 		// TODO: allow restrict to multiple groups? nested groups?
 	} else if (strcmp(attr, "Color") == 0) {
@@ -129,290 +230,662 @@ static void feature_set_attribute(annotation_set_t* annotation_set, annotation_f
 	}
 }
 
-#define ASAP_XML_PARSER_MAX_STACK 16
+static asap_xml_parser_t* asap_xml_create_parser(asap_xml_batch_t* batch, v2f mpp) {
+	asap_xml_parser_t* parser = (asap_xml_parser_t*) calloc(1, sizeof(asap_xml_parser_t));
+	// hack: merge memory for yxml_t struct and stack buffer
+	// Note: what is a good stack buffer size?
+	parser->x = (yxml_t*) malloc(sizeof(yxml_t) + YXML_STACK_BUFFER_SIZE);
+	parser->batch = batch;
+	parser->mpp = mpp;
+	return parser;
+}
 
-bool load_asap_xml_annotations(app_state_t* app_state, const char* filename) {
+static void asap_xml_parser_reset(asap_xml_parser_t* parser) {
+	yxml_init(parser->x, parser->x + 1, YXML_STACK_BUFFER_SIZE);
+	parser->element_stack_index = 0;
+	parser->is_within_annotationfeatures_tag = false;
+	parser->attrcur = NULL;
+}
 
-	annotation_set_t* annotation_set = &app_state->scene.annotation_set;
-	annotation_group_t current_group = {};
-	annotation_feature_t current_feature = {};
-	asap_xml_element_enum element_stack[ASAP_XML_PARSER_MAX_STACK] = {};
-	i32 element_stack_index = 0;
-	bool is_within_annotationfeatures_tag = false;
-
-
-	mem_t* file = platform_read_entire_file(filename);
-	yxml_t* x = NULL;
-	bool32 success = false;
-	i64 start = get_clock();
-
-	if (0) { failed: cleanup:
-		if (x) free(x);
-		if (file) free(file);
-		return success;
-	}
-
-	if (file) {
-		// hack: merge memory for yxml_t struct and stack buffer
-		// Note: what is a good stack buffer size?
-		x = (yxml_t*) malloc(sizeof(yxml_t) + YXML_STACK_BUFFER_SIZE);
-
-		// ASAP puts all of the group definitions at the end of the file, instead of the beginning.
-		// To preserve the order of the groups, we need to load the XML in two passes:
-		// pass 0: read annotation groups only
-		// pass 1: read annotations and coordinates
-		for (i32 pass = 0; pass < 2; ++pass) {
-			yxml_init(x, x + 1, YXML_STACK_BUFFER_SIZE);
-
-			// parse XML byte for byte
-			char attrbuf[128];
-			char* attrbuf_end = attrbuf + sizeof(attrbuf);
-			char* attrcur = NULL;
-			char contentbuf[128];
-			char* contentbuf_end = contentbuf + sizeof(contentbuf);
-			char* contentcur = NULL;
-
-			char* doc = (char*) file->data;
-			for (; *doc; doc++) {
-				yxml_ret_t r = yxml_parse(x, *doc);
-				if (r == YXML_OK) {
-					continue; // nothing worthy of note has happened -> continue
-				} else if (r < 0) {
-					goto failed;
-				} else if (r > 0) {
-					// token
-					switch(r) {
-						case YXML_ELEMSTART: {
-							// start of an element: '<Tag ..'
-//						    console_print("element start: %s\n", x->elem);
-							contentcur = contentbuf;
-							*contentcur = '\0';
-							++element_stack_index;
-							if (element_stack_index >= ASAP_XML_PARSER_MAX_STACK) {
-								console_print_error("load_asap_xml_annotations(): element stack overflow (too many nested elements)\n");
-								goto failed;
-							}
-
-							asap_xml_element_enum element_type = ASAP_XML_ELEMENT_NONE;
-							if (strcmp(x->elem, "Coordinate") == 0) {
-								element_type = ASAP_XML_ELEMENT_COORDINATE;
-							} else if (strcmp(x->elem, "Annotation") == 0) {
-								element_type = ASAP_XML_ELEMENT_ANNOTATION;
-							} else if (strcmp(x->elem, "Feature") == 0) {
-								element_type = ASAP_XML_ELEMENT_FEATURE;
-							} else if (strcmp(x->elem, "Group") == 0) {
-								element_type = ASAP_XML_ELEMENT_GROUP;
-							} else if (strcmp(x->elem, "Attributes") == 0) {
-								element_type = ASAP_XML_ELEMENT_ATTRIBUTES;
-							} else if (strcmp(x->elem, "ASAP_Annotations") == 0) {
-								element_type = ASAP_XML_ELEMENT_ASAP_ANNOTATIONS;
-							} else if (strcmp(x->elem, "AnnotationGroups") == 0) {
-								element_type = ASAP_XML_ELEMENT_ANNOTATIONGROUPS;
-							} else if (strcmp(x->elem, "AnnotationFeatures") == 0) {
-								element_type = ASAP_XML_ELEMENT_ANNOTATIONFEATURES;
-							} else if (strcmp(x->elem, "Annotations") == 0) {
-								element_type = ASAP_XML_ELEMENT_ANNOTATIONS;
-							}
-
-							if (element_type == ASAP_XML_ELEMENT_ANNOTATIONFEATURES) {
-								// We need to track this in order to disambiguate feature definitions from feature values
-								// Feature definitions are stored separately within an <AnnotationFeatures> tag
-								// Feature values are stored within an <Annotation>
-								// (We are letting both situations use the <Feature> tag, but in a different way)
-								is_within_annotationfeatures_tag = true;
-							} else if (pass == ASAP_XML_PARSE_GROUPS_AND_FEATURES) {
-								if (element_type == ASAP_XML_ELEMENT_GROUP) {
-									// reset the state (start parsing a new group)
-									memset(&current_group, 0, sizeof(current_group));
-									current_group.is_explicitly_defined = true; // (because this group has an XML tag)
-								} else if (element_type == ASAP_XML_ELEMENT_FEATURE && is_within_annotationfeatures_tag) {
-									// reset the state (start parsing a new feature)
-									memset(&current_feature, 0, sizeof(current_feature));
-									current_feature.is_explicitly_defined = true; // (because this feature has an XML tag)
-								}
-							} else if (pass == ASAP_XML_PARSE_ANNOTATIONS) {
-								if (element_type == ASAP_XML_ELEMENT_ANNOTATION) {
-									annotation_t new_annotation = {};
-									arrput(annotation_set->stored_annotations, new_annotation);
-									++annotation_set->stored_annotation_count;
-								} else if (element_type == ASAP_XML_ELEMENT_COORDINATE) {
-									ASSERT(annotation_set->stored_annotation_count == arrlen(annotation_set->stored_annotations));
-									ASSERT(annotation_set->stored_annotation_count > 0);
-									if (annotation_set->stored_annotations != NULL && annotation_set->stored_annotation_count > 0) {
-										annotation_t* current_annotation = arrlastptr(annotation_set->stored_annotations);
-										v2f new_coordinate = {};
-										ASSERT(current_annotation);
-										arrput(current_annotation->coordinates, new_coordinate);
-										++current_annotation->coordinate_count;
-									}
-								} else if (element_type == ASAP_XML_ELEMENT_FEATURE && !is_within_annotationfeatures_tag) {
-									element_type = ASAP_XML_ELEMENT_FEATURE;
-									memset(&current_feature, 0, sizeof(current_feature));
-								}
-							}
-							element_stack[element_stack_index] = element_type;
-
-						} break;
-						case YXML_CONTENT: {
-							// element content
-//						    console_print("   element content: %s\n", x->elem);
-							if (!contentcur) break;
-							char* tmp = x->data;
-							while (*tmp && contentbuf < contentbuf_end) {
-								*(contentcur++) = *(tmp++);
-							}
-							if (contentcur == contentbuf_end) {
-								// too long content
-								// TODO: harden against buffer overflow, see approach in isyntax.c
-								console_print_error("load_asap_xml_annotations(): encountered a too long XML element content\n");
-								goto failed;
-							}
-							*contentcur = '\0';
-						} break;
-
-						case YXML_ELEMEND: {
-							// end of an element: '.. />' or '</Tag>'
-							asap_xml_element_enum current_element_type = element_stack[element_stack_index];
-//						    console_print("element end: %s\n", current_element_type);
-							if (contentcur) {
-								// NOTE: usually only whitespace (newlines and such)
-//							    console_print("elem content: %s\n", contentbuf);
-							}
-
-							if (pass == ASAP_XML_PARSE_GROUPS_AND_FEATURES) {
-								if (current_element_type == ASAP_XML_ELEMENT_GROUP) {
-									annotation_group_t* parsed_group = &current_group;
-									// Check if a group already exists with this name, if not create it
-									i32 group_index = find_annotation_group_or_create_if_not_found(annotation_set, parsed_group->name);
-									annotation_group_t* destination_group = annotation_set->stored_groups + group_index;
-									// 'Commit' the group with all its attributes
-									memcpy(destination_group, parsed_group, sizeof(*destination_group));
-								} else if (is_within_annotationfeatures_tag && current_element_type == ASAP_XML_ELEMENT_FEATURE) {
-									annotation_feature_t* parsed_feature = &current_feature;
-									// Check if a feature already exists with this name, if not create it
-									i32 feature_index = find_annotation_feature_or_create_if_not_found(annotation_set, parsed_feature->name);
-									annotation_feature_t* destination_feature = annotation_set->stored_features + feature_index;
-									// 'Commit' the group with all its attributes
-									memcpy(destination_feature, parsed_feature, sizeof(*destination_feature));
-									destination_feature->id = feature_index;
-								}
-							} else if (pass == ASAP_XML_PARSE_ANNOTATIONS) {
-								if (!is_within_annotationfeatures_tag && current_element_type == ASAP_XML_ELEMENT_FEATURE) {
-									float value = current_feature.value;
-									annotation_feature_t* parsed_feature = &current_feature;
-									// Check if a feature already exists with this name, if not create it
-									i32 feature_index = find_annotation_feature_or_create_if_not_found(annotation_set, parsed_feature->name);
-									annotation_t* annotation = arrlastptr(annotation_set->stored_annotations);
-									if (annotation && feature_index < COUNT(annotation->features)) {
-										annotation->features[feature_index] = value;
-									} else {
-										fatal_error();
-									}
-								}
-							}
-							if (current_element_type == ASAP_XML_ELEMENT_ANNOTATIONFEATURES) {
-								// We need to track this in order to disambiguate feature definitions from feature values
-								// Feature definitions are stored separately within an <AnnotationFeatures> tag
-								// Feature values are stored within an <Annotation>
-								// (We are letting both situations use the <Feature> tag, but in a different way)
-								is_within_annotationfeatures_tag = false;
-							}
-
-							// 'Pop' out of the element stack
-							if (element_stack_index <= 0) {
-								// Underflow! More YXML_ELEMEND than YXML_ELEMSTART?
-								// yxml should throw an error in this case (malformed XML file?); this code should never be reached.
-								fatal_error();
-							}
-							--element_stack_index;
-
-
-						} break;
-
-						case YXML_ATTRSTART: {
-							// attribute: 'Name=..'
-//						    console_print("attr start: %s\n", x->attr);
-							attrcur = attrbuf;
-							*attrcur = '\0';
-						} break;
-						case YXML_ATTRVAL: {
-							// attribute value
-//						    console_print("   attr val: %s\n", x->attr);
-							if (!attrcur) break;
-							char* tmp = x->data;
-							while (*tmp && attrbuf < attrbuf_end) {
-								*(attrcur++) = *(tmp++);
-							}
-							if (attrcur == attrbuf_end) {
-								// too long attribute
-								console_print("load_asap_xml_annotations(): encountered a too long XML attribute\n");
-								goto failed;
-							}
-							*attrcur = '\0';
-						} break;
-						case YXML_ATTREND: {
-							// end of attribute '.."'
-							asap_xml_element_enum current_element_type = element_stack[element_stack_index];
-							if (attrcur) {
-//							    console_print("attr %s = %s\n", x->attr, attrbuf);
-								if (pass == ASAP_XML_PARSE_GROUPS_AND_FEATURES) {
-									if (current_element_type == ASAP_XML_ELEMENT_GROUP) {
-										group_set_attribute(&current_group, x->attr, attrbuf);
-									} else if (current_element_type == ASAP_XML_ELEMENT_FEATURE) {
-										feature_set_attribute(annotation_set, &current_feature, x->attr, attrbuf);
-									}
-								} else if (pass == ASAP_XML_PARSE_ANNOTATIONS) {
-									if (current_element_type == ASAP_XML_ELEMENT_ANNOTATION) {
-										annotation_set_attribute(annotation_set, arrlastptr(annotation_set->stored_annotations), x->attr, attrbuf);
-									} else if (current_element_type == ASAP_XML_ELEMENT_COORDINATE) {
-										annotation_t* annotation = arrlastptr(annotation_set->stored_annotations);
-										ASSERT(annotation);
-										if (annotation) {
-											v2f* coordinate = arrlastptr(annotation->coordinates);
-											ASSERT(coordinate);
-											if (coordinate) {
-												coordinate_set_attribute(annotation_set, annotation, coordinate, x->attr, attrbuf);
-											}
-										}
-									} else if (current_element_type == ASAP_XML_ELEMENT_FEATURE) {
-										feature_set_attribute(annotation_set, &current_feature, x->attr, attrbuf);
-									}
-								}
-							}
-						} break;
-						case YXML_PISTART:
-						case YXML_PICONTENT:
-						case YXML_PIEND:
-							break; // processing instructions (uninteresting, skip)
-						default: {
-							console_print("yxml_parse(): unrecognized token (%d)\n", r);
-							goto failed;
+static void asap_xml_destroy_parser(asap_xml_parser_t* parser) {
+	arrfree(parser->coordinates);
+	free(parser->x);
+	free(parser);
+}
+
+// Feed part of a document to the parser. Returns false if the XML is malformed.
+static bool asap_xml_parse(asap_xml_parser_t* parser, const char* data, size_t length) {
+	yxml_t* x = parser->x;
+	asap_xml_batch_t* batch = parser->batch;
+	char* attrbuf_end = parser->attrbuf + sizeof(parser->attrbuf);
+
+	for (size_t i = 0; i < length; ++i) {
+		yxml_ret_t r = yxml_parse(x, data[i]);
+		if (r == YXML_OK) {
+			continue; // nothing worthy of note has happened -> continue
+		} else if (r < 0) {
+			console_print_error("load_asap_xml_annotations(): XML parse error (%d)\n", r);
+			return false;
+		}
+		// token
+		switch(r) {
+			case YXML_ELEMSTART: {
+				// start of an element: '<Tag ..'
+				++parser->element_stack_index;
+				if (parser->element_stack_index >= COUNT(parser->element_stack)) {
+					console_print_error("load_asap_xml_annotations(): element stack overflow (too many nested elements)\n");
+					return false;
+				}
+
+				asap_xml_element_enum element_type = ASAP_XML_ELEMENT_NONE;
+				if (strcmp(x->elem, "Coordinate") == 0) {
+					element_type = ASAP_XML_ELEMENT_COORDINATE;
+				} else if (strcmp(x->elem, "Annotation") == 0) {
+					element_type = ASAP_XML_ELEMENT_ANNOTATION;
+				} else if (strcmp(x->elem, "Feature") == 0) {
+					element_type = ASAP_XML_ELEMENT_FEATURE;
+				} else if (strcmp(x->elem, "Group") == 0) {
+					element_type = ASAP_XML_ELEMENT_GROUP;
+				} else if (strcmp(x->elem, "Attributes") == 0) {
+					element_type = ASAP_XML_ELEMENT_ATTRIBUTES;
+				} else if (strcmp(x->elem, "ASAP_Annotations") == 0) {
+					element_type = ASAP_XML_ELEMENT_ASAP_ANNOTATIONS;
+				} else if (strcmp(x->elem, "AnnotationGroups") == 0) {
+					element_type = ASAP_XML_ELEMENT_ANNOTATIONGROUPS;
+				} else if (strcmp(x->elem, "AnnotationFeatures") == 0) {
+					element_type = ASAP_XML_ELEMENT_ANNOTATIONFEATURES;
+				} else if (strcmp(x->elem, "Annotations") == 0) {
+					element_type = ASAP_XML_ELEMENT_ANNOTATIONS;
+				}
+
+				if (element_type == ASAP_XML_ELEMENT_ANNOTATIONFEATURES) {
+					// We need to track this in order to disambiguate feature definitions from feature values
+					// Feature definitions are stored separately within an <AnnotationFeatures> tag
+					// Feature values are stored within an <Annotation>
+					// (We are letting both situations use the <Feature> tag, but in a different way)
+					parser->is_within_annotationfeatures_tag = true;
+				} else if (element_type == ASAP_XML_ELEMENT_GROUP) {
+					// reset the state (start parsing a new group)
+					memset(&parser->current_group, 0, sizeof(parser->current_group));
+					parser->current_group.is_explicitly_defined = true; // (because this group has an XML tag)
+				} else if (element_type == ASAP_XML_ELEMENT_FEATURE) {
+					// reset the state (start parsing a new feature definition or feature value)
+					memset(&parser->current_feature, 0, sizeof(parser->current_feature));
+					parser->current_feature.is_explicitly_defined = parser->is_within_annotationfeatures_tag;
+				} else if (element_type == ASAP_XML_ELEMENT_ANNOTATION) {
+					annotation_t new_annotation = {};
+					arrput(batch->annotations, new_annotation);
+					arrsetlen(parser->coordinates, 0);
+				} else if (element_type == ASAP_XML_ELEMENT_COORDINATE) {
+					if (arrlen(batch->annotations) > 0) {
+						v2f new_coordinate = {};
+						arrput(parser->coordinates, new_coordinate);
+					}
+				}
+				parser->element_stack[parser->element_stack_index] = element_type;
+			} break;
+
+			case YXML_CONTENT: {
+				// element content (usually only whitespace; we don't need it)
+			} break;
+
+			case YXML_ELEMEND: {
+				// end of an element: '.. />' or '</Tag>'
+				asap_xml_element_enum current_element_type = parser->element_stack[parser->element_stack_index];
+				if (current_element_type == ASAP_XML_ELEMENT_GROUP) {
+					// 'Commit' the group with all its attributes
+					i32 group_index = asap_xml_batch_find_group_or_create_if_not_found(batch, parser->current_group.name);
+					batch->groups[group_index] = parser->current_group;
+				} else if (current_element_type == ASAP_XML_ELEMENT_FEATURE) {
+					i32 feature_index = asap_xml_batch_find_feature_or_create_if_not_found(batch, parser->current_feature.name);
+					if (parser->is_within_annotationfeatures_tag) {
+						// 'Commit' the feature definition with all its attributes
+						batch->features[feature_index] = parser->current_feature;
+					} else if (arrlen(batch->annotations) > 0) {
+						annotation_t* annotation = arrlastptr(batch->annotations);
+						if (feature_index < COUNT(annotation->features)) {
+							annotation->features[feature_index] = parser->current_feature.value;
+						} else {
+							console_print_error("load_asap_xml_annotations(): too many features (maximum is %d)\n", COUNT(annotation->features));
+							return false;
 						}
 					}
+				} else if (current_element_type == ASAP_XML_ELEMENT_ANNOTATION) {
+					// Allocate the coordinates for the annotation only once, now that we know how many there are
+					annotation_t* annotation = arrlastptr(batch->annotations);
+					i32 coordinate_count = arrlen(parser->coordinates);
+					if (coordinate_count > 0) {
+						arrsetlen(annotation->coordinates, coordinate_count);
+						memcpy(annotation->coordinates, parser->coordinates, coordinate_count * sizeof(v2f));
+					}
+					annotation->coordinate_count = coordinate_count;
+				} else if (current_element_type == ASAP_XML_ELEMENT_ANNOTATIONFEATURES) {
+					parser->is_within_annotationfeatures_tag = false;
 				}
+
+				// 'Pop' out of the element stack
+				if (parser->element_stack_index <= 0) {
+					// Underflow! More YXML_ELEMEND than YXML_ELEMSTART?
+					// yxml should throw an error in this case (malformed XML file?); this code should never be reached.
+					fatal_error();
+				}
+				--parser->element_stack_index;
+			} break;
+
+			case YXML_ATTRSTART: {
+				// attribute: 'Name=..'
+				parser->attrcur = parser->attrbuf;
+				*parser->attrcur = '\0';
+			} break;
+			case YXML_ATTRVAL: {
+				// attribute value
+				if (!parser->attrcur) break;
+				char* tmp = x->data;
+				while (*tmp && parser->attrcur < attrbuf_end) {
+					*(parser->attrcur++) = *(tmp++);
+				}
+				if (parser->attrcur == attrbuf_end) {
+					// too long attribute
+					console_print("load_asap_xml_annotations(): encountered a too long XML attribute\n");
+					return false;
+				}
+				*parser->attrcur = '\0';
+			} break;
+			case YXML_ATTREND: {
+				// end of attribute '.."'
+				if (!parser->attrcur) break;
+				const char* attrbuf = parser->attrbuf;
+				asap_xml_element_enum current_element_type = parser->element_stack[parser->element_stack_index];
+				if (current_element_type == ASAP_XML_ELEMENT_GROUP) {
+					group_set_attribute(&parser->current_group, x->attr, attrbuf);
+				} else if (current_element_type == ASAP_XML_ELEMENT_FEATURE) {
+					feature_set_attribute(parser, &parser->current_feature, x->attr, attrbuf);
+				} else if (current_element_type == ASAP_XML_ELEMENT_ANNOTATION) {
+					annotation_set_attribute(parser, arrlastptr(batch->annotations), x->attr, attrbuf);
+				} else if (current_element_type == ASAP_XML_ELEMENT_COORDINATE) {
+					if (arrlen(parser->coordinates) > 0) {
+						coordinate_set_attribute(parser, arrlastptr(parser->coordinates), x->attr, attrbuf);
+					}
+				}
+			} break;
+			case YXML_PISTART:
+			case YXML_PICONTENT:
+			case YXML_PIEND:
+				break; // processing instructions (uninteresting, skip)
+			default: {
+				console_print("yxml_parse(): unrecognized token (%d)\n", r);
+				return false;
 			}
 		}
 	}
+	return true;
+}
 
-	// At this point, the indices for the 'active' annotations are all nicely in order (as they are loaded).
-	// So we simply set the indices in ascending order, as a reference to look up the actual annotation_t struct.
-	// (later on, the indices might get reordered by the user, annotations might get deleted, inserted, etc.)
-	ASSERT(annotation_set->active_annotation_indices == NULL);
-	arrsetlen(annotation_set->active_annotation_indices, annotation_set->stored_annotation_count);
-	annotation_set->active_annotation_count = annotation_set->stored_annotation_count;
-	for (i32 i = 0; i < annotation_set->active_annotation_count; ++i) {
-		annotation_set->active_annotation_indices[i] = i;
+static const char* asap_xml_find_string(const char* pos, const char* end, const char* needle) {
+	size_t needle_length = strlen(needle);
+	while (pos + needle_length <= end) {
+		pos = (const char*) memchr(pos, needle[0], end - pos);
+		if (!pos || pos + needle_length > end) break;
+		if (memcmp(pos, needle, needle_length) == 0) {
+			return pos;
+		}
+		++pos;
 	}
+	return NULL;
+}
+
+static inline bool asap_xml_is_whitespace(char c) {
+	return (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+}
+
+// Find the next '<Annotation' start tag (not to be confused with <Annotations>, <AnnotationGroups>, etc.)
+static const char* asap_xml_find_annotation_start(const char* pos, const char* end) {
+	while ((pos = (const char*) memchr(pos, '<', end - pos)) != NULL) {
+		if (end - pos < 12) return NULL;
+		if (memcmp(pos + 1, "Annotation", 10) == 0 && (asap_xml_is_whitespace(pos[11]) || pos[11] == '>' || pos[11] == '/')) {
+			return pos;
+		}
+		++pos;
+	}
+	return NULL;
+}
+
+// Find the end of the <Annotation> element starting at pos. Returns NULL if the element is incomplete.
+static const char* asap_xml_find_annotation_end(const char* pos, const char* end) {
+	// Skip over the start tag (attribute values may contain '>')
+	char quote = 0;
+	for (pos += 11; pos < end; ++pos) {
+		char c = *pos;
+		if (quote) {
+			if (c == quote) quote = 0;
+		} else if (c == '"' || c == '\'') {
+			quote = c;
+		} else if (c == '>') {
+			if (pos[-1] == '/') {
+				return pos + 1; // <Annotation ... />
+			}
+			break;
+		}
+	}
+	if (pos >= end) return NULL;
+	while ((pos = asap_xml_find_string(pos, end, "</Annotation")) != NULL) {
+		pos += 12;
+		while (pos < end && asap_xml_is_whitespace(*pos)) ++pos;
+		if (pos >= end) return NULL;
+		if (*pos == '>') {
+			return pos + 1;
+		}
+	}
+	return NULL;
+}
+
+static void asap_xml_merge_batch(annotation_set_t* annotation_set, asap_xml_batch_t* batch) {
+	temp_memory_t temp_memory = begin_temp_memory_on_local_thread();
+	i32 local_group_count = arrlen(batch->groups);
+	i32 local_feature_count = arrlen(batch->features);
+	i32* group_indices = arena_push_array(temp_memory.arena, local_group_count, i32);
+	i32* feature_indices = arena_push_array(temp_memory.arena, local_feature_count, i32);
+
+	for (i32 i = 0; i < local_group_count; ++i) {
+		annotation_group_t* parsed_group = batch->groups + i;
+		// Check if a group already exists with this name, if not create it
+		i32 group_index = find_annotation_group_or_create_if_not_found(annotation_set, parsed_group->name);
+		if (parsed_group->is_explicitly_defined) {
+			// 'Commit' the group with all its attributes
+			memcpy(annotation_set->stored_groups + group_index, parsed_group, sizeof(*parsed_group));
+		}
+		group_indices[i] = group_index;
+	}
+	for (i32 i = 0; i < local_feature_count; ++i) {
+		annotation_feature_t* parsed_feature = batch->features + i;
+		// Check if a feature already exists with this name, if not create it
+		i32 feature_index = find_annotation_feature_or_create_if_not_found(annotation_set, parsed_feature->name);
+		if (parsed_feature->is_explicitly_defined) {
+			annotation_feature_t* destination_feature = annotation_set->stored_features + feature_index;
+			memcpy(destination_feature, parsed_feature, sizeof(*destination_feature));
+			destination_feature->id = feature_index;
+			if (destination_feature->restrict_to_group) {
+				destination_feature->group_id = group_indices[parsed_feature->group_id];
+			}
+		}
+		feature_indices[i] = feature_index;
+	}
+
+	i32 annotation_count = arrlen(batch->annotations);
+	if (annotation_count > 0) {
+		i32 first_stored_index = annotation_set->stored_annotation_count;
+		annotation_t* annotations = arraddnptr(annotation_set->stored_annotations, annotation_count);
+		i32* active_indices = arraddnptr(annotation_set->active_annotation_indices, annotation_count);
+		for (i32 i = 0; i < annotation_count; ++i) {
+			annotation_t* annotation = annotations + i;
+			*annotation = batch->annotations[i]; // takes over ownership of the coordinates
+			annotation->group_id = group_indices[annotation->group_id];
+			if (local_feature_count > 0) {
+				float features[MAX_ANNOTATION_FEATURES];
+				memcpy(features, annotation->features, sizeof(features));
+				memset(annotation->features, 0, sizeof(annotation->features));
+				for (i32 j = 0; j < local_feature_count; ++j) {
+					if (feature_indices[j] < MAX_ANNOTATION_FEATURES) {
+						annotation->features[feature_indices[j]] = features[j];
+					}
+				}
+			}
+			active_indices[i] = first_stored_index + i;
+		}
+		annotation_set->stored_annotation_count += annotation_count;
+		annotation_set->active_annotation_count += annotation_count;
+		arrfree(batch->annotations);
+	}
+	arrfree(batch->groups);
+	arrfree(batch->features);
+	release_temp_memory(&temp_memory);
+}
+
+// Merge the batches that are ready, in order. Called on the main thread.
+static void asap_xml_loader_merge_batches(asap_xml_loader_t* loader, annotation_set_t* annotation_set) {
+	for (;;) {
+		asap_xml_batch_t* batch = loader->batches + (loader->merged_batch_count % ASAP_XML_LOAD_MAX_PENDING_BATCHES);
+		if (batch->state != ASAP_XML_BATCH_DONE) break;
+		read_barrier;
+		if (batch->failed) {
+			loader->failed = true;
+		}
+		asap_xml_merge_batch(annotation_set, batch);
+		++loader->merged_batch_count;
+		atomic_compare_exchange(&batch->state, ASAP_XML_BATCH_EMPTY, ASAP_XML_BATCH_DONE);
+		platform_semaphore_post(loader->free_batch_semaphore);
+	}
+}
+
+static void asap_xml_loader_release(asap_xml_loader_t* loader) {
+	if (atomic_decrement(&loader->refcount) == 0) {
+		platform_semaphore_post(loader->done_semaphore);
+	}
+}
+
+static void asap_xml_loader_destroy(asap_xml_loader_t* loader) {
+	platform_semaphore_destroy(loader->free_batch_semaphore);
+	platform_semaphore_destroy(loader->done_semaphore);
+	free(loader);
+}
+
+typedef struct asap_xml_parse_batch_task_t {
+	asap_xml_loader_t* loader;
+	asap_xml_batch_t* batch;
+} asap_xml_parse_batch_task_t;
+
+static void asap_xml_parse_batch_func(int logical_thread_index, void* userdata) {
+	asap_xml_parse_batch_task_t* task = (asap_xml_parse_batch_task_t*) userdata;
+	asap_xml_loader_t* loader = task->loader;
+	asap_xml_batch_t* batch = task->batch;
+
+	if (!loader->need_cancel) {
+		asap_xml_parser_t* parser = asap_xml_create_parser(batch, loader->mpp);
+		const char* end = batch->text + batch->text_length;
+		const char* pos = batch->text;
+		while ((pos = asap_xml_find_annotation_start(pos, end)) != NULL) {
+			const char* annotation_end = asap_xml_find_annotation_end(pos, end);
+			if (!annotation_end) {
+				annotation_end = end; // incomplete (file truncated?), let yxml report the error
+			}
+			asap_xml_parser_reset(parser);
+			if (!asap_xml_parse(parser, pos, annotation_end - pos) || yxml_eof(parser->x) < 0) {
+				batch->failed = true;
+				break;
+			}
+			pos = annotation_end;
+		}
+		asap_xml_destroy_parser(parser);
+	}
+	free(batch->text);
+	batch->text = NULL;
+	atomic_compare_exchange(&batch->state, ASAP_XML_BATCH_DONE, ASAP_XML_BATCH_PARSING);
+	asap_xml_loader_release(loader);
+}
+
+static asap_xml_batch_t* asap_xml_loader_acquire_batch(asap_xml_loader_t* loader, int logical_thread_index) {
+	if (loader->need_cancel) {
+		return NULL; // the main thread is waiting for us to stop
+	}
+	// Wait until the main thread has taken out the batch that previously used this slot.
+	// (This also limits how much memory the parsed but not yet merged annotations can take up.)
+	if (loader->is_synchronous) {
+		asap_xml_loader_merge_batches(loader, loader->annotation_set); // batches are parsed on this thread, all done
+	} else {
+		// Batches still waiting in the queue might otherwise never get parsed, if this is the only worker thread
+		while (work_queue_is_work_waiting_to_start(&global_work_queue)) {
+			work_queue_do_work(&global_work_queue, logical_thread_index);
+		}
+	}
+	platform_semaphore_wait(loader->free_batch_semaphore);
+	if (loader->need_cancel) {
+		return NULL;
+	}
+	asap_xml_batch_t* batch = loader->batches + (loader->submitted_batch_count % ASAP_XML_LOAD_MAX_PENDING_BATCHES);
+	ASSERT(batch->state == ASAP_XML_BATCH_EMPTY);
+	++loader->submitted_batch_count;
+	return batch;
+}
+
+// Hand over the group and feature definitions parsed by the loader thread so far.
+static void asap_xml_loader_submit_definitions(asap_xml_loader_t* loader, asap_xml_batch_t* definitions, int logical_thread_index) {
+	if (arrlen(definitions->groups) > 1 || arrlen(definitions->features) > 0) {
+		asap_xml_batch_t* batch = asap_xml_loader_acquire_batch(loader, logical_thread_index);
+		if (!batch) return;
+		batch->annotations = NULL;
+		batch->groups = definitions->groups;
+		batch->features = definitions->features;
+		batch->failed = false;
+		asap_xml_batch_reset(definitions);
+		atomic_compare_exchange(&batch->state, ASAP_XML_BATCH_DONE, ASAP_XML_BATCH_EMPTY);
+	}
+}
+
+static void asap_xml_loader_submit_annotations(asap_xml_loader_t* loader, asap_xml_batch_t* definitions, const char* text,
+                                               size_t text_length, int logical_thread_index) {
+	// Definitions that came earlier in the file need to be merged first, to preserve the order of the groups.
+	asap_xml_loader_submit_definitions(loader, definitions, logical_thread_index);
+
+	asap_xml_batch_t* batch = asap_xml_loader_acquire_batch(loader, logical_thread_index);
+	if (!batch) return;
+	asap_xml_batch_reset(batch);
+	batch->text = (char*) malloc(text_length);
+	memcpy(batch->text, text, text_length);
+	batch->text_length = text_length;
+	batch->state = ASAP_XML_BATCH_PARSING;
+	atomic_increment(&loader->refcount);
+
+	asap_xml_parse_batch_task_t task = { .loader = loader, .batch = batch };
+	if (loader->is_synchronous || !work_queue_submit_task(&global_work_queue, asap_xml_parse_batch_func, &task, sizeof(task))) {
+		asap_xml_parse_batch_func(logical_thread_index, &task); // parse on this thread instead
+	}
+}
+
+static void asap_xml_load_func(int logical_thread_index, void* userdata) {
+	asap_xml_loader_t* loader = *(asap_xml_loader_t**) userdata;
+
+	asap_xml_batch_t definitions = {};
+	asap_xml_batch_reset(&definitions);
+	asap_xml_parser_t* parser = asap_xml_create_parser(&definitions, loader->mpp);
+	asap_xml_parser_reset(parser);
+
+	size_t capacity = ASAP_XML_LOAD_CHUNK_SIZE;
+	char* buffer = (char*) malloc(capacity);
+	size_t length = 0;
+	bool is_eof = false;
+
+	while (!is_eof && !loader->need_cancel && !loader->failed) {
+		size_t bytes_to_read = capacity - length;
+		i64 bytes_read = file_stream_read(buffer + length, bytes_to_read, loader->fp);
+		if (bytes_read < (i64)bytes_to_read) {
+			is_eof = true;
+		}
+		if (bytes_read > 0) {
+			length += bytes_read;
+		}
+
+		// Cut out runs of consecutive <Annotation> elements (only whitespace in between) and submit them as batches.
+		// Everything else goes to the parser on this thread.
+		const char* end = buffer + length;
+		const char* pos = buffer;
+		const char* batch_start = NULL;
+		const char* batch_end = NULL;
+		for (;;) {
+			const char* annotation_start = asap_xml_find_annotation_start(pos, end);
+			if (annotation_start && batch_start && annotation_start > pos) {
+				const char* c = pos;
+				while (c < annotation_start && asap_xml_is_whitespace(*c)) ++c;
+				if (c < annotation_start) {
+					// Something other than another annotation follows; stop the batch here
+					asap_xml_loader_submit_annotations(loader, &definitions, batch_start, batch_end - batch_start, logical_thread_index);
+					batch_start = NULL;
+				} else {
+					pos = annotation_start; // skip the whitespace
+				}
+			}
+			if (!annotation_start) {
+				// No more annotations in this chunk. Hold back a few bytes, in case an <Annotation> start tag
+				// is split across two chunks.
+				if (batch_start) {
+					asap_xml_loader_submit_annotations(loader, &definitions, batch_start, batch_end - batch_start, logical_thread_index);
+					batch_start = NULL;
+				}
+				const char* parse_end = is_eof ? end : MAX(pos, end - 16);
+				if (!asap_xml_parse(parser, pos, parse_end - pos)) {
+					loader->failed = true;
+				}
+				pos = parse_end;
+				break;
+			}
+			if (!batch_start && annotation_start > pos) {
+				if (!asap_xml_parse(parser, pos, annotation_start - pos)) {
+					loader->failed = true;
+					break;
+				}
+			}
+			pos = annotation_start;
+			const char* annotation_end = asap_xml_find_annotation_end(annotation_start, end);
+			if (!annotation_end) {
+				if (!is_eof) break; // incomplete, continue after reading the next chunk
+				annotation_end = end; // file truncated? let yxml report the error
+			}
+			if (!batch_start) {
+				batch_start = annotation_start;
+			}
+			batch_end = annotation_end;
+			pos = annotation_end;
+			if (batch_end - batch_start >= ASAP_XML_LOAD_BATCH_SIZE) {
+				asap_xml_loader_submit_annotations(loader, &definitions, batch_start, batch_end - batch_start, logical_thread_index);
+				batch_start = NULL;
+			}
+		}
+		if (batch_start) {
+			asap_xml_loader_submit_annotations(loader, &definitions, batch_start, batch_end - batch_start, logical_thread_index);
+		}
+
+		// Move the part that hasn't been processed yet to the start of the buffer
+		size_t remaining = end - pos;
+		memmove(buffer, pos, remaining);
+		length = remaining;
+		if (length == capacity) {
+			// A single annotation larger than the buffer
+			capacity *= 2;
+			buffer = (char*) realloc(buffer, capacity);
+		}
+	}
+	if (!loader->failed && !loader->need_cancel && yxml_eof(parser->x) < 0) {
+		console_print_error("load_asap_xml_annotations(): unexpected end of file\n");
+		loader->failed = true;
+	}
+	asap_xml_loader_submit_definitions(loader, &definitions, logical_thread_index);
+
+	asap_xml_batch_destroy(&definitions);
+	asap_xml_destroy_parser(parser);
+	free(buffer);
+	file_stream_close(loader->fp);
+	loader->fp = NULL;
+	asap_xml_loader_release(loader);
+}
+
+// ASAP puts all of the group definitions at the end of the file, instead of the beginning.
+// To preserve the order of the groups, we try to find and load the definitions before loading the annotations.
+static void asap_xml_load_definitions_from_end_of_file(annotation_set_t* annotation_set, file_stream_t fp, v2f mpp) {
+	i64 filesize = file_stream_get_filesize(fp);
+	i64 tail_size = MIN(filesize, ASAP_XML_LOAD_TAIL_SIZE);
+	if (tail_size <= 0) return;
+	char* tail = (char*) malloc(tail_size);
+	i64 bytes_read = file_read_at_offset(tail, fp, filesize - tail_size, tail_size);
+	if (bytes_read == tail_size) {
+		const char* sections[] = {"AnnotationGroups", "AnnotationFeatures"};
+		for (i32 i = 0; i < COUNT(sections); ++i) {
+			char start_tag[64];
+			char end_tag[64];
+			snprintf(start_tag, sizeof(start_tag), "<%s>", sections[i]);
+			snprintf(end_tag, sizeof(end_tag), "</%s>", sections[i]);
+			const char* start = asap_xml_find_string(tail, tail + tail_size, start_tag);
+			if (!start) continue;
+			const char* end = asap_xml_find_string(start, tail + tail_size, end_tag);
+			if (!end) continue;
+			end += strlen(end_tag);
+
+			asap_xml_batch_t definitions = {};
+			asap_xml_batch_reset(&definitions);
+			asap_xml_parser_t* parser = asap_xml_create_parser(&definitions, mpp);
+			asap_xml_parser_reset(parser);
+			if (asap_xml_parse(parser, start, end - start)) {
+				asap_xml_merge_batch(annotation_set, &definitions);
+			}
+			asap_xml_batch_destroy(&definitions);
+			asap_xml_destroy_parser(parser);
+		}
+	}
+	free(tail);
+}
+
+bool load_asap_xml_annotations(app_state_t* app_state, const char* filename) {
+	annotation_set_t* annotation_set = &app_state->scene.annotation_set;
+	if (annotation_set->asap_xml_loader) {
+		cancel_loading_asap_xml_annotations(annotation_set);
+	}
+
+	file_stream_t fp = file_stream_open_for_reading(filename);
+	if (!fp) {
+		console_print_error("load_asap_xml_annotations(): could not open '%s'\n", filename);
+		return false;
+	}
+
+	asap_xml_loader_t* loader = (asap_xml_loader_t*) calloc(1, sizeof(asap_xml_loader_t));
+	strncpy(loader->filename, filename, sizeof(loader->filename)-1);
+	loader->fp = fp;
+	loader->mpp = annotation_set->mpp;
+	loader->start = get_clock();
+	loader->annotation_set = annotation_set;
+	loader->refcount = 1; // released when the loader task is done
+	loader->free_batch_semaphore = platform_semaphore_create(ASAP_XML_LOAD_MAX_PENDING_BATCHES);
+	loader->done_semaphore = platform_semaphore_create(0);
+
+	asap_xml_load_definitions_from_end_of_file(annotation_set, fp, loader->mpp);
 
 	strncpy(annotation_set->asap_xml_filename, filename, sizeof(annotation_set->asap_xml_filename)-1);
+	annotation_binary_store_set_filename(annotation_set, filename);
+	annotation_set->binary_store.is_valid = false;
 	annotation_set->export_as_asap_xml = true;
 	annotation_set->annotations_were_loaded_from_file = true;
-	success = true;
-	float seconds_elapsed = get_seconds_elapsed(start, get_clock());
-	console_print_verbose("Loaded ASAP XML annotations in %g seconds.\n", seconds_elapsed);
+	annotation_set->asap_xml_loader = loader;
+
+	if (global_worker_thread_count == 0 || !work_queue_submit_task(&global_work_queue, asap_xml_load_func, &loader, sizeof(loader))) {
+		// Load everything on the main thread instead
+		loader->is_synchronous = true;
+		asap_xml_load_func(0, &loader);
+		update_loading_asap_xml_annotations(annotation_set);
+		return annotation_set->asap_xml_loader == NULL && annotation_set->annotations_were_loaded_from_file;
+	}
+	return true;
+}
 
-	goto cleanup;
-	// return success;
+// Called every frame on the main thread while annotations are being loaded in the background.
+void update_loading_asap_xml_annotations(annotation_set_t* annotation_set) {
+	asap_xml_loader_t* loader = annotation_set->asap_xml_loader;
+	if (!loader) return;
+
+	asap_xml_loader_merge_batches(loader, annotation_set);
+	if (loader->refcount == 0) {
+		// Loader thread finished and all batches are parsed
+		platform_semaphore_wait(loader->done_semaphore); // the last one to leave might not have posted yet
+		asap_xml_loader_merge_batches(loader, annotation_set);
+		ASSERT(loader->merged_batch_count == loader->submitted_batch_count);
+		if (loader->failed) {
+			// Don't overwrite the original file with an incomplete set of annotations
+			console_print_error("Failed to load ASAP XML annotations from '%s'\n", loader->filename);
+			annotation_set->export_as_asap_xml = false;
+			annotation_set->annotations_were_loaded_from_file = false;
+		} else {
+			float seconds_elapsed = get_seconds_elapsed(loader->start, get_clock());
+			console_print_verbose("Loaded ASAP XML annotations in %g seconds (%d annotations).\n", seconds_elapsed, annotation_set->active_annotation_count);
+			// Convert to the binary annotation store, so that loading is much faster next time
+			annotation_set->binary_store.need_save = true;
+		}
+		asap_xml_loader_destroy(loader);
+		annotation_set->asap_xml_loader = NULL;
+	}
+}
+
+void cancel_loading_asap_xml_annotations(annotation_set_t* annotation_set) {
+	asap_xml_loader_t* loader = annotation_set->asap_xml_loader;
+	if (!loader) return;
+
+	loader->need_cancel = true;
+	platform_semaphore_post(loader->free_batch_semaphore); // wake up the loader task, if it is waiting for a free slot
+	platform_semaphore_wait(loader->done_semaphore);
+	read_barrier;
+	for (i32 i = 0; i < ASAP_XML_LOAD_MAX_PENDING_BATCHES; ++i) {
+		asap_xml_batch_t* batch = loader->batches + i;
+		if (batch->state != ASAP_XML_BATCH_EMPTY) {
+			asap_xml_batch_destroy(batch);
+		}
+	}
+	asap_xml_loader_destroy(loader);
+	annotation_set->asap_xml_loader = NULL;
 }
 
 void asap_xml_print_color(char* buf, size_t bufsize, rgba_t rgba) {
@@ -0,0 +1,774 @@
+/*
+  Slidescape, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2024  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Binary annotation store.
+// Rewriting the whole annotation set as XML after every change is too slow for large annotation sets, so autosave
+// writes to a compact binary file instead. The XML file is still written when saving explicitly or when closing.
+//
+// File layout: a header, followed by a sequence of records. Each record starts with a record header (type + size).
+// Annotations are stored in columns: all coordinates of a record in one contiguous array of v2f, with offsets
+// per annotation. Annotations are identified by their stored index (which never changes, because
+// stored_annotations is append-only), so a later record can replace an annotation written by an earlier one.
+// Autosave only appends the annotations that changed since the last save, followed by a commit record.
+// Records after the last commit record are ignored when loading (e.g. an interrupted write).
+// When more than half of the file consists of outdated records, a complete snapshot is written instead.
+//
+// Loading memory-maps the file and copies the columns straight into the annotation set.
+
+#define ANNOTATION_BINARY_MAGIC 0x4e415353 // "SSAN"
+#define ANNOTATION_BINARY_VERSION 1
+#define ANNOTATION_BINARY_STORE_EXTENSION "annotations"
+#define ANNOTATION_BINARY_MIN_COMPACTION_SIZE MEGABYTES(1)
+
+enum annotation_binary_record_type_enum {
+	ANNOTATION_BINARY_RECORD_GROUPS = 1,
+	ANNOTATION_BINARY_RECORD_FEATURES = 2,
+	ANNOTATION_BINARY_RECORD_ANNOTATIONS = 3,
+	ANNOTATION_BINARY_RECORD_ACTIVE_INDICES = 4,
+	ANNOTATION_BINARY_RECORD_COMMIT = 5,
+};
+
+enum annotation_binary_flags_enum {
+	ANNOTATION_BINARY_FLAG_IS_OPEN = 1,
+	ANNOTATION_BINARY_FLAG_HAS_PROPERTIES = 2,
+	ANNOTATION_BINARY_FLAG_IS_EXPLICITLY_DEFINED = 4,
+	ANNOTATION_BINARY_FLAG_HIDDEN = 8,
+	ANNOTATION_BINARY_FLAG_DELETED = 0x10,
+	ANNOTATION_BINARY_FLAG_RESTRICT_TO_GROUP = 0x20,
+	ANNOTATION_BINARY_FLAG_XML_EXPORT_IS_CURRENT = 0x40,
+};
+
+// NOTE: all on-disk structures are padded to a multiple of 8 bytes, so that the columns stay aligned.
+typedef struct annotation_binary_header_t {
+	u32 magic;
+	u32 version;
+	v2f mpp;
+	u64 reserved;
+} annotation_binary_header_t;
+
+typedef struct annotation_binary_record_header_t {
+	u32 type;
+	u32 reserved;
+	u64 size; // size of the payload following the record header
+} annotation_binary_record_header_t;
+
+// Payload of GROUPS and FEATURES records: table header, stored entries, then the active indices (i32, padded)
+typedef struct annotation_binary_table_header_t {
+	i32 stored_count;
+	i32 active_count;
+} annotation_binary_table_header_t;
+
+typedef struct annotation_binary_group_t {
+	char name[256];
+	rgba_t color;
+	u32 flags;
+} annotation_binary_group_t;
+
+typedef struct annotation_binary_feature_t {
+	char name[256];
+	rgba_t color;
+	i32 group_id;
+	u32 flags;
+	u32 reserved;
+} annotation_binary_feature_t;
+
+// Payload of ANNOTATIONS records: this header, followed by the columns (see annotation_binary_get_column_layout())
+typedef struct annotation_binary_annotations_header_t {
+	i32 count;
+	i32 feature_value_count;
+	u64 coordinate_count;
+	u64 name_bytes;
+} annotation_binary_annotations_header_t;
+
+typedef struct annotation_binary_feature_value_t {
+	i32 annotation; // index within the record
+	i32 feature; // stored feature index
+	float value;
+} annotation_binary_feature_value_t;
+
+typedef struct annotation_binary_commit_t {
+	i32 stored_annotation_count;
+	u32 flags;
+} annotation_binary_commit_t;
+
+typedef struct annotation_binary_column_layout_t {
+	u64 coordinates;
+	u64 coordinate_offsets; // u64[count+1]
+	u64 hashes;             // u64[count]
+	u64 stored_indices;     // i32[count]
+	u64 types;              // i32[count]
+	u64 group_ids;          // i32[count]
+	u64 colors;             // rgba_t[count]
+	u64 flags;              // u32[count]
+	u64 name_offsets;       // u32[count+1]
+	u64 feature_values;     // annotation_binary_feature_value_t[feature_value_count]
+	u64 names;              // char[name_bytes], not zero-terminated
+	u64 total_size;
+} annotation_binary_column_layout_t;
+
+static inline u64 annotation_binary_align(u64 size) {
+	return (size + 7) & ~7;
+}
+
+static annotation_binary_column_layout_t annotation_binary_get_column_layout(annotation_binary_annotations_header_t* header) {
+	annotation_binary_column_layout_t layout = {};
+	u64 count = header->count;
+	u64 pos = sizeof(annotation_binary_annotations_header_t);
+	layout.coordinates = pos;        pos += header->coordinate_count * sizeof(v2f);
+	layout.coordinate_offsets = pos; pos += (count + 1) * sizeof(u64);
+	layout.hashes = pos;             pos += count * sizeof(u64);
+	layout.stored_indices = pos;     pos += count * sizeof(i32);
+	layout.types = pos;              pos += count * sizeof(i32);
+	layout.group_ids = pos;          pos += count * sizeof(i32);
+	layout.colors = pos;             pos += count * sizeof(rgba_t);
+	layout.flags = pos;              pos += count * sizeof(u32);
+	layout.name_offsets = pos;       pos += (count + 1) * sizeof(u32);
+	layout.feature_values = pos;     pos += header->feature_value_count * sizeof(annotation_binary_feature_value_t);
+	layout.names = pos;              pos += header->name_bytes;
+	layout.total_size = annotation_binary_align(pos);
+	return layout;
+}
+
+// Simple 64-bit hash, only used for detecting which annotations changed since the last save
+static u64 annotation_binary_hash(u64 hash, const void* data, size_t size) {
+	const u8* p = (const u8*)data;
+	const u64 multiplier = 0x9E3779B97F4A7C15ull;
+	while (size >= 8) {
+		u64 word;
+		memcpy(&word, p, 8);
+		hash = (hash ^ word) * multiplier;
+		hash ^= hash >> 29;
+		p += 8;
+		size -= 8;
+	}
+	if (size > 0) {
+		u64 word = 0;
+		memcpy(&word, p, size);
+		hash = (hash ^ word ^ ((u64)size << 56)) * multiplier;
+		hash ^= hash >> 29;
+	}
+	return hash;
+}
+
+// The stored index is included, so that a copy of an annotation at a different index is never mistaken for a saved one
+static u64 annotation_binary_hash_annotation(annotation_t* annotation, i32 stored_index, size_t name_length) {
+	u32 fields[6] = {(u32)stored_index, (u32)annotation->type, (u32)annotation->group_id, annotation->color.values[0] | (annotation->color.values[1] << 8) | (annotation->color.values[2] << 16) | ((u32)annotation->color.values[3] << 24),
+	                 (u32)annotation->is_open | ((u32)annotation->has_properties << 1), (u32)annotation->coordinate_count};
+	u64 hash = annotation_binary_hash(0xcbf29ce484222325ull, fields, sizeof(fields));
+	hash = annotation_binary_hash(hash, annotation->name, name_length);
+	hash = annotation_binary_hash(hash, annotation->features, sizeof(annotation->features));
+	hash = annotation_binary_hash(hash, annotation->coordinates, annotation->coordinate_count * sizeof(v2f));
+	return hash ? hash : 1; // zero means 'never saved'
+}
+
+static i64 annotation_binary_push_record_header(memrw_t* out, u32 type) {
+	annotation_binary_record_header_t record_header = {.type = type};
+	return memrw_push_back(out, &record_header, sizeof(record_header));
+}
+
+static void annotation_binary_finish_record(memrw_t* out, i64 record_header_offset) {
+	u64 payload_size = out->used_size - (record_header_offset + sizeof(annotation_binary_record_header_t));
+	u64 padding = annotation_binary_align(payload_size) - payload_size;
+	if (padding > 0) {
+		memrw_push_back(out, NULL, padding);
+	}
+	annotation_binary_record_header_t* record_header = (annotation_binary_record_header_t*)(out->data + record_header_offset);
+	record_header->size = payload_size + padding;
+}
+
+static void annotation_binary_write_groups(memrw_t* out, annotation_set_t* annotation_set) {
+	i64 record_offset = annotation_binary_push_record_header(out, ANNOTATION_BINARY_RECORD_GROUPS);
+	annotation_binary_table_header_t table = {annotation_set->stored_group_count, annotation_set->active_group_count};
+	memrw_push_back(out, &table, sizeof(table));
+	for (i32 i = 0; i < annotation_set->stored_group_count; ++i) {
+		annotation_group_t* group = annotation_set->stored_groups + i;
+		annotation_binary_group_t entry = {};
+		memcpy(entry.name, group->name, MIN(sizeof(entry.name), sizeof(group->name)));
+		entry.name[sizeof(entry.name)-1] = '\0';
+		entry.color = group->color;
+		entry.flags = (group->is_explicitly_defined ? ANNOTATION_BINARY_FLAG_IS_EXPLICITLY_DEFINED : 0) |
+		              (group->hidden ? ANNOTATION_BINARY_FLAG_HIDDEN : 0) | (group->deleted ? ANNOTATION_BINARY_FLAG_DELETED : 0);
+		memrw_push_back(out, &entry, sizeof(entry));
+	}
+	memrw_push_back(out, annotation_set->active_group_indices, annotation_set->active_group_count * sizeof(i32));
+	annotation_binary_finish_record(out, record_offset);
+}
+
+static void annotation_binary_write_features(memrw_t* out, annotation_set_t* annotation_set) {
+	i64 record_offset = annotation_binary_push_record_header(out, ANNOTATION_BINARY_RECORD_FEATURES);
+	annotation_binary_table_header_t table = {annotation_set->stored_feature_count, annotation_set->active_feature_count};
+	memrw_push_back(out, &table, sizeof(table));
+	for (i32 i = 0; i < annotation_set->stored_feature_count; ++i) {
+		annotation_feature_t* feature = annotation_set->stored_features + i;
+		annotation_binary_feature_t entry = {};
+		memcpy(entry.name, feature->name, MIN(sizeof(entry.name), sizeof(feature->name)));
+		entry.name[sizeof(entry.name)-1] = '\0';
+		entry.color = feature->color;
+		entry.group_id = feature->group_id;
+		entry.flags = (feature->is_explicitly_defined ? ANNOTATION_BINARY_FLAG_IS_EXPLICITLY_DEFINED : 0) |
+		              (feature->restrict_to_group ? ANNOTATION_BINARY_FLAG_RESTRICT_TO_GROUP : 0) | (feature->deleted ? ANNOTATION_BINARY_FLAG_DELETED : 0);
+		memrw_push_back(out, &entry, sizeof(entry));
+	}
+	memrw_push_back(out, annotation_set->active_feature_indices, annotation_set->active_feature_count * sizeof(i32));
+	annotation_binary_finish_record(out, record_offset);
+}
+
+static void annotation_binary_write_active_indices(memrw_t* out, annotation_set_t* annotation_set) {
+	i64 record_offset = annotation_binary_push_record_header(out, ANNOTATION_BINARY_RECORD_ACTIVE_INDICES);
+	annotation_binary_table_header_t table = {annotation_set->stored_annotation_count, annotation_set->active_annotation_count};
+	memrw_push_back(out, &table, sizeof(table));
+	memrw_push_back(out, annotation_set->active_annotation_indices, annotation_set->active_annotation_count * sizeof(i32));
+	annotation_binary_finish_record(out, record_offset);
+}
+
+static void annotation_binary_write_annotations(memrw_t* out, annotation_set_t* annotation_set, i32* stored_indices, u64* hashes, i32 count) {
+	// First pass: determine the sizes of the variable-length columns
+	annotation_binary_annotations_header_t header = {};
+	header.count = count;
+	for (i32 i = 0; i < count; ++i) {
+		annotation_t* annotation = annotation_set->stored_annotations + stored_indices[i];
+		header.coordinate_count += annotation->coordinate_count;
+		header.name_bytes += strnlen(annotation->name, sizeof(annotation->name));
+		for (i32 j = 0; j < MAX_ANNOTATION_FEATURES; ++j) {
+			if (annotation->features[j] != 0.0f) {
+				header.feature_value_count += 1;
+			}
+		}
+	}
+	annotation_binary_column_layout_t layout = annotation_binary_get_column_layout(&header);
+
+	i64 record_offset = annotation_binary_push_record_header(out, ANNOTATION_BINARY_RECORD_ANNOTATIONS);
+	u64 payload_offset = memrw_push_back(out, NULL, layout.total_size);
+	u8* payload = out->data + payload_offset;
+	memcpy(payload, &header, sizeof(header));
+
+	v2f* coordinates = (v2f*)(payload + layout.coordinates);
+	u64* coordinate_offsets = (u64*)(payload + layout.coordinate_offsets);
+	u64* hash_column = (u64*)(payload + layout.hashes);
+	i32* stored_index_column = (i32*)(payload + layout.stored_indices);
+	i32* types = (i32*)(payload + layout.types);
+	i32* group_ids = (i32*)(payload + layout.group_ids);
+	rgba_t* colors = (rgba_t*)(payload + layout.colors);
+	u32* flags = (u32*)(payload + layout.flags);
+	u32* name_offsets = (u32*)(payload + layout.name_offsets);
+	annotation_binary_feature_value_t* feature_values = (annotation_binary_feature_value_t*)(payload + layout.feature_values);
+	char* names = (char*)(payload + layout.names);
+
+	u64 coordinate_pos = 0;
+	u32 name_pos = 0;
+	i32 feature_value_pos = 0;
+	for (i32 i = 0; i < count; ++i) {
+		annotation_t* annotation = annotation_set->stored_annotations + stored_indices[i];
+		coordinate_offsets[i] = coordinate_pos;
+		memcpy(coordinates + coordinate_pos, annotation->coordinates, annotation->coordinate_count * sizeof(v2f));
+		coordinate_pos += annotation->coordinate_count;
+		hash_column[i] = hashes[i];
+		stored_index_column[i] = stored_indices[i];
+		types[i] = annotation->type;
+		group_ids[i] = annotation->group_id;
+		colors[i] = annotation->color;
+		flags[i] = (annotation->is_open ? ANNOTATION_BINARY_FLAG_IS_OPEN : 0) | (annotation->has_properties ? ANNOTATION_BINARY_FLAG_HAS_PROPERTIES : 0);
+		name_offsets[i] = name_pos;
+		size_t name_length = strnlen(annotation->name, sizeof(annotation->name));
+		memcpy(names + name_pos, annotation->name, name_length);
+		name_pos += name_length;
+		for (i32 j = 0; j < MAX_ANNOTATION_FEATURES; ++j) {
+			if (annotation->features[j] != 0.0f) {
+				annotation_binary_feature_value_t* feature_value = feature_values + feature_value_pos++;
+				feature_value->annotation = i;
+				feature_value->feature = j;
+				feature_value->value = annotation->features[j];
+			}
+		}
+	}
+	coordinate_offsets[count] = coordinate_pos;
+	name_offsets[count] = name_pos;
+	annotation_binary_finish_record(out, record_offset);
+}
+
+static void annotation_binary_write_commit(memrw_t* out, annotation_set_t* annotation_set, bool xml_export_is_current) {
+	i64 record_offset = annotation_binary_push_record_header(out, ANNOTATION_BINARY_RECORD_COMMIT);
+	annotation_binary_commit_t commit = {};
+	commit.stored_annotation_count = annotation_set->stored_annotation_count;
+	commit.flags = xml_export_is_current ? ANNOTATION_BINARY_FLAG_XML_EXPORT_IS_CURRENT : 0;
+	memrw_push_back(out, &commit, sizeof(commit));
+	annotation_binary_finish_record(out, record_offset);
+}
+
+static u64 annotation_binary_hash_table_record(annotation_set_t* annotation_set, void (*write_func)(memrw_t*, annotation_set_t*), memrw_t* scratch) {
+	memrw_rewind(scratch);
+	write_func(scratch, annotation_set);
+	return annotation_binary_hash(0xcbf29ce484222325ull, scratch->data, scratch->used_size);
+}
+
+void annotation_binary_store_set_filename(annotation_set_t* annotation_set, const char* xml_filename) {
+	annotation_binary_store_t* store = &annotation_set->binary_store;
+	strncpy(store->filename, xml_filename, sizeof(store->filename)-1);
+	store->filename[sizeof(store->filename)-1] = '\0';
+	replace_file_extension(store->filename, sizeof(store->filename), ANNOTATION_BINARY_STORE_EXTENSION);
+}
+
+bool annotation_binary_store_is_newer_than(const char* binary_store_filename, const char* other_filename) {
+	struct stat binary_store_st = {};
+	if (platform_stat(binary_store_filename, &binary_store_st) != 0) {
+		return false;
+	}
+	struct stat other_st = {};
+	if (platform_stat(other_filename, &other_st) != 0) {
+		return true; // other file doesn't exist
+	}
+	// NOTE: the binary store is always written after the XML file, so on equal timestamps the binary store wins
+	return binary_store_st.st_mtime >= other_st.st_mtime;
+}
+
+typedef struct annotation_binary_write_task_t {
+	memrw_t buffer;
+	annotation_set_t* annotation_set;
+	bool is_snapshot;
+} annotation_binary_write_task_t;
+
+static void annotation_binary_write_func(i32 logical_thread_index, void* userdata) {
+	annotation_binary_write_task_t* task = (annotation_binary_write_task_t*) userdata;
+	annotation_binary_store_t* store = &task->annotation_set->binary_store;
+	bool success = false;
+	if (task->is_snapshot) {
+		// Write a complete new file next to the old one, then swap them
+		char temp_filename[sizeof(store->filename) + 8];
+		snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", store->filename);
+		FILE* fp = fopen(temp_filename, "wb");
+		if (fp) {
+			success = (fwrite(task->buffer.data, 1, task->buffer.used_size, fp) == task->buffer.used_size);
+			success = (fclose(fp) == 0) && success;
+			if (success) {
+				remove(store->filename);
+				success = (rename(temp_filename, store->filename) == 0);
+			} else {
+				remove(temp_filename);
+			}
+		}
+	} else {
+		FILE* fp = fopen(store->filename, "ab");
+		if (fp) {
+			success = (fwrite(task->buffer.data, 1, task->buffer.used_size, fp) == task->buffer.used_size);
+			success = (fclose(fp) == 0) && success;
+		}
+	}
+	if (!success) {
+		console_print_error("Error: could not write binary annotation store '%s'\n", store->filename);
+		store->write_failed = 1;
+	}
+	memrw_destroy(&task->buffer);
+	write_barrier;
+	task->annotation_set->is_saving_in_progress = 0;
+}
+
+// Writes the annotations that changed since the last save (or a complete snapshot, if needed).
+// Returns false if the store could not be written right now (e.g. another save is still in progress).
+bool save_annotation_binary_store(annotation_set_t* annotation_set, bool async) {
+	annotation_binary_store_t* store = &annotation_set->binary_store;
+	if (store->filename[0] == '\0') return false;
+	if (annotation_set->asap_xml_loader || annotation_set->coco_loader) return false; // still loading
+
+	// Writes must happen in order, so don't start a new one while a previous write is still in progress
+	if (!atomic_compare_exchange(&annotation_set->is_saving_in_progress, 1, 0)) {
+		return false;
+	}
+	if (store->write_failed) {
+		store->write_failed = 0;
+		store->is_valid = false; // we don't know what made it to disk; start over
+	}
+
+	i64 clock_start = get_clock();
+	temp_memory_t temp_memory = begin_temp_memory_on_local_thread();
+	i32 active_count = annotation_set->active_annotation_count;
+	u64* hashes = arena_push_array(temp_memory.arena, active_count, u64);
+	i32* changed_indices = arena_push_array(temp_memory.arena, active_count, i32);
+	u64* changed_hashes = arena_push_array(temp_memory.arena, active_count, u64);
+	i32 changed_count = 0;
+	u64 live_size = sizeof(annotation_binary_header_t);
+	for (i32 i = 0; i < active_count; ++i) {
+		i32 stored_index = annotation_set->active_annotation_indices[i];
+		annotation_t* annotation = annotation_set->stored_annotations + stored_index;
+		size_t name_length = strnlen(annotation->name, sizeof(annotation->name));
+		u64 hash = annotation_binary_hash_annotation(annotation, stored_index, name_length);
+		hashes[i] = hash;
+		if (!store->is_valid || hash != annotation->saved_hash) {
+			changed_indices[changed_count] = stored_index;
+			changed_hashes[changed_count] = hash;
+			++changed_count;
+		}
+		live_size += annotation->coordinate_count * sizeof(v2f) + name_length + 40;
+	}
+
+	memrw_t scratch = memrw_create(KILOBYTES(64));
+	u64 groups_hash = annotation_binary_hash_table_record(annotation_set, annotation_binary_write_groups, &scratch);
+	live_size += scratch.used_size;
+	u64 features_hash = annotation_binary_hash_table_record(annotation_set, annotation_binary_write_features, &scratch);
+	live_size += scratch.used_size;
+	u64 active_indices_hash = annotation_binary_hash_table_record(annotation_set, annotation_binary_write_active_indices, &scratch);
+	live_size += scratch.used_size;
+	memrw_destroy(&scratch);
+
+	bool xml_export_is_current = !annotation_set->modified;
+	bool is_snapshot = !store->is_valid;
+	if (!is_snapshot && store->file_size > ANNOTATION_BINARY_MIN_COMPACTION_SIZE && (u64)store->file_size > 2 * live_size) {
+		// Too many outdated records: compact the file by writing everything again
+		is_snapshot = true;
+		memcpy(changed_indices, annotation_set->active_annotation_indices, active_count * sizeof(i32));
+		memcpy(changed_hashes, hashes, active_count * sizeof(u64));
+		changed_count = active_count;
+	}
+	bool groups_changed = is_snapshot || groups_hash != store->groups_hash;
+	bool features_changed = is_snapshot || features_hash != store->features_hash;
+	bool active_indices_changed = is_snapshot || active_indices_hash != store->active_indices_hash;
+
+	if (!is_snapshot && changed_count == 0 && !groups_changed && !features_changed && !active_indices_changed
+	    && xml_export_is_current == store->xml_export_was_current) {
+		// Nothing to do
+		release_temp_memory(&temp_memory);
+		annotation_set->is_saving_in_progress = 0;
+		store->need_save = false;
+		return true;
+	}
+
+	annotation_binary_write_task_t task = {};
+	task.annotation_set = annotation_set;
+	task.is_snapshot = is_snapshot;
+	task.buffer = memrw_create(is_snapshot ? live_size + KILOBYTES(4) : KILOBYTES(64));
+	if (is_snapshot) {
+		annotation_binary_header_t header = {};
+		header.magic = ANNOTATION_BINARY_MAGIC;
+		header.version = ANNOTATION_BINARY_VERSION;
+		header.mpp = annotation_set->mpp;
+		memrw_push_back(&task.buffer, &header, sizeof(header));
+	}
+	if (groups_changed) annotation_binary_write_groups(&task.buffer, annotation_set);
+	if (features_changed) annotation_binary_write_features(&task.buffer, annotation_set);
+	if (changed_count > 0) annotation_binary_write_annotations(&task.buffer, annotation_set, changed_indices, changed_hashes, changed_count);
+	if (active_indices_changed) annotation_binary_write_active_indices(&task.buffer, annotation_set);
+	annotation_binary_write_commit(&task.buffer, annotation_set, xml_export_is_current);
+
+	for (i32 i = 0; i < changed_count; ++i) {
+		annotation_set->stored_annotations[changed_indices[i]].saved_hash = changed_hashes[i];
+	}
+	release_temp_memory(&temp_memory);
+
+	store->groups_hash = groups_hash;
+	store->features_hash = features_hash;
+	store->active_indices_hash = active_indices_hash;
+	store->xml_export_was_current = xml_export_is_current;
+	store->file_size = is_snapshot ? task.buffer.used_size : store->file_size + task.buffer.used_size;
+	store->is_valid = true;
+	store->need_save = false;
+
+	console_print_verbose("Binary annotation store: %s %d annotations (%lld bytes) in %g seconds\n", is_snapshot ? "wrote snapshot of" : "appended",
+	                      changed_count, (long long)task.buffer.used_size, get_seconds_elapsed(clock_start, get_clock()));
+
+	if (async && global_worker_thread_count > 0 && work_queue_submit_task(&global_work_queue, annotation_binary_write_func, &task, sizeof(task))) {
+		// The worker releases the lock when done
+	} else {
+		annotation_binary_write_func(0, &task);
+	}
+	return true;
+}
+
+static bool annotation_binary_load_table(u8* payload, u64 payload_size, void** stored_items, i32* stored_count, i32** active_indices, i32* active_count, bool is_groups) {
+	annotation_binary_table_header_t* table = (annotation_binary_table_header_t*)payload;
+	size_t entry_size = is_groups ? sizeof(annotation_binary_group_t) : sizeof(annotation_binary_feature_t);
+	if (payload_size < sizeof(*table) || table->stored_count < 0 || table->active_count < 0) return false;
+	if (sizeof(*table) + table->stored_count * entry_size + table->active_count * sizeof(i32) > payload_size) {
+		return false;
+	}
+	u8* entries = payload + sizeof(*table);
+	i32* active = (i32*)(entries + table->stored_count * entry_size);
+	for (i32 i = 0; i < table->active_count; ++i) {
+		if (active[i] < 0 || active[i] >= table->stored_count) {
+			return false; // corrupt table
+		}
+	}
+	if (is_groups) {
+		annotation_group_t** groups = (annotation_group_t**)stored_items;
+		arrsetlen(*groups, table->stored_count);
+		for (i32 i = 0; i < table->stored_count; ++i) {
+			annotation_binary_group_t* entry = (annotation_binary_group_t*)entries + i;
+			annotation_group_t* group = *groups + i;
+			memset(group, 0, sizeof(*group));
+			memcpy(group->name, entry->name, sizeof(group->name));
+			group->name[sizeof(group->name)-1] = '\0';
+			group->color = entry->color;
+			group->id = i;
+			group->is_explicitly_defined = (entry->flags & ANNOTATION_BINARY_FLAG_IS_EXPLICITLY_DEFINED) != 0;
+			group->hidden = (entry->flags & ANNOTATION_BINARY_FLAG_HIDDEN) != 0;
+			group->deleted = (entry->flags & ANNOTATION_BINARY_FLAG_DELETED) != 0;
+		}
+	} else {
+		annotation_feature_t** features = (annotation_feature_t**)stored_items;
+		arrsetlen(*features, table->stored_count);
+		for (i32 i = 0; i < table->stored_count; ++i) {
+			annotation_binary_feature_t* entry = (annotation_binary_feature_t*)entries + i;
+			annotation_feature_t* feature = *features + i;
+			memset(feature, 0, sizeof(*feature));
+			memcpy(feature->name, entry->name, sizeof(feature->name));
+			feature->name[sizeof(feature->name)-1] = '\0';
+			feature->color = entry->color;
+			feature->id = i;
+			feature->group_id = entry->group_id;
+			feature->is_explicitly_defined = (entry->flags & ANNOTATION_BINARY_FLAG_IS_EXPLICITLY_DEFINED) != 0;
+			feature->restrict_to_group = (entry->flags & ANNOTATION_BINARY_FLAG_RESTRICT_TO_GROUP) != 0;
+			feature->deleted = (entry->flags & ANNOTATION_BINARY_FLAG_DELETED) != 0;
+		}
+	}
+	*stored_count = table->stored_count;
+	arrsetlen(*active_indices, table->active_count);
+	memcpy(*active_indices, active, table->active_count * sizeof(i32));
+	*active_count = table->active_count;
+	return true;
+}
+
+// 'stored_count' is the number of stored annotations according to the commit that this record is part of.
+static bool annotation_binary_load_annotations(annotation_set_t* annotation_set, u8* payload, u64 payload_size, i32 stored_count, float scale_x, float scale_y) {
+	annotation_binary_annotations_header_t* header = (annotation_binary_annotations_header_t*)payload;
+	if (payload_size < sizeof(*header) || header->count < 0 || header->feature_value_count < 0) return false;
+	// Check the sizes of the columns individually first, so that computing the layout can't overflow
+	if (header->coordinate_count > payload_size / sizeof(v2f) || header->name_bytes > payload_size) return false;
+	annotation_binary_column_layout_t layout = annotation_binary_get_column_layout(header);
+	if (layout.total_size > payload_size) return false;
+
+	v2f* coordinates = (v2f*)(payload + layout.coordinates);
+	u64* coordinate_offsets = (u64*)(payload + layout.coordinate_offsets);
+	u64* hashes = (u64*)(payload + layout.hashes);
+	i32* stored_indices = (i32*)(payload + layout.stored_indices);
+	i32* types = (i32*)(payload + layout.types);
+	i32* group_ids = (i32*)(payload + layout.group_ids);
+	rgba_t* colors = (rgba_t*)(payload + layout.colors);
+	u32* flags = (u32*)(payload + layout.flags);
+	u32* name_offsets = (u32*)(payload + layout.name_offsets);
+	annotation_binary_feature_value_t* feature_values = (annotation_binary_feature_value_t*)(payload + layout.feature_values);
+	char* names = (char*)(payload + layout.names);
+	bool need_rescale = (scale_x != 1.0f || scale_y != 1.0f);
+
+	for (i32 i = 0; i < header->count; ++i) {
+		i32 stored_index = stored_indices[i];
+		if (stored_index < 0 || stored_index >= stored_count) {
+			return false;
+		}
+		if (coordinate_offsets[i] > coordinate_offsets[i+1] || coordinate_offsets[i+1] > header->coordinate_count ||
+		    name_offsets[i] > name_offsets[i+1] || name_offsets[i+1] > header->name_bytes) {
+			return false;
+		}
+		if (types[i] < ANNOTATION_UNKNOWN_TYPE || types[i] > ANNOTATION_TEXT ||
+		    group_ids[i] < 0 || group_ids[i] >= annotation_set->stored_group_count) {
+			return false;
+		}
+		u64 coordinate_count = coordinate_offsets[i+1] - coordinate_offsets[i];
+		u32 name_length = name_offsets[i+1] - name_offsets[i];
+		i32 old_stored_count = arrlen(annotation_set->stored_annotations);
+		if (stored_index >= old_stored_count) {
+			arrsetlen(annotation_set->stored_annotations, stored_index + 1);
+			memset(annotation_set->stored_annotations + old_stored_count, 0, (stored_index + 1 - old_stored_count) * sizeof(annotation_t));
+		}
+		annotation_t* annotation = annotation_set->stored_annotations + stored_index;
+		destroy_annotation(annotation); // replaced by a newer version
+		memset(annotation, 0, sizeof(*annotation));
+		annotation->type = (annotation_type_enum)types[i];
+		annotation->group_id = group_ids[i];
+		annotation->color = colors[i];
+		annotation->is_open = (flags[i] & ANNOTATION_BINARY_FLAG_IS_OPEN) != 0;
+		annotation->has_properties = (flags[i] & ANNOTATION_BINARY_FLAG_HAS_PROPERTIES) != 0;
+		memcpy(annotation->name, names + name_offsets[i], MIN(name_length, sizeof(annotation->name)-1));
+		arrsetlen(annotation->coordinates, coordinate_count);
+		annotation->coordinate_count = (i32)coordinate_count;
+		memcpy(annotation->coordinates, coordinates + coordinate_offsets[i], coordinate_count * sizeof(v2f));
+		if (need_rescale) {
+			for (u64 j = 0; j < coordinate_count; ++j) {
+				annotation->coordinates[j].x *= scale_x;
+				annotation->coordinates[j].y *= scale_y;
+			}
+		} else {
+			annotation->saved_hash = hashes[i];
+		}
+	}
+	for (i32 i = 0; i < header->feature_value_count; ++i) {
+		annotation_binary_feature_value_t* feature_value = feature_values + i;
+		if (feature_value->annotation >= 0 && feature_value->annotation < header->count && feature_value->feature >= 0 && feature_value->feature < MAX_ANNOTATION_FEATURES) {
+			annotation_t* annotation = annotation_set->stored_annotations + stored_indices[feature_value->annotation];
+			annotation->features[feature_value->feature] = feature_value->value;
+		}
+	}
+	return true;
+}
+
+// Find the commit record that completes the changes starting at 'pos'. Returns false if there is none.
+static bool annotation_binary_find_commit(u8* data, u64 pos, u64 committed_end, annotation_binary_commit_t* commit) {
+	while (pos < committed_end) {
+		annotation_binary_record_header_t* record_header = (annotation_binary_record_header_t*)(data + pos);
+		u8* payload = data + pos + sizeof(annotation_binary_record_header_t);
+		pos += sizeof(annotation_binary_record_header_t) + record_header->size;
+		if (record_header->type == ANNOTATION_BINARY_RECORD_COMMIT) {
+			if (record_header->size < sizeof(*commit)) {
+				return false;
+			}
+			memcpy(commit, payload, sizeof(*commit));
+			return true;
+		}
+	}
+	return false;
+}
+
+bool load_annotation_binary_store(annotation_set_t* annotation_set, const char* filename) {
+	i64 clock_start = get_clock();
+	mapped_file_t file = {};
+	if (!file_map_for_reading(filename, &file)) {
+		return false;
+	}
+	annotation_binary_header_t* header = (annotation_binary_header_t*)file.data;
+	if (file.size < sizeof(*header) || header->magic != ANNOTATION_BINARY_MAGIC || header->version != ANNOTATION_BINARY_VERSION) {
+		console_print_error("Error: '%s' is not a valid binary annotation store\n", filename);
+		file_unmap(&file);
+		return false;
+	}
+
+	// First pass: find the end of the last complete commit; anything after it is discarded
+	u64 committed_end = 0;
+	u64 pos = sizeof(*header);
+	while (pos + sizeof(annotation_binary_record_header_t) <= file.size) {
+		annotation_binary_record_header_t* record_header = (annotation_binary_record_header_t*)(file.data + pos);
+		u64 payload_pos = pos + sizeof(annotation_binary_record_header_t);
+		if (record_header->size % 8 != 0 || record_header->size > file.size - payload_pos) {
+			break;
+		}
+		pos = payload_pos + record_header->size;
+		if (record_header->type == ANNOTATION_BINARY_RECORD_COMMIT) {
+			committed_end = pos;
+		}
+	}
+	if (committed_end == 0) {
+		console_print_error("Error: binary annotation store '%s' does not contain any committed changes\n", filename);
+		file_unmap(&file);
+		return false;
+	}
+
+	// Second pass: apply the records in order
+	float scale_x = 1.0f;
+	float scale_y = 1.0f;
+	if (header->mpp.x > 0.0f && header->mpp.y > 0.0f) {
+		scale_x = annotation_set->mpp.x / header->mpp.x;
+		scale_y = annotation_set->mpp.y / header->mpp.y;
+	}
+	bool success = true;
+	annotation_binary_commit_t last_commit = {};
+	pos = sizeof(*header);
+	while (pos < committed_end) {
+		annotation_binary_record_header_t* record_header = (annotation_binary_record_header_t*)(file.data + pos);
+		u8* payload = file.data + pos + sizeof(annotation_binary_record_header_t);
+		u64 payload_size = record_header->size;
+		pos += sizeof(annotation_binary_record_header_t) + payload_size;
+		switch(record_header->type) {
+			case ANNOTATION_BINARY_RECORD_GROUPS: {
+				if (!annotation_binary_load_table(payload, payload_size, (void**)&annotation_set->stored_groups, &annotation_set->stored_group_count,
+				                                  &annotation_set->active_group_indices, &annotation_set->active_group_count, true)) {
+					success = false;
+				}
+			} break;
+			case ANNOTATION_BINARY_RECORD_FEATURES: {
+				if (!annotation_binary_load_table(payload, payload_size, (void**)&annotation_set->stored_features, &annotation_set->stored_feature_count,
+				                                  &annotation_set->active_feature_indices, &annotation_set->active_feature_count, false)) {
+					success = false;
+				}
+			} break;
+			case ANNOTATION_BINARY_RECORD_ANNOTATIONS: {
+				// Stored indices are bounded by the stored annotation count at the time of the commit.
+				annotation_binary_commit_t commit = {};
+				if (!annotation_binary_find_commit(file.data, pos, committed_end, &commit) ||
+				    !annotation_binary_load_annotations(annotation_set, payload, payload_size, commit.stored_annotation_count, scale_x, scale_y)) {
+					success = false;
+				}
+			} break;
+			case ANNOTATION_BINARY_RECORD_ACTIVE_INDICES: {
+				annotation_binary_table_header_t table = {};
+				if (payload_size < sizeof(table)) {
+					success = false;
+					break;
+				}
+				memcpy(&table, payload, sizeof(table));
+				if (table.active_count < 0 || sizeof(table) + (u64)table.active_count * sizeof(i32) > payload_size) {
+					success = false;
+					break;
+				}
+				arrsetlen(annotation_set->active_annotation_indices, table.active_count);
+				memcpy(annotation_set->active_annotation_indices, payload + sizeof(table), table.active_count * sizeof(i32));
+				annotation_set->active_annotation_count = table.active_count;
+			} break;
+			case ANNOTATION_BINARY_RECORD_COMMIT: {
+				if (payload_size < sizeof(last_commit)) {
+					success = false;
+					break;
+				}
+				memcpy(&last_commit, payload, sizeof(last_commit));
+				if (last_commit.stored_annotation_count < 0) {
+					success = false;
+				}
+			} break;
+			default: break; // unknown record type, skip
+		}
+		if (!success) break;
+	}
+	u64 file_size = file.size;
+	file_unmap(&file);
+
+	// The stored annotations array may be longer than needed if annotations were deleted without being saved
+	i32 stored_count = (i32)arrlen(annotation_set->stored_annotations);
+	if (last_commit.stored_annotation_count > stored_count) {
+		arrsetlen(annotation_set->stored_annotations, last_commit.stored_annotation_count);
+		memset(annotation_set->stored_annotations + stored_count, 0, (last_commit.stored_annotation_count - stored_count) * sizeof(annotation_t));
+		stored_count = last_commit.stored_annotation_count;
+	}
+	annotation_set->stored_annotation_count = stored_count;
+	for (i32 i = 0; i < annotation_set->active_annotation_count; ++i) {
+		i32 stored_index = annotation_set->active_annotation_indices[i];
+		if (stored_index < 0 || stored_index >= stored_count) {
+			success = false;
+			break;
+		}
+	}
+	if (!success) {
+		console_print_error("Error: binary annotation store '%s' is corrupt\n", filename);
+		return false;
+	}
+
+	// The next save can append to this file, unless it has an incomplete record at the end
+	annotation_binary_store_t* store = &annotation_set->binary_store;
+	strncpy(store->filename, filename, sizeof(store->filename)-1);
+	store->file_size = committed_end;
+	store->is_valid = (committed_end == file_size) && scale_x == 1.0f && scale_y == 1.0f;
+	store->xml_export_was_current = (last_commit.flags & ANNOTATION_BINARY_FLAG_XML_EXPORT_IS_CURRENT) != 0;
+	memrw_t scratch = memrw_create(KILOBYTES(64));
+	store->groups_hash = annotation_binary_hash_table_record(annotation_set, annotation_binary_write_groups, &scratch);
+	store->features_hash = annotation_binary_hash_table_record(annotation_set, annotation_binary_write_features, &scratch);
+	store->active_indices_hash = annotation_binary_hash_table_record(annotation_set, annotation_binary_write_active_indices, &scratch);
+	memrw_destroy(&scratch);
+
+	annotation_set->annotations_were_loaded_from_file = true;
+	annotation_set->export_as_asap_xml = true;
+	// If autosave wrote changes that were never exported, the XML file needs to be updated
+	annotation_set->modified = !store->xml_export_was_current;
+
+	console_print_verbose("Loaded binary annotation store '%s' in %g seconds (%d annotations).\n", filename,
+	                      get_seconds_elapsed(clock_start, get_clock()), annotation_set->active_annotation_count);
+	return true;
+}
@@ -0,0 +1,224 @@
+/*
+  Slidescape, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2024  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Spatial index for annotations.
+// Drawing and hit testing only need to consider the annotations near the camera view or the mouse cursor.
+// For very large annotation sets (hundreds of thousands of annotations), checking every annotation's bounds
+// every frame is too slow, so we keep the annotations sorted into the cells of a uniform grid.
+
+#define ANNOTATION_SPATIAL_INDEX_MAX_CELLS_PER_AXIS 1024
+#define ANNOTATION_SPATIAL_INDEX_MAX_CELLS_PER_ANNOTATION 256
+#define ANNOTATION_SPATIAL_INDEX_TARGET_ANNOTATIONS_PER_CELL 4
+
+static bounds2i annotation_spatial_index_get_cell_range(annotation_spatial_index_t* spatial_index, bounds2f bounds) {
+	// NOTE: bounds outside the grid are clamped to the edge cells. This is needed because annotations may be
+	// added or moved outside the original grid bounds after the index has been built.
+	bounds2i range = {};
+	float left = (bounds.left - spatial_index->grid_bounds.left) / spatial_index->cell_size.x;
+	float right = (bounds.right - spatial_index->grid_bounds.left) / spatial_index->cell_size.x;
+	float top = (bounds.top - spatial_index->grid_bounds.top) / spatial_index->cell_size.y;
+	float bottom = (bounds.bottom - spatial_index->grid_bounds.top) / spatial_index->cell_size.y;
+	float max_x = (float)(spatial_index->cell_count_x - 1);
+	float max_y = (float)(spatial_index->cell_count_y - 1);
+	range.left = (i32)CLAMP(left, 0.0f, max_x);
+	range.right = (i32)CLAMP(right, 0.0f, max_x);
+	range.top = (i32)CLAMP(top, 0.0f, max_y);
+	range.bottom = (i32)CLAMP(bottom, 0.0f, max_y);
+	return range;
+}
+
+static void annotation_spatial_index_insert(annotation_spatial_index_t* spatial_index, annotation_t* annotation, i32 active_index) {
+	if (annotation->coordinate_count == 0) {
+		// Nothing to draw or hit test (yet). Once coordinates are added, the annotation is invalidated and re-inserted.
+		annotation->valid_flags |= ANNOTATION_VALID_SPATIAL_INDEX;
+		return;
+	}
+	annotation_recalculate_bounds_if_necessary(annotation);
+	bounds2i range = annotation_spatial_index_get_cell_range(spatial_index, annotation->bounds);
+	i64 cells_spanned = (i64)(range.right - range.left + 1) * (i64)(range.bottom - range.top + 1);
+	if (cells_spanned <= ANNOTATION_SPATIAL_INDEX_MAX_CELLS_PER_ANNOTATION) {
+		for (i32 cell_y = range.top; cell_y <= range.bottom; ++cell_y) {
+			for (i32 cell_x = range.left; cell_x <= range.right; ++cell_x) {
+				arrput(spatial_index->cells[cell_y * spatial_index->cell_count_x + cell_x], active_index);
+			}
+		}
+		spatial_index->entry_count += cells_spanned;
+		annotation->valid_flags |= ANNOTATION_VALID_SPATIAL_INDEX;
+		return;
+	}
+	// Very large annotations would take up too many cells; these are always returned as query candidates.
+	arrput(spatial_index->oversized_annotation_indices, active_index);
+	spatial_index->entry_count += 1;
+	annotation->valid_flags |= ANNOTATION_VALID_SPATIAL_INDEX;
+}
+
+static void annotation_spatial_index_clear(annotation_spatial_index_t* spatial_index) {
+	i32 cell_count = spatial_index->cell_count_x * spatial_index->cell_count_y;
+	for (i32 i = 0; i < cell_count; ++i) {
+		arrfree(spatial_index->cells[i]);
+	}
+	arrfree(spatial_index->cells);
+	arrsetlen(spatial_index->oversized_annotation_indices, 0);
+	spatial_index->cell_count_x = 0;
+	spatial_index->cell_count_y = 0;
+	spatial_index->indexed_annotation_count = 0;
+	spatial_index->entry_count = 0;
+	spatial_index->stale_entry_count = 0;
+}
+
+static void annotation_spatial_index_rebuild(annotation_set_t* annotation_set) {
+	annotation_spatial_index_t* spatial_index = &annotation_set->spatial_index;
+	annotation_spatial_index_clear(spatial_index);
+
+	// Determine the extent of the grid
+	i32 annotation_count = annotation_set->active_annotation_count;
+	bounds2f grid_bounds = { +FLT_MAX, +FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (i32 i = 0; i < annotation_count; ++i) {
+		annotation_t* annotation = get_active_annotation(annotation_set, i);
+		if (annotation->coordinate_count > 0) {
+			annotation_recalculate_bounds_if_necessary(annotation);
+			grid_bounds = bounds2f_encompassing(grid_bounds, annotation->bounds);
+		}
+	}
+	if (grid_bounds.left > grid_bounds.right || grid_bounds.top > grid_bounds.bottom) {
+		grid_bounds = BOUNDS2F(0.0f, 0.0f, 1.0f, 1.0f);
+	}
+	float grid_width = ATLEAST(grid_bounds.right - grid_bounds.left, 1.0f);
+	float grid_height = ATLEAST(grid_bounds.bottom - grid_bounds.top, 1.0f);
+
+	// Choose (roughly square) cells so that on average only a few annotations end up in each cell
+	float target_cell_count = ATLEAST(1.0f, (float)annotation_count / ANNOTATION_SPATIAL_INDEX_TARGET_ANNOTATIONS_PER_CELL);
+	float cell_side = sqrtf((grid_width * grid_height) / target_cell_count);
+	spatial_index->cell_count_x = CLAMP((i32)ceilf(grid_width / cell_side), 1, ANNOTATION_SPATIAL_INDEX_MAX_CELLS_PER_AXIS);
+	spatial_index->cell_count_y = CLAMP((i32)ceilf(grid_height / cell_side), 1, ANNOTATION_SPATIAL_INDEX_MAX_CELLS_PER_AXIS);
+	spatial_index->cell_size = V2F(grid_width / (float)spatial_index->cell_count_x, grid_height / (float)spatial_index->cell_count_y);
+	spatial_index->grid_bounds = grid_bounds;
+
+	i32 cell_count = spatial_index->cell_count_x * spatial_index->cell_count_y;
+	arrsetlen(spatial_index->cells, cell_count);
+	memset(spatial_index->cells, 0, cell_count * sizeof(i32*));
+
+	for (i32 i = 0; i < annotation_count; ++i) {
+		annotation_spatial_index_insert(spatial_index, get_active_annotation(annotation_set, i), i);
+	}
+	spatial_index->indexed_annotation_count = annotation_count;
+	spatial_index->annotation_count_at_rebuild = annotation_count;
+	spatial_index->need_check_invalidated = false;
+	spatial_index->is_valid = true;
+}
+
+// Force a full rebuild next time the index is used.
+// Needed whenever active annotation indices are removed or reordered.
+void annotation_spatial_index_invalidate(annotation_set_t* annotation_set) {
+	annotation_set->spatial_index.is_valid = false;
+}
+
+void annotation_spatial_index_update(annotation_set_t* annotation_set) {
+	annotation_spatial_index_t* spatial_index = &annotation_set->spatial_index;
+	i32 annotation_count = annotation_set->active_annotation_count;
+	if (!spatial_index->is_valid || annotation_count < spatial_index->indexed_annotation_count ||
+	    annotation_count > 2 * ATLEAST(spatial_index->annotation_count_at_rebuild, 1024)) {
+		annotation_spatial_index_rebuild(annotation_set);
+		return;
+	}
+
+	// Re-insert annotations that have been modified since the last update.
+	// The old entries are left behind in the grid; we only keep track of how many there might be.
+	if (spatial_index->need_check_invalidated) {
+		for (i32 i = 0; i < spatial_index->indexed_annotation_count; ++i) {
+			annotation_t* annotation = get_active_annotation(annotation_set, i);
+			if (!(annotation->valid_flags & ANNOTATION_VALID_SPATIAL_INDEX)) {
+				annotation_spatial_index_insert(spatial_index, annotation, i);
+				++spatial_index->stale_entry_count;
+			}
+		}
+		spatial_index->need_check_invalidated = false;
+	}
+
+	// Insert newly added annotations
+	for (i32 i = spatial_index->indexed_annotation_count; i < annotation_count; ++i) {
+		annotation_spatial_index_insert(spatial_index, get_active_annotation(annotation_set, i), i);
+	}
+	spatial_index->indexed_annotation_count = annotation_count;
+
+	// Too many stale entries make queries less efficient -> start over
+	if (spatial_index->stale_entry_count > 1024 + spatial_index->entry_count / 4) {
+		annotation_spatial_index_rebuild(annotation_set);
+	}
+}
+
+// Find the (active indices of) annotations that might overlap with an area.
+// The result is sorted and contains no duplicates, so that annotations are drawn/hit tested in their usual order.
+void annotation_spatial_index_query(annotation_set_t* annotation_set, bounds2f area, i32** result_indices) {
+	annotation_spatial_index_update(annotation_set);
+	annotation_spatial_index_t* spatial_index = &annotation_set->spatial_index;
+	arrsetlen(*result_indices, 0);
+	i32 annotation_count = spatial_index->indexed_annotation_count;
+	if (annotation_count == 0) {
+		return;
+	}
+
+	bounds2i range = annotation_spatial_index_get_cell_range(spatial_index, area);
+	if (range.left == 0 && range.top == 0 && range.right == spatial_index->cell_count_x - 1 && range.bottom == spatial_index->cell_count_y - 1) {
+		// Everything is in range (e.g. when zoomed out to view the whole slide).
+		arrsetlen(*result_indices, annotation_count);
+		for (i32 i = 0; i < annotation_count; ++i) {
+			(*result_indices)[i] = i;
+		}
+		return;
+	}
+
+	// Use a bitmap to get rid of duplicates (annotations spanning multiple cells), and to sort the results.
+	temp_memory_t temp_memory = begin_temp_memory_on_local_thread();
+	i32 word_count = (annotation_count + 31) / 32;
+	u32* bitmap = arena_push_array(temp_memory.arena, word_count, u32);
+	memset(bitmap, 0, word_count * sizeof(u32));
+	for (i32 cell_y = range.top; cell_y <= range.bottom; ++cell_y) {
+		for (i32 cell_x = range.left; cell_x <= range.right; ++cell_x) {
+			i32* cell = spatial_index->cells[cell_y * spatial_index->cell_count_x + cell_x];
+			i32 entry_count = arrlen(cell);
+			for (i32 i = 0; i < entry_count; ++i) {
+				i32 active_index = cell[i];
+				ASSERT(active_index >= 0 && active_index < annotation_count);
+				bitmap[active_index >> 5] |= (1u << (active_index & 31));
+			}
+		}
+	}
+	i32 oversized_count = arrlen(spatial_index->oversized_annotation_indices);
+	for (i32 i = 0; i < oversized_count; ++i) {
+		i32 active_index = spatial_index->oversized_annotation_indices[i];
+		bitmap[active_index >> 5] |= (1u << (active_index & 31));
+	}
+	for (i32 word_index = 0; word_index < word_count; ++word_index) {
+		u32 word = bitmap[word_index];
+		while (word) {
+			i32 bit = bit_scan_forward(word);
+			arrput(*result_indices, word_index * 32 + bit);
+			word &= word - 1; // clear lowest set bit
+		}
+	}
+	release_temp_memory(&temp_memory);
+}
+
+void annotation_spatial_index_destroy(annotation_spatial_index_t* spatial_index) {
+	annotation_spatial_index_clear(spatial_index);
+	arrfree(spatial_index->oversized_annotation_indices);
+	arrfree(spatial_index->visible_annotation_indices);
+	arrfree(spatial_index->hit_test_candidate_indices);
+	memset(spatial_index, 0, sizeof(*spatial_index));
+}
@@ -19,6 +19,7 @@
 #include "common.h"
 
 #include "platform.h"
+#include "intrinsics.h"
 //#define SHEREDOM_JSON_IMPLEMENTATION
 #include "json.h"
 #include "stringutils.h"
@@ -396,21 +397,519 @@ bool open_coco(coco_t* coco, const char* json_source, size_t json_length) {
 	return coco->is_valid;
 }
 
-bool load_coco_from_file(coco_t* coco, const char* json_filename) {
-	bool success = false;
-	mem_t* coco_file = platform_read_entire_file(json_filename);
+// Loading large COCO files.
+// Nearly all of a typical COCO file consists of the "annotations" array. Instead of building one huge DOM for the
+// whole file (which may take a LONG time and use a LOT of memory), we read the file in chunks and cut the annotation
+// objects out of the document. These are parsed in batches on the worker threads, and merged in order as they become
+// ready. The rest of the document (with an empty "annotations" array left in place) is small, and is parsed in one go
+// after the whole file has been read.
+#define COCO_LOAD_CHUNK_SIZE MEGABYTES(8)
+#define COCO_LOAD_BATCH_SIZE MEGABYTES(1)
+#define COCO_LOAD_MAX_PENDING_BATCHES 64
+
+enum coco_batch_state_enum {
+	COCO_BATCH_EMPTY = 0,   // slot is free
+	COCO_BATCH_PARSING = 1, // submitted to a worker thread
+	COCO_BATCH_DONE = 2,    // ready to be merged
+};
+
+typedef struct coco_batch_t {
+	volatile i32 state;
+	char* text; // JSON array containing the annotation objects
+	size_t text_length;
+	coco_t parsed;
+	bool failed;
+} coco_batch_t;
+
+struct coco_loader_t {
+	char filename[512];
+	file_stream_t fp;
+	i64 filesize;
+	coco_batch_t batches[COCO_LOAD_MAX_PENDING_BATCHES]; // ring buffer, indexed by sequence number
+	i32 submitted_batch_count; // only accessed by the loader task
+	i32 merged_batch_count; // only accessed by the thread that merges the batches
+	volatile i32 refcount; // the loader task and all batches that are still being parsed
+	semaphore_handle_t free_batch_semaphore; // counts the free slots in the ring buffer
+	semaphore_handle_t progress_semaphore; // posted each time a batch is parsed
+	semaphore_handle_t done_semaphore; // posted when the refcount drops to zero
+	volatile i32 need_cancel;
+	bool failed;
+	bool is_synchronous; // the loader runs on the calling thread, which also merges the batches
+	coco_t remainder; // everything except the annotations; parsed by the loader task after reading the whole file
+	coco_t* coco; // destination for the annotations, if loading into a coco_t
+	annotation_set_t* annotation_set; // destination for the annotations, if loading into an annotation set
+	i64 start;
+	// Scanner state, kept across chunks
+	i32 depth;
+	bool is_in_string;
+	bool is_escaped;
+	bool is_in_annotations_array;
+	char key[16]; // last string encountered at the top level of the document
+	i32 key_length;
+};
+
+static i32 coco_find_group_for_category_or_create_if_not_found(annotation_set_t* annotation_set, i32 category_id) {
+	for (i32 i = 0; i < annotation_set->stored_group_count; ++i) {
+		if (annotation_set->stored_groups[i].id == category_id) {
+			return i;
+		}
+	}
+	// Categories are usually defined after the annotations; the name and color are filled in later.
+	char name[64];
+	snprintf(name, sizeof(name), "Category %d", category_id);
+	add_annotation_group(annotation_set, name);
+	i32 group_index = annotation_set->stored_group_count - 1;
+	annotation_set->stored_groups[group_index].id = category_id;
+	return group_index;
+}
+
+static void coco_merge_annotations_into_annotation_set(annotation_set_t* annotation_set, coco_t* parsed) {
+	i32 annotation_count = parsed->annotation_count;
+	if (annotation_count <= 0) return;
+	i32 first_stored_index = annotation_set->stored_annotation_count;
+	annotation_t* annotations = arraddnptr(annotation_set->stored_annotations, annotation_count);
+	i32* active_indices = arraddnptr(annotation_set->active_annotation_indices, annotation_count);
+	memset(annotations, 0, annotation_count * sizeof(annotation_t));
+	i32 last_category_id = -1;
+	i32 last_group_index = 0;
+	for (i32 i = 0; i < annotation_count; ++i) {
+		coco_annotation_t* coco_annotation = parsed->annotations + i;
+		annotation_t* annotation = annotations + i;
+		if (coco_annotation->category_id != last_category_id) {
+			last_category_id = coco_annotation->category_id;
+			last_group_index = coco_find_group_for_category_or_create_if_not_found(annotation_set, last_category_id);
+		}
+		annotation->group_id = last_group_index;
+		i32 coordinate_count = coco_annotation->segmentation.coordinate_count;
+		if (coordinate_count > 0) {
+			if (coordinate_count == 1) {
+				annotation->type = ANNOTATION_POINT;
+			} else if (coordinate_count == 2) {
+				annotation->type = ANNOTATION_LINE;
+			} else {
+				annotation->type = ANNOTATION_POLYGON;
+			}
+			// Take over the coordinate array, converting to micrometers in place
+			v2f* coordinates = coco_annotation->segmentation.coordinates;
+			for (i32 j = 0; j < coordinate_count; ++j) {
+				coordinates[j] = V2F(annotation_set->mpp.x * coordinates[j].x, annotation_set->mpp.y * coordinates[j].y);
+			}
+			annotation->coordinates = coordinates;
+			annotation->coordinate_count = coordinate_count;
+			coco_annotation->segmentation.coordinates = NULL;
+		}
+		memcpy(annotation->features, coco_annotation->features, sizeof(annotation->features));
+		active_indices[i] = first_stored_index + i;
+	}
+	annotation_set->stored_annotation_count += annotation_count;
+	annotation_set->active_annotation_count += annotation_count;
+}
 
-	if (coco_file) {
-		success = open_coco(coco, (char*) coco_file->data, coco_file->len);
-		if (success) {
+static void coco_transfer_metadata_to_annotation_set(coco_t* coco, annotation_set_t* annotation_set);
 
+// Apply the categories and features, once the whole file has been read.
+static void coco_merge_definitions_into_annotation_set(annotation_set_t* annotation_set, coco_t* coco) {
+	coco_transfer_metadata_to_annotation_set(coco, annotation_set);
+	for (i32 i = 0; i < coco->category_count; ++i) {
+		coco_category_t* category = coco->categories + i;
+		i32 group_index = coco_find_group_for_category_or_create_if_not_found(annotation_set, category->id);
+		annotation_group_t* group = annotation_set->stored_groups + group_index;
+		group->color = category->color;
+		group->color.a = 255; // COCO colors are stored as RGB
+		snprintf(group->name, sizeof(group->name), "%s", category->name);
+	}
+	for (i32 i = 0; i < coco->feature_count; ++i) {
+		coco_feature_t* coco_feature = coco->features + i;
+		i32 feature_index = find_annotation_feature_or_create_if_not_found(annotation_set, coco_feature->name);
+		annotation_feature_t* feature = annotation_set->stored_features + feature_index;
+		feature->id = coco_feature->id;
+		feature->restrict_to_group = coco_feature->restrict_to_group;
+		if (feature->restrict_to_group) {
+			feature->group_id = coco_find_group_for_category_or_create_if_not_found(annotation_set, coco_feature->category_id);
 		}
+	}
+}
+
+static void coco_batch_destroy(coco_batch_t* batch) {
+	free(batch->text);
+	batch->text = NULL;
+	coco_destroy(&batch->parsed);
+	memset(&batch->parsed, 0, sizeof(batch->parsed));
+}
 
-		free(coco_file);
+// Merge the batches that are ready, in order.
+static void coco_loader_merge_batches(coco_loader_t* loader) {
+	for (;;) {
+		coco_batch_t* batch = loader->batches + (loader->merged_batch_count % COCO_LOAD_MAX_PENDING_BATCHES);
+		if (batch->state != COCO_BATCH_DONE) break;
+		read_barrier;
+		if (batch->failed) {
+			console_print_error("load_coco_from_file(): JSON parse error\n");
+			loader->failed = true;
+		}
+		if (loader->annotation_set) {
+			coco_merge_annotations_into_annotation_set(loader->annotation_set, &batch->parsed);
+		} else {
+			coco_t* coco = loader->coco;
+			i32 annotation_count = batch->parsed.annotation_count;
+			if (annotation_count > 0) {
+				coco_annotation_t* annotations = arraddnptr(coco->annotations, annotation_count);
+				memcpy(annotations, batch->parsed.annotations, annotation_count * sizeof(coco_annotation_t)); // takes over the coordinates
+				coco->annotation_count += annotation_count;
+				batch->parsed.annotation_count = 0;
+			}
+		}
+		coco_batch_destroy(batch);
+		++loader->merged_batch_count;
+		atomic_compare_exchange(&batch->state, COCO_BATCH_EMPTY, COCO_BATCH_DONE);
+		platform_semaphore_post(loader->free_batch_semaphore);
+	}
+}
+
+static void coco_loader_release(coco_loader_t* loader) {
+	if (atomic_decrement(&loader->refcount) == 0) {
+		platform_semaphore_post(loader->done_semaphore);
+	}
+}
+
+static void coco_loader_destroy(coco_loader_t* loader) {
+	for (i32 i = 0; i < COCO_LOAD_MAX_PENDING_BATCHES; ++i) {
+		coco_batch_destroy(loader->batches + i);
+	}
+	coco_destroy(&loader->remainder);
+	platform_semaphore_destroy(loader->free_batch_semaphore);
+	platform_semaphore_destroy(loader->progress_semaphore);
+	platform_semaphore_destroy(loader->done_semaphore);
+	free(loader);
+}
+
+typedef struct coco_parse_batch_task_t {
+	coco_loader_t* loader;
+	coco_batch_t* batch;
+} coco_parse_batch_task_t;
+
+static void coco_parse_batch_func(int logical_thread_index, void* userdata) {
+	coco_parse_batch_task_t* task = (coco_parse_batch_task_t*) userdata;
+	coco_loader_t* loader = task->loader;
+	coco_batch_t* batch = task->batch;
+	if (!loader->need_cancel) {
+		json_value_s* root = json_parse(batch->text, batch->text_length);
+		if (root && root->type == json_type_array) {
+			coco_parse_annotations(&batch->parsed, (json_array_s*)root->payload);
+		} else {
+			batch->failed = true;
+		}
+		if (root) free(root);
 	}
+	free(batch->text);
+	batch->text = NULL;
+	atomic_compare_exchange(&batch->state, COCO_BATCH_DONE, COCO_BATCH_PARSING);
+	platform_semaphore_post(loader->progress_semaphore);
+	coco_loader_release(loader);
+}
+
+static coco_batch_t* coco_loader_acquire_batch(coco_loader_t* loader, int logical_thread_index) {
+	if (loader->need_cancel) {
+		return NULL; // the main thread is waiting for us to stop
+	}
+	// Batches still waiting in the queue might otherwise never get parsed, if this is the only worker thread
+	while (work_queue_is_work_waiting_to_start(&global_work_queue)) {
+		work_queue_do_work(&global_work_queue, logical_thread_index);
+	}
+	if (loader->is_synchronous) {
+		// Nobody else is going to merge the batches; take out the finished ones until the slot we need is free.
+		coco_batch_t* batch = loader->batches + (loader->submitted_batch_count % COCO_LOAD_MAX_PENDING_BATCHES);
+		for (;;) {
+			coco_loader_merge_batches(loader);
+			if (batch->state == COCO_BATCH_EMPTY) break;
+			platform_semaphore_wait(loader->progress_semaphore);
+		}
+	}
+	// Wait until the batch that previously used this slot has been merged.
+	// (This also limits how much memory the parsed but not yet merged annotations can take up.)
+	platform_semaphore_wait(loader->free_batch_semaphore);
+	if (loader->need_cancel) {
+		return NULL;
+	}
+	coco_batch_t* batch = loader->batches + (loader->submitted_batch_count % COCO_LOAD_MAX_PENDING_BATCHES);
+	ASSERT(batch->state == COCO_BATCH_EMPTY);
+	++loader->submitted_batch_count;
+	return batch;
+}
+
+static void coco_loader_submit_batch(coco_loader_t* loader, const char* text, size_t text_length, int logical_thread_index) {
+	coco_batch_t* batch = coco_loader_acquire_batch(loader, logical_thread_index);
+	if (!batch) return;
+	batch->text_length = text_length + 2;
+	batch->text = (char*) malloc(batch->text_length);
+	batch->text[0] = '[';
+	memcpy(batch->text + 1, text, text_length);
+	batch->text[text_length + 1] = ']';
+	batch->failed = false;
+	batch->state = COCO_BATCH_PARSING;
+	atomic_increment(&loader->refcount);
+
+	coco_parse_batch_task_t task = { .loader = loader, .batch = batch };
+	if (global_worker_thread_count == 0 || !work_queue_submit_task(&global_work_queue, coco_parse_batch_func, &task, sizeof(task))) {
+		coco_parse_batch_func(logical_thread_index, &task); // parse on this thread instead
+	}
+}
+
+static void coco_load_func(int logical_thread_index, void* userdata) {
+	coco_loader_t* loader = *(coco_loader_t**) userdata;
+
+	memrw_t remainder = memrw_create(KILOBYTES(64)); // the document without the annotation objects
+	size_t capacity = COCO_LOAD_CHUNK_SIZE;
+	char* buffer = (char*) malloc(capacity);
+	size_t length = 0;
+	size_t scan_pos = 0;
+	bool is_eof = false;
+
+	while (!is_eof && !loader->need_cancel) {
+		size_t bytes_to_read = capacity - length;
+		i64 bytes_read = file_stream_read(buffer + length, bytes_to_read, loader->fp);
+		if (bytes_read < (i64)bytes_to_read) {
+			is_eof = true;
+		}
+		if (bytes_read > 0) {
+			length += bytes_read;
+		}
+
+		// Track the nesting depth, and find the start and end of each object inside the top-level "annotations" array.
+		// Bytes carried over from the previous chunk (an incomplete annotation object) have already been scanned.
+		i64 copy_start = loader->is_in_annotations_array ? -1 : (i64)scan_pos;
+		i64 object_start = loader->is_in_annotations_array && scan_pos > 0 ? 0 : -1;
+		i64 batch_start = object_start;
+		i64 batch_end = -1;
+		for (size_t i = scan_pos; i < length; ++i) {
+			char c = buffer[i];
+			if (loader->is_in_string) {
+				if (loader->is_escaped) {
+					loader->is_escaped = false;
+				} else if (c == '\\') {
+					loader->is_escaped = true;
+				} else if (c == '"') {
+					loader->is_in_string = false;
+				} else if (loader->depth == 1 && loader->key_length < (i32)sizeof(loader->key) - 1) {
+					loader->key[loader->key_length++] = c;
+				}
+			} else if (c == '"') {
+				loader->is_in_string = true;
+				if (loader->depth == 1) {
+					loader->key_length = 0;
+				}
+			} else if (c == '{' || c == '[') {
+				if (loader->is_in_annotations_array && loader->depth == 2 && c == '{') {
+					object_start = i;
+					if (batch_start < 0) batch_start = i;
+				} else if (loader->depth == 1 && c == '[') {
+					loader->key[loader->key_length] = '\0';
+					if (strcmp(loader->key, "annotations") == 0) {
+						loader->is_in_annotations_array = true;
+						memrw_push_back(&remainder, buffer + copy_start, i + 1 - copy_start);
+						copy_start = -1;
+					}
+				}
+				++loader->depth;
+			} else if (c == '}' || c == ']') {
+				--loader->depth;
+				if (loader->is_in_annotations_array) {
+					if (loader->depth == 2 && c == '}') {
+						object_start = -1;
+						batch_end = i + 1;
+						if (batch_end - batch_start >= COCO_LOAD_BATCH_SIZE) {
+							coco_loader_submit_batch(loader, buffer + batch_start, batch_end - batch_start, logical_thread_index);
+							batch_start = -1;
+						}
+					} else if (loader->depth == 1) {
+						// End of the "annotations" array
+						if (batch_start >= 0 && batch_end > batch_start) {
+							coco_loader_submit_batch(loader, buffer + batch_start, batch_end - batch_start, logical_thread_index);
+						}
+						batch_start = -1;
+						loader->is_in_annotations_array = false;
+						copy_start = i;
+					}
+				}
+			}
+		}
+
+		// Submit the complete objects, and keep the incomplete one for the next chunk
+		if (batch_start >= 0 && batch_end > batch_start) {
+			coco_loader_submit_batch(loader, buffer + batch_start, batch_end - batch_start, logical_thread_index);
+		}
+		if (copy_start >= 0) {
+			memrw_push_back(&remainder, buffer + copy_start, length - copy_start);
+		}
+		size_t remaining = 0;
+		if (object_start >= 0) {
+			remaining = length - object_start;
+			memmove(buffer, buffer + object_start, remaining);
+		}
+		length = remaining;
+		scan_pos = remaining;
+		if (length == capacity) {
+			// A single annotation larger than the buffer
+			capacity *= 2;
+			buffer = (char*) realloc(buffer, capacity);
+		}
+	}
+	free(buffer);
+	file_stream_close(loader->fp);
+	loader->fp = NULL;
+
+	// Parse the rest of the document while the last annotations are being parsed
+	if (!loader->need_cancel) {
+		if (!open_coco(&loader->remainder, (char*) remainder.data, remainder.used_size)) {
+			loader->failed = true;
+		}
+		loader->remainder.original_filesize = loader->filesize;
+	}
+	memrw_destroy(&remainder);
+	coco_loader_release(loader);
+}
+
+static coco_loader_t* coco_loader_create(const char* filename) {
+	file_stream_t fp = file_stream_open_for_reading(filename);
+	if (!fp) {
+		return NULL;
+	}
+	coco_loader_t* loader = (coco_loader_t*) calloc(1, sizeof(coco_loader_t));
+	snprintf(loader->filename, sizeof(loader->filename), "%s", filename);
+	loader->fp = fp;
+	loader->filesize = file_stream_get_filesize(fp);
+	loader->start = get_clock();
+	loader->refcount = 1; // released when the loader task is done
+	loader->free_batch_semaphore = platform_semaphore_create(COCO_LOAD_MAX_PENDING_BATCHES);
+	loader->progress_semaphore = platform_semaphore_create(0);
+	loader->done_semaphore = platform_semaphore_create(0);
+	return loader;
+}
+
+// Run the loader on the calling thread; the batches are still parsed on the worker threads.
+static void coco_loader_run_synchronously(coco_loader_t* loader) {
+	loader->is_synchronous = true;
+	coco_load_func(0, &loader);
+	// Merge the last batches as they come in
+	while (loader->merged_batch_count < loader->submitted_batch_count) {
+		coco_loader_merge_batches(loader);
+		if (loader->merged_batch_count < loader->submitted_batch_count) {
+			platform_semaphore_wait(loader->progress_semaphore);
+		}
+	}
+	platform_semaphore_wait(loader->done_semaphore);
+}
+
+bool load_coco_from_file(coco_t* coco, const char* json_filename) {
+	coco_loader_t* loader = coco_loader_create(json_filename);
+	if (!loader) {
+		return false;
+	}
+	loader->coco = coco;
+	coco_loader_run_synchronously(loader);
+
+	// Everything apart from the annotations comes from the rest of the document
+	coco_annotation_t* annotations = coco->annotations;
+	i32 annotation_count = coco->annotation_count;
+	*coco = loader->remainder;
+	arrfree(coco->annotations); // empty
+	coco->annotations = annotations;
+	coco->annotation_count = annotation_count;
+	memset(&loader->remainder, 0, sizeof(loader->remainder));
+
+	bool success = coco->is_valid && !loader->failed;
+	console_print("Loaded COCO JSON with %d annotations in %g seconds\n", coco->annotation_count, get_seconds_elapsed(loader->start, get_clock()));
+	coco_loader_destroy(loader);
 	return success;
 }
 
+// Quick check whether a JSON file contains COCO annotations (as opposed to e.g. a case list).
+bool is_coco_file(const char* json_filename) {
+	bool result = false;
+	file_stream_t fp = file_stream_open_for_reading(json_filename);
+	if (fp) {
+		char buffer[4096];
+		i64 bytes_read = file_stream_read(buffer, sizeof(buffer) - 1, fp);
+		if (bytes_read > 0) {
+			buffer[bytes_read] = '\0';
+			result = strstr(buffer, "\"annotations\"") || strstr(buffer, "\"categories\"") || strstr(buffer, "\"images\"");
+		}
+		file_stream_close(fp);
+	}
+	return result;
+}
+
+// Load COCO annotations into the annotation set in the background. They become visible as they are merged.
+bool load_coco_annotations(app_state_t* app_state, const char* filename) {
+	annotation_set_t* annotation_set = &app_state->scene.annotation_set;
+	if (annotation_set->coco_loader) {
+		cancel_loading_coco_annotations(annotation_set);
+	}
+	coco_loader_t* loader = coco_loader_create(filename);
+	if (!loader) {
+		console_print_error("load_coco_annotations(): could not open '%s'\n", filename);
+		return false;
+	}
+	loader->annotation_set = annotation_set;
+	annotation_set->coco_loader = loader;
+	// Don't overwrite the COCO file; the annotations are saved next to it as ASAP XML
+	char xml_filename[512];
+	snprintf(xml_filename, sizeof(xml_filename), "%s", filename);
+	replace_file_extension(xml_filename, sizeof(xml_filename), "xml");
+	snprintf(annotation_set->asap_xml_filename, sizeof(annotation_set->asap_xml_filename), "%s", xml_filename);
+	annotation_binary_store_set_filename(annotation_set, xml_filename);
+	annotation_set->binary_store.is_valid = false;
+	annotation_set->export_as_asap_xml = true;
+	annotation_set->annotations_were_loaded_from_file = true;
+
+	if (global_worker_thread_count == 0 || !work_queue_submit_task(&global_work_queue, coco_load_func, &loader, sizeof(loader))) {
+		coco_loader_run_synchronously(loader);
+		update_loading_coco_annotations(annotation_set);
+		return annotation_set->coco_loader == NULL && annotation_set->annotations_were_loaded_from_file;
+	}
+	return true;
+}
+
+// Called every frame on the main thread while annotations are being loaded in the background.
+void update_loading_coco_annotations(annotation_set_t* annotation_set) {
+	coco_loader_t* loader = annotation_set->coco_loader;
+	if (!loader) return;
+
+	coco_loader_merge_batches(loader);
+	if (loader->refcount == 0) {
+		// Loader task finished and all batches are parsed
+		if (!loader->is_synchronous) {
+			platform_semaphore_wait(loader->done_semaphore); // the last one to leave might not have posted yet
+		}
+		coco_loader_merge_batches(loader);
+		ASSERT(loader->merged_batch_count == loader->submitted_batch_count);
+		if (loader->failed) {
+			console_print_error("Failed to load COCO annotations from '%s'\n", loader->filename);
+			annotation_set->export_as_asap_xml = false;
+			annotation_set->annotations_were_loaded_from_file = false;
+		} else {
+			coco_merge_definitions_into_annotation_set(annotation_set, &loader->remainder);
+			float seconds_elapsed = get_seconds_elapsed(loader->start, get_clock());
+			console_print_verbose("Loaded COCO annotations in %g seconds (%d annotations).\n", seconds_elapsed, annotation_set->active_annotation_count);
+			annotation_set->binary_store.need_save = true;
+		}
+		coco_loader_destroy(loader);
+		annotation_set->coco_loader = NULL;
+	}
+}
+
+void cancel_loading_coco_annotations(annotation_set_t* annotation_set) {
+	coco_loader_t* loader = annotation_set->coco_loader;
+	if (!loader) return;
+
+	loader->need_cancel = true;
+	platform_semaphore_post(loader->free_batch_semaphore); // wake up the loader task, if it is waiting for a free slot
+	platform_semaphore_wait(loader->done_semaphore);
+	read_barrier;
+	coco_loader_destroy(loader);
+	annotation_set->coco_loader = NULL;
+}
+
 static void coco_output_info(coco_t* coco, memrw_t* out) {
 	char buf[4096];
 	i32 len = snprintf(buf, sizeof(buf), "\"info\":{\"description\": \"%s\","
@@ -715,10 +1214,7 @@ void coco_transfer_annotations_from_annotation_set(coco_t* coco, annotation_set_
 	}
 }
 
-void coco_transfer_annotations_to_annotation_set(coco_t* coco, annotation_set_t* annotation_set) {
-
-
-	// TODO: transfer meta info, licenses, images
+static void coco_transfer_metadata_to_annotation_set(coco_t* coco, annotation_set_t* annotation_set) {
 	annotation_set->coco.info = coco->info;
 
 	// Transfer licenses
@@ -742,6 +1238,10 @@ void coco_transfer_annotations_to_annotation_set(coco_t* coco, annotation_set_t*
 			annotation_set->coco.image_count = coco->image_count;
 		}
 	}
+}
+
+void coco_transfer_annotations_to_annotation_set(coco_t* coco, annotation_set_t* annotation_set) {
+	coco_transfer_metadata_to_annotation_set(coco, annotation_set);
 
 	// Transfer groups (categories)
 	i32 group_count = coco->category_count;
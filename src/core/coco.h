@@ -108,6 +108,7 @@ typedef struct coco_t {
 
 bool open_coco(coco_t* coco, const char* json_source, size_t json_length);
 bool load_coco_from_file(coco_t* coco, const char* json_filename);
+bool is_coco_file(const char* json_filename);
 void coco_init_main_image(coco_t* coco, image_t* image);
 void coco_transfer_annotations_from_annotation_set(coco_t* coco, annotation_set_t* annotation_set);
 void coco_transfer_annotations_to_annotation_set(coco_t* coco, annotation_set_t* annotation_set);
@@ -20,6 +20,8 @@
 #include "platform.h"
 #include "stringutils.h"
 #include "gui.h"
+#include "phasecorrelate.h"
+#include "pixel_convert.h"
 
 #if COMPILER_MSVC
 #include <direct.h>
@@ -190,6 +192,24 @@ void console_execute_command(app_state_t* app_state, const char* command) {
 			begin_a_very_long_task();
 		} else if (strcmp(cmd, "modal") == 0) {
 			gui_add_modal_message_popup("Modal test", "This is a modal message test.");
+		} else if (strcmp(cmd, "annotation_benchmark") == 0) {
+			i32 annotation_count = 1000000;
+			if (arg) {
+				annotation_count = ATLEAST(1, atoi(arg));
+			}
+			annotation_benchmark_begin(app_state, annotation_count);
+		} else if (strcmp(cmd, "phase_correlate_benchmark") == 0) {
+			i32 size = 1000;
+			if (arg) {
+				size = ATLEAST(16, atoi(arg));
+			}
+			phase_correlate_benchmark(size, 10);
+		} else if (strcmp(cmd, "pixel_convert_benchmark") == 0) {
+			i32 pixel_count = 4096 * 4096;
+			if (arg) {
+				pixel_count = ATLEAST(16, atoi(arg));
+			}
+			pixel_convert_benchmark(pixel_count, 10);
 		} else if (strcmp(cmd, "tiff_save_description") == 0) {
 			if (arrlen(app_state->loaded_images) > 0) {
 				image_t* image = app_state->loaded_images[0];
@@ -633,6 +633,26 @@ void draw_layers_window(app_state_t* app_state) {
                     }
                 }
             }
+            if (ImGui::Button("Register (deformable)")) {
+                if (image->deformation_field) {
+                    deformation_field_destroy(image->deformation_field);
+                }
+                image->deformation_field = deformation_field_create(app_state->loaded_images[0], image, image_registration_deformation_level,
+                                                                    image_registration_deformation_patch_size, image_registration_deformation_grid_spacing);
+            }
+            deformation_field_t* field = image->deformation_field;
+            if (field) {
+                ImGui::SameLine();
+                ImGui::Checkbox("Apply deformation", &field->is_enabled);
+                ImGui::SameLine();
+                if (ImGui::Button("Discard")) {
+                    deformation_field_destroy(field);
+                    image->deformation_field = NULL;
+                } else {
+                    i32 patch_count = field->grid_width * field->grid_height;
+                    ImGui::Text("Deformation field: %d/%d patches done, max displacement %.0f um", field->patches_filtered, patch_count, field->max_displacement);
+                }
+            }
         }
 //		ImGui::DragFloat("Offset Y", &image->origin_offset.y, image->mpp_y, 0.0f, 0.0f, "%g px");
 	}
@@ -1150,6 +1170,13 @@ void gui_draw(app_state_t* app_state, input_t* input, i32 client_width, i32 clie
 			ImGui::SliderInt("Worker threads", &global_active_worker_thread_count, 1, global_worker_thread_count);
 			ImGui::SliderInt("Min level display", &global_lowest_scale_to_render, 0, 16);
 			ImGui::SliderInt("Max level display", &global_highest_scale_to_render, 0, 16);
+			ImGui::Checkbox("Instanced tile rendering", &tile_rendering_use_instancing);
+			ImGui::Checkbox("Log tile rendering stats to console", &tile_rendering_log_stats);
+			ImGui::Checkbox("Upload tiles via persistent mapped buffer", &tile_upload_use_persistent_ring);
+			ImGui::SliderInt("GPU tile memory budget (MB)", &tile_texture_pool_budget_in_mb, 64, 8192);
+			i64 tile_memory_allocated = 0, tile_memory_used = 0;
+			tile_texture_pool_get_usage(&tile_memory_allocated, &tile_memory_used);
+			ImGui::Text("GPU tile memory: %.1f MB in use, %.1f MB allocated", (float)tile_memory_used / MEGABYTES(1), (float)tile_memory_allocated / MEGABYTES(1));
 			ImGui::SliderFloat("Rotation", &app_state->scene.rotation, -1.0f * IM_PI, 1.0f * IM_PI);
 			if (ImGui::Button("Reset rotation")) {
 				app_state->scene.rotation = 0.0f;
@@ -137,6 +137,13 @@ extern float annotation_insert_hover_distance INIT(= 30.0f);
 extern float annotation_freeform_insert_interval_distance INIT(= 35.0f);
 extern bool annotation_highlight_inside_of_polygons INIT(=true);
 extern float annotation_highlight_opacity INIT(=0.1f);
+extern annotation_draw_condition_enum annotation_draw_fill_area_condition INIT(= ANNOTATION_DRAW_IF_AT_LEAST_ONE_FEATURE_SET);
+extern bool annotation_draw_using_gpu_buffers INIT(=true);
+extern bool annotation_enable_level_of_detail INIT(=true);
+extern float annotation_lod_simplification_tolerance INIT(=0.5f); // in screen pixels
+extern float annotation_lod_min_fill_size INIT(=6.0f); // in screen pixels; smaller annotations are not filled
+extern float annotation_lod_density_cell_size INIT(=4.0f); // in screen pixels
+extern bool annotation_autosave_to_binary_store INIT(=true);
 extern bool show_delete_annotation_prompt;
 extern bool show_save_quit_prompt;
 extern bool dont_ask_to_delete_annotations;
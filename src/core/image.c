@@ -20,11 +20,14 @@
 #include "platform.h"
 #include "image.h"
 #include "jpeg_decoder.h"
+#include "intrinsics.h"
+#include "pixel_convert.h"
 
 #define STBI_ASSERT(x) ASSERT(x)
 #include "stb_image.h" // for stbi_image_free()
 
-#include "viewer.h" // for unload_texture()
+#include "viewer.h" // for unload_texture(), unload_tile_texture()
+#include "image_registration.h" // for deformation_field_destroy()
 
 // TODO: refcount mechanism and eviction scheme, retain tiles for re-use?
 void tile_release_cache(tile_t* tile) {
@@ -108,6 +111,9 @@ static void image_change_resolution(image_t* image, float mpp_x, float mpp_y) {
             if (level_image->exists) {
                 i32 pyramid_image_index = level_image->pyramid_image_index;
                 if (image->backend == IMAGE_BACKEND_TIFF) {
+                    if (!tiff->main_image_ifd->is_tiled && i > 0) {
+                        continue; // virtual level of a stripped image, not backed by an IFD
+                    }
                     ASSERT(pyramid_image_index < tiff->ifd_count);
                     tiff_ifd_t* ifd = tiff->ifds + pyramid_image_index;
                     ifd->um_per_pixel_x = level_image->um_per_pixel_x;
@@ -251,35 +257,58 @@ bool init_image_from_tiff(image_t* image, tiff_t tiff, bool is_overlay, image_t*
         } else if (tiff.is_ndpi) {
             DUMMY_STATEMENT;
         } else {
-            // The image is NOT tiled
+            // The image is NOT tiled, but consists of strips.
+            // It is presented as tiles of TIFF_VIRTUAL_TILE_SIZE (cut from the strips on demand, see tiff_decode_tile()).
+            // The downsampled levels are built in the background, using the level indexing mechanism.
             memset(image->level_images, 0, sizeof(image->level_images));
-            image->level_count = 1;
-            level_image_t* level_image = image->level_images + 0;
+            image->level_count = tiff.max_downsample_level + 1;
+            if (image->level_count > WSI_MAX_LEVELS) {
+                fatal_error();
+            }
             tiff_ifd_t* ifd = tiff.main_image_ifd;
-            level_image->exists = true;
-            level_image->pyramid_image_index = 0;
-            level_image->downsample_factor = ifd->downsample_factor;
-            level_image->width_in_pixels = ifd->image_width;
-            level_image->height_in_pixels = ifd->image_height;
-            level_image->tile_count = 1;
-            level_image->width_in_tiles = 1;
-            ASSERT(level_image->width_in_tiles > 0);
-            level_image->height_in_tiles = 1;
-            level_image->tile_width = ifd->tile_width;
-            level_image->tile_height = ifd->tile_height;
-            level_image->um_per_pixel_x = ifd->um_per_pixel_x;
-            level_image->um_per_pixel_y = ifd->um_per_pixel_y;
-            level_image->x_tile_side_in_um = ifd->x_tile_side_in_um;
-            level_image->y_tile_side_in_um = ifd->y_tile_side_in_um;
-            ASSERT(level_image->x_tile_side_in_um > 0);
-            ASSERT(level_image->y_tile_side_in_um > 0);
-            level_image->tiles = (tile_t*) calloc(1, sizeof(tile_t)); // only 1 tile in this case
+            tiff_virtual_pyramid_t* pyramid = tiff.virtual_pyramid;
             ASSERT(ifd->strip_byte_counts != NULL);
             ASSERT(ifd->strip_offsets != NULL);
-            tile_t* tile = level_image->tiles + 0;
-            tile->tile_index = 0;
-            tile->tile_x = 0;
-            tile->tile_y = 0;
+            for (i32 level_index = 0; level_index < image->level_count; ++level_index) {
+                level_image_t* level_image = image->level_images + level_index;
+                level_image->downsample_factor = exp2f((float)level_index);
+                level_image->tile_width = ifd->tile_width;
+                level_image->tile_height = ifd->tile_height;
+                level_image->um_per_pixel_x = image->mpp_x * level_image->downsample_factor;
+                level_image->um_per_pixel_y = image->mpp_y * level_image->downsample_factor;
+                level_image->x_tile_side_in_um = level_image->um_per_pixel_x * (float)ifd->tile_width;
+                level_image->y_tile_side_in_um = level_image->um_per_pixel_y * (float)ifd->tile_height;
+                ASSERT(level_image->x_tile_side_in_um > 0);
+                ASSERT(level_image->y_tile_side_in_um > 0);
+
+                bool exists = (level_index == 0) || (pyramid && level_index >= pyramid->first_level && level_index < pyramid->level_count);
+                if (!exists) {
+                    // This level is too large to keep in memory in its entirety; there is only placeholder information.
+                    level_image->exists = false;
+                    continue;
+                }
+                level_image->exists = true;
+                level_image->pyramid_image_index = 0; // all levels are read through the main image IFD
+                if (level_index == 0) {
+                    level_image->width_in_pixels = ifd->image_width;
+                    level_image->height_in_pixels = ifd->image_height;
+                } else {
+                    level_image->width_in_pixels = pyramid->levels[level_index].width;
+                    level_image->height_in_pixels = pyramid->levels[level_index].height;
+                    level_image->needs_indexing = true; // the level still needs to be built, see do_level_image_indexing()
+                }
+                level_image->width_in_tiles = (level_image->width_in_pixels + level_image->tile_width - 1) / level_image->tile_width;
+                ASSERT(level_image->width_in_tiles > 0);
+                level_image->height_in_tiles = (level_image->height_in_pixels + level_image->tile_height - 1) / level_image->tile_height;
+                level_image->tile_count = level_image->width_in_tiles * level_image->height_in_tiles;
+                level_image->tiles = (tile_t*) calloc(1, level_image->tile_count * sizeof(tile_t));
+                for (i32 tile_index = 0; tile_index < level_image->tile_count; ++tile_index) {
+                    tile_t* tile = level_image->tiles + tile_index;
+                    tile->tile_index = tile_index;
+                    tile->tile_x = tile_index % level_image->width_in_tiles;
+                    tile->tile_y = tile_index / level_image->width_in_tiles;
+                }
+            }
         }
 
 
@@ -567,9 +596,9 @@ bool init_image_from_mrxs(image_t* image, mrxs_t* mrxs, bool is_overlay) {
 
 	image->tile_width = mrxs->tile_width;
 	image->tile_height = mrxs->tile_height;
-	image->width_in_pixels = mrxs->tile_width * mrxs->base_width_in_tiles;
+	image->width_in_pixels = mrxs->width_in_pixels;
 	image->width_in_um = image->width_in_pixels * image->mpp_x;
-	image->height_in_pixels = mrxs->tile_height * mrxs->base_height_in_tiles;
+	image->height_in_pixels = mrxs->height_in_pixels;
 	image->height_in_um = image->height_in_pixels * image->mpp_y;
 	// TODO: fix code duplication with tiff_deserialize()
 	if (mrxs->level_count > 0 && image->tile_width) {
@@ -589,8 +618,8 @@ bool init_image_from_mrxs(image_t* image, mrxs_t* mrxs, bool is_overlay) {
 			level_image->needs_indexing = false;
 			level_image->pyramid_image_index = level_index; // not used
 			level_image->downsample_factor = exp2f((float)level_index);
-			level_image->width_in_pixels = mrxs_level->width_in_tiles * mrxs->tile_width; // TODO: check that this is right
-			level_image->height_in_pixels = mrxs_level->height_in_tiles * mrxs->tile_height; // TODO: check that this is right
+			level_image->width_in_pixels = mrxs_level->width_in_pixels;
+			level_image->height_in_pixels = mrxs_level->height_in_pixels;
 			level_image->width_in_tiles = mrxs_level->width_in_tiles;
 			ASSERT(level_image->width_in_tiles > 0);
 			level_image->height_in_tiles = mrxs_level->height_in_tiles;
@@ -625,8 +654,8 @@ bool init_image_from_mrxs(image_t* image, mrxs_t* mrxs, bool is_overlay) {
 				tile->tile_x = tile_index % level_image->width_in_tiles;
 				tile->tile_y = tile_index / level_image->width_in_tiles;
 
-				mrxs_tile_t* mrxs_tile = mrxs_level->tiles + tile_index;
-				if (mrxs_tile->hier_entry.length == 0) {
+				// Output tiles that no camera image overlaps
+				if (mrxs_level->tile_source_offsets[tile_index] == mrxs_level->tile_source_offsets[tile_index + 1]) {
 					tile->is_empty = true;
 				}
 			}
@@ -847,9 +876,10 @@ float f32_rgb_to_f32_y(float R, float G, float B) {
     return Y;
 }
 
-// TODO: optimize?
 void image_convert_u8_rgba_to_f32_y(u8* src, float* dest, i32 w, i32 h, i32 components) {
-    if (components == 3 || components == 4) {
+    if (components == 4) {
+        convert_bgra_to_f32_y((u32*)src, dest, (i64)w * h); // luminance is symmetric in R and B
+    } else if (components == 3) {
         i32 row_elements = w * components;
         for (i32 y = 0; y < h; ++y) {
             u8* src_pixel = src + y * row_elements;
@@ -869,252 +899,422 @@ void image_convert_u8_rgba_to_f32_y(u8* src, float* dest, i32 w, i32 h, i32 comp
     }
 }
 
-bool image_read_region(image_t* image, i32 level, i32 x, i32 y, i32 w, i32 h, void* dest, pixel_format_enum desired_pixel_format) {
-    ASSERT(dest != NULL);
-
-	if (w <= 0 || h <= 0) {
-		return false;
-	}
-	if (level < 0 || level >= image->level_count) {
-		console_print_error("image_read_region(): level %d out of bounds (valid range 0-%d)\n", level, image->level_count-1);
-		return false;
-	}
-
-    pixel_format_enum intermediate_pixel_format = PIXEL_FORMAT_UNDEFINED;
-    void* intermediate_pixel_buffer = NULL;
+static bool isyntax_region_reader_open(image_t* image, isyntax_region_reader_t* reader) {
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s%s", image->directory, image->name);
+    isyntax_t* isyntax = calloc(1, sizeof(isyntax_t));
+    isyntax_set_work_queue(isyntax, &global_work_queue);
+    isyntax_cache_t* cache = NULL;
+    if (isyntax_open(isyntax, filename, false) &&
+        libisyntax_cache_create("image_read_region", 500, &cache) == LIBISYNTAX_OK &&
+        libisyntax_cache_inject(cache, isyntax) == LIBISYNTAX_OK) {
+        reader->isyntax = isyntax;
+        reader->cache = cache;
+        return true;
+    } else {
+        console_print_error("image_read_isyntax_tile(): could not open '%s' for reading\n", filename);
+        isyntax_destroy(isyntax);
+        free(isyntax);
+        if (cache) libisyntax_cache_destroy(cache);
+        return false;
+    }
+}
 
-    switch (image->backend) {
-        default: {
-            console_print_error("image_read_region(): not implemented for backend '%s'\n", get_image_backend_name(image));
-            return false;
-        } break;
-        case IMAGE_BACKEND_OPENSLIDE: {
-            intermediate_pixel_format = PIXEL_FORMAT_U8_BGRA;
-            if (desired_pixel_format == intermediate_pixel_format) {
-                intermediate_pixel_buffer = (uint32_t*) dest;
+// The iSyntax tile streamer used by the viewer keeps its own state in the isyntax_t, so for reading arbitrary
+// regions we open separate instances of the file and decode tiles through the libisyntax tile cache.
+// Decoding a tile holds the mutex of the cache for the whole duration, so each concurrent tile read gets a reader
+// (instance + cache) of its own: it claims an idle reader, or opens a new one (up to one per worker thread).
+bool image_read_isyntax_tile(image_t* image, i32 level, i32 tile_x, i32 tile_y, u32* dest) {
+    ASSERT(image->backend == IMAGE_BACKEND_ISYNTAX);
+    benaphore_lock(&image->lock);
+    if (!image->isyntax_region_reader_semaphore) {
+        image->isyntax_region_reader_max_count = CLAMP(global_worker_thread_count + 1, 1, ISYNTAX_REGION_READER_MAX_COUNT);
+        image->isyntax_region_reader_semaphore = platform_semaphore_create(image->isyntax_region_reader_max_count);
+    }
+    benaphore_unlock(&image->lock);
+
+    // The semaphore guarantees that at least one reader is idle, or that there is room to open a new one
+    platform_semaphore_wait(image->isyntax_region_reader_semaphore);
+    isyntax_region_reader_t* reader = NULL;
+    i32 reader_count = image->isyntax_region_reader_count;
+    read_barrier;
+    for (i32 i = 0; i < reader_count; ++i) {
+        if (atomic_compare_exchange(&image->isyntax_region_readers[i].is_busy, 1, 0)) {
+            reader = image->isyntax_region_readers + i;
+            break;
+        }
+    }
+    if (!reader) {
+        benaphore_lock(&image->lock);
+        if (!image->isyntax_region_reader_failed && image->isyntax_region_reader_count < image->isyntax_region_reader_max_count) {
+            isyntax_region_reader_t* new_reader = image->isyntax_region_readers + image->isyntax_region_reader_count;
+            if (isyntax_region_reader_open(image, new_reader)) {
+                new_reader->is_busy = 1;
+                write_barrier;
+                image->isyntax_region_reader_count++;
+                reader = new_reader;
             } else {
-                intermediate_pixel_buffer = malloc(w * h * sizeof(uint32_t));
+                image->isyntax_region_reader_failed = true;
             }
-            openslide.read_region(image->openslide_wsi.osr, intermediate_pixel_buffer, x, y, level, w, h);
-        } break;
-		case IMAGE_BACKEND_TIFF:
-		case IMAGE_BACKEND_DICOM:
-		case IMAGE_BACKEND_STBI:{
-			level_image_t* level_image = image->level_images + level;
-
-			bounds2i level_tiles_bounds = BOUNDS2I(0, 0, (i32)level_image->width_in_tiles, (i32)level_image->height_in_tiles);
-			i32 local_x = x << level;
-			i32 local_y = y << level;
-			i32 tile_width = level_image->tile_width;
-			i32 tile_height = level_image->tile_height;
-			i32 tile_x0 = local_x / tile_width;
-			i32 tile_y0 = local_y / tile_height;
-			i32 tile_x1 = (local_x + w - 1) / tile_width + 1;
-			i32 tile_y1 = (local_y + h - 1) / tile_height + 1;
-			bounds2i region_tiles = BOUNDS2I(tile_x0, tile_y0, tile_x1, tile_y1);
-			bounds2i tiles_within_level_bounds = clip_bounds2i(region_tiles, level_tiles_bounds);
-
-			i32 width_in_tiles = tiles_within_level_bounds.right - tiles_within_level_bounds.left;
-			i32 height_in_tiles = tiles_within_level_bounds.bottom - tiles_within_level_bounds.top;
-
-			if (width_in_tiles > 0 && height_in_tiles > 0) {
-				load_tile_task_t* wishlist = calloc(width_in_tiles * height_in_tiles, sizeof(load_tile_task_t));
-				i32 tiles_to_load = 0;
-
-				work_queue_t read_completion_queue = work_queue_create("/imagereadregionsem",
-                                                                       width_in_tiles * height_in_tiles);
-
-				// request tiles
-				benaphore_lock(&image->lock);
-				for (i32 tile_y = tiles_within_level_bounds.min.y; tile_y < tiles_within_level_bounds.max.y; ++tile_y) {
-					for (i32 tile_x = tiles_within_level_bounds.min.x; tile_x < tiles_within_level_bounds.max.x; ++tile_x) {
-						tile_t* tile = get_tile(level_image, tile_x, tile_y);
-						if (tile->is_empty) continue; // no need to load empty tiles
-						if (tile->is_cached && tile->pixels) {
-							//TODO: retain
-							continue; // already cached
-						}
-						tile->need_keep_in_cache = true;
-						wishlist[tiles_to_load++] = (load_tile_task_t){
-							.resource_id = image->resource_id,
-							.image = image, .tile = tile, .level = level,
-							.tile_x = tile->tile_x,
-							.tile_y = tile->tile_y,
-							.need_gpu_residency = tile->need_gpu_residency,
-							.need_keep_in_cache = true,
-							.completion_queue = &read_completion_queue,
-                            .refcount_to_decrement = 1, // refcount will be decremented at end of thread proc load_tile_func()
-						};
-
-					}
-				}
-
-				request_tiles(image, wishlist, tiles_to_load);
-				benaphore_unlock(&image->lock);
-
-				// retrieve all requested tiles
-				while (read_completion_queue.completion_count < tiles_to_load) {
-					if (work_queue_is_work_in_progress(&read_completion_queue)) {
-						work_queue_entry_t entry = work_queue_get_next_entry(&read_completion_queue);
-						if (entry.is_valid) {
-							benaphore_lock(&image->lock);
-                            work_queue_mark_entry_completed(&read_completion_queue);
-							viewer_notify_tile_completed_task_t* task = (viewer_notify_tile_completed_task_t*) entry.userdata;
-							if (task->pixel_memory) {
-								tile_t* tile = get_tile_from_tile_index(image, task->scale, task->tile_index);
-								ASSERT(tile->pixels == NULL);
-								if (task->pixel_memory) {
-									tile->pixels = task->pixel_memory; // TODO: retain
-									tile->is_cached = true;
-								}
-							}
-							benaphore_unlock(&image->lock);
-						}
-					} else if (work_queue_is_work_waiting_to_start(&global_work_queue)) {
-                        work_queue_do_work(&global_work_queue, 0);
-					} else {
-						platform_sleep(1);
-					}
-				}
-                work_queue_destroy(&read_completion_queue);
-			}
+        } else {
+            // Another thread opened a reader in the meantime, and that reader must now be idle
+            for (i32 i = 0; i < image->isyntax_region_reader_count; ++i) {
+                if (atomic_compare_exchange(&image->isyntax_region_readers[i].is_busy, 1, 0)) {
+                    reader = image->isyntax_region_readers + i;
+                    break;
+                }
+            }
+        }
+        benaphore_unlock(&image->lock);
+    }
 
+    bool success = false;
+    if (reader) {
+        isyntax_error_t error = libisyntax_tile_read(reader->isyntax, reader->cache, level, tile_x, tile_y, dest, LIBISYNTAX_PIXEL_FORMAT_BGRA);
+        success = (error == LIBISYNTAX_OK);
+        write_barrier;
+        reader->is_busy = 0;
+    }
+    platform_semaphore_post(image->isyntax_region_reader_semaphore);
+    return success;
+}
 
-			intermediate_pixel_format = PIXEL_FORMAT_U8_BGRA;
-			if (desired_pixel_format == intermediate_pixel_format) {
-				intermediate_pixel_buffer = (uint32_t*) dest;
-			} else {
-				intermediate_pixel_buffer = malloc(w * h * sizeof(uint32_t));
-			}
+// Copy the part of a tile that overlaps the region into the destination buffer, converting the pixel format on the fly.
+// If pixels is NULL, or where the tile extends beyond the edge of the level, the area is filled with the background (white).
+static void read_region_copy_tile(u32* pixels, level_image_t* level_image, i32 tile_x, i32 tile_y, bounds2i region, void* dest, pixel_format_enum pixel_format) {
+    i32 tile_width = level_image->tile_width;
+    i32 tile_height = level_image->tile_height;
+    i32 region_width = region.max.x - region.min.x;
+    i32 tile_x0 = tile_x * tile_width;
+    i32 tile_y0 = tile_y * tile_height;
+    i32 x0 = MAX(region.min.x, tile_x0);
+    i32 y0 = MAX(region.min.y, tile_y0);
+    i32 x1 = MIN(region.max.x, tile_x0 + tile_width);
+    i32 y1 = MIN(region.max.y, tile_y0 + tile_height);
+    i32 valid_x1 = pixels ? CLAMP((i32)level_image->width_in_pixels, x0, x1) : x0;
+    i32 valid_y1 = pixels ? CLAMP((i32)level_image->height_in_pixels, y0, y1) : y0;
+    for (i32 y = y0; y < y1; ++y) {
+        i32 dest_offset = (y - region.min.y) * region_width + (x0 - region.min.x);
+        i32 copy_width = (y < valid_y1) ? valid_x1 - x0 : 0;
+        u32* src = pixels ? pixels + (y - tile_y0) * tile_width + (x0 - tile_x0) : NULL;
+        if (pixel_format == PIXEL_FORMAT_F32_Y) {
+            float* dest_row = (float*)dest + dest_offset;
+            if (copy_width > 0) {
+                convert_bgra_to_f32_y(src, dest_row, copy_width);
+            }
+            for (i32 x = copy_width; x < x1 - x0; ++x) {
+                dest_row[x] = 1.0f;
+            }
+        } else {
+            u32* dest_row = (u32*)dest + dest_offset;
+            if (copy_width > 0) {
+                memcpy(dest_row, src, copy_width * sizeof(u32));
+            }
+            memset(dest_row + copy_width, 0xFF, (x1 - x0 - copy_width) * sizeof(u32));
+        }
+    }
+}
 
+static void image_read_region_release(image_read_region_request_t* request) {
+    image_t* image = request->image;
+    benaphore_lock(&image->lock);
+    request->next_free = image->free_read_region_requests;
+    image->free_read_region_requests = request;
+    benaphore_unlock(&image->lock);
+    image_release(image, 1);
+}
 
-			// reconstruct the tiles into the requested region
-			i32 x0_tile_offset = local_x % tile_width;
-			i32 y0_tile_offset = local_y % tile_height;
-			i32 x1_tile_offset = ((local_x + w - 1) % tile_width) + 1;
-			i32 y1_tile_offset = ((local_y + h - 1) % tile_height) + 1;
-			int bg_value = 0xFF; // for memset() (white)
-			for (i32 tile_y = region_tiles.min.y; tile_y < region_tiles.max.y; ++tile_y) {
-				i32 dest_y = (tile_y - region_tiles.min.y) * tile_height;
-				if (tile_y > region_tiles.min.y) {
-					dest_y -= y0_tile_offset;
-				}
+// Called once for each task, plus once by the submitter after all tasks have been submitted.
+static void read_region_finish_task(image_read_region_request_t* request) {
+    write_barrier;
+    if (atomic_decrement(&request->tasks_remaining) == 0) {
+        read_barrier;
+        if (request->callback) {
+            request->callback(request, request->userdata);
+            image_read_region_release(request);
+        } else {
+            platform_semaphore_post(request->completion_semaphore);
+        }
+    }
+}
 
-				i32 copy_height = tile_height;
-				i32 copy_y0 = 0;
-				i32 copy_y1 = tile_height;
-				if (tile_y == region_tiles.min.y) {
-					copy_height -= y0_tile_offset;
-					copy_y0 = y0_tile_offset;
-				}
-				if (tile_y == region_tiles.max.y-1) {
-					copy_height -= (tile_height - y1_tile_offset);
-					copy_y1 = y1_tile_offset;
-				}
+static void read_region_tile_task_func(i32 logical_thread_index, void* userdata) {
+    read_region_tile_task_t* task = (read_region_tile_task_t*) userdata;
+    image_read_region_request_t* request = task->request;
+    image_t* image = request->image;
+    if (image->backend == IMAGE_BACKEND_OPENSLIDE) {
+        // OpenSlide assembles the whole region by itself
+        i32 w = request->region.max.x - request->region.min.x;
+        i32 h = request->region.max.y - request->region.min.y;
+        i64 x = (i64)request->region.min.x << request->level;
+        i64 y = (i64)request->region.min.y << request->level;
+        if (request->pixel_format == PIXEL_FORMAT_U8_BGRA) {
+            openslide.read_region(image->openslide_wsi.osr, (u32*)request->dest, x, y, request->level, w, h);
+        } else {
+            u32* pixels = malloc(w * h * sizeof(u32));
+            openslide.read_region(image->openslide_wsi.osr, pixels, x, y, request->level, w, h);
+            convert_bgra_to_f32_y(pixels, request->dest, w * h);
+            free(pixels);
+        }
+    } else {
+        level_image_t* level_image = image->level_images + request->level;
+        u8* pixels = NULL;
+        i32 tile_index = task->tile_y * level_image->width_in_tiles + task->tile_x;
+        if (!level_image->needs_indexing || is_tile_offset_known(image, request->level, tile_index)) {
+            pixels = decode_tile_to_bgra(logical_thread_index, image, request->level, task->tile_x, task->tile_y, NULL);
+        }
+        read_region_copy_tile((u32*)pixels, level_image, task->tile_x, task->tile_y, request->region, request->dest, request->pixel_format);
+        if (pixels) free(pixels);
+    }
+    read_region_finish_task(request);
+}
 
-				for (i32 tile_x = region_tiles.min.x; tile_x < region_tiles.max.x; ++tile_x) {
-					i32 dest_x = (tile_x - region_tiles.min.x) * tile_width;
-					if (tile_x > region_tiles.min.x) {
-						dest_x -= x0_tile_offset;
-					}
+static void read_region_submit_task(image_read_region_request_t* request, i32 tile_x, i32 tile_y) {
+    read_region_tile_task_t task = { .request = request, .tile_x = tile_x, .tile_y = tile_y };
+    atomic_increment(&request->tasks_remaining);
+    if (!work_queue_submit_task(&global_work_queue, read_region_tile_task_func, &task, sizeof(task))) {
+        // Queue is full, do the work on this thread instead
+        read_region_tile_task_func(0, &task);
+    }
+}
 
-					i32 copy_width = tile_width;
-					i32 copy_x0 = 0;
-					i32 copy_x1 = tile_width;
-					if (tile_x == region_tiles.min.x) {
-						copy_width -= x0_tile_offset;
-						copy_x0 = x0_tile_offset;
-					}
-					if (tile_x == region_tiles.max.x-1) {
-						copy_width -= (tile_width - x1_tile_offset);
-						copy_x1 = x1_tile_offset;
-					}
+// Returns true if the tile could be copied from the tile cache (without needing to decode it).
+static bool read_region_copy_cached_tile(image_read_region_request_t* request, i32 tile_x, i32 tile_y) {
+    image_t* image = request->image;
+    level_image_t* level_image = image->level_images + request->level;
+    bool result = false;
+    benaphore_lock(&image->lock);
+    tile_t* tile = get_tile(level_image, tile_x, tile_y);
+    if (tile->is_cached && tile->pixels) {
+        read_region_copy_tile((u32*)tile->pixels, level_image, tile_x, tile_y, request->region, request->dest, request->pixel_format);
+        result = true;
+    }
+    benaphore_unlock(&image->lock);
+    return result;
+}
 
-					bool copied = false;
-					if (tile_x >= 0 && tile_y >= 0 && tile_x < level_image->width_in_tiles && tile_y < level_image->height_in_tiles) {
-						// fill the area covered by this tile (if it exists)
-						tile_t* tile = get_tile(level_image, tile_x, tile_y);
-						if (!tile->is_empty && tile->is_cached && tile->pixels) {
-							uint32_t* row = (uint32_t*)intermediate_pixel_buffer + dest_y * w + dest_x;
-							for (i32 src_y = copy_y0; src_y < copy_y1; ++src_y) {
-								memcpy(row, (uint32_t*)tile->pixels + src_y * tile_width + copy_x0, copy_width * sizeof(uint32_t));
-								row += w;
-							}
-							copied = true;
-						}
-					}
-					if (!copied) {
-						// if the tile does not exist, fill the area with white
-						uint32_t* row = (uint32_t*)intermediate_pixel_buffer + dest_y * w + dest_x;
-						for (i32 src_y = copy_y0; src_y < copy_y1; ++src_y) {
-							memset(row, bg_value, copy_width * sizeof(uint32_t));
-							row += w;
-						}
-					}
-				}
-			}
+typedef struct level_indexing_task_t {
+	image_t* image;
+	level_image_t* level_image;
+	i32 scale;
+} level_indexing_task_t;
 
-			// release tiles
-			benaphore_lock(&image->lock);
-			for (i32 tile_y = tiles_within_level_bounds.min.y; tile_y < tiles_within_level_bounds.max.y; ++tile_y) {
-				for (i32 tile_x = tiles_within_level_bounds.min.x; tile_x < tiles_within_level_bounds.max.x; ++tile_x) {
-					tile_t* tile = get_tile(level_image, tile_x, tile_y);
-					if (tile->is_empty) continue; // no need to load empty tiles
-					if (tile->is_cached && tile->pixels) {
-						free(tile->pixels);
-						tile->pixels = NULL;
-						tile->is_cached = false;
-					}
-					tile->need_keep_in_cache = false;
-				}
-			}
-			benaphore_unlock(&image->lock);
+void level_image_indexing_task_func(i32 logical_thread_index, void* userdata);
 
+static bool read_region_is_tile_ready(image_t* image, i32 level, i32 tile_x, i32 tile_y) {
+    level_image_t* level_image = image->level_images + level;
+    i32 tile_index = tile_y * level_image->width_in_tiles + tile_x;
+    return !level_image->needs_indexing || level_image->indexing_job_finished || is_tile_offset_known(image, level, tile_index);
+}
 
+// If the location of the tile in the file is not known yet, park it until the indexing job for the level is done,
+// instead of waiting for it on the calling thread. Returns true if the tile was deferred.
+static bool read_region_defer_tile_until_indexed(image_read_region_request_t* request, i32 tile_x, i32 tile_y) {
+    image_t* image = request->image;
+    i32 level = request->level;
+    level_image_t* level_image = image->level_images + level;
+    if (read_region_is_tile_ready(image, level, tile_x, tile_y)) {
+        return false;
+    }
+    if (!level_image->indexing_job_submitted) {
+        begin_level_image_indexing(image, level_image, level);
+        if (!level_image->indexing_job_submitted) {
+            // Queue is full, do the indexing on this thread instead
+            level_image->indexing_job_submitted = true;
+            atomic_increment(&image->refcount); // retain
+            level_indexing_task_t task = { .image = image, .level_image = level_image, .scale = level };
+            level_image_indexing_task_func(0, &task);
+            return false;
+        }
+    }
+    bool is_deferred = false;
+    benaphore_lock(&image->lock);
+    // Check again, now that the indexing job can't slip in between (it resubmits the deferred tiles under the lock)
+    if (!read_region_is_tile_ready(image, level, tile_x, tile_y)) {
+        read_region_tile_task_t task = { .request = request, .tile_x = tile_x, .tile_y = tile_y };
+        arrput(image->deferred_read_region_tiles, task);
+        atomic_increment(&request->tasks_remaining);
+        is_deferred = true;
+    }
+    benaphore_unlock(&image->lock);
+    return is_deferred;
+}
 
-		} break;
+// Called when an indexing job has finished: submit the deferred tiles that can now be read.
+static void read_region_submit_deferred_tiles(image_t* image) {
+    read_region_tile_task_t* ready_tiles = NULL;
+    benaphore_lock(&image->lock);
+    for (i32 i = 0; i < arrlen(image->deferred_read_region_tiles); ) {
+        read_region_tile_task_t task = image->deferred_read_region_tiles[i];
+        if (read_region_is_tile_ready(image, task.request->level, task.tile_x, task.tile_y)) {
+            arrput(ready_tiles, task);
+            arrdelswap(image->deferred_read_region_tiles, i);
+        } else {
+            ++i;
+        }
+    }
+    benaphore_unlock(&image->lock);
+    for (i32 i = 0; i < arrlen(ready_tiles); ++i) {
+        read_region_tile_task_t* task = ready_tiles + i;
+        if (!work_queue_submit_task(&global_work_queue, read_region_tile_task_func, task, sizeof(*task))) {
+            read_region_tile_task_func(0, task);
+        }
     }
+    arrfree(ready_tiles);
+}
 
-    bool success = true;
-    if (intermediate_pixel_format == desired_pixel_format) {
-        return true; // we're already done!
-    } else {
-        // need to convert between pixel formats
-        if (intermediate_pixel_format == PIXEL_FORMAT_U8_BGRA) {
-            if (desired_pixel_format == PIXEL_FORMAT_F32_Y) {
-                image_convert_u8_rgba_to_f32_y(intermediate_pixel_buffer, dest, w, h, 4);
-            } else {
-                console_print_error("image_read_region(): pixel conversion (%d to %d) not implemented\n", intermediate_pixel_format, desired_pixel_format);
-                success = false;
+// Tiles that are cached, empty or outside the level are filled in immediately; all others are decoded in separate
+// tasks, which copy only the part of the tile that is needed directly into the destination buffer.
+static void read_region_submit_tiles(image_read_region_request_t* request) {
+    image_t* image = request->image;
+    i32 level = request->level;
+    bounds2i region = request->region;
+    level_image_t* level_image = image->level_images + level;
+    i32 tile_width = level_image->tile_width;
+    i32 tile_height = level_image->tile_height;
+    bounds2i region_tiles = BOUNDS2I(region.min.x / tile_width, region.min.y / tile_height,
+                                     (region.max.x - 1) / tile_width + 1, (region.max.y - 1) / tile_height + 1);
+
+    for (i32 tile_y = region_tiles.min.y; tile_y < region_tiles.max.y; ++tile_y) {
+        for (i32 tile_x = region_tiles.min.x; tile_x < region_tiles.max.x; ++tile_x) {
+            bool is_inside_level = (tile_x < level_image->width_in_tiles && tile_y < level_image->height_in_tiles);
+            if (!is_inside_level || get_tile(level_image, tile_x, tile_y)->is_empty) {
+                read_region_copy_tile(NULL, level_image, tile_x, tile_y, region, request->dest, request->pixel_format);
+                continue;
             }
-        } else {
-            console_print_error("image_read_region(): pixel conversion (%d to %d) not implemented\n", intermediate_pixel_format, desired_pixel_format);
-            success = false;
+            if (read_region_copy_cached_tile(request, tile_x, tile_y)) {
+                continue;
+            }
+            if (level_image->needs_indexing && read_region_defer_tile_until_indexed(request, tile_x, tile_y)) {
+                continue;
+            }
+            read_region_submit_task(request, tile_x, tile_y);
         }
-        if (intermediate_pixel_buffer) free(intermediate_pixel_buffer);
     }
-    return success;
 }
 
-void do_level_image_indexing(image_t* image, level_image_t* level_image, i32 scale) {
+static image_read_region_request_t* image_read_region_acquire_request(image_t* image) {
+    benaphore_lock(&image->lock);
+    image_read_region_request_t* request = image->free_read_region_requests;
+    if (request) {
+        image->free_read_region_requests = request->next_free;
+    } else {
+        request = calloc(1, sizeof(image_read_region_request_t));
+        request->completion_semaphore = platform_semaphore_create(0);
+        arrput(image->read_region_requests, request); // only freed in image_destroy()
+    }
+    benaphore_unlock(&image->lock);
+    atomic_increment(&image->refcount); // retain
+    return request;
+}
+
+// Start reading a region in the background. If a callback is specified, it is called once the destination buffer is
+// filled in (on the thread that finishes the last tile, or on the calling thread if nothing needed to be decoded),
+// after which the request is recycled. Otherwise, the caller must call image_read_region_wait() exactly once.
+// NOTE: x and y are specified in level 0 pixel coordinates (same as openslide_read_region()), w and h in pixels of the level.
+image_read_region_request_t* image_read_region_async(image_t* image, i32 level, i32 x, i32 y, i32 w, i32 h, void* dest, pixel_format_enum desired_pixel_format,
+                                                     image_read_region_callback_t* callback, void* userdata) {
+    ASSERT(dest != NULL);
+
+	if (w <= 0 || h <= 0) {
+		return NULL;
+	}
+	if (level < 0 || level >= image->level_count) {
+		console_print_error("image_read_region(): level %d out of bounds (valid range 0-%d)\n", level, image->level_count-1);
+		return NULL;
+	}
+	if (desired_pixel_format != PIXEL_FORMAT_U8_BGRA && desired_pixel_format != PIXEL_FORMAT_F32_Y) {
+		console_print_error("image_read_region(): pixel format %d not implemented\n", desired_pixel_format);
+		return NULL;
+	}
+	switch (image->backend) {
+		default: {
+			console_print_error("image_read_region(): not implemented for backend '%s'\n", get_image_backend_name(image));
+			return NULL;
+		} break;
+		case IMAGE_BACKEND_OPENSLIDE:
+		case IMAGE_BACKEND_TIFF:
+		case IMAGE_BACKEND_DICOM:
+		case IMAGE_BACKEND_MRXS:
+		case IMAGE_BACKEND_ISYNTAX:
+		case IMAGE_BACKEND_STBI: break;
+	}
+	if (x < 0 || y < 0) {
+		console_print_error("image_read_region(): negative coordinates not supported\n");
+		return NULL;
+	}
+
+	image_read_region_request_t* request = image_read_region_acquire_request(image);
+	request->image = image;
+	request->level = level;
+	request->region = BOUNDS2I(x >> level, y >> level, (x >> level) + w, (y >> level) + h);
+	request->dest = dest;
+	request->pixel_format = desired_pixel_format;
+	request->callback = callback;
+	request->userdata = userdata;
+	request->tasks_remaining = 1; // held by the submitter until all tasks are submitted
+
+	if (image->backend == IMAGE_BACKEND_OPENSLIDE) {
+		read_region_submit_task(request, 0, 0);
+	} else {
+		read_region_submit_tiles(request);
+	}
+	read_region_finish_task(request);
+	return request;
+}
+
+// Wait for a request started by image_read_region_async() (without callback) to complete, and recycle the request.
+// While waiting, the calling thread helps out with work that is waiting to start; otherwise it sleeps until signaled.
+bool image_read_region_wait(image_read_region_request_t* request) {
+	while (request->tasks_remaining > 0) {
+		if (work_queue_is_work_waiting_to_start(&global_work_queue)) {
+			work_queue_do_work(&global_work_queue, 0);
+		} else {
+			platform_semaphore_wait(request->completion_semaphore);
+		}
+	}
+	read_barrier;
+	image_read_region_release(request);
+	return true;
+}
+
+bool image_read_region(image_t* image, i32 level, i32 x, i32 y, i32 w, i32 h, void* dest, pixel_format_enum desired_pixel_format) {
+	image_read_region_request_t* request = image_read_region_async(image, level, x, y, w, h, dest, desired_pixel_format, NULL, NULL);
+	if (!request) {
+		return false;
+	}
+	return image_read_region_wait(request);
+}
+
+void do_level_image_indexing(image_t* image, level_image_t* level_image, i32 scale, i32 logical_thread_index) {
     if (image->backend == IMAGE_BACKEND_DICOM) {
-        if (dicom_instance_index_pixel_data(image->dicom.wsi.level_instances[scale])) {
+        if (dicom_instance_index_pixel_data(image->dicom.wsi.level_instances[scale], logical_thread_index)) {
             level_image->needs_indexing = false;
         }
+    } else if (image->backend == IMAGE_BACKEND_TIFF) {
+        // All downsampled levels of a stripped TIFF are built in one pass, so the other levels need no job of their own.
+        for (i32 i = 1; i < image->level_count; ++i) {
+            image->level_images[i].indexing_job_submitted = true;
+        }
+        if (!tiff_build_virtual_pyramid(&image->tiff, logical_thread_index, &image->is_deleted)) {
+            console_print_error("[thread %d] failed to build the downsampled levels of a stripped TIFF\n", logical_thread_index);
+        }
+        // If building failed, tiles that were not finished are left empty (instead of waiting for them forever).
+        write_barrier;
+        for (i32 i = 1; i < image->level_count; ++i) {
+            image->level_images[i].needs_indexing = false;
+        }
     }
 }
 
-typedef struct level_indexing_task_t {
-	image_t* image;
-	level_image_t* level_image;
-	i32 scale;
-} level_indexing_task_t;
-
 
 void level_image_indexing_task_func(i32 logical_thread_index, void* userdata) {
 	level_indexing_task_t* task = (level_indexing_task_t*) userdata;
-	do_level_image_indexing(task->image, task->level_image, task->scale);
-	atomic_decrement(&task->image->refcount); // release
+	do_level_image_indexing(task->image, task->level_image, task->scale, logical_thread_index);
+	write_barrier;
+	task->level_image->indexing_job_finished = true;
+	read_region_submit_deferred_tiles(task->image);
+	image_release(task->image, 1);
 }
 
 void begin_level_image_indexing(image_t* image, level_image_t* level_image, i32 scale) {
@@ -1132,16 +1332,41 @@ void begin_level_image_indexing(image_t* image, level_image_t* level_image, i32
 	};
 }
 
+// While a level is being indexed, tiles can only be loaded once the offset of their frame has been published.
+bool is_tile_offset_known(image_t* image, i32 scale, i32 tile_index) {
+    if (image->backend == IMAGE_BACKEND_DICOM) {
+        dicom_instance_t* instance = image->dicom.wsi.level_instances[scale];
+        if (instance && tile_index < instance->tile_count) {
+            bool result = instance->tiles[tile_index].is_offset_known;
+            read_barrier;
+            return result;
+        }
+        return false;
+    } else if (image->backend == IMAGE_BACKEND_TIFF) {
+        level_image_t* level_image = image->level_images + scale;
+        return tiff_is_virtual_tile_ready(&image->tiff, scale, tile_index / level_image->width_in_tiles);
+    }
+    return true;
+}
+
+// Drop references to the image held by tasks. Wakes up image_destroy() once the last one is gone.
+void image_release(image_t* image, i32 count) {
+    if (atomic_subtract(&image->refcount, count) == 0 && image->is_deleted) {
+        platform_semaphore_post(image->release_semaphore);
+    }
+}
+
 void image_destroy(image_t* image) {
+    // Hold a reference while setting is_deleted, so that exactly one image_release() sees the refcount drop to zero
+    // afterwards (possibly the one below), and posts the semaphore.
+    atomic_increment(&image->refcount);
     image->is_deleted = true;
-    while (image->refcount > 0) {
-//		console_print_error("refcount = %d\n", image->refcount);
-	    if (work_queue_is_work_waiting_to_start(&global_work_queue)) {
-		    work_queue_do_work(&global_work_queue, 0);
-	    } else {
-		    platform_sleep(1);
-	    }
+    write_barrier;
+    image_release(image, 1);
+    while (image->refcount > 0 && work_queue_is_work_waiting_to_start(&global_work_queue)) {
+        work_queue_do_work(&global_work_queue, 0);
     }
+    platform_semaphore_wait(image->release_semaphore);
 	if (image) {
 		if (image->type == IMAGE_TYPE_WSI) {
 			if (image->backend == IMAGE_BACKEND_OPENSLIDE) {
@@ -1150,6 +1375,17 @@ void image_destroy(image_t* image) {
 				tiff_destroy(&image->tiff);
 			} else if (image->backend == IMAGE_BACKEND_ISYNTAX) {
 				isyntax_destroy(&image->isyntax);
+				for (i32 i = 0; i < image->isyntax_region_reader_count; ++i) {
+					isyntax_region_reader_t* reader = image->isyntax_region_readers + i;
+					isyntax_destroy(reader->isyntax);
+					free(reader->isyntax);
+					libisyntax_cache_destroy(reader->cache);
+				}
+				image->isyntax_region_reader_count = 0;
+				if (image->isyntax_region_reader_semaphore) {
+					platform_semaphore_destroy(image->isyntax_region_reader_semaphore);
+					image->isyntax_region_reader_semaphore = NULL;
+				}
 			} else if (image->backend == IMAGE_BACKEND_DICOM) {
 				dicom_destroy(&image->dicom);
 			} else if (image->backend == IMAGE_BACKEND_MRXS) {
@@ -1177,10 +1413,11 @@ void image_destroy(image_t* image) {
 				for (i32 j = 0; j < level_image->tile_count; ++j) {
 					tile_t* tile = level_image->tiles + j;
 					if (tile->texture != 0) {
-						unload_texture(tile->texture);
+						unload_tile_texture(tile);
 					}
 				}
 			}
+			level_draw_cache_destroy(&level_image->draw_cache);
 			free(level_image->tiles);
 			level_image->tiles = NULL;
 		}
@@ -1196,6 +1433,20 @@ void image_destroy(image_t* image) {
 			memset(&image->label_image, 0, sizeof(image->label_image));
 		}
 
+		if (image->deformation_field) {
+			deformation_field_destroy(image->deformation_field);
+			image->deformation_field = NULL;
+		}
+
+		for (i32 i = 0; i < arrlen(image->read_region_requests); ++i) {
+			platform_semaphore_destroy(image->read_region_requests[i]->completion_semaphore);
+			free(image->read_region_requests[i]);
+		}
+		arrfree(image->read_region_requests);
+		image->free_read_region_requests = NULL;
+		arrfree(image->deferred_read_region_tiles);
+		benaphore_destroy(&image->lock);
+		platform_semaphore_destroy(image->release_semaphore);
 	}
 }
 
@@ -43,6 +43,7 @@ typedef enum pixel_format_enum {
 #define WSI_TILE_DIM 512
 
 typedef struct image_t image_t;
+typedef struct deformation_field_t deformation_field_t;
 
 typedef struct {
     i64 width;
@@ -107,12 +108,14 @@ typedef struct tile_t {
     i32 tile_y;
     u8* pixels;
     u32 texture;
+    u32 texture_slot; // slot in the tile texture pool (1-based); 0 if the tile has its own texture
     bool8 is_submitted_for_loading;
     bool8 is_empty;
     bool8 is_cached;
     bool8 need_keep_in_cache;
     bool8 need_gpu_residency; // TODO: revise: still needed?
     i64 time_last_drawn;
+    u32 texture_generation; // when the texture was last uploaded or unloaded (see level_draw_cache_t)
 } tile_t;
 
 typedef struct cached_tile_t {
@@ -120,6 +123,28 @@ typedef struct cached_tile_t {
     u8* pixels;
 } cached_tile_t;
 
+typedef struct tile_draw_batch_t {
+    u32 texture; // texture array containing the tiles
+    i32 first_instance;
+    i32 instance_count;
+} tile_draw_batch_t;
+
+// Instance data for drawing the visible tiles of a level with as few draw calls as possible.
+// Only rebuilt if the visible tiles change, or if any of the visible tiles got its texture uploaded or unloaded
+// in the meantime (i.e. its texture_generation is newer than that of the cache).
+typedef struct level_draw_cache_t {
+    u32 vao;
+    u32 instance_vbo;
+    bounds2i visible_tiles;
+    u32 texture_generation;
+    tile_draw_batch_t* batches;
+    u32* pooled_tile_indices; // tiles drawn by the batches
+    u32* standalone_tile_indices; // tiles with their own texture, drawn one at a time
+    i32 missing_tile_count;
+    bool use_instancing;
+    bool is_valid;
+} level_draw_cache_t;
+
 typedef struct {
     i64 width_in_pixels;
     i64 height_in_pixels;
@@ -137,10 +162,34 @@ typedef struct {
     v2f origin_offset;
     i32 pyramid_image_index;
     bool exists;
-    bool needs_indexing; //TODO: implement
+    bool needs_indexing; // tile offsets are published incrementally while indexing, see is_tile_offset_known()
     bool indexing_job_submitted;
+    volatile bool indexing_job_finished;
+    level_draw_cache_t draw_cache;
 } level_image_t;
 
+typedef struct image_read_region_request_t image_read_region_request_t;
+typedef void (image_read_region_callback_t)(image_read_region_request_t* request, void* userdata);
+
+struct image_read_region_request_t {
+    image_t* image;
+    i32 level;
+    bounds2i region; // in pixel coordinates of the level
+    void* dest;
+    pixel_format_enum pixel_format;
+    image_read_region_callback_t* callback;
+    void* userdata;
+    volatile i32 tasks_remaining;
+    semaphore_handle_t completion_semaphore; // signals completion to image_read_region_wait()
+    image_read_region_request_t* next_free;
+};
+
+typedef struct read_region_tile_task_t {
+    image_read_region_request_t* request;
+    i32 tile_x;
+    i32 tile_y;
+} read_region_tile_task_t;
+
 typedef struct simple_image_t {
     i32 channels_in_file;
     i32 channels;
@@ -153,6 +202,16 @@ typedef struct simple_image_t {
     bool is_valid;
 } simple_image_t;
 
+// Separate iSyntax instances for image_read_region(), so that they do not interfere with the tile streamer.
+// Each reader has its own tile cache (and therefore its own lock), so tiles can be decoded in parallel.
+#define ISYNTAX_REGION_READER_MAX_COUNT 8
+
+typedef struct isyntax_region_reader_t {
+	isyntax_t* isyntax;
+	isyntax_cache_t* cache;
+	volatile i32 is_busy;
+} isyntax_region_reader_t;
+
 typedef struct image_t {
     char name[512];
     char directory[512];
@@ -188,7 +247,17 @@ typedef struct image_t {
     simple_image_t label_image;
     i32 resource_id;
 	volatile i32 refcount;
+	semaphore_handle_t release_semaphore; // posted by image_release() when the last reference is gone after is_deleted is set
 	benaphore_t lock;
+	isyntax_region_reader_t isyntax_region_readers[ISYNTAX_REGION_READER_MAX_COUNT];
+	volatile i32 isyntax_region_reader_count;
+	i32 isyntax_region_reader_max_count;
+	semaphore_handle_t isyntax_region_reader_semaphore; // counts the readers that are idle or can still be opened
+	bool isyntax_region_reader_failed;
+	image_read_region_request_t** read_region_requests; // array
+	image_read_region_request_t* free_read_region_requests; // recycled requests (linked list)
+	read_region_tile_task_t* deferred_read_region_tiles; // array; tiles waiting for their level to be indexed (protected by lock)
+	deformation_field_t* deformation_field; // dense registration onto the base image (optional)
 } image_t;
 
 
@@ -231,8 +300,14 @@ bool init_image_from_dicom(image_t* image, dicom_series_t* dicom, bool is_overla
 bool init_image_from_mrxs(image_t* image, mrxs_t* mrxs, bool is_overlay);
 bool init_image_from_stbi(image_t* image, simple_image_t* simple, bool is_overlay);
 void init_image_from_openslide(image_t* image, wsi_t* wsi, bool is_overlay);
+bool image_read_isyntax_tile(image_t* image, i32 level, i32 tile_x, i32 tile_y, u32* dest);
+image_read_region_request_t* image_read_region_async(image_t* image, i32 level, i32 x, i32 y, i32 w, i32 h, void* dest, pixel_format_enum desired_pixel_format,
+                                                     image_read_region_callback_t* callback, void* userdata);
+bool image_read_region_wait(image_read_region_request_t* request);
 bool image_read_region(image_t* image, i32 level, i32 x, i32 y, i32 w, i32 h, void* dest, pixel_format_enum desired_pixel_format);
 void begin_level_image_indexing(image_t* image, level_image_t* level_image, i32 scale);
+void image_release(image_t* image, i32 count);
+bool is_tile_offset_known(image_t* image, i32 scale, i32 tile_index);
 void image_destroy(image_t* image);
 
 #ifdef __cplusplus
@@ -19,8 +19,10 @@
 #include "common.h"
 #include "image.h"
 #include "image_registration.h"
+#include "viewer.h"
 
 #include "phasecorrelate.h"
+#include "pixel_convert.h"
 
 #include "stb_image.h"
 #include "stb_image_write.h"
@@ -83,17 +85,6 @@ void run_test_with_basic_test_images() {
 }
 #endif
 
-static void convert_bgra_to_rgba(uint32_t* pixels, i32 pixel_count) {
-    // convert bgr to rgb
-    u8* p = (u8*)pixels;
-    for (i32 i=0; i < pixel_count; ++i) {
-        u8 t = p[0];
-        p[0] = p[2];
-        p[2] = t;
-        p += 4;
-    }
-}
-
 static void set_white_level(float* pixels, i32 pixel_count, float white) {
     float scale = 1.0f / white;
     for (i32 i = 0; i < pixel_count; ++i) {
@@ -172,14 +163,9 @@ image_transform_t do_local_image_registration(image_t* image1, image_t* image2,
                                               image_register_preprocess_method_enum preprocess_method) {
     image_transform_t result = {};
 
-    if (image1->backend == IMAGE_BACKEND_ISYNTAX || image2->backend == IMAGE_BACKEND_ISYNTAX) {
-        // TODO: implement read_region() for iSyntax backend
-        return result;
-    }
-
     i64 start = get_clock();
 
-	level = 0;
+	level = CLAMP(level, 0, MIN(image1->level_count, image2->level_count) - 1);
     i32 w = patch_width;
     i32 h = patch_width;
     i32 half_patch_width_global = (patch_width / 2) << level;
@@ -199,9 +185,8 @@ image_transform_t do_local_image_registration(image_t* image1, image_t* image2,
     float* region1 = calloc(1, w * h * sizeof(float));
     float* region2 = calloc(1, w * h * sizeof(float));
 
-    // TODO: fix levels > 0 giving incorrect result
-    bool ok = image_read_region(image1, 0, x1, y1, w, h, region1, PIXEL_FORMAT_F32_Y);
-    ok = ok && image_read_region(image2, 0, x2, y2, w, h, region2, PIXEL_FORMAT_F32_Y);
+    bool ok = image_read_region(image1, level, x1, y1, w, h, region1, PIXEL_FORMAT_F32_Y);
+    ok = ok && image_read_region(image2, level, x2, y2, w, h, region2, PIXEL_FORMAT_F32_Y);
     if (!ok) {
         console_print("Image registration not possible: image_read_region() failed\n");
         return result;
@@ -211,15 +196,15 @@ image_transform_t do_local_image_registration(image_t* image1, image_t* image2,
         uint32_t* rgb_region1 = calloc(1, w * h * sizeof(float));
         uint32_t* rgb_region2 = calloc(1, w * h * sizeof(float));
 
-        ok = image_read_region(image1, 0, x1, y1, w, h, rgb_region1, PIXEL_FORMAT_U8_BGRA);
-        ok = ok && image_read_region(image2, 0, x2, y2, w, h, rgb_region2, PIXEL_FORMAT_U8_BGRA);
+        ok = image_read_region(image1, level, x1, y1, w, h, rgb_region1, PIXEL_FORMAT_U8_BGRA);
+        ok = ok && image_read_region(image2, level, x2, y2, w, h, rgb_region2, PIXEL_FORMAT_U8_BGRA);
         if (!ok) {
             console_print("Image registration not possible: image_read_region() failed\n");
             return result;
         }
 
-        convert_bgra_to_rgba(rgb_region1, w * h);
-        convert_bgra_to_rgba(rgb_region2, w * h);
+        convert_swap_red_blue(rgb_region1, rgb_region1, w * h);
+        convert_swap_red_blue(rgb_region2, rgb_region2, w * h);
 
 //        stbi_write_jpg("rgb_thumb1.jpg", w, h, 4, rgb_region1, 80);
 //        stbi_write_jpg("rgb_thumb2.jpg", w, h, 4, rgb_region2, 80);
@@ -253,14 +238,14 @@ image_transform_t do_local_image_registration(image_t* image1, image_t* image2,
     }
 
     v2f pixel_shift = phase_correlate(&input1, &input2, NULL, 1.0f, &result.response, offset_limit);
-    pixel_shift.x *= image2->mpp_x ;//* level_image2->downsample_factor;
-    pixel_shift.y *= image2->mpp_y ;//* level_image2->downsample_factor;
+    pixel_shift.x *= image2->mpp_x * level_image2->downsample_factor;
+    pixel_shift.y *= image2->mpp_y * level_image2->downsample_factor;
 
     result.translate = pixel_shift;
     result.is_valid = true;
 
-    console_print("Local image registration (on level 0) using method %d: level0 pixel offset = (%.0f, %.0f), io time = %g seconds, processing time = %g seconds\n",
-                  preprocess_method, pixel_shift.x / image2->mpp_x, pixel_shift.y / image2->mpp_y,
+    console_print("Local image registration (on level %d) using method %d: level0 pixel offset = (%.0f, %.0f), io time = %g seconds, processing time = %g seconds\n",
+                  level, preprocess_method, pixel_shift.x / image2->mpp_x, pixel_shift.y / image2->mpp_y,
                   get_seconds_elapsed(start, clock_after_read), get_seconds_elapsed(clock_after_read, get_clock()));
 
     free(region1);
@@ -268,14 +253,157 @@ image_transform_t do_local_image_registration(image_t* image1, image_t* image2,
     return result;
 }
 
+// Multi-resolution registration
+//
+// The transform maps image2 onto image1, in level 0 pixel coordinates: content at pixel q in image2 appears in image1
+// at R(rotation) * (q - center) + center + shift, where center is the center of image2.
+// A coarse estimate (including rotation) is made on a low resolution level, using the whole level. The estimate is
+// then refined on progressively finer levels, each time on a patch around the center of the tissue, within a
+// shrinking search window.
+
+typedef struct registration_patch_t {
+    float* pixels;
+    i32 w, h;
+    v2i origin; // in pixel coordinates of the level
+    float downsample;
+} registration_patch_t;
+
+typedef struct registration_estimate_t {
+    v2f shift;
+    float rotation;
+    v2f center;
+} registration_estimate_t;
+
+typedef struct registration_candidate_t {
+    registration_patch_t* fixed;
+    registration_patch_t* moving;
+    registration_estimate_t estimate;
+    i32 offset_limit;
+    v2f residual; // in pixel coordinates of the level
+    float response;
+} registration_candidate_t;
+
+typedef struct registration_candidate_task_t {
+    registration_candidate_t* candidate;
+    volatile i32* tasks_remaining;
+    semaphore_handle_t completion_semaphore;
+} registration_candidate_task_t;
+
+static bool read_registration_patch(image_t* image, i32 level, registration_patch_t* patch, image_read_region_request_t** request) {
+    level_image_t* level_image = image->level_images + level;
+    patch->origin.x = ATLEAST(0, patch->origin.x);
+    patch->origin.y = ATLEAST(0, patch->origin.y);
+    patch->downsample = level_image->downsample_factor;
+    patch->pixels = malloc(patch->w * patch->h * sizeof(float));
+    *request = image_read_region_async(image, level, patch->origin.x << level, patch->origin.y << level, patch->w, patch->h,
+                                       patch->pixels, PIXEL_FORMAT_F32_Y, NULL, NULL);
+    return (*request != NULL);
+}
+
+static void preprocess_registration_patch(registration_patch_t* patch, bool is_moving_image) {
+    set_white_level(patch->pixels, patch->w * patch->h, 230.0f / 255.0f);
+    if (is_moving_image) {
+        set_black_level(patch->pixels, patch->w * patch->h, 150.0f / 255.0f);
+    }
+}
+
+// Resample the moving patch into the frame of the fixed patch, according to the estimated transform.
+static void warp_registration_patch(registration_patch_t* moving, registration_patch_t* fixed, registration_estimate_t* estimate, float* dest) {
+    float cos_r = cosf(-estimate->rotation);
+    float sin_r = sinf(-estimate->rotation);
+    float fixed_scale = fixed->downsample;
+    float moving_scale = 1.0f / moving->downsample;
+    for (i32 y = 0; y < fixed->h; ++y) {
+        float* dest_row = dest + y * fixed->w;
+        for (i32 x = 0; x < fixed->w; ++x) {
+            // position in image1 (level 0) -> position in image2 (level 0) -> position in moving patch
+            float px = (float)(fixed->origin.x + x) * fixed_scale - estimate->center.x - estimate->shift.x;
+            float py = (float)(fixed->origin.y + y) * fixed_scale - estimate->center.y - estimate->shift.y;
+            float qx = (cos_r * px - sin_r * py + estimate->center.x) * moving_scale - (float)moving->origin.x;
+            float qy = (sin_r * px + cos_r * py + estimate->center.y) * moving_scale - (float)moving->origin.y;
+            i32 x0 = (i32)floorf(qx);
+            i32 y0 = (i32)floorf(qy);
+            if (x0 < 0 || y0 < 0 || x0 + 1 >= moving->w || y0 + 1 >= moving->h) {
+                dest_row[x] = 1.0f; // background
+                continue;
+            }
+            float fx = qx - (float)x0;
+            float fy = qy - (float)y0;
+            float* src = moving->pixels + y0 * moving->w + x0;
+            float top = src[0] + fx * (src[1] - src[0]);
+            float bottom = src[moving->w] + fx * (src[moving->w + 1] - src[moving->w]);
+            dest_row[x] = top + fy * (bottom - top);
+        }
+    }
+}
+
+static void registration_candidate_task_func(i32 logical_thread_index, void* userdata) {
+    registration_candidate_task_t* task = (registration_candidate_task_t*) userdata;
+    registration_candidate_t* candidate = task->candidate;
+    registration_patch_t* fixed = candidate->fixed;
+    float* warped = malloc(fixed->w * fixed->h * sizeof(float));
+    warp_registration_patch(candidate->moving, fixed, &candidate->estimate, warped);
+    buffer2d_t input1 = { .w = fixed->w, .h = fixed->h, .data = fixed->pixels};
+    buffer2d_t input2 = { .w = fixed->w, .h = fixed->h, .data = warped};
+    candidate->residual = phase_correlate(&input1, &input2, NULL, 1.0f, &candidate->response, candidate->offset_limit);
+    free(warped);
+    write_barrier;
+    if (atomic_decrement(task->tasks_remaining) == 0) {
+        platform_semaphore_post(task->completion_semaphore);
+    }
+}
+
+// Evaluate the candidates in parallel on the worker threads; returns the index of the candidate with the highest response.
+static i32 evaluate_registration_candidates(registration_candidate_t* candidates, i32 candidate_count) {
+    volatile i32 tasks_remaining = candidate_count;
+    semaphore_handle_t completion_semaphore = platform_semaphore_create(0);
+    for (i32 i = 0; i < candidate_count; ++i) {
+        registration_candidate_task_t task = {
+            .candidate = candidates + i, .tasks_remaining = &tasks_remaining, .completion_semaphore = completion_semaphore,
+        };
+        if (!work_queue_submit_task(&global_work_queue, registration_candidate_task_func, &task, sizeof(task))) {
+            registration_candidate_task_func(0, &task);
+        }
+    }
+    // Help out with the queued work; once nothing is left to start, block until the last candidate signals completion.
+    while (tasks_remaining > 0 && work_queue_is_work_waiting_to_start(&global_work_queue)) {
+        work_queue_do_work(&global_work_queue, 0);
+    }
+    platform_semaphore_wait(completion_semaphore);
+    platform_semaphore_destroy(completion_semaphore);
+    read_barrier;
+    i32 best = 0;
+    for (i32 i = 1; i < candidate_count; ++i) {
+        if (candidates[i].response > candidates[best].response) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Center of mass of the (dark) tissue, in pixel coordinates of the patch.
+static v2f find_tissue_center(registration_patch_t* patch) {
+    double sum_x = 0.0, sum_y = 0.0, total = 0.0;
+    for (i32 y = 0; y < patch->h; ++y) {
+        float* row = patch->pixels + y * patch->w;
+        for (i32 x = 0; x < patch->w; ++x) {
+            float weight = 1.0f - row[x];
+            if (weight > 0.1f) {
+                sum_x += weight * x;
+                sum_y += weight * y;
+                total += weight;
+            }
+        }
+    }
+    if (total < 1.0) {
+        return V2F(patch->w * 0.5f, patch->h * 0.5f);
+    }
+    return V2F((float)(sum_x / total), (float)(sum_y / total));
+}
+
 image_transform_t do_image_registration(image_t* image1, image_t* image2, i32 levels_from_top) {
     image_transform_t result = {};
 
-	if (image1->backend == IMAGE_BACKEND_ISYNTAX || image2->backend == IMAGE_BACKEND_ISYNTAX) {
-		// TODO: implement read_region() for iSyntax backend
-		return result;
-	}
-
     i64 start = get_clock();
 
     i32 thumb_level1 = ATLEAST(0, image1->level_count - levels_from_top - 1);
@@ -285,51 +413,475 @@ image_transform_t do_image_registration(image_t* image1, image_t* image2, i32 le
         console_print("Image registration not possible: number of levels differs (%d vs %d)\n", image1->level_count, image2->level_count);
         return result;
     }
+    i32 coarse_level = thumb_level1;
+    i32 finest_level = ATLEAST(0, coarse_level - image_registration_refinement_levels);
+
+    // Coarse estimate on the whole level, searching over rotation angles
+    level_image_t* level_image1 = image1->level_images + coarse_level;
+    level_image_t* level_image2 = image2->level_images + coarse_level;
+    registration_patch_t fixed = { .w = (i32)level_image1->width_in_pixels, .h = (i32)level_image1->height_in_pixels };
+    registration_patch_t moving = { .w = (i32)level_image2->width_in_pixels, .h = (i32)level_image2->height_in_pixels };
+    image_read_region_request_t* request1 = NULL;
+    image_read_region_request_t* request2 = NULL;
+    bool ok = read_registration_patch(image1, coarse_level, &fixed, &request1);
+    ok = read_registration_patch(image2, coarse_level, &moving, &request2) && ok;
+    if (request1) image_read_region_wait(request1);
+    if (request2) image_read_region_wait(request2);
+    if (!ok) {
+        console_print("Image registration not possible: image_read_region() failed\n");
+        free(fixed.pixels);
+        free(moving.pixels);
+        return result;
+    }
+    i64 clock_after_read = get_clock();
 
-    level_image_t* level_image1 = image1->level_images + thumb_level1;
-    level_image_t* level_image2 = image2->level_images + thumb_level2;
+    preprocess_registration_patch(&fixed, false);
+    preprocess_registration_patch(&moving, true);
+
+    registration_estimate_t estimate = {0};
+    estimate.center = V2F(image2->width_in_pixels * 0.5f, image2->height_in_pixels * 0.5f);
+
+    float max_angle = image_registration_max_rotation_degrees;
+    float angle_step = image_registration_rotation_step_degrees;
+    i32 steps_per_side = (angle_step > 0.0f) ? (i32)(max_angle / angle_step) : 0;
+    registration_candidate_t* candidates = NULL;
+    float best_angle = 0.0f;
+    v2f best_shift = {0};
+    for (i32 pass = 0; pass < 2; ++pass) {
+        arrsetlen(candidates, 0);
+        for (i32 i = -steps_per_side; i <= steps_per_side; ++i) {
+            if (pass > 0 && i == 0) continue; // already evaluated in the first pass
+            registration_candidate_t candidate = { .fixed = &fixed, .moving = &moving, .estimate = estimate };
+            candidate.estimate.rotation = (best_angle + (float)i * angle_step) * (float)(M_PI / 180.0);
+            arrput(candidates, candidate);
+        }
+        if (arrlen(candidates) == 0) break;
+        i32 best = evaluate_registration_candidates(candidates, (i32)arrlen(candidates));
+        if (pass == 0 || candidates[best].response > result.response) {
+            best_angle = candidates[best].estimate.rotation * (float)(180.0 / M_PI);
+            result.response = candidates[best].response;
+            best_shift = v2f_scale(fixed.downsample, candidates[best].residual);
+        }
+        // Second pass: finer steps around the best angle
+        angle_step *= 0.25f;
+        steps_per_side = MIN(steps_per_side, 3);
+    }
+    arrfree(candidates);
+    estimate.rotation = best_angle * (float)(M_PI / 180.0);
+    estimate.shift = best_shift;
+    v2f tissue_center = v2f_scale(level_image1->downsample_factor, find_tissue_center(&fixed)); // level 0
+    free(fixed.pixels);
+    free(moving.pixels);
+    console_print("Image registration: level %d: offset = (%.0f, %.0f), rotation = %.2f degrees, io time = %g seconds, total time = %g seconds\n",
+                  coarse_level, estimate.shift.x, estimate.shift.y, estimate.rotation * (180.0 / M_PI),
+                  get_seconds_elapsed(start, clock_after_read), get_seconds_elapsed(start, get_clock()));
+
+    // Refine on finer levels, using patches around the center of the tissue
+    i32 offset_limit = image_registration_refinement_search_window;
+    for (i32 level = coarse_level - 1; level >= finest_level; --level) {
+        i64 level_start = get_clock();
+        level_image1 = image1->level_images + level;
+        level_image2 = image2->level_images + level;
+        i32 patch_size = image_registration_patch_size;
+        registration_patch_t fixed_patch = { .w = patch_size, .h = patch_size };
+        fixed_patch.origin.x = (i32)(tissue_center.x / level_image1->downsample_factor) - patch_size / 2;
+        fixed_patch.origin.y = (i32)(tissue_center.y / level_image1->downsample_factor) - patch_size / 2;
+
+        // Read a larger patch from image2, to leave room for the rotation and the remaining error of the estimate
+        v2f center_in_image1 = V2F((fixed_patch.origin.x + patch_size / 2) * level_image1->downsample_factor,
+                                   (fixed_patch.origin.y + patch_size / 2) * level_image1->downsample_factor);
+        v2f p = v2f_subtract(v2f_subtract(center_in_image1, estimate.center), estimate.shift);
+        float cos_r = cosf(-estimate.rotation);
+        float sin_r = sinf(-estimate.rotation);
+        v2f center_in_image2 = V2F(cos_r * p.x - sin_r * p.y + estimate.center.x, sin_r * p.x + cos_r * p.y + estimate.center.y);
+        i32 moving_patch_size = patch_size + patch_size / 2;
+        registration_patch_t moving_patch = { .w = moving_patch_size, .h = moving_patch_size };
+        moving_patch.origin.x = (i32)(center_in_image2.x / level_image2->downsample_factor) - moving_patch_size / 2;
+        moving_patch.origin.y = (i32)(center_in_image2.y / level_image2->downsample_factor) - moving_patch_size / 2;
+
+        ok = read_registration_patch(image1, level, &fixed_patch, &request1);
+        ok = read_registration_patch(image2, level, &moving_patch, &request2) && ok;
+        if (request1) image_read_region_wait(request1);
+        if (request2) image_read_region_wait(request2);
+        if (ok) {
+            preprocess_registration_patch(&fixed_patch, false);
+            preprocess_registration_patch(&moving_patch, true);
+            registration_candidate_t candidate = {
+                .fixed = &fixed_patch, .moving = &moving_patch, .estimate = estimate, .offset_limit = offset_limit,
+            };
+            evaluate_registration_candidates(&candidate, 1);
+            // Only accept the correction if the peak is well within the search window
+            bool is_accepted = fabsf(candidate.residual.x) < offset_limit - 1 && fabsf(candidate.residual.y) < offset_limit - 1;
+            if (is_accepted) {
+                estimate.shift = v2f_add(estimate.shift, v2f_scale(fixed_patch.downsample, candidate.residual));
+                result.response = candidate.response;
+            }
+            console_print("Image registration: level %d: offset = (%.1f, %.1f), correction = (%.1f, %.1f)%s, time = %g seconds\n",
+                          level, estimate.shift.x, estimate.shift.y, candidate.residual.x, candidate.residual.y,
+                          is_accepted ? "" : " (rejected)", get_seconds_elapsed(level_start, get_clock()));
+        }
+        free(fixed_patch.pixels);
+        free(moving_patch.pixels);
+        if (!ok) break;
+        offset_limit = ATLEAST(8, offset_limit / 2);
+    }
 
-    i32 w1 = (i32)level_image1->width_in_pixels;
-    i32 h1 = (i32)level_image1->height_in_pixels;
-    i32 w2 = (i32)level_image2->width_in_pixels;
-    i32 h2 = (i32)level_image2->height_in_pixels;
+    // The viewer places images using a translation only. Fold the rotation into the translation by matching up the
+    // tissue center: find where it ends up in image2 under the full transform, and shift image2 so that these coincide.
+    v2f p = v2f_subtract(v2f_subtract(tissue_center, estimate.center), estimate.shift);
+    float cos_r = cosf(-estimate.rotation);
+    float sin_r = sinf(-estimate.rotation);
+    v2f tissue_center_in_image2 = V2F(cos_r * p.x - sin_r * p.y + estimate.center.x, sin_r * p.x + cos_r * p.y + estimate.center.y);
+    v2f pixel_offset = v2f_subtract(tissue_center, tissue_center_in_image2);
+    result.translate = V2F(pixel_offset.x * image2->mpp_x, pixel_offset.y * image2->mpp_y);
+    result.rotation = estimate.rotation;
+    result.is_valid = true;
 
-    float* region1 = calloc(1, w1 * h1 * sizeof(float));
-    float* region2 = calloc(1, w2 * h2 * sizeof(float));
+    console_print("Image registration: level0 pixel offset = (%.0f, %.0f), rotation = %.2f degrees, total time = %g seconds\n",
+                  estimate.shift.x, estimate.shift.y, estimate.rotation * (180.0 / M_PI), get_seconds_elapsed(start, get_clock()));
+    return result;
+}
 
-    bool ok = image_read_region(image1, thumb_level1, 0, 0, w1, h1, region1, PIXEL_FORMAT_F32_Y);
-    ok = ok && image_read_region(image2, thumb_level2, 0, 0, w2, h2, region2, PIXEL_FORMAT_F32_Y);
-    if (!ok) {
-        console_print("Image registration not possible: image_read_region() failed\n");
-        return result;
+// Dense (deformable) registration
+//
+// Local displacements are measured by phase correlation on a regular lattice of patches, on top of the current
+// origin offset of the moving image. The patches are computed incrementally on the worker threads: patches in the
+// visible region are submitted first, the rest is filled in in the background. Each time new measurements come in,
+// the lattice is outlier-filtered and smoothed into the displacement field that the tile shader uses for warping.
+
+typedef struct deformation_patch_task_t {
+    deformation_field_t* field;
+    i32 patch_index;
+} deformation_patch_task_t;
+
+deformation_field_t* deformation_field_create(image_t* fixed_image, image_t* moving_image, i32 level, i32 patch_size, i32 grid_spacing) {
+    level = CLAMP(level, 0, MIN(fixed_image->level_count, moving_image->level_count) - 1);
+    patch_size = ATLEAST(64, patch_size);
+    grid_spacing = ATLEAST(16, grid_spacing);
+    i64 grid_spacing_level0 = (i64)grid_spacing << level;
+
+    deformation_field_t* field = calloc(1, sizeof(deformation_field_t));
+    field->fixed_image = fixed_image;
+    field->moving_image = moving_image;
+    field->level = level;
+    field->patch_size = patch_size;
+    field->grid_spacing = grid_spacing;
+    field->grid_width = (i32)ATLEAST(1, (moving_image->width_in_pixels + grid_spacing_level0 - 1) / grid_spacing_level0);
+    field->grid_height = (i32)ATLEAST(1, (moving_image->height_in_pixels + grid_spacing_level0 - 1) / grid_spacing_level0);
+    field->spacing = V2F(grid_spacing_level0 * moving_image->mpp_x, grid_spacing_level0 * moving_image->mpp_y);
+    i32 patch_count = field->grid_width * field->grid_height;
+    field->measured_displacements = calloc(patch_count, sizeof(v2f));
+    field->responses = calloc(patch_count, sizeof(float));
+    field->patch_states = calloc(patch_count, sizeof(i32));
+    field->displacements = calloc(patch_count, sizeof(v2f));
+    field->is_enabled = true;
+    console_print("Deformable registration: %dx%d grid, spacing %d pixels on level %d, patch size %d\n",
+                  field->grid_width, field->grid_height, grid_spacing, level, patch_size);
+    return field;
+}
+
+// Fade the patch out towards the (white) background near the edges, using a Hann window.
+// Otherwise, tissue that is cut off at the edges of the patch correlates at zero shift, which dominates small patches.
+static void apply_hann_window_to_patch(float* pixels, i32 w, i32 h) {
+    float* window_x = malloc(w * sizeof(float));
+    for (i32 x = 0; x < w; ++x) {
+        window_x[x] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * (float)x / (float)(w - 1));
+    }
+    for (i32 y = 0; y < h; ++y) {
+        float window_y = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * (float)y / (float)(h - 1));
+        float* row = pixels + y * w;
+        for (i32 x = 0; x < w; ++x) {
+            row[x] = 1.0f - (1.0f - row[x]) * window_x[x] * window_y;
+        }
     }
+    free(window_x);
+}
 
-    i64 clock_after_read = get_clock();
+// Read the patches of both images around a grid point, and measure the local displacement.
+static void deformation_patch_task_func(i32 logical_thread_index, void* userdata) {
+    deformation_patch_task_t* task = (deformation_patch_task_t*) userdata;
+    deformation_field_t* field = task->field;
+    image_t* fixed_image = field->fixed_image;
+    image_t* moving_image = field->moving_image;
+    i32 state = DEFORMATION_PATCH_FAILED;
+
+    if (field->is_cancelled || fixed_image->is_deleted || moving_image->is_deleted) {
+        state = DEFORMATION_PATCH_PENDING; // try again later
+        goto done;
+    }
 
-    set_white_level(region1, w1 * h1, 230.0f / 255.0f);
-    set_white_level(region2, w2 * h2, 230.0f / 255.0f);
+    i32 grid_x = task->patch_index % field->grid_width;
+    i32 grid_y = task->patch_index / field->grid_width;
+    i32 level = field->level;
+    i32 patch_size = field->patch_size;
+    float moving_downsample = moving_image->level_images[level].downsample_factor;
+    float fixed_downsample = fixed_image->level_images[level].downsample_factor;
+
+    // Patch centers: the grid point in the moving image, and the same world position in the fixed image
+    float local_x = ((float)grid_x + 0.5f) * field->spacing.x;
+    float local_y = ((float)grid_y + 0.5f) * field->spacing.y;
+    float world_x = local_x + moving_image->origin_offset.x;
+    float world_y = local_y + moving_image->origin_offset.y;
+    i32 moving_x = (i32)(local_x / (moving_image->mpp_x * moving_downsample)) - patch_size / 2;
+    i32 moving_y = (i32)(local_y / (moving_image->mpp_y * moving_downsample)) - patch_size / 2;
+    i32 fixed_x = (i32)((world_x - fixed_image->origin_offset.x) / (fixed_image->mpp_x * fixed_downsample)) - patch_size / 2;
+    i32 fixed_y = (i32)((world_y - fixed_image->origin_offset.y) / (fixed_image->mpp_y * fixed_downsample)) - patch_size / 2;
+    // image_read_region() does not accept negative coordinates, so move both patches inward by the same amount
+    i32 inward_x = ATLEAST(0, -MIN(moving_x, fixed_x));
+    i32 inward_y = ATLEAST(0, -MIN(moving_y, fixed_y));
+    moving_x += inward_x;
+    fixed_x += inward_x;
+    moving_y += inward_y;
+    fixed_y += inward_y;
+
+    i32 pixel_count = patch_size * patch_size;
+    float* fixed_pixels = malloc(pixel_count * sizeof(float));
+    float* moving_pixels = malloc(pixel_count * sizeof(float));
+    image_read_region_request_t* fixed_request = image_read_region_async(fixed_image, level, fixed_x << level, fixed_y << level,
+                                                                         patch_size, patch_size, fixed_pixels, PIXEL_FORMAT_F32_Y, NULL, NULL);
+    image_read_region_request_t* moving_request = image_read_region_async(moving_image, level, moving_x << level, moving_y << level,
+                                                                          patch_size, patch_size, moving_pixels, PIXEL_FORMAT_F32_Y, NULL, NULL);
+    bool ok = (fixed_request != NULL && moving_request != NULL);
+    if (fixed_request) image_read_region_wait(fixed_request);
+    if (moving_request) image_read_region_wait(moving_request);
+
+    if (ok) {
+        // Skip patches without (enough) tissue, phase correlation on the background is meaningless
+        i32 tissue_pixel_count = 0;
+        for (i32 i = 0; i < pixel_count; ++i) {
+            if (fixed_pixels[i] < 0.8f) ++tissue_pixel_count;
+        }
+        if (tissue_pixel_count < pixel_count / 20) {
+            state = DEFORMATION_PATCH_NO_TISSUE;
+        } else {
+            set_white_level(fixed_pixels, pixel_count, 230.0f / 255.0f);
+            set_white_level(moving_pixels, pixel_count, 230.0f / 255.0f);
+            set_black_level(moving_pixels, pixel_count, 150.0f / 255.0f);
+            apply_hann_window_to_patch(fixed_pixels, patch_size, patch_size);
+            apply_hann_window_to_patch(moving_pixels, patch_size, patch_size);
+            buffer2d_t input1 = { .w = patch_size, .h = patch_size, .data = fixed_pixels};
+            buffer2d_t input2 = { .w = patch_size, .h = patch_size, .data = moving_pixels};
+            float response = 0.0f;
+            v2f pixel_shift = phase_correlate(&input1, &input2, NULL, 1.0f, &response, patch_size / 4);
+            field->measured_displacements[task->patch_index] = V2F(pixel_shift.x * moving_image->mpp_x * moving_downsample,
+                                                                   pixel_shift.y * moving_image->mpp_y * moving_downsample);
+            field->responses[task->patch_index] = response;
+            state = DEFORMATION_PATCH_DONE;
+        }
+    }
+    free(fixed_pixels);
+    free(moving_pixels);
+
+    done:
+    write_barrier;
+    field->patch_states[task->patch_index] = state;
+    if (state != DEFORMATION_PATCH_PENDING) {
+        atomic_increment(&field->patches_finished);
+    }
+    image_release(fixed_image, 1);
+    image_release(moving_image, 1);
+    atomic_decrement(&field->patches_in_flight);
+}
 
-    set_black_level(region2, w2 * h2, 150.0f / 255.0f);
+static bool deformation_field_submit_patch(deformation_field_t* field, i32 patch_index) {
+    if (field->patch_states[patch_index] != DEFORMATION_PATCH_PENDING) {
+        return false;
+    }
+    field->patch_states[patch_index] = DEFORMATION_PATCH_SUBMITTED;
+    atomic_increment(&field->fixed_image->refcount); // prevent the images from being destroyed while the task runs
+    atomic_increment(&field->moving_image->refcount);
+    atomic_increment(&field->patches_in_flight);
+    deformation_patch_task_t task = { .field = field, .patch_index = patch_index };
+    if (!work_queue_submit_task(&global_work_queue, deformation_patch_task_func, &task, sizeof(task))) {
+        deformation_patch_task_func(0, &task);
+    }
+    return true;
+}
 
-//    void debug_create_luminance_png(real_t* src, i32 w, i32 h, real_t scale, const char* filename);
-//    debug_create_luminance_png(region1, w1, h1, 1.0f, "thumb1.png");
-//    debug_create_luminance_png(region2, w2, h2, 1.0f, "thumb2.png");
+static int deformation_float_compare(const void* a, const void* b) {
+    float x = *(const float*)a;
+    float y = *(const float*)b;
+    return (x > y) - (x < y);
+}
 
-    buffer2d_t input1 = { .w = w1, .h = h1, .data = region1};
-    buffer2d_t input2 = { .w = w2, .h = h2, .data = region2};
+// Turn the raw measurements into a smooth displacement field:
+// 1. reject measurements with a weak response, or that deviate too much from the median of their neighbours;
+// 2. smooth the remaining measurements (weighted by their response);
+// 3. fill in the gaps (e.g. the background) by repeatedly averaging the neighbours that already have a value.
+static void deformation_field_filter(deformation_field_t* field) {
+    i32 grid_w = field->grid_width;
+    i32 grid_h = field->grid_height;
+    i32 count = grid_w * grid_h;
+    read_barrier;
+
+    float* weights = calloc(count, sizeof(float));
+    for (i32 i = 0; i < count; ++i) {
+        if (field->patch_states[i] == DEFORMATION_PATCH_DONE && field->responses[i] >= image_registration_deformation_min_response) {
+            weights[i] = field->responses[i];
+        }
+    }
 
-    v2f pixel_shift = phase_correlate(&input1, &input2, NULL, 1.0f, &result.response, 0);
-    pixel_shift.x *= image2->mpp_x * level_image2->downsample_factor;
-    pixel_shift.y *= image2->mpp_y * level_image2->downsample_factor;
+    // Median filter for outlier rejection
+    float outlier_threshold = 0.25f * MAX(field->spacing.x, field->spacing.y);
+    bool* is_outlier = calloc(count, sizeof(bool));
+    float neighbours_x[25];
+    float neighbours_y[25];
+    for (i32 y = 0; y < grid_h; ++y) {
+        for (i32 x = 0; x < grid_w; ++x) {
+            i32 index = y * grid_w + x;
+            if (weights[index] == 0.0f) continue;
+            i32 neighbour_count = 0;
+            for (i32 ny = ATLEAST(0, y - 2); ny <= ATMOST(grid_h - 1, y + 2); ++ny) {
+                for (i32 nx = ATLEAST(0, x - 2); nx <= ATMOST(grid_w - 1, x + 2); ++nx) {
+                    i32 neighbour_index = ny * grid_w + nx;
+                    if (weights[neighbour_index] > 0.0f) {
+                        neighbours_x[neighbour_count] = field->measured_displacements[neighbour_index].x;
+                        neighbours_y[neighbour_count] = field->measured_displacements[neighbour_index].y;
+                        ++neighbour_count;
+                    }
+                }
+            }
+            if (neighbour_count >= 4) {
+                qsort(neighbours_x, neighbour_count, sizeof(float), deformation_float_compare);
+                qsort(neighbours_y, neighbour_count, sizeof(float), deformation_float_compare);
+                v2f median = V2F(neighbours_x[neighbour_count / 2], neighbours_y[neighbour_count / 2]);
+                v2f d = field->measured_displacements[index];
+                if (fabsf(d.x - median.x) > outlier_threshold || fabsf(d.y - median.y) > outlier_threshold) {
+                    is_outlier[index] = true;
+                }
+            }
+        }
+    }
+    for (i32 i = 0; i < count; ++i) {
+        if (is_outlier[i]) weights[i] = 0.0f;
+    }
 
-    result.translate = pixel_shift;
-    result.is_valid = true;
+    // Weighted smoothing (3x3 binomial kernel)
+    bool* is_filled = calloc(count, sizeof(bool));
+    i32 filled_count = 0;
+    for (i32 y = 0; y < grid_h; ++y) {
+        for (i32 x = 0; x < grid_w; ++x) {
+            v2f sum = {};
+            float total_weight = 0.0f;
+            for (i32 dy = -1; dy <= 1; ++dy) {
+                i32 ny = y + dy;
+                if (ny < 0 || ny >= grid_h) continue;
+                for (i32 dx = -1; dx <= 1; ++dx) {
+                    i32 nx = x + dx;
+                    if (nx < 0 || nx >= grid_w) continue;
+                    i32 neighbour_index = ny * grid_w + nx;
+                    float kernel = (float)((2 - abs(dx)) * (2 - abs(dy)));
+                    float weight = kernel * weights[neighbour_index];
+                    sum.x += weight * field->measured_displacements[neighbour_index].x;
+                    sum.y += weight * field->measured_displacements[neighbour_index].y;
+                    total_weight += weight;
+                }
+            }
+            i32 index = y * grid_w + x;
+            if (total_weight > 0.0f) {
+                field->displacements[index] = V2F(sum.x / total_weight, sum.y / total_weight);
+                is_filled[index] = true;
+                ++filled_count;
+            } else {
+                field->displacements[index] = V2F(0.0f, 0.0f);
+            }
+        }
+    }
 
-    console_print("Image registration (on level %d): level0 pixel offset = (%.0f, %.0f), io time = %g seconds, processing time = %g seconds\n",
-                  thumb_level1, pixel_shift.x / image2->mpp_x, pixel_shift.y / image2->mpp_y,
-                  get_seconds_elapsed(start, clock_after_read), get_seconds_elapsed(clock_after_read, get_clock()));
+    // Fill the gaps
+    if (filled_count > 0) {
+        bool* was_filled = calloc(count, sizeof(bool));
+        while (filled_count < count) {
+            memcpy(was_filled, is_filled, count * sizeof(bool));
+            i32 newly_filled = 0;
+            for (i32 y = 0; y < grid_h; ++y) {
+                for (i32 x = 0; x < grid_w; ++x) {
+                    i32 index = y * grid_w + x;
+                    if (was_filled[index]) continue;
+                    v2f sum = {};
+                    i32 neighbour_count = 0;
+                    if (x > 0 && was_filled[index - 1]) { sum = v2f_add(sum, field->displacements[index - 1]); ++neighbour_count; }
+                    if (x < grid_w - 1 && was_filled[index + 1]) { sum = v2f_add(sum, field->displacements[index + 1]); ++neighbour_count; }
+                    if (y > 0 && was_filled[index - grid_w]) { sum = v2f_add(sum, field->displacements[index - grid_w]); ++neighbour_count; }
+                    if (y < grid_h - 1 && was_filled[index + grid_w]) { sum = v2f_add(sum, field->displacements[index + grid_w]); ++neighbour_count; }
+                    if (neighbour_count > 0) {
+                        field->displacements[index] = V2F(sum.x / neighbour_count, sum.y / neighbour_count);
+                        is_filled[index] = true;
+                        ++newly_filled;
+                    }
+                }
+            }
+            if (newly_filled == 0) break;
+            filled_count += newly_filled;
+        }
+        free(was_filled);
+    }
 
-    free(region1);
-    free(region2);
-    return result;
+    float max_displacement_sq = 0.0f;
+    for (i32 i = 0; i < count; ++i) {
+        v2f d = field->displacements[i];
+        max_displacement_sq = MAX(max_displacement_sq, d.x * d.x + d.y * d.y);
+    }
+    field->max_displacement = sqrtf(max_displacement_sq);
+    ++field->generation;
+
+    free(weights);
+    free(is_outlier);
+    free(is_filled);
+}
+
+// Called once per frame (main thread). Keeps a limited number of patch tasks in flight, so that the patches in the
+// visible region (in world coordinates) can take precedence over the rest whenever the view changes.
+void deformation_field_update(deformation_field_t* field, bounds2f visible_bounds) {
+    if (field->is_cancelled || field->fixed_image->is_deleted || field->moving_image->is_deleted) {
+        return;
+    }
+    i32 patch_count = field->grid_width * field->grid_height;
+    i32 max_patches_in_flight = ATLEAST(2, global_active_worker_thread_count);
+
+    if (field->patches_in_flight < max_patches_in_flight) {
+        // Visible region first
+        v2f origin = field->moving_image->origin_offset;
+        i32 min_x = ATLEAST(0, (i32)floorf((visible_bounds.left - origin.x) / field->spacing.x));
+        i32 min_y = ATLEAST(0, (i32)floorf((visible_bounds.top - origin.y) / field->spacing.y));
+        i32 max_x = ATMOST(field->grid_width - 1, (i32)floorf((visible_bounds.right - origin.x) / field->spacing.x));
+        i32 max_y = ATMOST(field->grid_height - 1, (i32)floorf((visible_bounds.bottom - origin.y) / field->spacing.y));
+        for (i32 y = min_y; y <= max_y && field->patches_in_flight < max_patches_in_flight; ++y) {
+            for (i32 x = min_x; x <= max_x && field->patches_in_flight < max_patches_in_flight; ++x) {
+                deformation_field_submit_patch(field, y * field->grid_width + x);
+            }
+        }
+        // Then the rest of the slide, in the background
+        while (field->next_background_patch < patch_count && field->patches_in_flight < max_patches_in_flight) {
+            deformation_field_submit_patch(field, field->next_background_patch++);
+        }
+    }
+
+    i32 patches_finished = field->patches_finished;
+    if (patches_finished != field->patches_filtered) {
+        field->patches_filtered = patches_finished;
+        deformation_field_filter(field);
+        if (patches_finished == patch_count) {
+            console_print("Deformable registration: all %d patches done, max displacement = %g um\n", patch_count, field->max_displacement);
+        }
+    }
+}
+
+void deformation_field_destroy(deformation_field_t* field) {
+    field->is_cancelled = true;
+    while (field->patches_in_flight > 0) {
+        if (work_queue_is_work_waiting_to_start(&global_work_queue)) {
+            work_queue_do_work(&global_work_queue, 0);
+        } else {
+            platform_sleep(1);
+        }
+    }
+    if (field->texture) {
+        unload_texture(field->texture);
+    }
+    free(field->measured_displacements);
+    free(field->responses);
+    free((void*)field->patch_states);
+    free(field->displacements);
+    free(field);
 }
@@ -34,11 +34,51 @@ typedef enum image_register_preprocess_method_enum {
 typedef struct image_transform_t {
     bool is_valid;
     v2f translate;
+    float rotation; // in radians, around the center of image2 (already folded into translate around the tissue center)
     float response;
 } image_transform_t;
 
+typedef enum deformation_patch_state_enum {
+    DEFORMATION_PATCH_PENDING = 0,
+    DEFORMATION_PATCH_SUBMITTED = 1,
+    DEFORMATION_PATCH_DONE = 2,
+    DEFORMATION_PATCH_NO_TISSUE = 3,
+    DEFORMATION_PATCH_FAILED = 4,
+} deformation_patch_state_enum;
+
+// Dense (deformable) registration of image2 (moving) onto image1 (fixed).
+// Grid point (i, j) lies at ((i + 0.5) * spacing.x, (j + 0.5) * spacing.y) in the coordinate space of the moving image
+// (in um, relative to its origin offset). The displacements are in um, on top of the origin offset of the moving image.
+typedef struct deformation_field_t {
+    image_t* fixed_image;
+    image_t* moving_image;
+    i32 level; // level on which the patches are compared
+    i32 patch_size; // in pixels of that level
+    i32 grid_spacing; // in pixels of that level
+    i32 grid_width;
+    i32 grid_height;
+    v2f spacing; // in um
+    v2f* measured_displacements; // raw phase correlation results (written by the worker threads)
+    float* responses;
+    volatile i32* patch_states;
+    volatile i32 patches_in_flight;
+    volatile i32 patches_finished;
+    i32 next_background_patch; // where to continue scanning for patches outside the visible region
+    i32 patches_filtered; // value of patches_finished when the field was last filtered
+    v2f* displacements; // outlier-filtered and smoothed field (main thread only)
+    float max_displacement; // in um
+    u32 generation; // incremented whenever the filtered field changes
+    u32 texture;
+    u32 texture_generation;
+    bool is_enabled;
+    volatile bool is_cancelled;
+} deformation_field_t;
+
 image_transform_t do_image_registration(image_t* image1, image_t* image2, i32 levels_from_top);
 image_transform_t do_local_image_registration(image_t* image1, image_t* image2, v2f center_point, i32 level, i32 patch_width, image_register_preprocess_method_enum preprocess_method);
+deformation_field_t* deformation_field_create(image_t* fixed_image, image_t* moving_image, i32 level, i32 patch_size, i32 grid_spacing);
+void deformation_field_update(deformation_field_t* field, bounds2f visible_bounds);
+void deformation_field_destroy(deformation_field_t* field);
 
 #ifdef __cplusplus
 }
@@ -509,6 +509,16 @@ u8* download_remote_caselist(const char* hostname, i32 portno, const char* filen
 	char uri[2048];
 	snprintf(uri, sizeof(uri), "/slide_set/%s", filename);
 	u8* read_buffer = do_http_request(hostname, portno, uri, bytes_read, 0);
+	if (read_buffer && bytes_read && *bytes_read > 4) {
+		// Strip the HTTP headers, so that only the JSON remains
+		i64 content_offset = find_end_of_http_headers(read_buffer, *bytes_read);
+		if (content_offset > 0) {
+			i32 content_length = *bytes_read - (i32)content_offset;
+			memmove(read_buffer, read_buffer + content_offset, content_length);
+			read_buffer[content_length] = '\0';
+			*bytes_read = content_length;
+		}
+	}
 	return read_buffer;
 }
 
@@ -544,6 +554,8 @@ bool open_remote_slide(app_state_t *app_state, const char *hostname, i32 portno,
 
 			unload_all_images(app_state);
 			image_t* image = (image_t*)calloc(1, sizeof(image_t));
+			image->lock = benaphore_create();
+			image->release_semaphore = platform_semaphore_create(0);
 			bool is_valid = init_image_from_tiff(image, tiff, false, NULL);
 			add_image(app_state, image, true, false);
 			success = is_valid;
@@ -51,6 +51,7 @@
 #include "dicom.h"
 #include "dicom_wsi.h"
 #include "jpeg_decoder.h"
+#include "pixel_convert.h"
 #include "remote.h"
 #include "gui.h"
 #include "caselist.h"
@@ -58,8 +59,11 @@
 #include "shader.h"
 #include "ini.h"
 #include "image_registration.h"
+#include "triangulate.h"
 
 #include "viewer_opengl.cpp"
+#include "viewer_opengl_tiles.cpp"
+#include "viewer_opengl_annotations.cpp"
 #include "viewer_io_file.cpp"
 #include "viewer_io_remote.cpp"
 #include "viewer_options.cpp"
@@ -114,6 +118,14 @@ void unload_all_images(app_state_t *app_state) {
 	i32 current_image_count = arrlen(app_state->loaded_images);
 	if (current_image_count > 0) {
 		ASSERT(app_state->loaded_images);
+		// Deformation fields refer to the base image, so stop them before destroying any of the images
+		for (i32 i = 0; i < current_image_count; ++i) {
+			image_t* old_image = app_state->loaded_images[i];
+			if (old_image->deformation_field) {
+				deformation_field_destroy(old_image->deformation_field);
+				old_image->deformation_field = NULL;
+			}
+		}
 		for (i32 i = 0; i < current_image_count; ++i) {
 			image_t* old_image = app_state->loaded_images[i];
 			image_destroy(old_image);
@@ -228,9 +240,10 @@ void request_tiles(image_t* image, load_tile_task_t* wishlist, i32 tiles_to_load
 	}
 
 	if (tiles_to_load > 0){
-		if (image->backend == IMAGE_BACKEND_TIFF && image->tiff.is_remote) {
+		if (image->backend == IMAGE_BACKEND_TIFF && image->tiff.is_remote && image->tiff.main_image_ifd->is_tiled) {
 			// For remote slides, only send out a batch request every so often, instead of single tile requests every frame.
 			// (to reduce load on the server)
+			// NOTE: stripped images are loaded one virtual tile at a time below (tiff_decode_tile() reads the strips remotely).
 			static u32 intermittent = 0;
 			++intermittent;
 			u32 intermittent_interval = 1;
@@ -239,6 +252,12 @@ void request_tiles(image_t* image, load_tile_task_t* wishlist, i32 tiles_to_load
 				load_tile_task_batch_t batch = {};
 				batch.task_count = ATMOST(COUNT(batch.tile_tasks), tiles_to_load);
 				memcpy(batch.tile_tasks, wishlist, batch.task_count * sizeof(load_tile_task_t));
+				// Retain before submitting: the task may already be done before work_queue_submit_task() returns
+				i32 refcount_increment = 0;
+				for (i32 i = 0; i < batch.task_count; ++i) {
+					refcount_increment += batch.tile_tasks[i].refcount_to_decrement;
+				}
+				atomic_add(&image->refcount, refcount_increment);
 				if (work_queue_submit_task(&global_work_queue, tiff_load_tile_batch_func, &batch, sizeof(batch))) {
 					// success
 					for (i32 i = 0; i < batch.task_count; ++i) {
@@ -247,8 +266,9 @@ void request_tiles(image_t* image, load_tile_task_t* wishlist, i32 tiles_to_load
 						tile->is_submitted_for_loading = true;
 						tile->need_gpu_residency = task->need_gpu_residency;
 						tile->need_keep_in_cache = task->need_keep_in_cache;
-                        atomic_add(&image->refcount, task->refcount_to_decrement);
 					}
+				} else {
+					atomic_subtract(&image->refcount, refcount_increment);
 				}
 			}
 		} else {
@@ -266,13 +286,15 @@ void request_tiles(image_t* image, load_tile_task_t* wishlist, i32 tiles_to_load
 						tile->need_keep_in_cache = task.need_keep_in_cache;
 					}
 				} else {
+					atomic_add(&image->refcount, task.refcount_to_decrement); // retain before the task can run
 					if (work_queue_submit_task(&global_work_queue, load_tile_func, &task, sizeof(task))) {
 						// TODO: should we even allow this to fail?
 						// success
 						tile->is_submitted_for_loading = true;
 						tile->need_gpu_residency = task.need_gpu_residency;
 						tile->need_keep_in_cache = task.need_keep_in_cache;
-                        atomic_add(&image->refcount, task.refcount_to_decrement);
+					} else {
+						atomic_subtract(&image->refcount, task.refcount_to_decrement);
 					}
 				}
 			}
@@ -313,6 +335,7 @@ void viewer_process_completion_queue(app_state_t* app_state) {
 				finalize_texture_upload_using_pbo(transfer_state);
 				tile_t* tile = (tile_t*) transfer_state->userdata;  // TODO: think of something more elegant?
 				tile->texture = transfer_state->texture;
+				notify_tile_texture_changed(tile);
 			}
 			float time_elapsed = get_seconds_elapsed(app_state->last_frame_start, get_clock());
 			if (time_elapsed > max_texture_load_time) {
@@ -330,9 +353,12 @@ void viewer_process_completion_queue(app_state_t* app_state) {
 //	last_section = profiler_end_section(last_section, "viewer_update_and_render: texture finalization", 7.0f);
 #endif
 
+	tile_upload_ring_reclaim();
+
 	// Retrieve completed tasks from the worker threads
 	i32 pixel_transfer_index_start = app_state->next_pixel_transfer_to_submit;
 	while (work_queue_is_work_in_progress(&global_completion_queue)) {
+		i32 pixel_transfer_index_before = app_state->next_pixel_transfer_to_submit;
 		work_queue_entry_t entry = work_queue_get_next_entry(&global_completion_queue);
 		if (entry.is_valid) {
 //			if (!entry.callback) fatal_error();
@@ -341,10 +367,13 @@ void viewer_process_completion_queue(app_state_t* app_state) {
 			// TODO(pvalkema): fix assumption here that isyntax_streamer_tile_completed_task_t has the same layout as viewer_notify_tile_completed_task_t
 			if (entry.callback == viewer_notify_load_tile_completed || entry.task_identifier == VIEWER_ISYNTAX_TILE_COMPLETION_TASK_IDENTIFIER) {
 				viewer_notify_tile_completed_task_t* task = (viewer_notify_tile_completed_task_t*) entry.userdata;
+				// Tiles from the iSyntax streamer are never staged in the upload ring
+				i32 ring_region = (entry.callback == viewer_notify_load_tile_completed) ? task->upload_ring_region : 0;
 				image_t* image = get_image_from_resource_id(app_state, task->resource_id);
 				if (!image) {
 					// Image doesn't exist anymore (was unloaded?)
 					if (task->pixel_memory) free(task->pixel_memory);
+					if (ring_region) tile_upload_ring_release(ring_region, false);
 				} else {
 					// Upload the tile to the GPU
 					tile_t* tile = get_tile_from_tile_index(image, task->scale, task->tile_index);
@@ -354,12 +383,13 @@ void viewer_process_completion_queue(app_state_t* app_state) {
 					if (task->pixel_memory) {
 						bool need_free_pixel_memory = true;
 						if (task->want_gpu_residency) {
-							pixel_transfer_state_t* transfer_state =
-									submit_texture_upload_via_pbo(app_state, task->tile_width, task->tile_height,
-									                              4, task->pixel_memory, finalize_textures_immediately);
 							if (finalize_textures_immediately) {
-								tile->texture = transfer_state->texture;
+								upload_tile_texture(app_state, tile, task->tile_width, task->tile_height, task->pixel_memory, ring_region);
+								ring_region = 0;
 							} else {
+								pixel_transfer_state_t* transfer_state =
+										submit_texture_upload_via_pbo(app_state, task->tile_width, task->tile_height,
+										                              4, task->pixel_memory, false);
 								transfer_state->userdata = (void*) tile;
 								tile->is_submitted_for_loading = true; // stuff still needs to happen, don't resubmit!
 							}
@@ -376,6 +406,7 @@ void viewer_process_completion_queue(app_state_t* app_state) {
 						// TODO: handle possible I/O errors? Don't just assume the tile was empty!
 						tile->is_empty = true; // failed; don't resubmit!
 					}
+					if (ring_region) tile_upload_ring_release(ring_region, false); // not used
 				}
 
 			} else if (entry.callback == viewer_upload_already_cached_tile_to_gpu) {
@@ -388,13 +419,7 @@ void viewer_process_completion_queue(app_state_t* app_state) {
 					tile->is_submitted_for_loading = false;
 					if (tile->is_cached && tile->pixels) {
 						if (tile->need_gpu_residency) {
-							pixel_transfer_state_t* transfer_state = submit_texture_upload_via_pbo(app_state,
-							                                                                       task->image->tile_width,
-							                                                                       task->image->tile_height,
-							                                                                       4,
-							                                                                       tile->pixels,
-							                                                                       finalize_textures_immediately);
-							tile->texture = transfer_state->texture;
+							upload_tile_texture(app_state, tile, task->image->tile_width, task->image->tile_height, tile->pixels, 0);
 						} else {
 							ASSERT(!"viewer_only_upload_cached_tile() called but !tile->need_gpu_residency\n");
 						}
@@ -416,7 +441,9 @@ void viewer_process_completion_queue(app_state_t* app_state) {
 			break;
 		}
 
-		if (pixel_transfer_index_start == app_state->next_pixel_transfer_to_submit) {
+		// Uploads via the upload ring don't use up any of the pixel transfer states
+		if (pixel_transfer_index_before != app_state->next_pixel_transfer_to_submit &&
+		    pixel_transfer_index_start == app_state->next_pixel_transfer_to_submit) {
 //				console_print("Warning: not enough PBO's to do all the pixel transfers\n");
 			break;
 		}
@@ -435,6 +462,11 @@ void update_and_render_image(app_state_t* app_state, image_t* image) {
 
 		// IO
 
+		// Continue computing the deformation field (if any) in the background, visible region first
+		if (image->deformation_field) {
+			deformation_field_update(image->deformation_field, scene->camera_bounds);
+		}
+
 		benaphore_lock(&image->lock);
 
 		// Upload macro and label images (just-in-time)
@@ -480,6 +512,16 @@ void update_and_render_image(app_state_t* app_state, image_t* image) {
             }
         }
 
+		// Tiles may be displaced by a deformation field, so we may need to look a bit beyond the edges of the screen
+		bounds2f tile_camera_bounds = scene->camera_bounds;
+		if (image->deformation_field && image->deformation_field->is_enabled) {
+			float margin = image->deformation_field->max_displacement;
+			tile_camera_bounds.left -= margin;
+			tile_camera_bounds.top -= margin;
+			tile_camera_bounds.right += margin;
+			tile_camera_bounds.bottom += margin;
+		}
+
         // Start pulling image data from the WSI
 		if (image->backend == IMAGE_BACKEND_ISYNTAX) {
 			isyntax_t* isyntax = &image->isyntax;
@@ -498,7 +540,7 @@ void update_and_render_image(app_state_t* app_state, image_t* image) {
 			} else if (wsi->first_load_complete) {
 				tile_streamer.origin_offset = image->origin_offset; // TODO: superfluous?
 				if (!scene->restrict_load_bounds) {
-					tile_streamer.camera_bounds = scene->camera_bounds;
+					tile_streamer.camera_bounds = tile_camera_bounds;
 				} else {
 					tile_streamer.camera_bounds = scene->tile_load_bounds;
 				}
@@ -518,6 +560,7 @@ void update_and_render_image(app_state_t* app_state, image_t* image) {
 				ASSERT(level_image->tiles && level_image->tile_count > 0);
 				tile_t* tile = level_image->tiles + 0;
 				tile->texture = image->simple.texture;
+				notify_tile_texture_changed(tile);
 			}
 
 		} else {
@@ -533,13 +576,10 @@ void update_and_render_image(app_state_t* app_state, image_t* image) {
 				if (!drawn_level->exists) {
 					continue; // no image data
 				}
-				if (drawn_level->needs_indexing) {
-					continue;
-				}
 
 				bounds2i level_tiles_bounds = BOUNDS2I(0, 0, (i32)drawn_level->width_in_tiles, (i32)drawn_level->height_in_tiles);
 
-				bounds2i visible_tiles = world_bounds_to_tile_bounds(&scene->camera_bounds, drawn_level->x_tile_side_in_um,
+				bounds2i visible_tiles = world_bounds_to_tile_bounds(&tile_camera_bounds, drawn_level->x_tile_side_in_um,
 				                                                     drawn_level->y_tile_side_in_um, image->origin_offset);
 				visible_tiles = clip_bounds2i(visible_tiles, level_tiles_bounds);
 
@@ -557,10 +597,12 @@ void update_and_render_image(app_state_t* app_state, image_t* image) {
 					for (i32 tile_x = visible_tiles.min.x; tile_x < visible_tiles.max.x; ++tile_x) {
 
 						tile_t* tile = get_tile(drawn_level, tile_x, tile_y);
-                        // TODO: check that the file offset is actually known (level might need indexing)
 						if (tile->texture != 0 || tile->is_empty || tile->is_submitted_for_loading) {
 							continue; // nothing needs to be done with this tile
 						}
+						if (drawn_level->needs_indexing && !is_tile_offset_known(image, scale, tile_y * drawn_level->width_in_tiles + tile_x)) {
+							continue; // level is still being indexed, and the file offset of this tile is not yet known
+						}
 
 						float tile_distance_from_center_of_screen_x =
 								(scene->camera.x - ((tile_x + 0.5f) * drawn_level->x_tile_side_in_um)) / drawn_level->um_per_pixel_x;
@@ -612,30 +654,8 @@ void update_and_render_image(app_state_t* app_state, image_t* image) {
 //		last_section = profiler_end_section(last_section, "viewer_update_and_render: load tiles", 5.0f);
 
 		// RENDERING
-		mat4x4 projection = {};
-		{
-			float l = -0.5f * scene->r_minus_l;
-			float r = +0.5f * scene->r_minus_l;
-			float b = +0.5f * scene->t_minus_b;
-			float t = -0.5f * scene->t_minus_b;
-			float n = 100.0f;
-			float f = -100.0f;
-			mat4x4_ortho(projection, l, r, b, t, n, f);
-		}
-
-		mat4x4 I;
-		mat4x4_identity(I);
-
-		// define view matrix
-		mat4x4 view_matrix;
-		mat4x4_rotate_Z(view_matrix, I, scene->rotation);
-		mat4x4_translate_in_place(view_matrix,
-		                          -scene->camera.x + image->origin_offset.x,
-		                          -scene->camera.y + image->origin_offset.y,
-		                          0.0f);
-
 		mat4x4 projection_view_matrix;
-		mat4x4_mul(projection_view_matrix, projection, view_matrix);
+		get_projection_view_matrix(scene, image->origin_offset, projection_view_matrix);
 
 		glUseProgram(basic_shader.program);
 		glActiveTexture(GL_TEXTURE0);
@@ -744,6 +764,9 @@ void update_and_render_image(app_state_t* app_state, image_t* image) {
 
 		// Draw tiles
 		// Draw all levels within the viewport, up to the current zoom factor
+		i64 tile_rendering_start = get_clock();
+		tile_shader_set_uniforms(app_state, scene, projection_view_matrix);
+		tile_shader_set_deformation_field(image->deformation_field);
 		i32 lowest_level_to_draw = ATLEAST(lowest_visible_scale, global_lowest_scale_to_render);
 		i32 highest_level_to_draw = ATMOST(highest_visible_scale, global_highest_scale_to_render);
 		for (i32 level = lowest_level_to_draw; level <= highest_level_to_draw; ++level) {
@@ -754,7 +777,7 @@ void update_and_render_image(app_state_t* app_state, image_t* image) {
 
 			bounds2i level_tiles_bounds = BOUNDS2I(0, 0, (i32)drawn_level->width_in_tiles, (i32)drawn_level->height_in_tiles);
 
-			bounds2i visible_tiles = world_bounds_to_tile_bounds(&scene->camera_bounds, drawn_level->x_tile_side_in_um,
+			bounds2i visible_tiles = world_bounds_to_tile_bounds(&tile_camera_bounds, drawn_level->x_tile_side_in_um,
 			                                                     drawn_level->y_tile_side_in_um, image->origin_offset);
 			visible_tiles = clip_bounds2i(visible_tiles, level_tiles_bounds);
 
@@ -765,37 +788,15 @@ void update_and_render_image(app_state_t* app_state, image_t* image) {
 				visible_tiles = clip_bounds2i(visible_tiles, crop_tile_bounds);
 			}
 
-			i32 missing_tiles_on_this_level = 0;
-			for (i32 tile_y = visible_tiles.min.y; tile_y < visible_tiles.max.y; ++tile_y) {
-				for (i32 tile_x = visible_tiles.min.x; tile_x < visible_tiles.max.x; ++tile_x) {
-
-					tile_t *tile = get_tile(drawn_level, tile_x, tile_y);
-					if (tile->texture) {
-						tile->time_last_drawn = app_state->frame_counter;
-						u32 texture = get_texture_for_tile(image, level, tile_x, tile_y);
-
-						float tile_pos_x = drawn_level->origin_offset.x + drawn_level->x_tile_side_in_um * tile_x;
-						float tile_pos_y = drawn_level->origin_offset.y + drawn_level->y_tile_side_in_um * tile_y;
-
-						// define model matrix
-						mat4x4 model_matrix;
-						mat4x4_translate(model_matrix, tile_pos_x, tile_pos_y, 0.0f);
-						mat4x4_scale_aniso(model_matrix, model_matrix, drawn_level->x_tile_side_in_um,
-						                   drawn_level->y_tile_side_in_um, 1.0f);
-						glUniformMatrix4fv(basic_shader.u_model_matrix, 1, GL_FALSE, &model_matrix[0][0]);
-
-						draw_rect(texture);
-					} else {
-						++missing_tiles_on_this_level;
-					}
-				}
-			}
+			i32 missing_tiles_on_this_level = draw_level_tiles(app_state, drawn_level, visible_tiles);
 
 			if (missing_tiles_on_this_level == 0) {
 				break; // don't need to bother drawing the next level, there are no gaps left to fill in!
 			}
 
 		}
+		glUseProgram(basic_shader.program);
+		tile_render_stats_update(app_state, get_seconds_elapsed(tile_rendering_start, get_clock()));
 
 		// restore OpenGL state
 		glDisable(GL_STENCIL_TEST);
@@ -1091,6 +1092,10 @@ void viewer_update_and_render(app_state_t *app_state, input_t *input, i32 client
 	ASSERT(scene->initialized);
 	annotation_set_t* annotation_set = &scene->annotation_set;
 
+	// Pick up annotations that have been loaded in the background
+	update_loading_asap_xml_annotations(annotation_set);
+	update_loading_coco_annotations(annotation_set);
+
 	// Note: could be changed to allow e.g. multiple scenes side by side
 	{
 		rect2f old_viewport = scene->viewport;
@@ -1848,6 +1853,8 @@ void viewer_update_and_render(app_state_t *app_state, input_t *input, i32 client
 		glBindVertexArray(0);
 	}
 
+	// Annotations are drawn on top of the image layers
+	draw_annotations_using_gpu_buffers(app_state, scene);
 
 	do_after_scene_render(app_state, input);
 }
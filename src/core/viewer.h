@@ -124,6 +124,7 @@ typedef struct viewer_notify_tile_completed_task_t {
 	bool want_gpu_residency;
 	bool is_empty; // TODO: check this value
 	bool failed;
+	i32 upload_ring_region; // copy of pixel_memory staged for upload by the worker thread (0 if none)
 } viewer_notify_tile_completed_task_t;
 
 
@@ -368,6 +369,7 @@ void add_image(app_state_t* app_state, image_t* image, bool need_zoom_reset, boo
 void unload_all_images(app_state_t* app_state);
 bool load_generic_file(app_state_t* app_state, const char* filename, u32 filetype_hint);
 image_t* load_image_from_file(app_state_t* app_state, file_info_t* file, directory_info_t* directory, u32 filetype_hint);
+u8* decode_tile_to_bgra(i32 logical_thread_index, image_t* image, i32 level, i32 tile_x, i32 tile_y, bool* is_empty_ptr);
 void load_tile_func(i32 logical_thread_index, void* userdata);
 void load_openslide_wsi(wsi_t* wsi, const char* filename);
 void unload_openslide_wsi(wsi_t* wsi);
@@ -389,6 +391,21 @@ void unload_texture(u32 texture);
 void init_opengl_stuff(app_state_t* app_state);
 void upload_tile_on_worker_thread(image_t* image, void* tile_pixels, i32 scale, i32 tile_index, i32 tile_width, i32 tile_height);
 
+// viewer_opengl_annotations.cpp
+void init_annotation_shader();
+
+// viewer_opengl_tiles.cpp
+void init_tile_rendering();
+void upload_tile_texture(app_state_t* app_state, tile_t* tile, i32 width, i32 height, u8* pixels, i32 ring_region);
+i32 tile_upload_ring_stage(u8* pixels, i32 width, i32 height);
+void tile_upload_ring_release(i32 ring_region, bool need_fence);
+void tile_upload_ring_reclaim();
+void unload_tile_texture(tile_t* tile);
+void notify_tile_texture_changed(tile_t* tile);
+void tile_texture_pool_get_usage(i64* allocated_bytes, i64* used_bytes);
+void level_draw_cache_destroy(level_draw_cache_t* cache);
+void tile_shader_set_deformation_field(deformation_field_t* field);
+
 // viewer_io_file.cpp
 const char* get_active_directory(app_state_t* app_state);
 const char* get_annotation_directory(app_state_t* app_state);
@@ -450,6 +467,19 @@ extern i32 desired_window_height INIT(= 720);
 extern bool draw_macro_image_in_background INIT(= false);
 extern bool draw_label_image_in_background INIT(= false);
 extern bool debug_draw_isyntax_valid_data_envelopes INIT(= false);
+extern bool tile_rendering_use_instancing INIT(= true);
+extern bool tile_rendering_log_stats INIT(= false);
+extern bool tile_upload_use_persistent_ring INIT(= true);
+extern i32 tile_texture_pool_budget_in_mb INIT(= 1024); // GPU memory for image tiles; least recently drawn tiles get evicted
+extern i32 image_registration_refinement_levels INIT(= 3); // number of levels below the coarse level used for refinement
+extern i32 image_registration_patch_size INIT(= 1024);
+extern i32 image_registration_refinement_search_window INIT(= 64); // in pixels, halved on each finer level
+extern float image_registration_max_rotation_degrees INIT(= 10.0f);
+extern float image_registration_rotation_step_degrees INIT(= 2.0f);
+extern i32 image_registration_deformation_level INIT(= 2);
+extern i32 image_registration_deformation_patch_size INIT(= 512);
+extern i32 image_registration_deformation_grid_spacing INIT(= 256); // in pixels of the deformation level
+extern float image_registration_deformation_min_response INIT(= 0.01f);
 
 
 extern i32 global_next_resource_id INIT(= 1000);
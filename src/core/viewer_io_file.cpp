@@ -26,23 +26,22 @@ void viewer_upload_already_cached_tile_to_gpu(int logical_thread_index, void* us
 
 void viewer_notify_load_tile_completed(int logical_thread_index, void* userdata) {
 	viewer_notify_tile_completed_task_t* task = (viewer_notify_tile_completed_task_t*)userdata;
-	work_queue_submit_task(&global_completion_queue, viewer_notify_load_tile_completed, task, sizeof(*task));
+	if (task->pixel_memory && task->want_gpu_residency) {
+		// Copy the pixels into the upload ring now, so that the main thread doesn't have to.
+		task->upload_ring_region = tile_upload_ring_stage(task->pixel_memory, task->tile_width, task->tile_height);
+	}
+	if (!work_queue_submit_task(&global_completion_queue, viewer_notify_load_tile_completed, task, sizeof(*task))) {
+		// The completion queue overflowed, so the main thread will never see this tile.
+		// Give back the ring region, otherwise it would block all later regions from being reclaimed.
+		if (task->upload_ring_region) tile_upload_ring_release(task->upload_ring_region, false);
+		if (task->pixel_memory) free(task->pixel_memory);
+	}
 }
 
 
-void load_tile_func(i32 logical_thread_index, void* userdata) {
-	load_tile_task_t* task = (load_tile_task_t*) userdata;
-	image_t* image = task->image;
-
-	if (image->is_deleted) {
-		// Early out to save time if the image was already closed/waiting for destruction
-		atomic_subtract(&image->refcount, task->refcount_to_decrement);
-		return;
-	}
-
-	i32 level = task->level;
-	i32 tile_x = task->tile_x;
-	i32 tile_y = task->tile_y;
+// Decode a single tile into a (malloc'ed) BGRA buffer of tile_width * tile_height pixels.
+// Returns NULL if the tile could not be loaded. Safe to call concurrently from multiple threads.
+u8* decode_tile_to_bgra(i32 logical_thread_index, image_t* image, i32 level, i32 tile_x, i32 tile_y, bool* is_empty_ptr) {
 	level_image_t* level_image = image->level_images + level;
 	ASSERT(level_image->exists);
 	i32 tile_index = tile_y * level_image->width_in_tiles + tile_x;
@@ -104,15 +103,9 @@ void load_tile_func(i32 logical_thread_index, void* userdata) {
 		openslide.read_region(wsi->osr, (u32*)temp_memory, x, y, wsi_file_level, level_image->tile_width, level_image->tile_height);
 
 		// Check for (partially) empty tiles
+		// Fill in any empty pixels with the background color.
 		u32 pixel_count = level_image->tile_width * level_image->tile_height;
-		u32* pixels = (u32*)temp_memory;
-		u32 nonempty_pixel_count = 0;
-		for (i32 i = 0; i < pixel_count; ++i) {
-			// Fill in any empty pixels with the background color.
-			u32 p = pixels[i];
-			nonempty_pixel_count += (p > 0);
-			pixels[i] = p ? p : image_background_color;
-		}
+		i64 nonempty_pixel_count = convert_fill_empty_bgra((u32*)temp_memory, pixel_count, image_background_color);
 		if (nonempty_pixel_count == 0) {
 			// Tile is entirely empty.
 			console_print_verbose("thread %d: tile level %d, tile %d (%d, %d): openslide.read_region() returned zeroes (empty tile)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
@@ -136,21 +129,57 @@ void load_tile_func(i32 logical_thread_index, void* userdata) {
 			failed = true;
 		}
 	} else if (image->backend == IMAGE_BACKEND_ISYNTAX) {
-//		console_print_error("thread %d: tile level %d, tile %d (%d, %d): TYRING\n", logical_thread_index, level, tile_index, tile_x, tile_y);
-		ASSERT(!"invalid code path");
-
+		// NOTE: the viewer streams iSyntax tiles through isyntax_streamer.c; this path is only used by image_read_region().
+		if (!image_read_isyntax_tile(image, level, tile_x, tile_y, (u32*)temp_memory)) {
+			failed = true;
+		}
 	} else if (image->backend == IMAGE_BACKEND_STBI) {
-		ASSERT(!"invalid code path");
+		// NOTE: the viewer uploads the whole image as a single texture; this path is only used by image_read_region().
+		if (image->simple.pixels && level == 0) {
+			// stb_image gives us RGBA, swap to BGRA
+			u32* src = (u32*)image->simple.pixels;
+			u32* dest = (u32*)temp_memory;
+			i32 pixel_count = image->simple.width * image->simple.height;
+			for (i32 i = 0; i < pixel_count; ++i) {
+				u32 p = src[i];
+				dest[i] = (p & 0xFF00FF00) | ((p & 0xFF) << 16) | ((p >> 16) & 0xFF);
+			}
+		} else {
+			failed = true;
+		}
 	} else {
 		console_print_error("thread %d: tile level %d, tile %d (%d, %d): unsupported image type\n", logical_thread_index, level, tile_index, tile_x, tile_y);
 		failed = true;
 	}
 
-
 	if (failed && temp_memory != NULL) {
 		free(temp_memory);
 		temp_memory = NULL;
 	}
+	if (is_empty_ptr) {
+		*is_empty_ptr = is_empty;
+	}
+	return temp_memory;
+}
+
+void load_tile_func(i32 logical_thread_index, void* userdata) {
+	load_tile_task_t* task = (load_tile_task_t*) userdata;
+	image_t* image = task->image;
+
+	if (image->is_deleted) {
+		// Early out to save time if the image was already closed/waiting for destruction
+		image_release(image, task->refcount_to_decrement);
+		return;
+	}
+
+	i32 level = task->level;
+	i32 tile_x = task->tile_x;
+	i32 tile_y = task->tile_y;
+	level_image_t* level_image = image->level_images + level;
+	i32 tile_index = tile_y * level_image->width_in_tiles + tile_x;
+
+	bool is_empty = false; // we might 'discover' that the tile is empty for OpenSlide backend (-> read_region() would return all zeroes)
+	u8* temp_memory = decode_tile_to_bgra(logical_thread_index, image, level, tile_x, tile_y, &is_empty);
 
 //	console_print_verbose("[thread %d] completing...\n", logical_thread_index);
 
@@ -193,7 +222,7 @@ void load_tile_func(i32 logical_thread_index, void* userdata) {
     // NOTE: we guarantee existence of image_t until the jobs submitted from the main thread are done.
     // However, we will NOT wait for the completion queues to also be finished (usually the responsibility of the main thread).
     // This means that when we receive the completion tasks on the main thread, we have to check if the image is still valid.
-    atomic_subtract(&image->refcount, task->refcount_to_decrement);
+    image_release(image, task->refcount_to_decrement);
 
 //	console_print_verbose("[thread %d] tile load done\n", logical_thread_index);
 
@@ -521,7 +550,7 @@ bool viewer_load_new_image(app_state_t* app_state, file_info_t* file, directory_
 				// Enable export as XML (make sure XML annotations do not get out of date!)
 				annotation_set->export_as_asap_xml = true;
 				replace_file_extension(temp_filename, temp_size, "xml");
-				strncpy(annotation_set->asap_xml_filename, temp_filename, sizeof(annotation_set->asap_xml_filename)-1);
+				snprintf(annotation_set->asap_xml_filename, sizeof(annotation_set->asap_xml_filename), "%s", temp_filename);
 
 
 			} else {
@@ -534,6 +563,24 @@ bool viewer_load_new_image(app_state_t* app_state, file_info_t* file, directory_
 
             // TODO: use most recently updated annotations?
             replace_file_extension(temp_filename, sizeof(temp_filename), "xml");
+
+            // Autosave writes to a binary annotation store; prefer it over the XML file if it is more recent.
+            annotation_binary_store_set_filename(annotation_set, temp_filename);
+            const char* binary_store_filename = annotation_set->binary_store.filename;
+            if (annotation_binary_store_is_newer_than(binary_store_filename, temp_filename)) {
+                console_print("Found binary annotation store: '%s'\n", binary_store_filename);
+                if (load_annotation_binary_store(annotation_set, binary_store_filename)) {
+                    snprintf(annotation_set->asap_xml_filename, sizeof(annotation_set->asap_xml_filename), "%s", temp_filename);
+                    were_annotations_loaded = true;
+                    app_state->scene.enable_annotations = true;
+                } else {
+                    // Fall back to the XML file (if it exists)
+                    unload_and_reinit_annotations(annotation_set);
+                    annotation_set->mpp = V2F(image->mpp_x, image->mpp_y);
+                    coco_init_main_image(&annotation_set->coco, image);
+                    annotation_binary_store_set_filename(annotation_set, temp_filename);
+                }
+            }
             if (file_exists(temp_filename)) {
                 console_print("Found XML annotations: '%s'\n", temp_filename);
                 if (!were_annotations_loaded) {
@@ -592,10 +639,21 @@ bool load_generic_file(app_state_t* app_state, const char* filename, u32 filetyp
 					}
 					success = load_asap_xml_annotations(app_state, filename);
 				} else if (file.type == VIEWER_FILE_TYPE_JSON) {
-					// TODO: disambiguate between COCO annotations and case lists
-					reload_global_caselist(app_state, filename);
-					show_slide_list_window = true;
-					success = caselist_select_first_case(app_state, &app_state->caselist);
+					if (is_coco_file(filename)) {
+						annotation_set_t* annotation_set = &app_state->scene.annotation_set;
+						unload_and_reinit_annotations(annotation_set);
+						if (arrlen(app_state->loaded_images) > 0) {
+							image_t* image = app_state->loaded_images[0];
+							annotation_set->mpp = V2F(image->mpp_x, image->mpp_y);
+						} else {
+							annotation_set->mpp = V2F(0.25f, 0.25f);
+						}
+						success = load_coco_annotations(app_state, filename);
+					} else {
+						reload_global_caselist(app_state, filename);
+						show_slide_list_window = true;
+						success = caselist_select_first_case(app_state, &app_state->caselist);
+					}
 				}
 			}
 		} else if (file.is_directory) {
@@ -674,6 +732,8 @@ void set_annotation_directory(app_state_t* app_state, const char* path) {
 image_t* load_image_from_file(app_state_t* app_state, file_info_t* file, directory_info_t* directory, u32 filetype_hint) {
 
 	image_t* image = (image_t*)calloc(1, sizeof(image_t));
+	image->lock = benaphore_create();
+	image->release_semaphore = platform_semaphore_create(0);
 	image->is_local = true;
 	image->resource_id = global_next_resource_id++;
 
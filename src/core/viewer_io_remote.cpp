@@ -29,7 +29,7 @@ void tiff_load_tile_batch_func(i32 logical_thread_index, void* userdata) {
 	}
 	if (image->is_deleted) {
 		// Early out to save time if the image was already closed/waiting for destruction
-		atomic_subtract(&image->refcount, refcount_decrement_amount);
+		image_release(image, refcount_decrement_amount);
 		return;
 	}
 
@@ -118,18 +118,17 @@ void tiff_load_tile_batch_func(i32 logical_thread_index, void* userdata) {
 						viewer_notify_tile_completed_task_t completion_task = {};
 						completion_task.resource_id = task->resource_id;
 						completion_task.pixel_memory = pixel_memory;
-						// TODO: check if we need to pass the tile height here too?
 						completion_task.tile_width = level_image->tile_width;
+						completion_task.tile_height = level_image->tile_height;
 						completion_task.scale = task->level;
 						completion_task.tile_index = task->tile_y * level_image->width_in_tiles + task->tile_x;
 						completion_task.want_gpu_residency = true;
 
+						// Note: the completion callback takes care of submitting the task to the completion queue
 						ASSERT(task->completion_callback);
 						if (task->completion_callback) {
 							task->completion_callback(logical_thread_index, &completion_task);
 						}
-						work_queue_submit_task(&global_completion_queue, task->completion_callback, &completion_task,
-						                       sizeof(completion_task));
 
 						//new_textures[i] = load_texture(pixel_memory, TILE_DIM, TILE_DIM, GL_BGRA);
 					}
@@ -162,6 +161,6 @@ void tiff_load_tile_batch_func(i32 logical_thread_index, void* userdata) {
     // NOTE: we guarantee existence of image_t until the jobs submitted from the main thread are done.
     // However, we will NOT wait for the completion queues to also be finished (usually the responsibility of the main thread).
     // This means that when we receive the completion tasks on the main thread, we have to check if the image is still valid.
-    atomic_subtract(&image->refcount, refcount_decrement_amount);
+    image_release(image, refcount_decrement_amount);
 
 }
\ No newline at end of file
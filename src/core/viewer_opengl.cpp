@@ -147,6 +147,33 @@ void init_draw_normalized_quad() {
 	glEnableVertexAttribArray(1);
 }
 
+// Calculate the matrix that transforms world coordinates into clip space, for the current camera position.
+void get_projection_view_matrix(scene_t* scene, v2f origin_offset, mat4x4 projection_view_matrix) {
+	mat4x4 projection = {};
+	{
+		float l = -0.5f * scene->r_minus_l;
+		float r = +0.5f * scene->r_minus_l;
+		float b = +0.5f * scene->t_minus_b;
+		float t = -0.5f * scene->t_minus_b;
+		float n = 100.0f;
+		float f = -100.0f;
+		mat4x4_ortho(projection, l, r, b, t, n, f);
+	}
+
+	mat4x4 I;
+	mat4x4_identity(I);
+
+	// define view matrix
+	mat4x4 view_matrix;
+	mat4x4_rotate_Z(view_matrix, I, scene->rotation);
+	mat4x4_translate_in_place(view_matrix,
+	                          -scene->camera.x + origin_offset.x,
+	                          -scene->camera.y + origin_offset.y,
+	                          0.0f);
+
+	mat4x4_mul(projection_view_matrix, projection, view_matrix);
+}
+
 void draw_rect(u32 texture) {
 	glBindVertexArray(vao_rect);
 //	glUniform1i(basic_shader_u_tex, 0);
@@ -412,6 +439,12 @@ void init_opengl_stuff(app_state_t* app_state) {
 
 	init_draw_normalized_quad();
 
+	// load the shader for drawing annotations
+	init_annotation_shader();
+
+	// load the shader for drawing image tiles (instanced)
+	init_tile_rendering();
+
 #ifdef STRINGIFY_SHADERS
 	write_stringified_shaders();
 #endif
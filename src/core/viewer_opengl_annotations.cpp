@@ -0,0 +1,561 @@
+/*
+  Slidescape, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2024  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Drawing annotations using static vertex buffers on the GPU.
+// The vertices are stored in world coordinates, so they only need to be uploaded again if annotations change.
+// Line thickness is specified in screen pixels: each polygon vertex is stored twice, with an offset (miter) vector
+// that the vertex shader scales depending on the zoom level.
+
+#define ANNOTATION_GPU_CHUNK_MAX_ANNOTATIONS 2048
+
+typedef struct annotation_gpu_vertex_t {
+	v2f pos;
+	v2f offset; // direction to extrude the line; zero for fill areas
+	float span; // size of the annotation in world units (for level of detail)
+} annotation_gpu_vertex_t;
+
+typedef struct annotation_shader_t {
+	u32 program;
+	i32 u_projection_view_matrix;
+	i32 u_pixel_width;
+	i32 u_line_thickness;
+	i32 u_min_span_in_pixels;
+	i32 u_color;
+} annotation_shader_t;
+
+annotation_shader_t annotation_shader;
+
+// Tesselating the fill areas is CPU intensive, so it is done on a worker thread, one job per chunk.
+// The job works on its own copy of the coordinates; the results are only adopted by the annotations if they
+// have not been modified in the meantime. Until the job is done, the chunk keeps drawing its old geometry.
+typedef struct annotation_gpu_tesselation_entry_t {
+	i32 annotation_index;
+	i32 first_coordinate;
+	i32 coordinate_count;
+	v2f* triangles; // array
+	bool is_complex_polygon;
+} annotation_gpu_tesselation_entry_t;
+
+typedef struct annotation_gpu_tesselation_job_t {
+	annotation_gpu_tesselation_entry_t* entries; // array
+	v2f* coordinates; // array
+	volatile i32 refcount; // held by the chunk and by the worker
+	volatile bool is_done;
+} annotation_gpu_tesselation_job_t;
+
+// Scratch space for building the chunk geometry (only used on the main thread)
+static annotation_gpu_vertex_t* annotation_gpu_scratch_vertices;
+static u32* annotation_gpu_scratch_fill_indices;
+static u32* annotation_gpu_scratch_outline_indices;
+
+void init_annotation_shader() {
+	annotation_shader.program = load_basic_shader_program("shaders/annotation.vert", "shaders/annotation.frag");
+	annotation_shader.u_projection_view_matrix = get_uniform(annotation_shader.program, "projection_view_matrix");
+	annotation_shader.u_pixel_width = get_uniform(annotation_shader.program, "pixel_width");
+	annotation_shader.u_line_thickness = get_uniform(annotation_shader.program, "line_thickness");
+	annotation_shader.u_min_span_in_pixels = get_uniform(annotation_shader.program, "min_span_in_pixels");
+	annotation_shader.u_color = get_uniform(annotation_shader.program, "color");
+}
+
+static u32 annotation_gpu_get_fill_settings() {
+	// If any of these change, the fill areas need to be rebuilt for all annotations.
+	return (u32)annotation_highlight_inside_of_polygons | ((u32)annotation_draw_fill_area_condition << 1);
+}
+
+static bool annotation_gpu_need_fill(annotation_t* annotation) {
+	// Selected annotations are drawn on top by draw_annotation_batch(); the GPU buffers don't know about the selection
+	if (annotation_draw_fill_area_condition == ANNOTATION_DRAW_IF_SELECTED) {
+		return false;
+	}
+	return annotation_need_draw_fill_area(annotation);
+}
+
+static void annotation_gpu_tesselation_job_release(annotation_gpu_tesselation_job_t* job) {
+	if (atomic_decrement(&job->refcount) == 0) {
+		for (i32 i = 0; i < arrlen(job->entries); ++i) {
+			arrfree(job->entries[i].triangles);
+		}
+		arrfree(job->entries);
+		arrfree(job->coordinates);
+		free(job);
+	}
+}
+
+static void annotation_gpu_tesselation_task_func(i32 logical_thread_index, void* userdata) {
+	annotation_gpu_tesselation_job_t* job = *(annotation_gpu_tesselation_job_t**) userdata;
+	for (i32 i = 0; i < arrlen(job->entries); ++i) {
+		annotation_gpu_tesselation_entry_t* entry = job->entries + i;
+		if (!triangulate_process(job->coordinates + entry->first_coordinate, entry->coordinate_count, &entry->triangles)) {
+			entry->is_complex_polygon = true;
+		}
+	}
+	write_barrier;
+	job->is_done = true;
+	annotation_gpu_tesselation_job_release(job);
+}
+
+static void annotation_gpu_chunk_begin_tesselation(app_state_t* app_state, annotation_set_t* annotation_set, annotation_gpu_chunk_t* chunk) {
+	annotation_gpu_buffers_t* gpu_buffers = &annotation_set->gpu_buffers;
+	annotation_gpu_tesselation_job_t* job = NULL;
+	for (i32 i = 0; i < arrlen(chunk->annotation_indices); ++i) {
+		i32 annotation_index = chunk->annotation_indices[i];
+		annotation_t* annotation = get_active_annotation(annotation_set, annotation_index);
+		if (!gpu_buffers->is_filled_for_annotation[annotation_index] || annotation->coordinate_count < 2 ||
+		    (annotation->valid_flags & ANNOTATION_VALID_TESSELATION)) {
+			continue;
+		}
+		if (annotation->coordinate_count >= 10 && app_state->mouse_mode == MODE_DRAG_ANNOTATION_NODE) {
+			continue; // postponed, see annotation_tesselate_if_necessary()
+		}
+		if (!job) {
+			job = (annotation_gpu_tesselation_job_t*) calloc(1, sizeof(annotation_gpu_tesselation_job_t));
+		}
+		annotation_gpu_tesselation_entry_t entry = {};
+		entry.annotation_index = annotation_index;
+		entry.first_coordinate = (i32)arrlen(job->coordinates);
+		entry.coordinate_count = annotation->coordinate_count;
+		arrput(job->entries, entry);
+		memcpy(arraddnptr(job->coordinates, annotation->coordinate_count), annotation->coordinates, annotation->coordinate_count * sizeof(v2f));
+	}
+	if (job) {
+		job->refcount = 2;
+		chunk->tesselation_job = job;
+		if (!work_queue_submit_task(&global_work_queue, annotation_gpu_tesselation_task_func, &job, sizeof(job))) {
+			annotation_gpu_tesselation_task_func(0, &job);
+		}
+	}
+}
+
+static void annotation_gpu_chunk_finish_tesselation(annotation_set_t* annotation_set, annotation_gpu_chunk_t* chunk) {
+	annotation_gpu_tesselation_job_t* job = chunk->tesselation_job;
+	read_barrier;
+	for (i32 i = 0; i < arrlen(job->entries); ++i) {
+		annotation_gpu_tesselation_entry_t* entry = job->entries + i;
+		if (entry->annotation_index >= annotation_set->active_annotation_count) {
+			continue;
+		}
+		annotation_t* annotation = get_active_annotation(annotation_set, entry->annotation_index);
+		if ((annotation->valid_flags & ANNOTATION_VALID_TESSELATION) || annotation->coordinate_count != entry->coordinate_count ||
+		    memcmp(annotation->coordinates, job->coordinates + entry->first_coordinate, entry->coordinate_count * sizeof(v2f)) != 0) {
+			continue; // modified in the meantime
+		}
+		// Swap, so that the old triangles are freed together with the job
+		v2f* old_triangles = annotation->tesselated_trianges;
+		annotation->tesselated_trianges = entry->triangles;
+		entry->triangles = old_triangles;
+		if (entry->is_complex_polygon) {
+			annotation->is_complex_polygon = true;
+		}
+		annotation->valid_flags |= ANNOTATION_VALID_TESSELATION;
+	}
+	chunk->tesselation_job = NULL;
+	annotation_gpu_tesselation_job_release(job);
+}
+
+static void annotation_gpu_chunk_destroy(annotation_gpu_chunk_t* chunk) {
+	if (chunk->tesselation_job) annotation_gpu_tesselation_job_release(chunk->tesselation_job);
+	if (chunk->vao) glDeleteVertexArrays(1, &chunk->vao);
+	if (chunk->vbo) glDeleteBuffers(1, &chunk->vbo);
+	if (chunk->ebo) glDeleteBuffers(1, &chunk->ebo);
+	arrfree(chunk->annotation_indices);
+	memset(chunk, 0, sizeof(*chunk));
+}
+
+static void annotation_gpu_buffers_clear(annotation_gpu_buffers_t* gpu_buffers) {
+	for (i32 i = 0; i < arrlen(gpu_buffers->chunks); ++i) {
+		annotation_gpu_chunk_destroy(gpu_buffers->chunks + i);
+	}
+	arrsetlen(gpu_buffers->chunks, 0);
+	arrsetlen(gpu_buffers->chunk_index_for_annotation, 0);
+	arrsetlen(gpu_buffers->is_filled_for_annotation, 0);
+	arrsetlen(gpu_buffers->open_chunk_index_for_group, 0);
+	arrsetlen(gpu_buffers->cpu_drawn_annotation_indices, 0);
+	gpu_buffers->indexed_annotation_count = 0;
+}
+
+static void annotation_gpu_buffers_add(annotation_set_t* annotation_set, i32 annotation_index) {
+	annotation_gpu_buffers_t* gpu_buffers = &annotation_set->gpu_buffers;
+	annotation_t* annotation = get_active_annotation(annotation_set, annotation_index);
+	i32 group_id = annotation->group_id;
+	while (arrlen(gpu_buffers->open_chunk_index_for_group) <= group_id) {
+		arrput(gpu_buffers->open_chunk_index_for_group, -1);
+	}
+	i32 chunk_index = gpu_buffers->open_chunk_index_for_group[group_id];
+	if (chunk_index < 0 || arrlen(gpu_buffers->chunks[chunk_index].annotation_indices) >= ANNOTATION_GPU_CHUNK_MAX_ANNOTATIONS) {
+		annotation_gpu_chunk_t new_chunk = {};
+		new_chunk.group_id = group_id;
+		chunk_index = arrlen(gpu_buffers->chunks);
+		arrput(gpu_buffers->chunks, new_chunk);
+		gpu_buffers->open_chunk_index_for_group[group_id] = chunk_index;
+	}
+	annotation_gpu_chunk_t* chunk = gpu_buffers->chunks + chunk_index;
+	arrput(chunk->annotation_indices, annotation_index);
+	chunk->need_upload = true;
+	gpu_buffers->chunk_index_for_annotation[annotation_index] = chunk_index;
+	gpu_buffers->is_filled_for_annotation[annotation_index] = annotation_gpu_need_fill(annotation);
+	annotation->valid_flags |= ANNOTATION_VALID_GPU_BUFFERS;
+}
+
+static void annotation_gpu_buffers_remove(annotation_gpu_buffers_t* gpu_buffers, i32 annotation_index) {
+	i32 chunk_index = gpu_buffers->chunk_index_for_annotation[annotation_index];
+	if (chunk_index >= 0) {
+		annotation_gpu_chunk_t* chunk = gpu_buffers->chunks + chunk_index;
+		for (i32 i = 0; i < arrlen(chunk->annotation_indices); ++i) {
+			if (chunk->annotation_indices[i] == annotation_index) {
+				arrdelswap(chunk->annotation_indices, i);
+				break;
+			}
+		}
+		chunk->need_upload = true;
+		gpu_buffers->chunk_index_for_annotation[annotation_index] = -1;
+	}
+}
+
+static void annotation_gpu_push_outline(annotation_t* annotation, float span) {
+	i32 count = annotation->coordinate_count;
+	v2f* coordinates = annotation->coordinates;
+	bool closed = !annotation->is_open && count >= 3;
+	u32 base_index = (u32)arrlen(annotation_gpu_scratch_vertices);
+	for (i32 i = 0; i < count; ++i) {
+		v2f p = coordinates[i];
+		bool has_prev = closed || i > 0;
+		bool has_next = closed || i < count - 1;
+		v2f prev = has_prev ? coordinates[(i + count - 1) % count] : p;
+		v2f next = has_next ? coordinates[(i + 1) % count] : p;
+
+		// Direction of the incoming and outgoing line segments (fall back to the other one for endpoints)
+		v2f dir_in = v2f_subtract(p, prev);
+		v2f dir_out = v2f_subtract(next, p);
+		float len_in = v2f_length(dir_in);
+		float len_out = v2f_length(dir_out);
+		if (len_in > 0.0f) dir_in = v2f_scale(1.0f / len_in, dir_in);
+		if (len_out > 0.0f) dir_out = v2f_scale(1.0f / len_out, dir_out);
+		if (len_in <= 0.0f) dir_in = (len_out > 0.0f) ? dir_out : V2F(1.0f, 0.0f);
+		if (len_out <= 0.0f) dir_out = dir_in;
+
+		// Miter joint: extrude along the average of both normals, lengthened so that the line keeps its thickness
+		v2f normal_in = V2F(-dir_in.y, dir_in.x);
+		v2f normal_out = V2F(-dir_out.y, dir_out.x);
+		v2f miter = v2f_add(normal_in, normal_out);
+		float miter_length = v2f_length(miter);
+		if (miter_length < 1e-3f) {
+			miter = normal_in; // the line folds back on itself
+		} else {
+			miter = v2f_scale(1.0f / miter_length, miter);
+		}
+		float scale = 1.0f / ATLEAST(v2f_dot(miter, normal_out), 0.25f); // limit the length of sharp spikes
+		v2f offset = v2f_scale(scale, miter);
+
+		annotation_gpu_vertex_t vertex = {p, offset, span};
+		arrput(annotation_gpu_scratch_vertices, vertex);
+		vertex.offset = v2f_scale(-1.0f, offset);
+		arrput(annotation_gpu_scratch_vertices, vertex);
+	}
+
+	i32 segment_count = closed ? count : count - 1;
+	for (i32 i = 0; i < segment_count; ++i) {
+		u32 a = base_index + 2 * i;
+		u32 b = base_index + 2 * ((i + 1) % count);
+		u32 quad_indices[6] = {a, a + 1, b, a + 1, b + 1, b};
+		for (i32 j = 0; j < 6; ++j) {
+			arrput(annotation_gpu_scratch_outline_indices, quad_indices[j]);
+		}
+	}
+}
+
+static void annotation_gpu_chunk_upload(annotation_set_t* annotation_set, annotation_gpu_chunk_t* chunk) {
+	arrsetlen(annotation_gpu_scratch_vertices, 0);
+	arrsetlen(annotation_gpu_scratch_fill_indices, 0);
+	arrsetlen(annotation_gpu_scratch_outline_indices, 0);
+	annotation_gpu_buffers_t* gpu_buffers = &annotation_set->gpu_buffers;
+	bounds2f chunk_bounds = { +FLT_MAX, +FLT_MAX, -FLT_MAX, -FLT_MAX };
+	float chunk_min_span = 1e30f;
+
+	for (i32 i = 0; i < arrlen(chunk->annotation_indices); ++i) {
+		i32 annotation_index = chunk->annotation_indices[i];
+		annotation_t* annotation = get_active_annotation(annotation_set, annotation_index);
+		if (annotation->coordinate_count < 2) {
+			continue; // points are drawn as nodes by draw_annotations()
+		}
+		annotation_recalculate_bounds_if_necessary(annotation);
+		chunk_bounds = bounds2f_encompassing(chunk_bounds, annotation->bounds);
+		float span = 1e30f; // open annotations are always drawn in full
+		if (!annotation->is_open) {
+			span = MAX(annotation->bounds.max.x - annotation->bounds.min.x, annotation->bounds.max.y - annotation->bounds.min.y);
+		}
+		chunk_min_span = MIN(chunk_min_span, span);
+
+		if (gpu_buffers->is_filled_for_annotation[annotation_index]) {
+			if (!(annotation->valid_flags & ANNOTATION_VALID_TESSELATION)) {
+				// Tesselation was postponed (e.g. while dragging a coordinate), or the annotation was modified
+				// while it was being tesselated -> try again next time
+				annotation->valid_flags &= ~ANNOTATION_VALID_GPU_BUFFERS;
+				gpu_buffers->need_check_invalidated = true;
+			}
+			i32 vertex_count = (i32)arrlen(annotation->tesselated_trianges);
+			u32 base_index = (u32)arrlen(annotation_gpu_scratch_vertices);
+			for (i32 j = 0; j < vertex_count; ++j) {
+				annotation_gpu_vertex_t vertex = {annotation->tesselated_trianges[j], V2F(0.0f, 0.0f), span};
+				arrput(annotation_gpu_scratch_vertices, vertex);
+				arrput(annotation_gpu_scratch_fill_indices, base_index + j);
+			}
+		}
+		annotation_gpu_push_outline(annotation, span);
+	}
+	chunk->bounds = chunk_bounds;
+	chunk->min_span = chunk_min_span;
+
+	if (!chunk->vao) {
+		glGenVertexArrays(1, &chunk->vao);
+		glGenBuffers(1, &chunk->vbo);
+		glGenBuffers(1, &chunk->ebo);
+		glBindVertexArray(chunk->vao);
+		glBindBuffer(GL_ARRAY_BUFFER, chunk->vbo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, chunk->ebo);
+		u32 vertex_stride = sizeof(annotation_gpu_vertex_t);
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, vertex_stride, (void*)offsetof(annotation_gpu_vertex_t, pos));
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, vertex_stride, (void*)offsetof(annotation_gpu_vertex_t, offset));
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, vertex_stride, (void*)offsetof(annotation_gpu_vertex_t, span));
+		glEnableVertexAttribArray(2);
+	} else {
+		glBindVertexArray(chunk->vao);
+		glBindBuffer(GL_ARRAY_BUFFER, chunk->vbo);
+	}
+
+	// The fill indices come first, followed by the outline indices
+	i32 fill_index_count = (i32)arrlen(annotation_gpu_scratch_fill_indices);
+	i32 outline_index_count = (i32)arrlen(annotation_gpu_scratch_outline_indices);
+	glBufferData(GL_ARRAY_BUFFER, arrlen(annotation_gpu_scratch_vertices) * sizeof(annotation_gpu_vertex_t), annotation_gpu_scratch_vertices, GL_STATIC_DRAW);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, (fill_index_count + outline_index_count) * sizeof(u32), NULL, GL_STATIC_DRAW);
+	glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, fill_index_count * sizeof(u32), annotation_gpu_scratch_fill_indices);
+	glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, fill_index_count * sizeof(u32), outline_index_count * sizeof(u32), annotation_gpu_scratch_outline_indices);
+	glBindVertexArray(0);
+
+	chunk->fill_index_count = fill_index_count;
+	chunk->outline_index_count = outline_index_count;
+	chunk->need_upload = false;
+}
+
+// Force a full rebuild next time the buffers are updated.
+// Needed whenever active annotation indices are removed or reordered.
+void annotation_gpu_buffers_invalidate(annotation_set_t* annotation_set) {
+	annotation_set->gpu_buffers.is_valid = false;
+}
+
+void annotation_gpu_buffers_update(app_state_t* app_state, annotation_set_t* annotation_set) {
+	annotation_gpu_buffers_t* gpu_buffers = &annotation_set->gpu_buffers;
+	if (!annotation_draw_using_gpu_buffers || !annotation_shader.program) {
+		if (gpu_buffers->is_valid) {
+			annotation_gpu_buffers_clear(gpu_buffers);
+			gpu_buffers->is_valid = false;
+		}
+		return;
+	}
+
+	i32 annotation_count = annotation_set->active_annotation_count;
+	u32 fill_settings = annotation_gpu_get_fill_settings();
+	bool need_collect_cpu_drawn = false;
+	if (!gpu_buffers->is_valid || annotation_count < gpu_buffers->indexed_annotation_count || fill_settings != gpu_buffers->fill_settings_at_build) {
+		annotation_gpu_buffers_clear(gpu_buffers);
+		gpu_buffers->fill_settings_at_build = fill_settings;
+		gpu_buffers->need_check_invalidated = false;
+		gpu_buffers->is_valid = true;
+		need_collect_cpu_drawn = true;
+	}
+
+	// Move annotations that have been modified since the last update (coordinates, group, or features)
+	if (gpu_buffers->need_check_invalidated) {
+		for (i32 i = 0; i < gpu_buffers->indexed_annotation_count; ++i) {
+			annotation_t* annotation = get_active_annotation(annotation_set, i);
+			i32 chunk_index = gpu_buffers->chunk_index_for_annotation[i];
+			if (!(annotation->valid_flags & ANNOTATION_VALID_GPU_BUFFERS) || chunk_index < 0 ||
+			    gpu_buffers->chunks[chunk_index].group_id != annotation->group_id ||
+			    gpu_buffers->is_filled_for_annotation[i] != (u8)annotation_gpu_need_fill(annotation)) {
+				annotation_gpu_buffers_remove(gpu_buffers, i);
+				annotation_gpu_buffers_add(annotation_set, i);
+				need_collect_cpu_drawn = true;
+			}
+		}
+		gpu_buffers->need_check_invalidated = false;
+	}
+
+	// Add new annotations
+	if (annotation_count > gpu_buffers->indexed_annotation_count) {
+		arrsetlen(gpu_buffers->chunk_index_for_annotation, annotation_count);
+		arrsetlen(gpu_buffers->is_filled_for_annotation, annotation_count);
+		for (i32 i = gpu_buffers->indexed_annotation_count; i < annotation_count; ++i) {
+			gpu_buffers->chunk_index_for_annotation[i] = -1;
+			annotation_gpu_buffers_add(annotation_set, i);
+		}
+		gpu_buffers->indexed_annotation_count = annotation_count;
+		need_collect_cpu_drawn = true;
+	}
+
+	// Keep track of the annotations that have no geometry in the buffers (these always need to be drawn by ImGui)
+	if (need_collect_cpu_drawn) {
+		arrsetlen(gpu_buffers->cpu_drawn_annotation_indices, 0);
+		for (i32 i = 0; i < gpu_buffers->indexed_annotation_count; ++i) {
+			if (!annotation_gpu_buffers_contain(annotation_set, i, NULL)) {
+				arrput(gpu_buffers->cpu_drawn_annotation_indices, i);
+			}
+		}
+	}
+
+	// Upload only the chunks that changed, once their fill areas have been tesselated
+	for (i32 i = 0; i < arrlen(gpu_buffers->chunks); ++i) {
+		annotation_gpu_chunk_t* chunk = gpu_buffers->chunks + i;
+		if (chunk->need_upload && !chunk->tesselation_job) {
+			annotation_gpu_chunk_begin_tesselation(app_state, annotation_set, chunk);
+		}
+		if (chunk->tesselation_job) {
+			if (!chunk->tesselation_job->is_done) {
+				continue;
+			}
+			annotation_gpu_chunk_finish_tesselation(annotation_set, chunk);
+		}
+		if (chunk->need_upload) {
+			annotation_gpu_chunk_upload(annotation_set, chunk);
+		}
+	}
+}
+
+// Returns whether the annotation is drawn from the GPU buffers (and whether the inside of the annotation is filled).
+bool annotation_gpu_buffers_contain(annotation_set_t* annotation_set, i32 annotation_index, bool* is_filled) {
+	annotation_gpu_buffers_t* gpu_buffers = &annotation_set->gpu_buffers;
+	if (gpu_buffers->is_valid && annotation_index < gpu_buffers->indexed_annotation_count &&
+	    gpu_buffers->chunk_index_for_annotation[annotation_index] >= 0 &&
+	    get_active_annotation(annotation_set, annotation_index)->coordinate_count >= 2) {
+		if (is_filled) {
+			*is_filled = gpu_buffers->is_filled_for_annotation[annotation_index];
+		}
+		return true;
+	}
+	return false;
+}
+
+// Collect the annotations that draw_annotations() still needs to draw itself while the GPU buffers are in use:
+// annotations without geometry in the buffers, the selected annotation(s), the annotation being edited, and all
+// annotations of chunks in view that contain annotations smaller than min_span (these are merged into density tiles).
+// Other chunks are skipped as a whole, so the cost does not grow with the number of annotations in view.
+void annotation_gpu_buffers_collect_cpu_drawn(annotation_set_t* annotation_set, bounds2f camera_bounds, float min_span, i32** annotation_indices) {
+	annotation_gpu_buffers_t* gpu_buffers = &annotation_set->gpu_buffers;
+	arrsetlen(*annotation_indices, 0);
+	for (i32 i = 0; i < arrlen(gpu_buffers->cpu_drawn_annotation_indices); ++i) {
+		arrput(*annotation_indices, gpu_buffers->cpu_drawn_annotation_indices[i]);
+	}
+	for (i32 i = 0; i < arrlen(gpu_buffers->chunks); ++i) {
+		annotation_gpu_chunk_t* chunk = gpu_buffers->chunks + i;
+		chunk->is_drawn_on_cpu = chunk->min_span < min_span && !annotation_set->stored_groups[chunk->group_id].hidden &&
+		                         are_bounds2f_overlapping(camera_bounds, chunk->bounds);
+		if (chunk->is_drawn_on_cpu) {
+			for (i32 j = 0; j < arrlen(chunk->annotation_indices); ++j) {
+				i32 annotation_index = chunk->annotation_indices[j];
+				if (annotation_gpu_buffers_contain(annotation_set, annotation_index, NULL)) {
+					arrput(*annotation_indices, annotation_index);
+				}
+			}
+		}
+	}
+	// Selected annotations and the annotation being edited are drawn on top (unless already collected above)
+	for (i32 i = 0; i < arrlen(annotation_set->selected_annotation_indices); ++i) {
+		i32 annotation_index = annotation_set->selected_annotation_indices[i];
+		if (annotation_gpu_buffers_contain(annotation_set, annotation_index, NULL) &&
+		    !gpu_buffers->chunks[gpu_buffers->chunk_index_for_annotation[annotation_index]].is_drawn_on_cpu) {
+			arrput(*annotation_indices, annotation_index);
+		}
+	}
+	i32 editing_index = annotation_set->editing_annotation_index;
+	if (editing_index >= 0 && editing_index < annotation_set->active_annotation_count &&
+	    !get_active_annotation(annotation_set, editing_index)->selected &&
+	    annotation_gpu_buffers_contain(annotation_set, editing_index, NULL) &&
+	    !gpu_buffers->chunks[gpu_buffers->chunk_index_for_annotation[editing_index]].is_drawn_on_cpu) {
+		arrput(*annotation_indices, editing_index);
+	}
+}
+
+void annotation_gpu_buffers_destroy(annotation_gpu_buffers_t* gpu_buffers) {
+	annotation_gpu_buffers_clear(gpu_buffers);
+	arrfree(gpu_buffers->chunks);
+	arrfree(gpu_buffers->chunk_index_for_annotation);
+	arrfree(gpu_buffers->is_filled_for_annotation);
+	arrfree(gpu_buffers->open_chunk_index_for_group);
+	arrfree(gpu_buffers->cpu_drawn_annotation_indices);
+	memset(gpu_buffers, 0, sizeof(*gpu_buffers));
+}
+
+void draw_annotations_using_gpu_buffers(app_state_t* app_state, scene_t* scene) {
+	if (!scene->enable_annotations || !annotation_draw_using_gpu_buffers) return;
+	annotation_set_t* annotation_set = annotation_get_set_to_draw(&scene->annotation_set);
+	annotation_gpu_buffers_t* gpu_buffers = &annotation_set->gpu_buffers;
+	if (!gpu_buffers->is_valid || arrlen(gpu_buffers->chunks) == 0) return;
+
+	mat4x4 projection_view_matrix;
+	get_projection_view_matrix(scene, V2F(0.0f, 0.0f), projection_view_matrix);
+
+	glUseProgram(annotation_shader.program);
+	glUniformMatrix4fv(annotation_shader.u_projection_view_matrix, 1, GL_FALSE, &projection_view_matrix[0][0]);
+	glUniform1f(annotation_shader.u_pixel_width, scene->zoom.screen_point_width);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_STENCIL_TEST);
+	glEnable(GL_BLEND);
+	glBlendEquation(GL_FUNC_ADD);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	bounds2f extruded_camera_bounds = scene->camera_bounds;
+	float extrude_amount = 30.0f * scene->zoom.screen_point_width;
+	extruded_camera_bounds.min.x -= extrude_amount;
+	extruded_camera_bounds.min.y -= extrude_amount;
+	extruded_camera_bounds.max.x += extrude_amount;
+	extruded_camera_bounds.max.y += extrude_amount;
+
+	// First draw the inside of all annotations, then the outlines on top
+	for (i32 pass = 0; pass < 2; ++pass) {
+		bool is_fill_pass = (pass == 0);
+		if (is_fill_pass) {
+			glUniform1f(annotation_shader.u_line_thickness, 0.0f);
+			glUniform1f(annotation_shader.u_min_span_in_pixels, annotation_enable_level_of_detail ? annotation_lod_min_fill_size : 0.0f);
+		} else {
+			// With level of detail enabled, draw_annotation_batch() merges tiny annotations into density tiles instead
+			// (the shader measures in screen points, the threshold is in pixels)
+			float min_span_in_points = ANNOTATION_MIN_SPAN_FOR_FULL_DRAW * scene->zoom.pixel_width / scene->zoom.screen_point_width;
+			glUniform1f(annotation_shader.u_line_thickness, annotation_normal_line_thickness);
+			glUniform1f(annotation_shader.u_min_span_in_pixels, annotation_enable_level_of_detail ? min_span_in_points : 0.0f);
+		}
+		for (i32 i = 0; i < arrlen(gpu_buffers->chunks); ++i) {
+			annotation_gpu_chunk_t* chunk = gpu_buffers->chunks + i;
+			i32 index_count = is_fill_pass ? chunk->fill_index_count : chunk->outline_index_count;
+			if (index_count == 0 || !are_bounds2f_overlapping(extruded_camera_bounds, chunk->bounds)) {
+				continue;
+			}
+			annotation_group_t* group = annotation_set->stored_groups + chunk->group_id;
+			if (group->hidden) {
+				continue;
+			}
+			float alpha = is_fill_pass ? annotation_highlight_opacity : annotation_opacity;
+			glUniform4f(annotation_shader.u_color, group->color.r / 255.0f, group->color.g / 255.0f, group->color.b / 255.0f, alpha);
+			glBindVertexArray(chunk->vao);
+			size_t index_offset = is_fill_pass ? 0 : chunk->fill_index_count * sizeof(u32);
+			glDrawElements(GL_TRIANGLES, index_count, GL_UNSIGNED_INT, (void*)index_offset);
+		}
+	}
+
+	glBindVertexArray(0);
+	glDisable(GL_BLEND);
+}
@@ -0,0 +1,955 @@
+/*
+  Slidescape, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2024  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Drawing image tiles using instanced rendering.
+// Tile textures are stored as layers in a pool of 2D texture arrays ('pages'), grouped by tile size.
+// The pool is limited by a memory budget (tile_texture_pool_budget_in_mb). If the budget is reached, the least
+// recently drawn tiles are evicted and their slots are recycled; evicted tiles get reloaded once they are needed again.
+// For each tile size, the pool keeps a list of pages that have free layers, and the used slots in LRU order,
+// so that a slot can be handed out in constant time (see tile_texture_pool_allocate_slot()).
+// All visible tiles of a level that live in the same page are drawn with a single instanced draw call.
+// The per-tile instance data (tile position and layer) is cached per level, and only rebuilt if the visible
+// tiles change or if the textures of any of those tiles were uploaded or unloaded in the meantime.
+//
+// Tile uploads go through a large persistently mapped pixel buffer (the 'upload ring'), if the driver supports
+// ARB_buffer_storage (OpenGL 4.4). Worker threads copy finished tiles into the ring, so the main thread only needs to
+// issue the texture transfer. Fences tell us when the GPU is done reading a region, so it can be reused.
+// If the ring is unavailable or full, tiles are uploaded via the regular PBOs in app_state->pixel_transfer_states.
+//
+// Images with a deformation field (see deformation_field_t) are drawn with a subdivided tile mesh, so that the vertex
+// shader can warp each tile by displacing its vertices.
+
+#define TILE_TEXTURE_PAGE_TARGET_SIZE MEGABYTES(16)
+#define TILE_TEXTURE_PAGE_MIN_LAYERS 8
+#define TILE_TEXTURE_PAGE_MAX_LAYERS 256
+
+// Slots are 1-based, so that a texture_slot of 0 can mean 'not in the pool'.
+#define TILE_TEXTURE_SLOT(page_index, layer) ((((u32)(page_index) << 16) | (u32)(layer)) + 1)
+#define TILE_TEXTURE_SLOT_PAGE(slot) (((slot) - 1) >> 16)
+#define TILE_TEXTURE_SLOT_LAYER(slot) (((slot) - 1) & 0xFFFF)
+
+typedef struct tile_texture_page_t {
+	u32 texture;
+	i32 tile_width;
+	i32 tile_height;
+	i32 layer_count;
+	i32 size_class_index;
+	i32* free_layers; // array, used as a stack
+	tile_t** owners; // the tile occupying each layer (NULL if the layer is free)
+	u32* lru_prev; // per layer: slot drawn more recently (0 if none)
+	u32* lru_next; // per layer: slot drawn less recently (0 if none)
+	bool is_in_free_page_list;
+} tile_texture_page_t;
+
+// Bookkeeping for all pages holding tiles of the same size.
+typedef struct tile_texture_size_class_t {
+	i32 tile_width;
+	i32 tile_height;
+	i32* pages_with_free_layers; // array, used as a stack
+	u32 lru_head; // most recently drawn slot (0 if none)
+	u32 lru_tail; // least recently drawn slot (0 if none)
+} tile_texture_size_class_t;
+
+typedef struct tile_instance_t {
+	v2f tile_pos; // tile_x, tile_y
+	float layer;
+} tile_instance_t;
+
+typedef struct tile_shader_t {
+	u32 program;
+	i32 u_projection_view_matrix;
+	i32 u_level_origin;
+	i32 u_tile_side;
+	i32 u_tex;
+	i32 u_black_level;
+	i32 u_white_level;
+	i32 u_background_color;
+	i32 u_transparent_color;
+	i32 u_transparent_tolerance;
+	i32 u_use_transparent_filter;
+	i32 u_use_deformation;
+	i32 u_deformation_field;
+	i32 u_deformation_field_extent;
+} tile_shader_t;
+
+// The tile mesh: a plain quad (the first 6 indices), followed by a subdivided quad for deformed images.
+#define TILE_MESH_SUBDIVISIONS 16
+#define TILE_MESH_VERTEX_COUNT ((TILE_MESH_SUBDIVISIONS + 1) * (TILE_MESH_SUBDIVISIONS + 1))
+#define TILE_MESH_QUAD_INDEX_COUNT 6
+#define TILE_MESH_SUBDIVIDED_INDEX_COUNT (TILE_MESH_SUBDIVISIONS * TILE_MESH_SUBDIVISIONS * 6)
+
+#define TILE_UPLOAD_RING_SIZE MEGABYTES(64)
+#define TILE_UPLOAD_RING_MAX_REGIONS 1024
+#define TILE_UPLOAD_RING_ALIGNMENT 256
+
+typedef struct tile_upload_region_t {
+	i64 begin; // positions are monotonic (not wrapped around the ring size)
+	i64 end;
+	GLsync fence;
+	bool is_consumed;
+} tile_upload_region_t;
+
+typedef struct tile_upload_ring_t {
+	u32 pbo;
+	u8* mapped_buffer;
+	i64 size;
+	i64 head; // end of the most recently allocated region
+	i64 tail; // everything before this position can be overwritten
+	tile_upload_region_t regions[TILE_UPLOAD_RING_MAX_REGIONS];
+	u32 first_region_id; // oldest region that is still in use
+	u32 next_region_id;
+	benaphore_t lock;
+	bool is_available;
+} tile_upload_ring_t;
+
+typedef struct tile_render_stats_t {
+	i64 period_start;
+	i64 last_frame_counter;
+	i32 frame_count;
+	i64 draw_call_count;
+	i64 tile_count;
+	float seconds_elapsed;
+	i32 upload_count;
+	i32 upload_via_ring_count;
+} tile_render_stats_t;
+
+tile_shader_t tile_shader;
+
+static tile_texture_page_t* tile_texture_pages; // deleted pages have texture == 0, and may get reused
+static tile_texture_size_class_t* tile_texture_size_classes; // array
+static i32 tile_texture_max_layers = TILE_TEXTURE_PAGE_MAX_LAYERS;
+static i64 tile_texture_pool_allocated_bytes;
+static i64 tile_texture_pool_used_bytes;
+static bool tile_texture_pool_warned_over_budget;
+static u32 tile_texture_generation = 1; // incremented whenever a tile texture gets uploaded or unloaded, and stamped on the tile
+static tile_render_stats_t tile_render_stats;
+static tile_upload_ring_t tile_upload_ring;
+static u32 tile_mesh_vbo;
+static u32 tile_mesh_ebo;
+static bool tile_use_deformation; // set by tile_shader_set_deformation_field()
+
+// Scratch space for rebuilding the draw caches (only used on the main thread)
+static tile_instance_t* tile_scratch_instances;
+static i32* tile_scratch_page_cursors;
+static i32* tile_scratch_page_offsets;
+
+static bool is_buffer_storage_supported() {
+#if APPLE
+	return false; // macOS only supports up to OpenGL 4.1
+#else
+	i32 major = 0;
+	i32 minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	if (major > 4 || (major == 4 && minor >= 4)) {
+		return true;
+	}
+#if !WINDOWS
+	// Older contexts may still expose the extension (on Windows, glad only loads glBufferStorage() for OpenGL 4.4+)
+	i32 extension_count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &extension_count);
+	for (i32 i = 0; i < extension_count; ++i) {
+		const char* extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+		if (extension && strcmp(extension, "GL_ARB_buffer_storage") == 0) {
+			return true;
+		}
+	}
+#endif
+	return false;
+#endif
+}
+
+void init_tile_rendering() {
+	tile_shader.program = load_shader_program_with_defines("shaders/tile.vert", "shaders/basic.frag", "#define TEXTURE_ARRAY\n");
+	tile_shader.u_projection_view_matrix = get_uniform(tile_shader.program, "projection_view_matrix");
+	tile_shader.u_level_origin = get_uniform(tile_shader.program, "level_origin");
+	tile_shader.u_tile_side = get_uniform(tile_shader.program, "tile_side");
+	tile_shader.u_tex = get_uniform(tile_shader.program, "the_texture");
+	tile_shader.u_black_level = get_uniform(tile_shader.program, "black_level");
+	tile_shader.u_white_level = get_uniform(tile_shader.program, "white_level");
+	tile_shader.u_background_color = get_uniform(tile_shader.program, "bg_color");
+	tile_shader.u_transparent_color = get_uniform(tile_shader.program, "transparent_color");
+	tile_shader.u_transparent_tolerance = get_uniform(tile_shader.program, "transparent_tolerance");
+	tile_shader.u_use_transparent_filter = get_uniform(tile_shader.program, "use_transparent_filter");
+	tile_shader.u_use_deformation = get_uniform(tile_shader.program, "use_deformation");
+	tile_shader.u_deformation_field = get_uniform(tile_shader.program, "deformation_field");
+	tile_shader.u_deformation_field_extent = get_uniform(tile_shader.program, "deformation_field_extent");
+
+	// Set up the tile mesh. Like the quad used by draw_rect(), the outer edges are expanded by a tiny amount,
+	// to avoid seams between adjacent tiles.
+	{
+		const float epsilon = 0.00001f;
+		float* vertices = (float*)malloc(TILE_MESH_VERTEX_COUNT * 5 * sizeof(float));
+		float* vertex = vertices;
+		for (i32 j = 0; j <= TILE_MESH_SUBDIVISIONS; ++j) {
+			float v = (float)j / TILE_MESH_SUBDIVISIONS;
+			if (j == 0) v -= epsilon; else if (j == TILE_MESH_SUBDIVISIONS) v += epsilon;
+			for (i32 i = 0; i <= TILE_MESH_SUBDIVISIONS; ++i) {
+				float u = (float)i / TILE_MESH_SUBDIVISIONS;
+				if (i == 0) u -= epsilon; else if (i == TILE_MESH_SUBDIVISIONS) u += epsilon;
+				*vertex++ = u; // x, y, z, u, v
+				*vertex++ = v;
+				*vertex++ = -epsilon;
+				*vertex++ = u;
+				*vertex++ = v;
+			}
+		}
+		u16* indices = (u16*)malloc((TILE_MESH_QUAD_INDEX_COUNT + TILE_MESH_SUBDIVIDED_INDEX_COUNT) * sizeof(u16));
+		u16 row = TILE_MESH_SUBDIVISIONS + 1;
+		u16 top_left = 0, top_right = TILE_MESH_SUBDIVISIONS;
+		u16 bottom_left = TILE_MESH_SUBDIVISIONS * row, bottom_right = bottom_left + TILE_MESH_SUBDIVISIONS;
+		u16 quad_indices[TILE_MESH_QUAD_INDEX_COUNT] = {top_left, top_right, bottom_left, top_right, bottom_left, bottom_right};
+		memcpy(indices, quad_indices, sizeof(quad_indices));
+		u16* index = indices + TILE_MESH_QUAD_INDEX_COUNT;
+		for (i32 j = 0; j < TILE_MESH_SUBDIVISIONS; ++j) {
+			for (i32 i = 0; i < TILE_MESH_SUBDIVISIONS; ++i) {
+				u16 v0 = j * row + i;
+				*index++ = v0;
+				*index++ = v0 + 1;
+				*index++ = v0 + row;
+				*index++ = v0 + 1;
+				*index++ = v0 + row;
+				*index++ = v0 + row + 1;
+			}
+		}
+		glGenBuffers(1, &tile_mesh_vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, tile_mesh_vbo);
+		glBufferData(GL_ARRAY_BUFFER, TILE_MESH_VERTEX_COUNT * 5 * sizeof(float), vertices, GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glGenBuffers(1, &tile_mesh_ebo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, tile_mesh_ebo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, (TILE_MESH_QUAD_INDEX_COUNT + TILE_MESH_SUBDIVIDED_INDEX_COUNT) * sizeof(u16), indices, GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		free(vertices);
+		free(indices);
+	}
+
+	i32 max_layers = 0;
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+	if (max_layers > 0) {
+		tile_texture_max_layers = ATMOST(max_layers, TILE_TEXTURE_PAGE_MAX_LAYERS);
+	}
+
+	// Set up the persistently mapped upload ring
+	tile_upload_ring_t* ring = &tile_upload_ring;
+	ring->lock = benaphore_create();
+#if !APPLE
+	if (is_buffer_storage_supported()) {
+		u32 flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &ring->pbo);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->pbo);
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, TILE_UPLOAD_RING_SIZE, NULL, flags);
+		ring->mapped_buffer = (u8*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, TILE_UPLOAD_RING_SIZE, flags);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		if (ring->mapped_buffer) {
+			ring->size = TILE_UPLOAD_RING_SIZE;
+			write_barrier;
+			ring->is_available = true;
+		} else {
+			console_print_error("Tile upload ring: glMapBufferRange() failed, falling back to regular PBO uploads\n");
+			glDeleteBuffers(1, &ring->pbo);
+			ring->pbo = 0;
+		}
+	} else
+#endif
+	{
+		console_print_verbose("Tile upload ring: ARB_buffer_storage not available, using regular PBO uploads\n");
+	}
+}
+
+// Copy a finished tile into the upload ring (can be called from any thread).
+// Returns the region id + 1, or 0 if the ring is not available or currently full.
+i32 tile_upload_ring_stage(u8* pixels, i32 width, i32 height) {
+	tile_upload_ring_t* ring = &tile_upload_ring;
+	if (!ring->is_available || !tile_upload_use_persistent_ring) {
+		return 0;
+	}
+	i64 size = (i64)width * height * 4;
+	benaphore_lock(&ring->lock);
+	i64 begin = (ring->head + TILE_UPLOAD_RING_ALIGNMENT - 1) & ~(i64)(TILE_UPLOAD_RING_ALIGNMENT - 1);
+	i64 offset = begin % ring->size;
+	if (offset + size > ring->size) {
+		begin += ring->size - offset; // don't wrap around in the middle of a tile
+	}
+	if (ring->next_region_id - ring->first_region_id >= TILE_UPLOAD_RING_MAX_REGIONS || begin + size - ring->tail > ring->size) {
+		benaphore_unlock(&ring->lock);
+		return 0;
+	}
+	u32 region_id = ring->next_region_id++;
+	tile_upload_region_t* region = ring->regions + (region_id % TILE_UPLOAD_RING_MAX_REGIONS);
+	region->begin = begin;
+	region->end = begin + size;
+	region->fence = NULL;
+	region->is_consumed = false;
+	ring->head = region->end;
+	benaphore_unlock(&ring->lock);
+
+	memcpy(ring->mapped_buffer + (begin % ring->size), pixels, size);
+	return (i32)region_id + 1;
+}
+
+// Mark a region as no longer needed by the CPU. If it was used as the source of a texture transfer (need_fence),
+// the region stays reserved until the GPU has finished reading from it; this needs to happen on the main thread.
+// Without a fence, this can be called from any thread.
+void tile_upload_ring_release(i32 ring_region, bool need_fence) {
+	tile_upload_ring_t* ring = &tile_upload_ring;
+	ASSERT(ring_region > 0);
+	GLsync fence = need_fence ? glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) : NULL;
+	benaphore_lock(&ring->lock);
+	tile_upload_region_t* region = ring->regions + ((u32)(ring_region - 1) % TILE_UPLOAD_RING_MAX_REGIONS);
+	region->fence = fence;
+	region->is_consumed = true;
+	benaphore_unlock(&ring->lock);
+}
+
+// Reclaim the regions that the GPU has finished reading from (main thread only).
+void tile_upload_ring_reclaim() {
+	tile_upload_ring_t* ring = &tile_upload_ring;
+	if (!ring->is_available) {
+		return;
+	}
+	benaphore_lock(&ring->lock);
+	while (ring->first_region_id != ring->next_region_id) {
+		tile_upload_region_t* region = ring->regions + (ring->first_region_id % TILE_UPLOAD_RING_MAX_REGIONS);
+		if (!region->is_consumed) {
+			break; // still in flight (regions are reclaimed in order)
+		}
+		if (region->fence) {
+			GLenum status = glClientWaitSync(region->fence, 0, 0);
+			if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+				break;
+			}
+			glDeleteSync(region->fence);
+			region->fence = NULL;
+		}
+		ring->tail = region->end;
+		++ring->first_region_id;
+	}
+	benaphore_unlock(&ring->lock);
+}
+
+static inline i64 tile_texture_page_get_size(tile_texture_page_t* page) {
+	return (i64)page->tile_width * page->tile_height * 4 * page->layer_count;
+}
+
+static i64 tile_texture_pool_get_budget() {
+	return MEGABYTES((i64)ATLEAST(tile_texture_pool_budget_in_mb, 1));
+}
+
+static i32 tile_texture_page_get_layer_count(i32 tile_width, i32 tile_height) {
+	i64 tile_size = (i64)tile_width * tile_height * 4;
+	i32 layer_count = (i32)(TILE_TEXTURE_PAGE_TARGET_SIZE / ATLEAST(tile_size, 1));
+	layer_count = CLAMP(layer_count, TILE_TEXTURE_PAGE_MIN_LAYERS, tile_texture_max_layers);
+	return layer_count;
+}
+
+static i32 tile_texture_size_class_get_index(i32 tile_width, i32 tile_height) {
+	for (i32 i = 0; i < arrlen(tile_texture_size_classes); ++i) {
+		if (tile_texture_size_classes[i].tile_width == tile_width && tile_texture_size_classes[i].tile_height == tile_height) {
+			return i;
+		}
+	}
+	tile_texture_size_class_t size_class = {};
+	size_class.tile_width = tile_width;
+	size_class.tile_height = tile_height;
+	arrput(tile_texture_size_classes, size_class);
+	return arrlen(tile_texture_size_classes) - 1;
+}
+
+static inline tile_texture_page_t* tile_texture_slot_get_page(u32 slot) {
+	return tile_texture_pages + TILE_TEXTURE_SLOT_PAGE(slot);
+}
+
+static void tile_texture_lru_unlink(u32 slot) {
+	tile_texture_page_t* page = tile_texture_slot_get_page(slot);
+	tile_texture_size_class_t* size_class = tile_texture_size_classes + page->size_class_index;
+	i32 layer = TILE_TEXTURE_SLOT_LAYER(slot);
+	u32 prev = page->lru_prev[layer];
+	u32 next = page->lru_next[layer];
+	if (prev) {
+		tile_texture_slot_get_page(prev)->lru_next[TILE_TEXTURE_SLOT_LAYER(prev)] = next;
+	} else {
+		size_class->lru_head = next;
+	}
+	if (next) {
+		tile_texture_slot_get_page(next)->lru_prev[TILE_TEXTURE_SLOT_LAYER(next)] = prev;
+	} else {
+		size_class->lru_tail = prev;
+	}
+	page->lru_prev[layer] = 0;
+	page->lru_next[layer] = 0;
+}
+
+static void tile_texture_lru_push_front(u32 slot) {
+	tile_texture_page_t* page = tile_texture_slot_get_page(slot);
+	tile_texture_size_class_t* size_class = tile_texture_size_classes + page->size_class_index;
+	i32 layer = TILE_TEXTURE_SLOT_LAYER(slot);
+	u32 old_head = size_class->lru_head;
+	page->lru_prev[layer] = 0;
+	page->lru_next[layer] = old_head;
+	if (old_head) {
+		tile_texture_slot_get_page(old_head)->lru_prev[TILE_TEXTURE_SLOT_LAYER(old_head)] = slot;
+	} else {
+		size_class->lru_tail = slot;
+	}
+	size_class->lru_head = slot;
+}
+
+// Keep the LRU list ordered by time_last_drawn: tiles drawn in the current frame are all at the front.
+static inline void tile_texture_mark_drawn(tile_t* tile, i64 frame_counter) {
+	if (tile->time_last_drawn != frame_counter) {
+		tile->time_last_drawn = frame_counter;
+		tile_texture_lru_unlink(tile->texture_slot);
+		tile_texture_lru_push_front(tile->texture_slot);
+	}
+}
+
+static void tile_texture_page_add_to_free_page_list(i32 page_index) {
+	tile_texture_page_t* page = tile_texture_pages + page_index;
+	if (!page->is_in_free_page_list) {
+		arrput(tile_texture_size_classes[page->size_class_index].pages_with_free_layers, page_index);
+		page->is_in_free_page_list = true;
+	}
+}
+
+// Hand out a free layer of the page; pages without free layers leave the free page list.
+static u32 tile_texture_page_take_free_layer(i32 page_index) {
+	tile_texture_page_t* page = tile_texture_pages + page_index;
+	ASSERT(arrlen(page->free_layers) > 0);
+	i32 layer = arrpop(page->free_layers);
+	if (arrlen(page->free_layers) == 0 && page->is_in_free_page_list) {
+		i32* pages_with_free_layers = tile_texture_size_classes[page->size_class_index].pages_with_free_layers;
+		for (i32 i = arrlen(pages_with_free_layers) - 1; i >= 0; --i) { // usually the last one
+			if (pages_with_free_layers[i] == page_index) {
+				arrdel(pages_with_free_layers, i);
+				break;
+			}
+		}
+		page->is_in_free_page_list = false;
+	}
+	return TILE_TEXTURE_SLOT(page_index, layer);
+}
+
+static i32 tile_texture_page_create(i32 tile_width, i32 tile_height) {
+	i32 layer_count = tile_texture_page_get_layer_count(tile_width, tile_height);
+
+	tile_texture_page_t page = {};
+	page.tile_width = tile_width;
+	page.tile_height = tile_height;
+	page.layer_count = layer_count;
+	page.size_class_index = tile_texture_size_class_get_index(tile_width, tile_height);
+	arrsetcap(page.free_layers, layer_count);
+	for (i32 layer = layer_count - 1; layer >= 0; --layer) {
+		arrput(page.free_layers, layer); // lowest layers get handed out first
+	}
+	page.owners = (tile_t**) calloc(layer_count, sizeof(tile_t*));
+	page.lru_prev = (u32*) calloc(layer_count, sizeof(u32));
+	page.lru_next = (u32*) calloc(layer_count, sizeof(u32));
+
+	glGenTextures(1, &page.texture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, page.texture);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, default_texture_mag_filter);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, default_texture_min_filter);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, tile_width, tile_height, layer_count, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	// Reuse the index of a deleted page, if possible (the page index is part of the slot number)
+	i32 page_index = -1;
+	for (i32 i = 0; i < arrlen(tile_texture_pages); ++i) {
+		if (tile_texture_pages[i].texture == 0) {
+			page_index = i;
+			tile_texture_pages[i] = page;
+			break;
+		}
+	}
+	if (page_index < 0) {
+		page_index = arrlen(tile_texture_pages);
+		arrput(tile_texture_pages, page);
+	}
+	tile_texture_page_add_to_free_page_list(page_index);
+	tile_texture_pool_allocated_bytes += tile_texture_page_get_size(&page);
+	console_print_verbose("Tile texture pool: allocated page %d (%d layers of %dx%d)\n", page_index, layer_count, tile_width, tile_height);
+	return page_index;
+}
+
+static void tile_texture_page_destroy(i32 page_index) {
+	tile_texture_page_t* page = tile_texture_pages + page_index;
+	for (i32 layer = 0; layer < page->layer_count; ++layer) {
+		if (page->owners[layer]) {
+			unload_tile_texture(page->owners[layer]);
+		}
+	}
+	if (page->is_in_free_page_list) {
+		tile_texture_size_class_t* size_class = tile_texture_size_classes + page->size_class_index;
+		for (i32 i = 0; i < arrlen(size_class->pages_with_free_layers); ++i) {
+			if (size_class->pages_with_free_layers[i] == page_index) {
+				arrdel(size_class->pages_with_free_layers, i);
+				break;
+			}
+		}
+	}
+	tile_texture_pool_allocated_bytes -= tile_texture_page_get_size(page);
+	glDeleteTextures(1, &page->texture);
+	arrfree(page->free_layers);
+	free(page->owners);
+	free(page->lru_prev);
+	free(page->lru_next);
+	memset(page, 0, sizeof(*page));
+	console_print_verbose("Tile texture pool: released page %d\n", page_index);
+}
+
+static inline bool tile_texture_is_recently_drawn(tile_t* tile, i64 frame_counter) {
+	// Tiles drawn in the current or the previous frame are still on screen.
+	return tile->time_last_drawn >= frame_counter - 1;
+}
+
+// Find the least recently drawn tile of the given tile size. Returns 0 if all of them are still on screen.
+static u32 tile_texture_pool_find_lru_slot(i32 size_class_index, i64 frame_counter) {
+	u32 lru_slot = tile_texture_size_classes[size_class_index].lru_tail;
+	if (lru_slot) {
+		tile_t* owner = tile_texture_slot_get_page(lru_slot)->owners[TILE_TEXTURE_SLOT_LAYER(lru_slot)];
+		if (tile_texture_is_recently_drawn(owner, frame_counter)) {
+			return 0;
+		}
+	}
+	return lru_slot;
+}
+
+// Find a page with a different tile size, of the size that was least recently drawn from (empty pages come first).
+// Returns -1 if there is no such page, or if all of them are still on screen.
+static i32 tile_texture_pool_find_lru_page_of_other_size(i32 size_class_index, i64 frame_counter) {
+	i32 lru_size_class_index = -1;
+	i64 lru_time = INT64_MAX;
+	for (i32 i = 0; i < arrlen(tile_texture_size_classes); ++i) {
+		if (i == size_class_index) continue;
+		// The front of the LRU list tells us when any tile of this size was last drawn
+		u32 head = tile_texture_size_classes[i].lru_head;
+		i64 time = head ? tile_texture_slot_get_page(head)->owners[TILE_TEXTURE_SLOT_LAYER(head)]->time_last_drawn : -1;
+		if (time < lru_time && time < frame_counter - 1) {
+			lru_time = time;
+			lru_size_class_index = i;
+		}
+	}
+	if (lru_size_class_index < 0) {
+		return -1;
+	}
+	i32 lru_page_index = -1;
+	for (i32 page_index = 0; page_index < arrlen(tile_texture_pages); ++page_index) {
+		tile_texture_page_t* page = tile_texture_pages + page_index;
+		if (page->texture == 0 || page->size_class_index != lru_size_class_index) continue;
+		if (lru_page_index < 0 || arrlen(page->free_layers) > arrlen(tile_texture_pages[lru_page_index].free_layers)) {
+			lru_page_index = page_index;
+		}
+	}
+	return lru_page_index;
+}
+
+static u32 tile_texture_pool_allocate_slot(i32 tile_width, i32 tile_height, i64 frame_counter) {
+	// Use a free layer in an existing page, if there is one
+	i32 size_class_index = tile_texture_size_class_get_index(tile_width, tile_height);
+	i32* pages_with_free_layers = tile_texture_size_classes[size_class_index].pages_with_free_layers;
+	if (arrlen(pages_with_free_layers) > 0) {
+		return tile_texture_page_take_free_layer(arrlast(pages_with_free_layers));
+	}
+
+	i64 budget = tile_texture_pool_get_budget();
+	i64 new_page_size = (i64)tile_width * tile_height * 4 * tile_texture_page_get_layer_count(tile_width, tile_height);
+	i32 page_index = -1;
+	for (;;) {
+		if (tile_texture_pool_allocated_bytes + new_page_size <= budget) {
+			page_index = tile_texture_page_create(tile_width, tile_height);
+			break;
+		}
+		// Over budget: first try to get rid of pages holding tiles of another size (e.g. from a previous slide)
+		i32 other_page_index = tile_texture_pool_find_lru_page_of_other_size(size_class_index, frame_counter);
+		if (other_page_index >= 0 && arrlen(tile_texture_pages[other_page_index].free_layers) == tile_texture_pages[other_page_index].layer_count) {
+			tile_texture_page_destroy(other_page_index);
+			continue;
+		}
+		// Recycle the slot of the least recently drawn tile
+		u32 lru_slot = tile_texture_pool_find_lru_slot(size_class_index, frame_counter);
+		if (lru_slot != 0) {
+			tile_texture_page_t* page = tile_texture_slot_get_page(lru_slot);
+			unload_tile_texture(page->owners[TILE_TEXTURE_SLOT_LAYER(lru_slot)]);
+			return tile_texture_page_take_free_layer(TILE_TEXTURE_SLOT_PAGE(lru_slot));
+		}
+		if (other_page_index >= 0) {
+			tile_texture_page_destroy(other_page_index);
+			continue;
+		}
+		// Everything in the pool is on screen right now; we have no choice but to exceed the budget.
+		if (!tile_texture_pool_warned_over_budget) {
+			console_print("Warning: the visible tiles do not fit in the GPU tile memory budget (%d MB)\n", tile_texture_pool_budget_in_mb);
+			tile_texture_pool_warned_over_budget = true;
+		}
+		page_index = tile_texture_page_create(tile_width, tile_height);
+		break;
+	}
+	return tile_texture_page_take_free_layer(page_index);
+}
+
+void tile_texture_pool_get_usage(i64* allocated_bytes, i64* used_bytes) {
+	*allocated_bytes = tile_texture_pool_allocated_bytes;
+	*used_bytes = tile_texture_pool_used_bytes;
+}
+
+// Upload the pixels of a tile (BGRA) into a free slot in the texture pool.
+// If ring_region is nonzero, the pixels were already staged in the upload ring by tile_upload_ring_stage().
+void upload_tile_texture(app_state_t* app_state, tile_t* tile, i32 width, i32 height, u8* pixels, i32 ring_region) {
+	if (tile->texture != 0) {
+		unload_tile_texture(tile);
+	}
+	u32 slot = tile_texture_pool_allocate_slot(width, height, app_state->frame_counter);
+	tile_texture_page_t* page = tile_texture_pages + TILE_TEXTURE_SLOT_PAGE(slot);
+	page->owners[TILE_TEXTURE_SLOT_LAYER(slot)] = tile;
+	tile_texture_lru_push_front(slot);
+	tile_texture_pool_used_bytes += (i64)width * height * 4;
+
+	size_t pbo_offset = 0;
+	if (ring_region) {
+		tile_upload_region_t* region = tile_upload_ring.regions + ((u32)(ring_region - 1) % TILE_UPLOAD_RING_MAX_REGIONS);
+		pbo_offset = region->begin % tile_upload_ring.size;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, tile_upload_ring.pbo);
+		++tile_render_stats.upload_via_ring_count;
+	} else {
+		// Copy the pixels into a PBO; the transfer to the texture can then happen asynchronously.
+		pixel_transfer_state_t* transfer_state = app_state->pixel_transfer_states + app_state->next_pixel_transfer_to_submit;
+		app_state->next_pixel_transfer_to_submit = (app_state->next_pixel_transfer_to_submit + 1) % COUNT(app_state->pixel_transfer_states);
+		i64 buffer_size = (i64)width * height * 4;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, transfer_state->pbo);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, buffer_size, NULL, GL_STREAM_DRAW);
+		void* mapped_buffer = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+		memcpy(mapped_buffer, pixels, buffer_size);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	}
+
+	glBindTexture(GL_TEXTURE_2D_ARRAY, page->texture);
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, TILE_TEXTURE_SLOT_LAYER(slot), width, height, 1, GL_BGRA, GL_UNSIGNED_BYTE, (void*)pbo_offset);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	if (ring_region) {
+		tile_upload_ring_release(ring_region, true);
+	}
+	++tile_render_stats.upload_count;
+
+	tile->texture = page->texture;
+	tile->texture_slot = slot;
+	tile->time_last_drawn = app_state->frame_counter; // don't immediately become a candidate for eviction
+	tile->texture_generation = ++tile_texture_generation;
+}
+
+// Release the texture of a tile: either give its slot back to the pool, or delete its standalone texture.
+void unload_tile_texture(tile_t* tile) {
+	if (tile->texture_slot != 0) {
+		u32 page_index = TILE_TEXTURE_SLOT_PAGE(tile->texture_slot);
+		i32 layer = TILE_TEXTURE_SLOT_LAYER(tile->texture_slot);
+		ASSERT(page_index < arrlen(tile_texture_pages));
+		tile_texture_page_t* page = tile_texture_pages + page_index;
+		ASSERT(page->owners[layer] == tile);
+		tile_texture_lru_unlink(tile->texture_slot);
+		page->owners[layer] = NULL;
+		arrput(page->free_layers, layer);
+		tile_texture_page_add_to_free_page_list(page_index);
+		tile_texture_pool_used_bytes -= (i64)page->tile_width * page->tile_height * 4;
+	} else if (tile->texture != 0) {
+		unload_texture(tile->texture);
+	}
+	tile->texture = 0;
+	tile->texture_slot = 0;
+	tile->texture_generation = ++tile_texture_generation;
+}
+
+// Call this after assigning a standalone texture to tile->texture directly.
+void notify_tile_texture_changed(tile_t* tile) {
+	tile->texture_generation = ++tile_texture_generation;
+}
+
+void level_draw_cache_destroy(level_draw_cache_t* cache) {
+	if (cache->vao) glDeleteVertexArrays(1, &cache->vao);
+	if (cache->instance_vbo) glDeleteBuffers(1, &cache->instance_vbo);
+	arrfree(cache->batches);
+	arrfree(cache->pooled_tile_indices);
+	arrfree(cache->standalone_tile_indices);
+	memset(cache, 0, sizeof(*cache));
+}
+
+static void level_draw_cache_set_instance_offset(i32 first_instance) {
+	// glDrawElementsInstancedBaseInstance() needs OpenGL 4.2, so instead point the attributes at the first instance.
+	size_t offset = (size_t)first_instance * sizeof(tile_instance_t);
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(tile_instance_t), (void*)(offset + offsetof(tile_instance_t, tile_pos)));
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(tile_instance_t), (void*)(offset + offsetof(tile_instance_t, layer)));
+}
+
+static void level_draw_cache_init(level_draw_cache_t* cache) {
+	glGenVertexArrays(1, &cache->vao);
+	glBindVertexArray(cache->vao);
+
+	glBindBuffer(GL_ARRAY_BUFFER, tile_mesh_vbo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, tile_mesh_ebo);
+	u32 vertex_stride = 5 * sizeof(float);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, vertex_stride, (void*)0); // position coordinates
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, vertex_stride, (void*)(3*sizeof(float))); // texture coordinates
+	glEnableVertexAttribArray(1);
+
+	glGenBuffers(1, &cache->instance_vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, cache->instance_vbo);
+	level_draw_cache_set_instance_offset(0);
+	glEnableVertexAttribArray(2);
+	glVertexAttribDivisor(2, 1);
+	glEnableVertexAttribArray(3);
+	glVertexAttribDivisor(3, 1);
+
+	glBindVertexArray(0);
+}
+
+static void level_draw_cache_rebuild(level_draw_cache_t* cache, level_image_t* level_image, bounds2i visible_tiles) {
+	if (!cache->vao) {
+		level_draw_cache_init(cache);
+	}
+	arrsetlen(cache->batches, 0);
+	arrsetlen(cache->pooled_tile_indices, 0);
+	arrsetlen(cache->standalone_tile_indices, 0);
+	cache->missing_tile_count = 0;
+
+	// Sort the pooled tiles by page (counting sort), so that each page can be drawn in one go.
+	i32 page_count = arrlen(tile_texture_pages);
+	arrsetlen(tile_scratch_page_offsets, page_count + 1);
+	memset(tile_scratch_page_offsets, 0, (page_count + 1) * sizeof(i32));
+	for (i32 tile_y = visible_tiles.min.y; tile_y < visible_tiles.max.y; ++tile_y) {
+		for (i32 tile_x = visible_tiles.min.x; tile_x < visible_tiles.max.x; ++tile_x) {
+			u32 tile_index = tile_y * level_image->width_in_tiles + tile_x;
+			tile_t* tile = level_image->tiles + tile_index;
+			if (tile->texture_slot != 0) {
+				arrput(cache->pooled_tile_indices, tile_index);
+				++tile_scratch_page_offsets[TILE_TEXTURE_SLOT_PAGE(tile->texture_slot) + 1];
+			} else if (tile->texture != 0) {
+				arrput(cache->standalone_tile_indices, tile_index);
+			} else {
+				++cache->missing_tile_count;
+			}
+		}
+	}
+	for (i32 i = 0; i < page_count; ++i) {
+		tile_scratch_page_offsets[i + 1] += tile_scratch_page_offsets[i];
+	}
+
+	i32 instance_count = arrlen(cache->pooled_tile_indices);
+	arrsetlen(tile_scratch_instances, instance_count);
+	arrsetlen(tile_scratch_page_cursors, page_count);
+	memcpy(tile_scratch_page_cursors, tile_scratch_page_offsets, page_count * sizeof(i32));
+	for (i32 i = 0; i < instance_count; ++i) {
+		u32 tile_index = cache->pooled_tile_indices[i];
+		tile_t* tile = level_image->tiles + tile_index;
+		u32 page_index = TILE_TEXTURE_SLOT_PAGE(tile->texture_slot);
+		tile_instance_t* instance = tile_scratch_instances + tile_scratch_page_cursors[page_index]++;
+		instance->tile_pos = V2F((float)(tile_index % level_image->width_in_tiles), (float)(tile_index / level_image->width_in_tiles));
+		instance->layer = (float)TILE_TEXTURE_SLOT_LAYER(tile->texture_slot);
+	}
+
+	for (i32 page_index = 0; page_index < page_count; ++page_index) {
+		i32 first_instance = tile_scratch_page_offsets[page_index];
+		i32 count = tile_scratch_page_offsets[page_index + 1] - first_instance;
+		if (count == 0) continue;
+		if (tile_rendering_use_instancing) {
+			tile_draw_batch_t batch = {tile_texture_pages[page_index].texture, first_instance, count};
+			arrput(cache->batches, batch);
+		} else {
+			// One draw call per tile (for comparison)
+			for (i32 i = 0; i < count; ++i) {
+				tile_draw_batch_t batch = {tile_texture_pages[page_index].texture, first_instance + i, 1};
+				arrput(cache->batches, batch);
+			}
+		}
+	}
+
+	if (instance_count > 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, cache->instance_vbo);
+		glBufferData(GL_ARRAY_BUFFER, instance_count * sizeof(tile_instance_t), tile_scratch_instances, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	cache->visible_tiles = visible_tiles;
+	cache->texture_generation = tile_texture_generation;
+	cache->use_instancing = tile_rendering_use_instancing;
+	cache->is_valid = true;
+}
+
+// Set the uniforms that are the same for all levels (mirrors the uniforms of the basic shader).
+void tile_shader_set_uniforms(app_state_t* app_state, scene_t* scene, mat4x4 projection_view_matrix) {
+	glUseProgram(tile_shader.program);
+	glUniform1i(tile_shader.u_tex, 0);
+	glUniformMatrix4fv(tile_shader.u_projection_view_matrix, 1, GL_FALSE, &projection_view_matrix[0][0]);
+	glUniform3fv(tile_shader.u_background_color, 1, (GLfloat *) &app_state->clear_color);
+	if (app_state->use_image_adjustments) {
+		glUniform1f(tile_shader.u_black_level, app_state->black_level);
+		glUniform1f(tile_shader.u_white_level, app_state->white_level);
+	} else {
+		glUniform1f(tile_shader.u_black_level, 0.0f);
+		glUniform1f(tile_shader.u_white_level, 1.0f);
+	}
+	glUniform1i(tile_shader.u_use_transparent_filter, scene->use_transparent_filter);
+	if (scene->use_transparent_filter) {
+		glUniform3fv(tile_shader.u_transparent_color, 1, (GLfloat *) &scene->transparent_color);
+		glUniform1f(tile_shader.u_transparent_tolerance, scene->transparent_tolerance);
+	}
+}
+
+// Enable warping of the tiles by a deformation field (pass NULL to disable). Applies to the following draw_level_tiles() calls.
+// Expects tile_shader_set_uniforms() to have been called.
+void tile_shader_set_deformation_field(deformation_field_t* field) {
+	tile_use_deformation = (field != NULL && field->is_enabled && field->patches_filtered > 0);
+	if (tile_use_deformation) {
+		if (field->texture == 0 || field->texture_generation != field->generation) {
+			if (field->texture == 0) {
+				glGenTextures(1, &field->texture);
+				glBindTexture(GL_TEXTURE_2D, field->texture);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			} else {
+				glBindTexture(GL_TEXTURE_2D, field->texture);
+			}
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, field->grid_width, field->grid_height, 0, GL_RG, GL_FLOAT, field->displacements);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			field->texture_generation = field->generation;
+		}
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, field->texture);
+		glActiveTexture(GL_TEXTURE0);
+		glUniform1i(tile_shader.u_deformation_field, 1);
+		glUniform2f(tile_shader.u_deformation_field_extent, field->grid_width * field->spacing.x, field->grid_height * field->spacing.y);
+	}
+	glUniform1i(tile_shader.u_use_deformation, tile_use_deformation);
+}
+
+static bool level_draw_cache_is_outdated(level_draw_cache_t* cache, level_image_t* level_image, bounds2i visible_tiles) {
+	if (!cache->is_valid || cache->use_instancing != tile_rendering_use_instancing ||
+	    memcmp(&cache->visible_tiles, &visible_tiles, sizeof(bounds2i)) != 0) {
+		return true;
+	}
+	// Only changes to the visible tiles of this level matter
+	for (i32 tile_y = visible_tiles.min.y; tile_y < visible_tiles.max.y; ++tile_y) {
+		tile_t* row = level_image->tiles + tile_y * level_image->width_in_tiles;
+		for (i32 tile_x = visible_tiles.min.x; tile_x < visible_tiles.max.x; ++tile_x) {
+			if (row[tile_x].texture_generation > cache->texture_generation) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Draw the visible tiles of a level. Returns the number of visible tiles that are not (yet) available.
+// Expects tile_shader_set_uniforms() to have been called; leaves the basic shader active afterwards.
+i32 draw_level_tiles(app_state_t* app_state, level_image_t* level_image, bounds2i visible_tiles) {
+	level_draw_cache_t* cache = &level_image->draw_cache;
+	if (level_draw_cache_is_outdated(cache, level_image, visible_tiles)) {
+		level_draw_cache_rebuild(cache, level_image, visible_tiles);
+	}
+
+	i32 pooled_tile_count = arrlen(cache->pooled_tile_indices);
+	for (i32 i = 0; i < pooled_tile_count; ++i) {
+		tile_texture_mark_drawn(level_image->tiles + cache->pooled_tile_indices[i], app_state->frame_counter);
+	}
+
+	i32 batch_count = arrlen(cache->batches);
+	if (batch_count > 0) {
+		glUseProgram(tile_shader.program);
+		glUniform2f(tile_shader.u_level_origin, level_image->origin_offset.x, level_image->origin_offset.y);
+		glUniform2f(tile_shader.u_tile_side, level_image->x_tile_side_in_um, level_image->y_tile_side_in_um);
+		glBindVertexArray(cache->vao);
+		glBindBuffer(GL_ARRAY_BUFFER, cache->instance_vbo);
+		glActiveTexture(GL_TEXTURE0);
+		i32 index_count = tile_use_deformation ? TILE_MESH_SUBDIVIDED_INDEX_COUNT : TILE_MESH_QUAD_INDEX_COUNT;
+		void* index_offset = (void*)(tile_use_deformation ? TILE_MESH_QUAD_INDEX_COUNT * sizeof(u16) : 0);
+		for (i32 i = 0; i < batch_count; ++i) {
+			tile_draw_batch_t* batch = cache->batches + i;
+			level_draw_cache_set_instance_offset(batch->first_instance);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, batch->texture);
+			glDrawElementsInstanced(GL_TRIANGLES, index_count, GL_UNSIGNED_SHORT, index_offset, batch->instance_count);
+		}
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindVertexArray(0);
+		tile_render_stats.draw_call_count += batch_count;
+	}
+
+	// Tiles that have their own texture (e.g. simple images) are drawn one at a time (without deformation)
+	glUseProgram(basic_shader.program);
+	i32 standalone_tile_count = arrlen(cache->standalone_tile_indices);
+	for (i32 i = 0; i < standalone_tile_count; ++i) {
+		u32 tile_index = cache->standalone_tile_indices[i];
+		tile_t* tile = level_image->tiles + tile_index;
+		tile->time_last_drawn = app_state->frame_counter;
+		i32 tile_x = tile_index % level_image->width_in_tiles;
+		i32 tile_y = tile_index / level_image->width_in_tiles;
+
+		float tile_pos_x = level_image->origin_offset.x + level_image->x_tile_side_in_um * tile_x;
+		float tile_pos_y = level_image->origin_offset.y + level_image->y_tile_side_in_um * tile_y;
+
+		mat4x4 model_matrix;
+		mat4x4_translate(model_matrix, tile_pos_x, tile_pos_y, 0.0f);
+		mat4x4_scale_aniso(model_matrix, model_matrix, level_image->x_tile_side_in_um,
+		                   level_image->y_tile_side_in_um, 1.0f);
+		glUniformMatrix4fv(basic_shader.u_model_matrix, 1, GL_FALSE, &model_matrix[0][0]);
+
+		draw_rect(tile->texture);
+	}
+	tile_render_stats.draw_call_count += standalone_tile_count;
+	tile_render_stats.tile_count += pooled_tile_count + standalone_tile_count;
+
+	return cache->missing_tile_count;
+}
+
+// Accumulate the time spent on drawing tiles, and periodically report the averages in the console.
+void tile_render_stats_update(app_state_t* app_state, float seconds_elapsed) {
+	tile_render_stats_t* stats = &tile_render_stats;
+	stats->seconds_elapsed += seconds_elapsed;
+	if (stats->last_frame_counter != app_state->frame_counter) {
+		stats->last_frame_counter = app_state->frame_counter;
+		++stats->frame_count;
+	}
+	i64 now = get_clock();
+	if (stats->period_start == 0) {
+		stats->period_start = now;
+	} else if (get_seconds_elapsed(stats->period_start, now) > 2.0f) {
+		if (tile_rendering_log_stats && stats->frame_count > 0) {
+			float frames = (float)stats->frame_count;
+			console_print("Tile rendering (%s): %.3f ms/frame (CPU), %.1f draw calls/frame, %.1f tiles/frame\n",
+			              tile_rendering_use_instancing ? "instanced" : "one draw call per tile",
+			              stats->seconds_elapsed * 1000.0f / frames, stats->draw_call_count / frames,
+			              stats->tile_count / frames);
+			if (stats->upload_count > 0) {
+				console_print("Tile uploads: %.2f tiles/frame (%d uploaded, %d via the persistent upload ring)\n",
+				              stats->upload_count / frames, stats->upload_count, stats->upload_via_ring_count);
+			}
+		}
+		memset(stats, 0, sizeof(*stats));
+		stats->period_start = now;
+		stats->last_frame_counter = app_state->frame_counter;
+	}
+}
@@ -32,6 +32,7 @@ void viewer_init_options(app_state_t* app_state) {
 	ini_register_i32(ini, "window_height", &desired_window_height);
 	ini_register_bool(ini, "window_start_maximized", &window_start_maximized);
 	ini_register_bool(ini, "vsync", &is_vsync_enabled);
+	ini_register_i32(ini, "gpu_tile_memory_budget_mb", &tile_texture_pool_budget_in_mb);
 
 	ini_apply(ini);
 }
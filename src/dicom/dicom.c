@@ -269,7 +269,7 @@ static inline u32 dicom_get_element_length_without_trailing_whitespace(u8* eleme
 }
 
 // Print information about a data element
-static void debug_print_dicom_element(dicom_instance_t* instance, dicom_data_element_t element, FILE* out, i32 nesting_level, u32 item_number) {
+static void debug_print_dicom_element(dicom_instance_t* instance, dicom_data_element_t element, memrw_t* out, i32 nesting_level, u32 item_number) {
 	memrw_t string_builder = memrw_create(512);
 	if (nesting_level > 0) {
 		for (i32 i = 1; i < nesting_level; ++i) {
@@ -343,18 +343,40 @@ static void debug_print_dicom_element(dicom_instance_t* instance, dicom_data_ele
 	}
 	memrw_putc('\n', &string_builder);
 
-	memrw_putc('\0', &string_builder);
-	console_print_verbose("%s", string_builder.data);
 	if (out) {
-		fprintf(out, "%s", string_builder.data);
+		memrw_write(string_builder.data, out, (i64)string_builder.used_size);
 	}
 	memrw_destroy(&string_builder);
 }
 
 static void handle_dicom_tag_for_tag_dumping(dicom_series_t* series, dicom_instance_t* instance, dicom_data_element_t element) {
 	u32 current_item_number = instance->pos_stack[instance->nesting_level].item_number;
-	debug_print_dicom_element(instance, element, series->debug_output_file, instance->nesting_level,
-	                          current_item_number);
+	if (instance->debug_log.data) {
+		debug_print_dicom_element(instance, element, &instance->debug_log, instance->nesting_level,
+		                          current_item_number);
+	}
+}
+
+// Instances may be loaded concurrently, so each instance collects its own tag dump output.
+// This is written out afterwards, one instance at a time, so that the output does not get interleaved.
+static void dicom_flush_instance_debug_log(dicom_series_t* series, dicom_instance_t* instance) {
+	memrw_t* log = &instance->debug_log;
+	if (log->data && log->used_size > 0) {
+		if (series->debug_output_file) {
+			fwrite(log->data, 1, log->used_size, series->debug_output_file);
+		}
+		if (is_verbose_mode) {
+			const char* line = (const char*)log->data;
+			const char* end = line + log->used_size;
+			while (line < end) {
+				const char* line_end = memchr(line, '\n', end - line);
+				i32 line_length = (i32)(line_end ? line_end - line : end - line);
+				console_print_verbose("%.*s\n", line_length, line);
+				line += line_length + 1;
+			}
+		}
+	}
+	memrw_destroy(log);
 }
 
 
@@ -784,11 +806,14 @@ bool dicom_read_encapsulated_pixel_data_item(dicom_instance_t* instance, dicom_d
 				instance->pixel_data_offset_count = offset_count;
 				instance->pixel_data_start_offset = element.data_offset + element.length;
                 ASSERT(instance->pixel_data_offsets == NULL);
-				instance->pixel_data_offsets = malloc(offset_count * sizeof(u32));
+				instance->pixel_data_offsets = malloc(offset_count * sizeof(u64));
 				ASSERT(offset_count == instance->number_of_frames);
 				ASSERT(instance->pixel_data_offsets != NULL);
 				ASSERT(offset_count * sizeof(u32) == element.length);
-				memcpy(instance->pixel_data_offsets, instance->data + element.data_offset, offset_count * sizeof(u32));
+				u32* basic_offset_table = (u32*)(instance->data + element.data_offset);
+				for (i32 i = 0; i < offset_count; ++i) {
+					instance->pixel_data_offsets[i] = basic_offset_table[i];
+				}
                 ASSERT(instance->pixel_data_sizes == NULL);
 				instance->pixel_data_sizes = malloc(offset_count * sizeof(u32));
 				for (i32 i = 0; i < offset_count - 1; ++i) {
@@ -821,7 +846,7 @@ bool dicom_read_encapsulated_pixel_data_item(dicom_instance_t* instance, dicom_d
 				instance->pixel_data_start_offset = element.data_offset + element.length;
                 ASSERT(instance->pixel_data_offsets == NULL);
                 ASSERT(instance->pixel_data_sizes == NULL);
-				instance->pixel_data_offsets = calloc(1, instance->pixel_data_offset_count * sizeof(u32));
+				instance->pixel_data_offsets = calloc(1, instance->pixel_data_offset_count * sizeof(u64));
 				instance->pixel_data_sizes = calloc(1, instance->pixel_data_offset_count * sizeof(u32));
 
 				// We might be lucky if we have already read to the end of the file.
@@ -1061,60 +1086,388 @@ bool dicom_read_chunk(dicom_instance_t* instance) {
 
 }
 
-bool dicom_instance_index_pixel_data(dicom_instance_t* instance) {
-    bool success = false;
-    if (instance->is_pixel_data_encapsulated && !instance->are_all_offsets_read) {
-
-        size_t chunk_size = MEGABYTES(4);
-        temp_memory_t temp = begin_temp_memory_on_local_thread();
-        void* chunk = arena_push_size(temp.arena, chunk_size);
-        size_t filesize = instance->total_bytes_in_stream  + (i64)sizeof(dicom_header_t);
-
-        bool finished = false;
-        do {
-            dicom_parser_pos_t* current_position = instance->pos_stack + instance->nesting_level;
-            i64 file_offset = current_position->element.data_offset + (i64)sizeof(dicom_header_t);
-            size_t bytes_left_in_file = filesize - file_offset;
-            ASSERT(bytes_left_in_file >= 0);
-            size_t bytes_to_read = MIN(chunk_size, bytes_left_in_file);
-
-            size_t bytes_read = file_handle_read_at_offset(chunk, instance->file_handle, file_offset, bytes_to_read);
-
-            if (bytes_read == bytes_to_read) {
-                // Hack: trick the parser into thinking the data buffer actually starts at the start of the DICOM stream,
-                // even though we are skipping that and really starting where we left off previously
-                // NOTE: this means that instance->data now points to an invalid memory location (caution!)
-                instance->data = (u8*)chunk - current_position->element.data_offset;
-                instance->bytes_read_from_file = current_position->element.data_offset + (i64)bytes_to_read;
-
-                finished = dicom_read_chunk(instance);
-
-            } else {
-                console_print_error("dicom_instance_index_pixel_data(): error reading DICOM instance from file\n");
-                break;
-            }
-        } while (!finished);
-        success = finished;
-
-        release_temp_memory(&temp);
-    }
+// Indexing of encapsulated pixel data without a Basic Offset Table.
+// The pixel data is split into ranges that are scanned in parallel on the worker threads. Each worker first resyncs
+// on an Item tag (FFFE,E000) whose length chains to further Items, and then walks the chain by reading only the
+// 8-byte item headers. Completed ranges are stitched together in file order, and their frame offsets are published
+// to the tiles immediately, so that visible tiles can start loading while the rest of the file is still being indexed.
+// The resulting offset table is saved in a sidecar file next to the DICOM file, so it can be reused next time.
+
+#define DICOM_INDEX_RANGE_SIZE MEGABYTES(128)
+#define DICOM_INDEX_RESYNC_CHUNK_SIZE MEGABYTES(1)
+#define DICOM_INDEX_RESYNC_CHAIN_LENGTH 3
+#define DICOM_OFFSET_TABLE_SIGNATURE 0x544f4453 // 'SDOT'
+#define DICOM_OFFSET_TABLE_VERSION 1
+
+typedef struct dicom_index_range_t {
+	i64 begin; // file offsets
+	i64 end;
+	i64 first_item_offset; // -1 if no valid Item starts within this range
+	i64 next_item_offset; // where the chain continues after the last Item in this range
+	u64* item_offsets; // array
+	u32* item_sizes; // array
+	bool is_end_of_sequence_reached;
+	bool is_done;
+	bool failed;
+} dicom_index_range_t;
+
+typedef struct dicom_indexer_t {
+	dicom_instance_t* instance;
+	i64 filesize;
+	dicom_index_range_t* ranges;
+	i32 range_count;
+	i32 ranges_published;
+	i64 frames_published;
+	i64 expected_next_item_offset;
+	i32* frame_tile_indices; // tile index for each frame, -1 if there is no tile for the frame
+	bool is_end_of_sequence_reached;
+	bool failed;
+	benaphore_t lock;
+	volatile i32 ranges_remaining;
+} dicom_indexer_t;
+
+typedef struct dicom_index_range_task_t {
+	dicom_indexer_t* indexer;
+	i32 range_index;
+} dicom_index_range_task_t;
+
+static bool dicom_read_item_header(file_handle_t file_handle, i64 offset, i64 filesize, u32* tag, u32* length) {
+	if (offset + 8 > filesize) {
+		return false;
+	}
+	u32 header[2];
+	if (file_handle_read_at_offset(header, file_handle, offset, sizeof(header)) != sizeof(header)) {
+		return false;
+	}
+	*tag = header[0];
+	*length = header[1];
+	return true;
+}
 
-    if (!instance->are_all_offsets_read) {
-        console_print_error("dicom_instance_index_pixel_data(): frame offsets could not be read\n");
-        success = false;
-    }
+// Check that a candidate Item is followed by a plausible chain of Items (or the end of the sequence).
+static bool dicom_is_valid_item_chain(file_handle_t file_handle, i64 offset, i64 filesize) {
+	for (i32 i = 0; i < DICOM_INDEX_RESYNC_CHAIN_LENGTH; ++i) {
+		u32 tag = 0;
+		u32 length = 0;
+		if (!dicom_read_item_header(file_handle, offset, filesize, &tag, &length)) {
+			return false;
+		}
+		if (tag == DICOM_SequenceDelimitationItem) {
+			return (i > 0 && length == 0);
+		}
+		if (tag != DICOM_Item || length == DICOM_UNDEFINED_LENGTH) {
+			return false;
+		}
+		offset += 8 + (i64)length;
+		if (offset == filesize) {
+			return true; // the last Item may end exactly at the end of the file
+		}
+	}
+	return true;
+}
 
-    // update tiles
-    if (success) {
-        for (i32 i = 0; i < instance->tile_count; ++i) {
-            dicom_tile_t* tile = instance->tiles + i;
-            tile->data_offset_in_file = sizeof(dicom_header_t) + instance->pixel_data_start_offset + instance->pixel_data_offsets[tile->frame_index];
-            tile->data_size = instance->pixel_data_sizes[tile->frame_index];
-            tile->is_offset_known = true;
-        }
-    }
+// Find the first Item within the range that starts a valid chain of Items.
+static i64 dicom_index_resync_on_item(dicom_indexer_t* indexer, dicom_index_range_t* range) {
+	static const u8 item_tag_bytes[4] = {0xFE, 0xFF, 0x00, 0xE0};
+	file_handle_t file_handle = indexer->instance->file_handle;
+	i64 found_offset = -1;
+	temp_memory_t temp = begin_temp_memory_on_local_thread();
+	u8* chunk = arena_push_size(temp.arena, DICOM_INDEX_RESYNC_CHUNK_SIZE);
+	i64 chunk_offset = range->begin;
+	while (found_offset < 0 && chunk_offset < range->end) {
+		// Chunks overlap a little, so that tags straddling the chunk boundary are not missed.
+		size_t bytes_to_read = (size_t)MIN(DICOM_INDEX_RESYNC_CHUNK_SIZE, indexer->filesize - chunk_offset);
+		size_t bytes_read = file_handle_read_at_offset(chunk, file_handle, chunk_offset, bytes_to_read);
+		if (bytes_read < sizeof(item_tag_bytes)) {
+			break;
+		}
+		for (i64 i = 0; i <= (i64)bytes_read - 4; ++i) {
+			if (chunk_offset + i >= range->end) {
+				break;
+			}
+			if (chunk[i] == item_tag_bytes[0] && memcmp(chunk + i, item_tag_bytes, 4) == 0) {
+				if (dicom_is_valid_item_chain(file_handle, chunk_offset + i, indexer->filesize)) {
+					found_offset = chunk_offset + i;
+					break;
+				}
+			}
+		}
+		chunk_offset += (i64)bytes_read - 3;
+	}
+	release_temp_memory(&temp);
+	return found_offset;
+}
+
+// Walk the chain of Items starting at the given offset, until the end of the range is passed.
+static void dicom_index_walk_items(dicom_indexer_t* indexer, dicom_index_range_t* range, i64 start_offset) {
+	arrsetlen(range->item_offsets, 0);
+	arrsetlen(range->item_sizes, 0);
+	range->first_item_offset = start_offset;
+	range->next_item_offset = start_offset;
+	range->is_end_of_sequence_reached = false;
+	range->failed = false;
+	if (start_offset < 0) {
+		return;
+	}
+	i64 offset = start_offset;
+	while (offset < range->end) {
+		u32 tag = 0;
+		u32 length = 0;
+		if (!dicom_read_item_header(indexer->instance->file_handle, offset, indexer->filesize, &tag, &length)) {
+			// Running into the end of the file is not an error if the sequence was not terminated.
+			range->is_end_of_sequence_reached = (offset == indexer->filesize);
+			range->failed = !range->is_end_of_sequence_reached;
+			break;
+		}
+		if (tag == DICOM_SequenceDelimitationItem) {
+			range->is_end_of_sequence_reached = true;
+			break;
+		}
+		if (tag != DICOM_Item || length == DICOM_UNDEFINED_LENGTH || offset + 8 + (i64)length > indexer->filesize) {
+			range->failed = true;
+			break;
+		}
+		arrput(range->item_offsets, offset);
+		arrput(range->item_sizes, length + 8);
+		offset += 8 + (i64)length;
+	}
+	range->next_item_offset = offset;
+}
+
+static void dicom_index_publish_frame(dicom_indexer_t* indexer, i64 frame_index, u64 item_offset, u32 item_size) {
+	dicom_instance_t* instance = indexer->instance;
+	instance->pixel_data_offsets[frame_index] = item_offset - sizeof(dicom_header_t) - instance->pixel_data_start_offset;
+	instance->pixel_data_sizes[frame_index] = item_size;
+	i32 tile_index = indexer->frame_tile_indices[frame_index];
+	if (tile_index >= 0) {
+		dicom_tile_t* tile = instance->tiles + tile_index;
+		tile->data_offset_in_file = item_offset;
+		tile->data_size = item_size;
+		write_barrier;
+		tile->is_offset_known = true;
+	}
+}
+
+// Stitch together the ranges that are completed, in file order. Needs to be called with the lock held.
+static void dicom_index_publish_completed_ranges(dicom_indexer_t* indexer) {
+	dicom_instance_t* instance = indexer->instance;
+	while (indexer->ranges_published < indexer->range_count) {
+		dicom_index_range_t* range = indexer->ranges + indexer->ranges_published;
+		if (!range->is_done) {
+			break;
+		}
+		if (!indexer->is_end_of_sequence_reached && !indexer->failed) {
+			i64 expected_offset = indexer->expected_next_item_offset;
+			if (expected_offset < range->end && range->first_item_offset != expected_offset) {
+				// The worker resynced on something that is not actually part of the chain (or found nothing).
+				// Rare, but we can simply redo this range starting from the known position.
+				console_print_verbose("DICOM indexing: resync mismatch at offset %lld, rescanning range\n", expected_offset);
+				dicom_index_walk_items(indexer, range, expected_offset);
+			}
+			if (expected_offset < range->end) {
+				for (i32 i = 0; i < arrlen(range->item_offsets); ++i) {
+					if (indexer->frames_published >= instance->pixel_data_offset_count) {
+						console_print_error("DICOM indexing: more pixel data items than frames (%lld)\n", instance->number_of_frames);
+						indexer->failed = true;
+						break;
+					}
+					dicom_index_publish_frame(indexer, indexer->frames_published++, range->item_offsets[i], range->item_sizes[i]);
+				}
+				indexer->expected_next_item_offset = range->next_item_offset;
+				indexer->is_end_of_sequence_reached = range->is_end_of_sequence_reached;
+				if (range->failed) {
+					console_print_error("DICOM indexing: invalid pixel data item at offset %lld\n", range->next_item_offset);
+					indexer->failed = true;
+				}
+			}
+		}
+		arrfree(range->item_offsets);
+		arrfree(range->item_sizes);
+		indexer->ranges_published++;
+	}
+}
+
+static void dicom_index_range_task_func(i32 logical_thread_index, void* userdata) {
+	dicom_index_range_task_t* task = (dicom_index_range_task_t*) userdata;
+	dicom_indexer_t* indexer = task->indexer;
+	dicom_index_range_t* range = indexer->ranges + task->range_index;
 
-    return success;
+	// The first range starts right at the first Item, the others need to find their footing.
+	i64 start_offset = (task->range_index == 0) ? range->begin : dicom_index_resync_on_item(indexer, range);
+	dicom_index_walk_items(indexer, range, start_offset);
+
+	benaphore_lock(&indexer->lock);
+	range->is_done = true;
+	dicom_index_publish_completed_ranges(indexer);
+	benaphore_unlock(&indexer->lock);
+	atomic_decrement(&indexer->ranges_remaining);
+}
+
+static void dicom_get_offset_table_sidecar_filename(dicom_instance_t* instance, char* buffer, size_t buffer_size) {
+	snprintf(buffer, buffer_size, "%s.offsets", instance->filename);
+}
+
+typedef struct dicom_offset_table_header_t {
+	u32 signature;
+	u32 version;
+	i64 filesize;
+	i64 modification_time;
+	u32 pixel_data_start_offset;
+	u32 frame_count;
+} dicom_offset_table_header_t;
+
+static dicom_offset_table_header_t dicom_get_offset_table_header(dicom_instance_t* instance) {
+	dicom_offset_table_header_t header = {0};
+	header.signature = DICOM_OFFSET_TABLE_SIGNATURE;
+	header.version = DICOM_OFFSET_TABLE_VERSION;
+	header.filesize = instance->total_bytes_in_stream + (i64)sizeof(dicom_header_t);
+	struct stat st = {0};
+	if (platform_stat(instance->filename, &st) == 0) {
+		header.modification_time = (i64)st.st_mtime;
+	}
+	header.pixel_data_start_offset = instance->pixel_data_start_offset;
+	header.frame_count = instance->pixel_data_offset_count;
+	return header;
+}
+
+static bool dicom_load_offset_table_sidecar(dicom_instance_t* instance) {
+	char sidecar_filename[sizeof(instance->filename) + 16];
+	dicom_get_offset_table_sidecar_filename(instance, sidecar_filename, sizeof(sidecar_filename));
+	if (!file_exists(sidecar_filename)) {
+		return false;
+	}
+	bool success = false;
+	file_stream_t fp = file_stream_open_for_reading(sidecar_filename);
+	if (fp) {
+		dicom_offset_table_header_t expected = dicom_get_offset_table_header(instance);
+		dicom_offset_table_header_t header = {0};
+		u32 count = instance->pixel_data_offset_count;
+		if (file_stream_read(&header, sizeof(header), fp) == sizeof(header) && memcmp(&header, &expected, sizeof(header)) == 0 &&
+		    file_stream_read(instance->pixel_data_offsets, count * sizeof(u64), fp) == count * sizeof(u64) &&
+		    file_stream_read(instance->pixel_data_sizes, count * sizeof(u32), fp) == count * sizeof(u32)) {
+			success = true;
+			for (u32 i = 0; i < count; ++i) {
+				u64 end = instance->pixel_data_start_offset + instance->pixel_data_offsets[i] + instance->pixel_data_sizes[i];
+				if (end > (u64)instance->total_bytes_in_stream) {
+					success = false;
+					break;
+				}
+			}
+		}
+		file_stream_close(fp);
+		if (!success) {
+			console_print_verbose("DICOM: ignoring outdated or invalid offset table '%s'\n", sidecar_filename);
+		}
+	}
+	return success;
+}
+
+static void dicom_save_offset_table_sidecar(dicom_instance_t* instance) {
+	char sidecar_filename[sizeof(instance->filename) + 16];
+	dicom_get_offset_table_sidecar_filename(instance, sidecar_filename, sizeof(sidecar_filename));
+	// NOTE: the directory might not be writable; the sidecar is only an optimization, so failing is fine.
+	file_stream_t fp = file_stream_open_for_writing(sidecar_filename);
+	if (fp) {
+		dicom_offset_table_header_t header = dicom_get_offset_table_header(instance);
+		file_stream_write(&header, sizeof(header), fp);
+		file_stream_write(instance->pixel_data_offsets, instance->pixel_data_offset_count * sizeof(u64), fp);
+		file_stream_write(instance->pixel_data_sizes, instance->pixel_data_offset_count * sizeof(u32), fp);
+		file_stream_close(fp);
+	} else {
+		console_print_verbose("DICOM: could not write offset table '%s'\n", sidecar_filename);
+	}
+}
+
+static bool dicom_instance_index_pixel_data_in_parallel(dicom_instance_t* instance, i32 logical_thread_index) {
+	dicom_indexer_t indexer = {0};
+	indexer.instance = instance;
+	indexer.filesize = instance->total_bytes_in_stream + (i64)sizeof(dicom_header_t);
+	indexer.lock = benaphore_create();
+
+	i64 begin = (i64)sizeof(dicom_header_t) + instance->pixel_data_start_offset;
+	indexer.expected_next_item_offset = begin;
+	indexer.range_count = (i32)MAX(1, (indexer.filesize - begin + DICOM_INDEX_RANGE_SIZE - 1) / DICOM_INDEX_RANGE_SIZE);
+	indexer.ranges = calloc(indexer.range_count, sizeof(dicom_index_range_t));
+	for (i32 i = 0; i < indexer.range_count; ++i) {
+		dicom_index_range_t* range = indexer.ranges + i;
+		range->begin = begin + (i64)i * DICOM_INDEX_RANGE_SIZE;
+		range->end = MIN(range->begin + DICOM_INDEX_RANGE_SIZE, indexer.filesize);
+	}
+
+	indexer.frame_tile_indices = malloc(instance->pixel_data_offset_count * sizeof(i32));
+	memset(indexer.frame_tile_indices, 0xFF, instance->pixel_data_offset_count * sizeof(i32));
+	for (i32 i = 0; i < instance->tile_count; ++i) {
+		dicom_tile_t* tile = instance->tiles + i;
+		if (tile->exists && tile->frame_index < instance->pixel_data_offset_count) {
+			indexer.frame_tile_indices[tile->frame_index] = i;
+		}
+	}
+
+	// Ranges are submitted in file order, so that the start of the pixel data gets published first.
+	indexer.ranges_remaining = indexer.range_count;
+	for (i32 i = 0; i < indexer.range_count; ++i) {
+		dicom_index_range_task_t task = {.indexer = &indexer, .range_index = i};
+		if (!work_queue_submit_task(&global_work_queue, dicom_index_range_task_func, &task, sizeof(task))) {
+			dicom_index_range_task_func(logical_thread_index, &task); // queue is full, do it ourselves
+		}
+	}
+	while (indexer.ranges_remaining > 0) {
+		if (!work_queue_do_work(&global_work_queue, logical_thread_index)) {
+			platform_sleep(1);
+		}
+	}
+	ASSERT(indexer.ranges_published == indexer.range_count);
+
+	bool success = !indexer.failed && indexer.frames_published == instance->pixel_data_offset_count;
+	if (!indexer.failed && !success) {
+		console_print_error("DICOM indexing: found %lld pixel data items, expected %lld frames\n", indexer.frames_published, instance->number_of_frames);
+	}
+
+	free(indexer.ranges);
+	free(indexer.frame_tile_indices);
+	benaphore_destroy(&indexer.lock);
+	return success;
+}
+
+bool dicom_instance_index_pixel_data(dicom_instance_t* instance, i32 logical_thread_index) {
+	bool success = false;
+	if (instance->is_pixel_data_encapsulated && !instance->are_all_offsets_read) {
+		ASSERT(instance->pixel_data_offsets && instance->pixel_data_sizes);
+		i64 start_time = get_clock();
+		if (dicom_load_offset_table_sidecar(instance)) {
+			console_print_verbose("DICOM: loaded offset table for '%s' from sidecar\n", instance->filename);
+			success = true;
+		} else {
+			success = dicom_instance_index_pixel_data_in_parallel(instance, logical_thread_index);
+			if (success) {
+				dicom_save_offset_table_sidecar(instance);
+			}
+		}
+		if (success) {
+			console_print_verbose("DICOM: indexed %u frames in %g seconds\n", instance->pixel_data_offset_count, get_seconds_elapsed(start_time, get_clock()));
+		}
+	}
+
+	if (success) {
+		instance->are_all_offsets_read = true;
+	} else {
+		console_print_error("dicom_instance_index_pixel_data(): frame offsets could not be read\n");
+	}
+
+	// update tiles
+	if (success) {
+		for (i32 i = 0; i < instance->tile_count; ++i) {
+			dicom_tile_t* tile = instance->tiles + i;
+			if (tile->exists && !tile->is_offset_known) {
+				tile->data_offset_in_file = sizeof(dicom_header_t) + instance->pixel_data_start_offset + instance->pixel_data_offsets[tile->frame_index];
+				tile->data_size = instance->pixel_data_sizes[tile->frame_index];
+				write_barrier;
+				tile->is_offset_known = true;
+			}
+		}
+	}
+
+	return success;
 }
 
 dicom_instance_t dicom_load_file(dicom_series_t* dicom_series, file_info_t* file) {
@@ -1122,7 +1475,10 @@ dicom_instance_t dicom_load_file(dicom_series_t* dicom_series, file_info_t* file
 	dicom_instance_t instance = {};
 	instance.series = dicom_series;
 
-	// TODO: pipe all debug output to private memrw_t for dumping it onto the console later (enable concurrent loading?)
+	// NOTE: debug output is collected in a private buffer, see dicom_flush_instance_debug_log()
+	if (dicom_series->debug_output_file || is_verbose_mode) {
+		instance.debug_log = memrw_create(KILOBYTES(64));
+	}
 
 	file_stream_t fp = file_stream_open_for_reading(file->full_filename);
 	if (fp) {
@@ -1139,8 +1495,8 @@ dicom_instance_t dicom_load_file(dicom_series_t* dicom_series, file_info_t* file
 				if (is_file_a_dicom_file(buffer.data, bytes_read)) {
 					console_print_verbose("Found DICOM file: '%s'\n", file->full_filename);
 					i64 payload_offset = sizeof(dicom_header_t);
-					if (dicom_series->debug_output_file) {
-						fprintf(dicom_series->debug_output_file, "\nFile: %s\n\n", file->full_filename);
+					if (instance.debug_log.data) {
+						memrw_printf(&instance.debug_log, "\nFile: %s\n\n", file->full_filename);
 					}
 					i64 payload_bytes = ((i64)buffer.used_size - payload_offset);
 					ASSERT(payload_bytes > 0);
@@ -1221,6 +1577,26 @@ dicom_instance_t dicom_load_file(dicom_series_t* dicom_series, file_info_t* file
 	return instance;
 }
 
+typedef struct dicom_load_file_task_t {
+	dicom_series_t* series;
+	file_info_t* file;
+	dicom_instance_t* result;
+	volatile i32* files_remaining;
+} dicom_load_file_task_t;
+
+static void dicom_load_file_task_func(i32 logical_thread_index, void* userdata) {
+	dicom_load_file_task_t* task = (dicom_load_file_task_t*) userdata;
+	*task->result = dicom_load_file(task->series, task->file);
+	atomic_decrement(task->files_remaining);
+}
+
+// for qsort
+static int compare_file_info_by_filename(const void* a, const void* b) {
+	const file_info_t* file_a = *(const file_info_t**)a;
+	const file_info_t* file_b = *(const file_info_t**)b;
+	return strcmp(file_a->full_filename, file_b->full_filename);
+}
+
 typedef struct indexed_value_t {
 	i64 value;
 	i32 index;
@@ -1234,6 +1610,12 @@ static int compare_indexed_value (const void* a, const void* b) {
 bool dicom_open_from_directory(dicom_series_t* dicom, directory_info_t* directory) {
 	i64 start = get_clock();
 
+	i32 file_count = arrlen(directory->dicom_files);
+	if (file_count <= 0) {
+		console_print_error("DICOM: no DICOM files found in directory\n");
+		return false;
+	}
+
 	#if DO_DEBUG
 	dicom->debug_output_file = fopen("dicom_dump.txt", "wb");
 	#endif
@@ -1243,14 +1625,39 @@ bool dicom_open_from_directory(dicom_series_t* dicom, directory_info_t* director
 
 	bool success = true;
 
-	i32 file_count = arrlen(directory->dicom_files);
+	// Parse the instance headers concurrently.
+	// Instances are collected into fixed slots, so the assembled series does not depend on the completion order.
+	file_info_t** sorted_files = malloc(file_count * sizeof(file_info_t*));
+	for (i32 i = 0; i < file_count; ++i) {
+		sorted_files[i] = directory->dicom_files + i;
+	}
+	qsort(sorted_files, file_count, sizeof(file_info_t*), compare_file_info_by_filename);
+
+	dicom_instance_t* loaded_instances = calloc(file_count, sizeof(dicom_instance_t));
+	volatile i32 files_remaining = file_count;
+	for (i32 i = 0; i < file_count; ++i) {
+		dicom_load_file_task_t task = {
+			.series = dicom, .file = sorted_files[i], .result = loaded_instances + i, .files_remaining = &files_remaining,
+		};
+		if (!work_queue_submit_task(&global_work_queue, dicom_load_file_task_func, &task, sizeof(task))) {
+			dicom_load_file_task_func(0, &task); // queue is full, do it ourselves
+		}
+	}
+	while (files_remaining > 0) {
+		if (!work_queue_do_work(&global_work_queue, 0)) {
+			platform_sleep(1);
+		}
+	}
+
 	for (i32 i = 0; i < file_count; ++i) {
-		file_info_t* file = directory->dicom_files + i;
-		dicom_instance_t instance = dicom_load_file(dicom, file);
-		if (instance.is_valid) {
-			arrput(dicom->instances, instance);
+		dicom_instance_t* instance = loaded_instances + i;
+		dicom_flush_instance_debug_log(dicom, instance);
+		if (instance->is_valid) {
+			arrput(dicom->instances, *instance);
 		}
 	}
+	free(loaded_instances);
+	free(sorted_files);
 
 	if (dicom->debug_output_file) {
 		fclose(dicom->debug_output_file);
@@ -1395,7 +1802,8 @@ bool dicom_open_from_file(dicom_series_t* dicom, file_info_t* file) {
 	#endif
 	dicom->tag_handler_func = handle_dicom_tag_for_tag_dumping;
 
-	dicom_load_file(dicom, file);
+	dicom_instance_t instance = dicom_load_file(dicom, file);
+	dicom_flush_instance_debug_log(dicom, &instance);
 
 	if (dicom->debug_output_file) {
 		fclose(dicom->debug_output_file);
@@ -25,6 +25,7 @@ extern "C" {
 #include "common.h"
 #include "platform.h" // for file_handle_t
 #include "mathutils.h" // for v2f
+#include "memrw.h"
 
 #ifndef DONT_INCLUDE_DICOM_DICT_H
 #include "dicom_dict.h"
@@ -347,7 +348,7 @@ typedef struct dicom_parser_pos_t {
 typedef struct dicom_tile_t {
 	dicom_instance_t* instance;
 	u32 frame_index;
-	u32 data_offset_in_file;
+	u64 data_offset_in_file;
 	u32 data_size;
     bool is_offset_known;
 	bool exists;
@@ -370,6 +371,7 @@ typedef struct dicom_instance_t {
 	dicom_parser_callback_func_t* tag_handler_func;
 	char filename[512];
 	file_handle_t file_handle; // for simultaneous file access on multiple threads
+	memrw_t debug_log; // tag dump output, merged into the series debug output after loading
 	i32 nesting_level;
 	dicom_parser_pos_t pos_stack[16]; // one per nesting level, for keeping track where we need to push/pop during parsing
 	dicom_tag_t nested_sequences[8]; // one for every two nesting levels (sequences only, not sequence items)
@@ -390,7 +392,7 @@ typedef struct dicom_instance_t {
 	bool are_all_offsets_read;
 	bool need_parse_abort;
 	dicom_data_element_t pixel_data;
-	u32* pixel_data_offsets; // malloc'ed
+	u64* pixel_data_offsets; // malloc'ed
 	u32* pixel_data_sizes; // malloc'ed
 	u32 pixel_data_start_offset;
 	u32 pixel_data_offset_count;
@@ -469,7 +471,7 @@ dicom_sh_t dicom_parse_short_string(str_t s);
 dicom_da_t dicom_parse_date(str_t s);
 dicom_tm_t dicom_parse_time(str_t s);
 i64 dicom_defragment_encapsulated_pixel_data_frame(u8* data, i64 len);
-bool dicom_instance_index_pixel_data(dicom_instance_t* instance);
+bool dicom_instance_index_pixel_data(dicom_instance_t* instance, i32 logical_thread_index);
 
 // globals
 #if defined(DICOM_IMPL)
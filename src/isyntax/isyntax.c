@@ -50,6 +50,7 @@
 #include "common.h"
 #include "work_queue.h"
 #include "intrinsics.h"
+#include "pixel_convert.h"
 
 #include "isyntax.h"
 
@@ -193,44 +194,6 @@ static i32 parse_up_to_five_integers(const char* str, i32* array_of_five_integer
 	return 5;
 }
 
-static void bgra_to_rgba(uint32_t *pixels, int width, int height) {
-    int num_pixels = width * height;
-    int num_pixels_aligned = (num_pixels / 4) * 4;
-
-#if defined(__ARM_NEON)
-    for (int i = 0; i < num_pixels_aligned; i += 4) {
-        uint32x4_t bgra = vld1q_u32(pixels + i);
-        uint32x4_t b_mask = vdupq_n_u32(0x000000FF);
-        uint32x4_t r_mask = vdupq_n_u32(0x00FF0000);
-        uint32x4_t b = vandq_u32(bgra, b_mask);
-        uint32x4_t r = vandq_u32(bgra, r_mask);
-        uint32x4_t br_swapped = vorrq_u32(vshlq_n_u32(b, 16), vshrq_n_u32(r, 16));
-        uint32x4_t ga_alpha_mask = vdupq_n_u32(0xFF00FF00);
-        uint32x4_t ga_alpha = vandq_u32(bgra, ga_alpha_mask);
-        uint32x4_t rgba = vorrq_u32(ga_alpha, br_swapped);
-        vst1q_u32(pixels + i, rgba);
-    }
-#elif defined(__SSE2__)
-    for (int i = 0; i < num_pixels_aligned; i += 4) {
-        __m128i bgra = _mm_loadu_si128((__m128i*)(pixels + i));
-        __m128i b_mask = _mm_set1_epi32(0x000000FF);
-        __m128i r_mask = _mm_set1_epi32(0x00FF0000);
-        __m128i b = _mm_and_si128(bgra, b_mask);
-        __m128i r = _mm_and_si128(bgra, r_mask);
-        __m128i br_swapped = _mm_or_si128(_mm_slli_epi32(b, 16), _mm_srli_epi32(r, 16));
-        __m128i ga_alpha_mask = _mm_set1_epi32(0xFF00FF00);
-        __m128i ga_alpha = _mm_and_si128(bgra, ga_alpha_mask);
-        __m128i rgba = _mm_or_si128(ga_alpha, br_swapped);
-        _mm_storeu_si128((__m128i*)(pixels + i), rgba);
-    }
-#else
-    for (int i = num_pixels_aligned; i < num_pixels; ++i) {
-        uint32_t val = pixels[i];
-        pixels[i] = ((val & 0xff) << 16) | (val & 0x00ff00) | ((val & 0xff0000) >> 16) | (val & 0xff000000);
-    }
-#endif
-}
-
 static u8* isyntax_decode_jpeg_stream(u8* compressed, size_t compressed_len, i32* width, i32* height, i32* channels_in_file,
                                       enum isyntax_pixel_format_t pixel_format) {
     u8* pixels = NULL;
@@ -250,7 +213,7 @@ static u8* isyntax_decode_jpeg_stream(u8* compressed, size_t compressed_len, i32
     if (pixel_format == LIBISYNTAX_PIXEL_FORMAT_BGRA) {
         DUMMY_STATEMENT; // no action needed
     } else if (pixel_format == LIBISYNTAX_PIXEL_FORMAT_RGBA) {
-        bgra_to_rgba((uint32_t*)pixels, w, h);
+        convert_swap_red_blue((u32*)pixels, (u32*)pixels, (i64)w * h);
     }
 #else
     // stb_image.h
@@ -258,7 +221,7 @@ static u8* isyntax_decode_jpeg_stream(u8* compressed, size_t compressed_len, i32
     if (pixel_format == LIBISYNTAX_PIXEL_FORMAT_RGBA) {
         DUMMY_STATEMENT; // no action needed
     } else if (pixel_format == LIBISYNTAX_PIXEL_FORMAT_BGRA) {
-        bgra_to_rgba((uint32_t*)pixels, w, h);
+        convert_swap_red_blue((u32*)pixels, (u32*)pixels, (i64)w * h);
     }
 #endif
     if (width) *width = w;
@@ -0,0 +1,91 @@
+/*
+  BSD 2-Clause License
+
+  Copyright (c) 2019-2024, Pieter Valkema, Alexandr Virodov
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Implementation of the cache and tile/region reading parts of the libisyntax API.
+// These read tiles on demand through isyntax_reader.c, independently of the streamer used by the viewer.
+
+#include "common.h"
+#include "libisyntax.h"
+#include "isyntax_reader.h"
+
+isyntax_error_t libisyntax_cache_create(const char* debug_name_or_null, int32_t cache_size,
+                                        isyntax_cache_t** out_isyntax_cache) {
+    isyntax_cache_t* cache = calloc(1, sizeof(isyntax_cache_t));
+    tile_list_init(&cache->cache_list, debug_name_or_null);
+    cache->target_cache_size = cache_size;
+    cache->mutex = benaphore_create();
+    // NOTE: the block allocators are created on the first injection, because that is when we know the block size.
+    *out_isyntax_cache = cache;
+    return LIBISYNTAX_OK;
+}
+
+isyntax_error_t libisyntax_cache_inject(isyntax_cache_t* isyntax_cache, isyntax_t* isyntax) {
+    if (isyntax->ll_coeff_block_allocator != NULL || isyntax->h_coeff_block_allocator != NULL) {
+        return LIBISYNTAX_INVALID_ARGUMENT;
+    }
+    if (!isyntax_cache->ll_coeff_block_allocator.is_valid) {
+        ASSERT(!isyntax_cache->h_coeff_block_allocator.is_valid);
+        isyntax_cache->allocator_block_width = isyntax->block_width;
+        isyntax_cache->allocator_block_height = isyntax->block_height;
+        size_t ll_coeff_block_size = isyntax->block_width * isyntax->block_height * sizeof(icoeff_t);
+        size_t block_allocator_maximum_capacity_in_blocks = GIGABYTES(32) / ll_coeff_block_size;
+        size_t ll_coeff_block_allocator_capacity_in_blocks = block_allocator_maximum_capacity_in_blocks / 4;
+        size_t h_coeff_block_size = ll_coeff_block_size * 3;
+        size_t h_coeff_block_allocator_capacity_in_blocks = ll_coeff_block_allocator_capacity_in_blocks * 3;
+        isyntax_cache->ll_coeff_block_allocator = block_allocator_create(ll_coeff_block_size, ll_coeff_block_allocator_capacity_in_blocks, MEGABYTES(256));
+        isyntax_cache->h_coeff_block_allocator = block_allocator_create(h_coeff_block_size, h_coeff_block_allocator_capacity_in_blocks, MEGABYTES(256));
+    }
+    if (isyntax_cache->allocator_block_width != isyntax->block_width ||
+        isyntax_cache->allocator_block_height != isyntax->block_height) {
+        return LIBISYNTAX_FATAL;
+    }
+    isyntax->ll_coeff_block_allocator = &isyntax_cache->ll_coeff_block_allocator;
+    isyntax->h_coeff_block_allocator = &isyntax_cache->h_coeff_block_allocator;
+    isyntax->is_block_allocator_owned = false;
+    return LIBISYNTAX_OK;
+}
+
+void libisyntax_cache_destroy(isyntax_cache_t* isyntax_cache) {
+    if (isyntax_cache->ll_coeff_block_allocator.is_valid) {
+        block_allocator_destroy(&isyntax_cache->ll_coeff_block_allocator);
+    }
+    if (isyntax_cache->h_coeff_block_allocator.is_valid) {
+        block_allocator_destroy(&isyntax_cache->h_coeff_block_allocator);
+    }
+    benaphore_destroy(&isyntax_cache->mutex);
+    free(isyntax_cache);
+}
+
+isyntax_error_t libisyntax_tile_read(isyntax_t* isyntax, isyntax_cache_t* isyntax_cache,
+                                     int32_t level, int64_t tile_x, int64_t tile_y,
+                                     uint32_t* pixels_buffer, int32_t pixel_format) {
+    if (pixel_format <= _LIBISYNTAX_PIXEL_FORMAT_START || pixel_format >= _LIBISYNTAX_PIXEL_FORMAT_END) {
+        return LIBISYNTAX_INVALID_ARGUMENT;
+    }
+    isyntax_tile_read(isyntax, isyntax_cache, level, tile_x, tile_y, pixels_buffer, pixel_format);
+    return LIBISYNTAX_OK;
+}
@@ -23,6 +23,9 @@
 #include "listing.h"
 #include "viewer.h" // for file_info_t and directory_info_t
  #include "jpeg_decoder.h"
+#include "intrinsics.h"
+#include "benaphore.h"
+#include "stb_image.h" // for stbi_zlib_decode_malloc()
 
 #include <ctype.h> // for isspace()
 
@@ -63,7 +66,7 @@ static void mrxs_slidedat_ini_parse_section_name(mrxs_t* mrxs, char* section_nam
 		    }
 		    for (i32 j = 0; j < hier->val_count; ++j) {
 			    mrxs_hier_val_t* hier_val = hier->val + j;
-			    if (!hier_val->is_ini_section_parsed && strcmp(section_name, hier_val->section) == 0) {
+			    if (!hier_val->is_ini_section_parsed && hier_val->section && strcmp(section_name, hier_val->section) == 0) {
 				    *section = MRXS_SECTION_LAYER_N_LEVEL_N_SECTION;
 				    *layer = i;
 				    *level = j;
@@ -83,7 +86,7 @@ static void mrxs_slidedat_ini_parse_section_name(mrxs_t* mrxs, char* section_nam
 		    }
 		    for (i32 j = 0; j < nonhier->val_count; ++j) {
 			    mrxs_nonhier_val_t* nonhier_val = nonhier->val + j;
-			    if (!nonhier_val->is_ini_section_parsed && strcmp(section_name, nonhier_val->section) == 0) {
+			    if (!nonhier_val->is_ini_section_parsed && nonhier_val->section && strcmp(section_name, nonhier_val->section) == 0) {
 				    *section = MRXS_SECTION_NONHIERLAYER_N_LEVEL_N_SECTION;
 				    *layer = i;
 				    *level = j;
@@ -163,6 +166,8 @@ bool mrxs_parse_slidedat_ini(mrxs_t* mrxs, mem_t* slidedat_ini) {
                             mrxs->base_width_in_tiles = atoi(value);
                         } else if (strcmp(key, "IMAGENUMBER_Y") == 0) {
                             mrxs->base_height_in_tiles = atoi(value);
+                        } else if (strcmp(key, "CameraImageDivisionsPerSide") == 0) {
+                            mrxs->camera_image_divisions = atoi(value);
                         }
                     } break;
                     case MRXS_SECTION_HIERARCHICAL: {
@@ -182,6 +187,45 @@ bool mrxs_parse_slidedat_ini(mrxs_t* mrxs, mem_t* slidedat_ini) {
                             } else {
                                 //TODO: error condition
                             }
+                        } else if (strncmp(key, "NONHIER_", 8) == 0) {
+                            i32 nonhier_index = atoi(key + 8);
+                            if (nonhier_index >= 0 && nonhier_index < mrxs->nonhier_count) {
+                                mrxs_nonhier_t* nonhier = mrxs->nonhier + nonhier_index;
+                                char* key_part2 = find_next_token(key + 8, '_');
+                                if (!key_part2) continue;
+                                if (strcmp(key_part2, "NAME") == 0) {
+                                    if (strcmp(value, "Scan data layer") == 0) {
+                                        nonhier->name = MRXS_NONHIER_SCAN_DATA_LAYER;
+                                    } else if (strcmp(value, "StitchingLayer") == 0) {
+                                        nonhier->name = MRXS_NONHIER_STITCHING_LAYER;
+                                    } else if (strcmp(value, "StitchingIntensityLayer") == 0) {
+                                        nonhier->name = MRXS_NONHIER_STITCHING_INTENSITY_LAYER;
+                                    } else if (strcmp(value, "VIMSLIDE_HISTOGRAM_DATA") == 0) {
+                                        nonhier->name = MRXS_NONHIER_VIMSLIDE_HISTOGRAM_DATA;
+                                    } else if (strcmp(value, "VIMSLIDE_POSITION_BUFFER") == 0) {
+                                        nonhier->name = MRXS_NONHIER_VIMSLIDE_POSITION_BUFFER;
+                                    } else {
+                                        nonhier->name = MRXS_NONHIER_UNKNOWN;
+                                    }
+                                } else if (strcmp(key_part2, "COUNT") == 0) {
+                                    nonhier->val_count = atoi(value);
+                                    nonhier->val = calloc(nonhier->val_count, sizeof(mrxs_nonhier_val_t));
+                                } else if (strcmp(key_part2, "SECTION") == 0) {
+                                    nonhier->section = mrxs_string_pool_push(mrxs, value);
+                                } else if (strncmp(key_part2, "VAL_", 4) == 0) {
+                                    i32 val_index = atoi(key_part2 + 4);
+                                    if (val_index >= 0 && val_index < nonhier->val_count) {
+                                        mrxs_nonhier_val_t* nonhier_val = nonhier->val + val_index;
+                                        char* key_part3 = find_next_token(key_part2 + 4, '_');
+                                        if (key_part3 == NULL) {
+                                            nonhier_val->name = mrxs_string_pool_push(mrxs, value);
+                                            nonhier_val->index = val_index;
+                                        } else if (strcmp(key_part3, "SECTION") == 0) {
+                                            nonhier_val->section = mrxs_string_pool_push(mrxs, value);
+                                        }
+                                    }
+                                }
+                            }
                         } else if (strncmp(key, "HIER_", 5) == 0) {
                             i32 hier_index = atoi(key + 5);
                             if (hier_index >= 0 && hier_index < mrxs->hier_count) {
@@ -314,193 +358,612 @@ bool mrxs_parse_slidedat_ini(mrxs_t* mrxs, mem_t* slidedat_ini) {
     return success;
 }
 
-bool mrxs_read_index_dat_slide_zoom_level(mrxs_t* mrxs, mem_t* index_dat, mrxs_hier_val_t* hier_val) {
+static inline bool mrxs_index_dat_read_u32(mapped_file_t* index_dat, u64 offset, u32* value) {
+	if (offset + sizeof(u32) > index_dat->size) {
+		return false;
+	}
+	memcpy(value, index_dat->data + offset, sizeof(u32));
+	return true;
+}
+
+bool mrxs_read_index_dat_slide_zoom_level(mrxs_t* mrxs, mapped_file_t* index_dat, u32 record_ptr, mrxs_hier_val_t* hier_val) {
 	i32 scale = hier_val->index;
 	if (!(scale >= 0 && scale < mrxs->level_count)) {
 		return false;
 	}
 	mrxs_level_t* level = mrxs->levels + scale;
 
-	i32 page_count = 0; // the first page doesn't count, it always has 0 entries
-	for (;;) {
+	// The entries are stored in a linked list of pages, each starting with an entry count and a pointer to the next page.
+	// The first page doesn't count, it always has 0 entries.
+	u64 page_offset = record_ptr;
+	u64 max_page_count = index_dat->size / (2 * sizeof(u32)); // guard against cycles in a corrupt file
+	for (u64 page_count = 0; page_count < max_page_count; ++page_count) {
+		u32 entry_count = 0;
+		u32 next_ptr = 0;
+		if (!mrxs_index_dat_read_u32(index_dat, page_offset, &entry_count) ||
+		    !mrxs_index_dat_read_u32(index_dat, page_offset + 4, &next_ptr)) {
+			return false;
+		}
+		u64 entries_offset = page_offset + 8;
+		if (entries_offset + (u64)entry_count * sizeof(mrxs_hier_entry_t) > index_dat->size) {
+			return false;
+		}
+		// Take the entries straight from the mapped file, instead of reading them one by one.
+		const mrxs_hier_entry_t* entries = (const mrxs_hier_entry_t*)(index_dat->data + entries_offset);
+		for (u32 j = 0; j < entry_count; ++j) {
+			mrxs_hier_entry_t entry = entries[j];
+			i32 image_x = (entry.image % mrxs->base_width_in_tiles) >> scale;
+			i32 image_y = (entry.image / mrxs->base_width_in_tiles) >> scale;
+			if (image_x < level->width_in_images && image_y < level->height_in_images) {
+				level->images[image_y * level->width_in_images + image_x].hier_entry = entry;
+			}
+		}
+		mrxs->index_entry_count += entry_count;
+		if (next_ptr != 0 && next_ptr < index_dat->size) {
+			page_offset = next_ptr;
+		} else {
+			return true; // last page reached
+		}
+	}
+	return false;
+}
+
+// Non-hierarchical records have the same layout as the hierarchical ones, but we only need their first entry.
+static bool mrxs_read_index_dat_nonhier_entry(mapped_file_t* index_dat, u32 record_ptr, mrxs_nonhier_entry_t* entry) {
+	u64 page_offset = record_ptr;
+	u64 max_page_count = index_dat->size / (2 * sizeof(u32));
+	for (u64 page_count = 0; page_count < max_page_count; ++page_count) {
 		u32 entry_count = 0;
 		u32 next_ptr = 0;
-		mem_read(&entry_count, index_dat, 4);
-		mem_read(&next_ptr, index_dat, 4);
+		if (!mrxs_index_dat_read_u32(index_dat, page_offset, &entry_count) ||
+		    !mrxs_index_dat_read_u32(index_dat, page_offset + 4, &next_ptr)) {
+			return false;
+		}
 		if (entry_count > 0) {
-			// read entries
-			for (i32 j = 0; j < entry_count; ++j) {
-				mrxs_hier_entry_t entry = {};
-				mem_read(&entry, index_dat, sizeof(entry));
-				i32 tile_index_x = entry.image % mrxs->base_width_in_tiles;
-				i32 tile_index_y = entry.image / mrxs->base_width_in_tiles;
-				tile_index_x >>= scale;
-				tile_index_y >>= scale;
-				if (tile_index_x < level->width_in_tiles && tile_index_y < level->height_in_tiles) {
-					mrxs_tile_t* tile = level->tiles + tile_index_y * level->width_in_tiles + tile_index_x;
-					tile->hier_entry = entry;
-					DUMMY_STATEMENT;
-				} else {
-					DUMMY_STATEMENT;
-				}
-				DUMMY_STATEMENT;
+			if (page_offset + 8 + sizeof(mrxs_nonhier_entry_t) > index_dat->size) {
+				return false;
 			}
+			memcpy(entry, index_dat->data + page_offset + 8, sizeof(mrxs_nonhier_entry_t));
+			return true;
 		}
-		if (next_ptr != 0 && next_ptr < index_dat->len) {
-			mem_seek(index_dat, next_ptr);
-			++page_count;
+		if (next_ptr != 0 && next_ptr < index_dat->size) {
+			page_offset = next_ptr;
 		} else {
-			break; // last page reached
+			return false;
+		}
+	}
+	return false;
+}
+
+// Find where the camera positions are stored: uncompressed in the VIMSLIDE_POSITION_BUFFER layer,
+// or (in newer slides) zlib-compressed in the StitchingIntensityLayer.
+static bool mrxs_find_camera_positions_entry(mrxs_t* mrxs, mapped_file_t* index_dat, u32 nonhier_root,
+                                             mrxs_nonhier_entry_t* entry, bool* is_compressed) {
+	enum mrxs_nonhier_enum candidates[] = {MRXS_NONHIER_VIMSLIDE_POSITION_BUFFER, MRXS_NONHIER_STITCHING_INTENSITY_LAYER};
+	for (i32 candidate = 0; candidate < COUNT(candidates); ++candidate) {
+		// There is one record stored for each NONHIER_i_VAL_j combination (all in a flat array)
+		i32 record_index = 0;
+		for (i32 nonhier_index = 0; nonhier_index < mrxs->nonhier_count; ++nonhier_index) {
+			mrxs_nonhier_t* nonhier = mrxs->nonhier + nonhier_index;
+			if (nonhier->name == candidates[candidate] && nonhier->val_count > 0) {
+				u32 record_ptr = 0;
+				if (mrxs_index_dat_read_u32(index_dat, nonhier_root + record_index * sizeof(u32), &record_ptr) &&
+				    mrxs_read_index_dat_nonhier_entry(index_dat, record_ptr, entry)) {
+					*is_compressed = (candidates[candidate] == MRXS_NONHIER_STITCHING_INTENSITY_LAYER);
+					return true;
+				}
+			}
+			record_index += nonhier->val_count;
 		}
 	}
+	return false;
+}
+
+static bool mrxs_read_index_dat(mrxs_t* mrxs, mapped_file_t* index_dat, mrxs_nonhier_entry_t* positions_entry, bool* positions_compressed) {
+	// Header: version (5 bytes), slide id (32 bytes), then the pointers to the hierarchical and non-hierarchical roots
+	u32 hier_root = 0;
+	u32 nonhier_root = 0;
+	if (!mrxs_index_dat_read_u32(index_dat, 37, &hier_root) || !mrxs_index_dat_read_u32(index_dat, 41, &nonhier_root)) {
+		return false;
+	}
+	if (!(hier_root > 0 && hier_root < index_dat->size && nonhier_root > 0 && nonhier_root < index_dat->size)) {
+		return false;
+	}
+	if (mrxs->base_width_in_tiles <= 0) {
+		return false;
+	}
+
+	// Initialize some basic stuff
+	mrxs_hier_t* hier_zoom_levels = mrxs->hier + mrxs->slide_zoom_level_hier_index;
+	mrxs->level_count = MIN(hier_zoom_levels->val_count, COUNT(mrxs->levels));
+	for (i32 i = 0; i < mrxs->level_count; ++i) {
+		mrxs_level_t* level = mrxs->levels + i;
+		level->width_in_images = (mrxs->base_width_in_tiles + (1 << i) - 1) >> i;
+		level->height_in_images = (mrxs->base_height_in_tiles + (1 << i) - 1) >> i;
+		u32 image_count = level->width_in_images * level->height_in_images;
+		level->images = calloc(image_count, sizeof(mrxs_tile_t));
+	}
+
+	// There is one record stored for each HIER_i_VAL_j combination (all in a flat array)
+	i32 record_index = 0;
+	for (i32 hier_index = 0; hier_index < mrxs->hier_count; ++hier_index) {
+		mrxs_hier_t* hier = mrxs->hier + hier_index;
+		for (i32 val_index = 0; val_index < hier->val_count; ++val_index, ++record_index) {
+			mrxs_hier_val_t* hier_val = hier->val + val_index;
+			if (hier->name == MRXS_HIER_SLIDE_ZOOM_LEVEL && hier_val->type == MRXS_HIER_VAL_ZOOMLEVEL) {
+				u32 record_ptr = 0;
+				if (!mrxs_index_dat_read_u32(index_dat, hier_root + record_index * sizeof(u32), &record_ptr)) {
+					return false;
+				}
+				if (!mrxs_read_index_dat_slide_zoom_level(mrxs, index_dat, record_ptr, hier_val)) {
+					return false;
+				}
+			}
+		}
+	}
+
+	if (!mrxs_find_camera_positions_entry(mrxs, index_dat, nonhier_root, positions_entry, positions_compressed)) {
+		memset(positions_entry, 0, sizeof(*positions_entry));
+	}
 	return true;
 }
 
-bool mrxs_open_from_directory(mrxs_t* mrxs, file_info_t* file, directory_info_t* directory) {
-    bool success = false;
+// Returns the file handle for one of the Data*.dat files, opening it if this is the first time it is needed.
+// Called from worker threads.
+static file_handle_t mrxs_get_dat_file_handle(mrxs_t* mrxs, u32 dat_index) {
+	if (!mrxs->dat_file_handles || dat_index >= (u32)mrxs->dat_count) {
+		return 0;
+	}
+	if (mrxs->dat_file_states[dat_index] == MRXS_DAT_FILE_OPEN) {
+		read_barrier;
+		return mrxs->dat_file_handles[dat_index];
+	}
+	benaphore_lock(&mrxs->dat_open_lock);
+	if (mrxs->dat_file_states[dat_index] == MRXS_DAT_FILE_NOT_OPENED) {
+		i64 start = get_clock();
+		const char* dat_filename = mrxs->dat_filenames[dat_index];
+		char full_dat_filename[512];
+		snprintf(full_dat_filename, sizeof(full_dat_filename), "%s" PATH_SEP "%s", mrxs->dat_directory, dat_filename);
+		full_dat_filename[sizeof(full_dat_filename) - 1] = '\0';
+		file_handle_t file_handle = open_file_handle_for_simultaneous_access(full_dat_filename);
+		if (file_handle) {
+			mrxs->dat_file_handles[dat_index] = file_handle;
+			write_barrier;
+			mrxs->dat_file_states[dat_index] = MRXS_DAT_FILE_OPEN;
+			console_print_verbose("Opening %s took %g seconds.\n", dat_filename, get_seconds_elapsed(start, get_clock()));
+		} else {
+			mrxs->dat_file_states[dat_index] = MRXS_DAT_FILE_FAILED;
+			console_print_error("Error: Could not open file for asynchronous I/O: %s\n", dat_filename);
+		}
+	}
+	file_handle_t result = mrxs->dat_file_handles[dat_index];
+	benaphore_unlock(&mrxs->dat_open_lock);
+	return result;
+}
 
-	i64 start = get_clock();
-    mem_t* slidedat_ini = read_entire_file_in_directory(file->full_filename, "Slidedat.ini");
-
-    if (slidedat_ini) {
-        if (mrxs_parse_slidedat_ini(mrxs, slidedat_ini)) {
-            mem_t* index_dat = read_entire_file_in_directory(file->full_filename, mrxs->index_dat_filename);
-	        if (index_dat) {
-		        i64 index_parse_start = get_clock();
-		        char version[6] = {};
-                char slide_id[33] = {};
-                u32 hier_root = 0;
-                u32 nonhier_root = 0;
-                mem_read(version, index_dat, 5);
-                mem_read(slide_id, index_dat, 32);
-                mem_read(&hier_root, index_dat, 4);
-                mem_read(&nonhier_root, index_dat, 4);
-
-                bool failed = false;
-                if (hier_root > 0 && hier_root < index_dat->len) {
-
-					// Initialize some basic stuff
-					mrxs_hier_t* hier_zoom_levels = mrxs->hier + mrxs->slide_zoom_level_hier_index;
-					mrxs->level_count = hier_zoom_levels->val_count;
-					for (i32 i = 0; i < mrxs->level_count; ++i) {
-						mrxs_level_t* level = mrxs->levels + i;
-						level->width_in_tiles = (mrxs->base_width_in_tiles + (1 << i) - 1) >> i;
-						level->height_in_tiles = (mrxs->base_height_in_tiles + (1 << i) - 1) >> i;
-						u32 tile_count = level->width_in_tiles * level->height_in_tiles;
-						level->tiles = calloc(tile_count, sizeof(mrxs_tile_t ));
+// Each position record is 9 bytes: a flag byte, followed by the x and y coordinates (32-bit little endian).
+static bool mrxs_load_camera_positions(mrxs_t* mrxs, mrxs_nonhier_entry_t* entry, bool is_compressed) {
+	file_handle_t file_handle = mrxs_get_dat_file_handle(mrxs, entry->file);
+	if (!file_handle || entry->length == 0) {
+		return false;
+	}
+	u8* data = malloc(entry->length);
+	if (file_handle_read_at_offset(data, file_handle, entry->offset, entry->length) != entry->length) {
+		free(data);
+		return false;
+	}
+	i32 size = (i32)entry->length;
+	if (is_compressed) {
+		i32 inflated_size = 0;
+		u8* inflated = (u8*)stbi_zlib_decode_malloc((const char*)data, size, &inflated_size);
+		free(data);
+		if (!inflated) {
+			return false;
+		}
+		data = inflated;
+		size = inflated_size;
+	}
+	i32 camera_count = mrxs->camera_count_x * mrxs->camera_count_y;
+	bool success = false;
+	if (size >= camera_count * 9) {
+		mrxs->camera_positions = malloc(camera_count * 2 * sizeof(i32));
+		for (i32 i = 0; i < camera_count; ++i) {
+			memcpy(mrxs->camera_positions + 2 * i, data + 9 * i + 1, 2 * sizeof(i32));
+		}
+		success = true;
+	} else {
+		console_print_error("MRXS: camera position data is too small (%d bytes for %d camera images)\n", size, camera_count);
+	}
+	free(data);
+	return success;
+}
+
+static void mrxs_get_camera_position(mrxs_t* mrxs, i32 camera_x, i32 camera_y, i32* x, i32* y) {
+	if (mrxs->has_camera_positions) {
+		i32 camera_index = camera_y * mrxs->camera_count_x + camera_x;
+		*x = mrxs->camera_positions[2 * camera_index];
+		*y = mrxs->camera_positions[2 * camera_index + 1];
+	} else {
+		// Without positions, assume a regular grid.
+		*x = camera_x * mrxs->camera_image_divisions * mrxs->tile_width;
+		*y = camera_y * mrxs->camera_image_divisions * mrxs->tile_height;
+	}
+}
+
+// Split the stored images of a level into the parts that come from different camera images, and place each part at
+// the position of its camera image. Returns an array of parts (free it after use).
+static mrxs_source_t* mrxs_place_level_images(mrxs_t* mrxs, i32 level_index, i32* part_count) {
+	mrxs_level_t* level = mrxs->levels + level_index;
+	i32 divisions = mrxs->camera_image_divisions;
+	i32 scale = 1 << level_index; // number of base level images per side covered by one stored image
+	i32 parts_per_side = MAX(1, scale / divisions);
+	i32 part_width = MAX(1, level->tile_width / parts_per_side);
+	i32 part_height = MAX(1, level->tile_height / parts_per_side);
+
+	i32 image_count = level->width_in_images * level->height_in_images;
+	i32 present_count = 0;
+	for (i32 i = 0; i < image_count; ++i) {
+		present_count += (level->images[i].hier_entry.length > 0);
+	}
+	mrxs_source_t* parts = malloc((size_t)present_count * parts_per_side * parts_per_side * sizeof(mrxs_source_t) + 1);
+	i32 count = 0;
+	for (i32 image_index = 0; image_index < image_count; ++image_index) {
+		if (level->images[image_index].hier_entry.length == 0) continue;
+		i32 image_x = image_index % level->width_in_images;
+		i32 image_y = image_index / level->width_in_images;
+		for (i32 part_y = 0; part_y < parts_per_side; ++part_y) {
+			for (i32 part_x = 0; part_x < parts_per_side; ++part_x) {
+				// Which camera image is this, and where in it (in base level pixels)?
+				i32 base_x = image_x * scale + part_x * divisions;
+				i32 base_y = image_y * scale + part_y * divisions;
+				i32 camera_x = base_x / divisions;
+				i32 camera_y = base_y / divisions;
+				if (camera_x >= mrxs->camera_count_x || camera_y >= mrxs->camera_count_y) continue;
+				i32 camera_pos_x = 0;
+				i32 camera_pos_y = 0;
+				mrxs_get_camera_position(mrxs, camera_x, camera_y, &camera_pos_x, &camera_pos_y);
+				i64 pos_x = (i64)camera_pos_x + (i64)(base_x % divisions) * mrxs->tile_width;
+				i64 pos_y = (i64)camera_pos_y + (i64)(base_y % divisions) * mrxs->tile_height;
+				mrxs_source_t* part = parts + count++;
+				part->image_index = image_index;
+				part->src_x = part_x * part_width;
+				part->src_y = part_y * part_height;
+				part->width = (parts_per_side == 1) ? level->tile_width : part_width;
+				part->height = (parts_per_side == 1) ? level->tile_height : part_height;
+				part->dest_x = (i32)floor((double)pos_x / scale);
+				part->dest_y = (i32)floor((double)pos_y / scale);
+			}
+		}
+	}
+	*part_count = count;
+	return parts;
+}
+
+// Precompute, for every output tile of the level, which parts of the stored images overlap it.
+static void mrxs_build_level_layout(mrxs_t* mrxs, i32 level_index, mrxs_source_t* parts, i32 part_count) {
+	mrxs_level_t* level = mrxs->levels + level_index;
+	i32 scale = 1 << level_index;
+	level->width_in_pixels = MAX(1, (mrxs->width_in_pixels + scale - 1) / scale);
+	level->height_in_pixels = MAX(1, (mrxs->height_in_pixels + scale - 1) / scale);
+	level->width_in_tiles = (level->width_in_pixels + level->tile_width - 1) / level->tile_width;
+	level->height_in_tiles = (level->height_in_pixels + level->tile_height - 1) / level->tile_height;
+	i32 tile_count = level->width_in_tiles * level->height_in_tiles;
+	level->tile_source_offsets = calloc(tile_count + 1, sizeof(i32));
+
+	// First count the sources for each tile, then fill them in.
+	for (i32 pass = 0; pass < 2; ++pass) {
+		i32* cursors = NULL;
+		if (pass == 1) {
+			for (i32 i = 0; i < tile_count; ++i) {
+				level->tile_source_offsets[i + 1] += level->tile_source_offsets[i];
+			}
+			level->sources = malloc(level->tile_source_offsets[tile_count] * sizeof(mrxs_source_t) + 1);
+			cursors = malloc(tile_count * sizeof(i32));
+			memcpy(cursors, level->tile_source_offsets, tile_count * sizeof(i32));
+		}
+		for (i32 i = 0; i < part_count; ++i) {
+			mrxs_source_t* part = parts + i;
+			i32 right = part->dest_x + part->width - 1;
+			i32 bottom = part->dest_y + part->height - 1;
+			if (right < 0 || bottom < 0) continue;
+			i32 tile_x0 = MAX(0, part->dest_x) / level->tile_width;
+			i32 tile_y0 = MAX(0, part->dest_y) / level->tile_height;
+			i32 tile_x1 = MIN(level->width_in_tiles - 1, right / level->tile_width);
+			i32 tile_y1 = MIN(level->height_in_tiles - 1, bottom / level->tile_height);
+			for (i32 tile_y = tile_y0; tile_y <= tile_y1; ++tile_y) {
+				for (i32 tile_x = tile_x0; tile_x <= tile_x1; ++tile_x) {
+					i32 tile_index = tile_y * level->width_in_tiles + tile_x;
+					if (pass == 0) {
+						++level->tile_source_offsets[tile_index + 1];
+					} else {
+						level->sources[cursors[tile_index]++] = *part;
 					}
+				}
+			}
+		}
+		if (cursors) free(cursors);
+	}
+}
 
-	                // There is one record stored for each HIER_i_VAL_j combination (all in a flat array)
-					i32 record_index = 0;
-	                for (i32 hier_index = 0; hier_index < mrxs->hier_count; ++hier_index) {
-		                mrxs_hier_t* hier = mrxs->hier + hier_index;
-		                for (i32 val_index = 0; val_index < hier->val_count; ++val_index, ++record_index) {
-			                mrxs_hier_val_t* hier_val = hier->val + val_index;
-
-			                mem_seek(index_dat, hier_root + record_index * sizeof(u32));
-			                u32 record_ptr = 0;
-			                mem_read(&record_ptr, index_dat, 4);
-			                mem_seek(index_dat, record_ptr);
-							if (hier->name == MRXS_HIER_SLIDE_ZOOM_LEVEL && hier_val->type == MRXS_HIER_VAL_ZOOMLEVEL) {
-								if (!mrxs_read_index_dat_slide_zoom_level(mrxs, index_dat, hier_val)) {
-									goto label_failed;
-								}
-							}
+static void mrxs_build_layout(mrxs_t* mrxs) {
+	if (mrxs->level_count == 0) {
+		return;
+	}
+	mrxs_source_t* level_parts[COUNT(mrxs->levels)] = {};
+	i32 level_part_counts[COUNT(mrxs->levels)] = {};
+	for (i32 i = 0; i < mrxs->level_count; ++i) {
+		level_parts[i] = mrxs_place_level_images(mrxs, i, level_part_counts + i);
+	}
+	// The size of the slide follows from where the camera images of the base level end up.
+	mrxs->width_in_pixels = 1;
+	mrxs->height_in_pixels = 1;
+	for (i32 i = 0; i < level_part_counts[0]; ++i) {
+		mrxs_source_t* part = level_parts[0] + i;
+		mrxs->width_in_pixels = MAX(mrxs->width_in_pixels, part->dest_x + part->width);
+		mrxs->height_in_pixels = MAX(mrxs->height_in_pixels, part->dest_y + part->height);
+	}
+	for (i32 i = 0; i < mrxs->level_count; ++i) {
+		mrxs_build_level_layout(mrxs, i, level_parts[i], level_part_counts[i]);
+		free(level_parts[i]);
+	}
+}
 
-		                }
-	                }
+static mrxs_image_cache_t* mrxs_image_cache_create() {
+	mrxs_image_cache_t* cache = calloc(1, sizeof(mrxs_image_cache_t));
+	cache->lock = benaphore_create();
+	return cache;
+}
 
-                } else {
-					label_failed:
-					failed = true;
-                    // TODO: error condition
-                }
+static void mrxs_image_cache_destroy(mrxs_image_cache_t* cache) {
+	for (i32 i = 0; i < COUNT(cache->entries); ++i) {
+		if (cache->entries[i].pixels) {
+			free(cache->entries[i].pixels);
+		}
+	}
+	benaphore_destroy(&cache->lock);
+	free(cache);
+}
 
-                if (!failed && nonhier_root > 0 && nonhier_root < index_dat->len) {
-                    mem_seek(index_dat, nonhier_root);
-//                    u32* record_ptrs = malloc(mrxs->nonhier_count * sizeof(u32));
-//	                mem_read(record_ptrs, index_dat, mrxs->nonhier_count * sizeof(u32));
-//                    for (i32 i = 0; i < mrxs->nonhier_count; ++i) {
-//                        u32 record_ptr = record_ptrs[i];
-//
-//                    }
-//
-//                    free(record_ptrs);
-					success = true;
-                } else {
-                    failed = true;
-                    // TODO: error condition
-                }
+// Returns the index of the entry with a reference added, or -1 if the image is not cached.
+static i32 mrxs_image_cache_acquire(mrxs_image_cache_t* cache, i32 level, i32 index) {
+	i32 result = -1;
+	benaphore_lock(&cache->lock);
+	for (i32 i = 0; i < COUNT(cache->entries); ++i) {
+		mrxs_cached_image_t* entry = cache->entries + i;
+		if (entry->pixels && entry->level == level && entry->index == index) {
+			++entry->refcount;
+			entry->last_used = ++cache->use_counter;
+			result = i;
+			break;
+		}
+	}
+	benaphore_unlock(&cache->lock);
+	return result;
+}
 
-                free(index_dat);
+static void mrxs_image_cache_release(mrxs_image_cache_t* cache, i32 entry_index) {
+	benaphore_lock(&cache->lock);
+	--cache->entries[entry_index].refcount;
+	benaphore_unlock(&cache->lock);
+}
 
-		        console_print_verbose("Parsing index took %g seconds.\n", get_seconds_elapsed(index_parse_start, get_clock()));
-            }
-        }
-        free(slidedat_ini);
-    }
-	i64 clock_index_loaded = get_clock();
-	console_print_verbose("Slidedat.ini and index loaded in %g seconds.\n", get_seconds_elapsed(start, clock_index_loaded));
+// Hands 'pixels' over to the cache, replacing the least recently used entry that is not in use.
+// Returns the index of the entry with a reference added; if there is no room (or another thread got there first),
+// returns -1 and the caller keeps ownership of 'pixels'.
+static i32 mrxs_image_cache_insert(mrxs_image_cache_t* cache, i32 level, i32 index, u32* pixels) {
+	i32 result = -1;
+	benaphore_lock(&cache->lock);
+	mrxs_cached_image_t* victim = NULL;
+	bool already_cached = false;
+	for (i32 i = 0; i < COUNT(cache->entries); ++i) {
+		mrxs_cached_image_t* entry = cache->entries + i;
+		if (entry->pixels && entry->level == level && entry->index == index) {
+			already_cached = true;
+			break;
+		}
+		if (entry->refcount == 0 && (!victim || entry->last_used < victim->last_used)) {
+			victim = entry;
+		}
+	}
+	if (victim && !already_cached) {
+		if (victim->pixels) {
+			free(victim->pixels);
+		}
+		victim->level = level;
+		victim->index = index;
+		victim->pixels = pixels;
+		victim->refcount = 1;
+		victim->last_used = ++cache->use_counter;
+		result = (i32)(victim - cache->entries);
+	}
+	benaphore_unlock(&cache->lock);
+	return result;
+}
+
+bool mrxs_open_from_directory(mrxs_t* mrxs, file_info_t* file, directory_info_t* directory) {
+	bool success = false;
+
+	i64 start = get_clock();
+	i64 clock_ini_parsed = start;
+	i64 clock_index_mapped = start;
+	i64 clock_index_parsed = start;
+	mrxs_nonhier_entry_t positions_entry = {0};
+	bool positions_compressed = false;
+	mem_t* slidedat_ini = read_entire_file_in_directory(file->full_filename, "Slidedat.ini");
+	if (slidedat_ini) {
+		if (mrxs_parse_slidedat_ini(mrxs, slidedat_ini)) {
+			clock_ini_parsed = get_clock();
+			char index_dat_path[512];
+			snprintf(index_dat_path, sizeof(index_dat_path), "%s" PATH_SEP "%s", file->full_filename, mrxs->index_dat_filename);
+			index_dat_path[sizeof(index_dat_path)-1] = '\0';
+			mapped_file_t index_dat = {0};
+			if (file_map_for_reading(index_dat_path, &index_dat)) {
+				clock_index_mapped = get_clock();
+				success = mrxs_read_index_dat(mrxs, &index_dat, &positions_entry, &positions_compressed);
+				if (!success) {
+					console_print_error("Error: could not parse MRXS index file %s\n", index_dat_path);
+				}
+				file_unmap(&index_dat);
+				clock_index_parsed = get_clock();
+			}
+		}
+		free(slidedat_ini);
+	}
 
 	if (success) {
+		// The Data*.dat files are opened when a tile from them is first needed: there may be hundreds of them,
+		// and on a network share opening them all up front takes seconds.
 		ASSERT(mrxs->dat_filenames && mrxs->dat_count > 0);
-		mrxs->dat_file_handles = malloc(mrxs->dat_count * sizeof(file_handle_t));
-		//TODO: measure performance, maybe move to worker threads?
-		for (i32 i = 0; i < mrxs->dat_count; ++i) {
-			const char* dat_filename = mrxs->dat_filenames[i];
-			char full_dat_filename[512];
-			snprintf(full_dat_filename, sizeof(full_dat_filename), "%s" PATH_SEP "%s", file->full_filename, dat_filename);
-			full_dat_filename[sizeof(full_dat_filename) - 1] = '\0';
-			file_handle_t file_handle = open_file_handle_for_simultaneous_access(full_dat_filename);
-			if (!file_handle) {
-				success = false;
-				console_print_error("Error: Could not open file for asynchronous I/O: %s\n", dat_filename);
-				break;
-			}
-			mrxs->dat_file_handles[i] = file_handle;
+		mrxs->dat_file_handles = calloc(mrxs->dat_count, sizeof(file_handle_t));
+		mrxs->dat_file_states = calloc(mrxs->dat_count, sizeof(u8));
+		mrxs->dat_directory = strdup(file->full_filename);
+		mrxs->dat_open_lock = benaphore_create();
+
+		// Place the camera images where they were actually taken (they overlap a bit), instead of on a regular grid.
+		mrxs->camera_image_divisions = MAX(1, mrxs->camera_image_divisions);
+		mrxs->camera_count_x = (mrxs->base_width_in_tiles + mrxs->camera_image_divisions - 1) / mrxs->camera_image_divisions;
+		mrxs->camera_count_y = (mrxs->base_height_in_tiles + mrxs->camera_image_divisions - 1) / mrxs->camera_image_divisions;
+		if (positions_entry.length > 0) {
+			mrxs->has_camera_positions = mrxs_load_camera_positions(mrxs, &positions_entry, positions_compressed);
+		}
+		if (!mrxs->has_camera_positions) {
+			console_print("MRXS: no camera positions found, assuming the images are on a regular grid\n");
 		}
+		mrxs_build_layout(mrxs);
+		mrxs->source_image_cache = mrxs_image_cache_create();
+		mrxs->output_tile_cache = mrxs_image_cache_create();
 	}
-	console_print_verbose("Opening file handles to %d dat files took %g seconds.\n", mrxs->dat_count, get_seconds_elapsed(clock_index_loaded, get_clock()));
 
+	i64 end = get_clock();
+	console_print_verbose("MRXS opened in %g seconds (Slidedat.ini: %g s, mapping index: %g s, parsing index (%lld entries): %g s, "
+	                      "camera positions and layout: %g s)\n",
+	                      get_seconds_elapsed(start, end), get_seconds_elapsed(start, clock_ini_parsed),
+	                      get_seconds_elapsed(clock_ini_parsed, clock_index_mapped), mrxs->index_entry_count,
+	                      get_seconds_elapsed(clock_index_mapped, clock_index_parsed), get_seconds_elapsed(clock_index_parsed, end));
+	return success;
+}
 
-    return success;
+static u32* mrxs_decode_stored_image(mrxs_t* mrxs, i32 level, i32 image_index) {
+	mrxs_level_t* mrxs_level = mrxs->levels + level;
+	mrxs_hier_entry_t hier_entry = mrxs_level->images[image_index].hier_entry;
+	if (hier_entry.length == 0) {
+		return NULL;
+	}
+	file_handle_t file_handle = mrxs_get_dat_file_handle(mrxs, hier_entry.file);
+	if (!file_handle) {
+		return NULL;
+	}
+	u8* result = NULL;
+	u8* compressed_tile_data = (u8*)arena_push_size(&local_thread_memory->temp_arena, hier_entry.length);
+	size_t bytes_read = file_handle_read_at_offset(compressed_tile_data, file_handle, hier_entry.offset, hier_entry.length);
+	if (bytes_read == hier_entry.length) {
+		if (mrxs_level->image_format == MRXS_IMAGE_FORMAT_JPEG) {
+			// JPEG compression
+			i32 width = 0;
+			i32 height = 0;
+			i32 channels_in_file = 0;
+			u8* pixels = jpeg_decode_image(compressed_tile_data, hier_entry.length, &width, &height, &channels_in_file);
+			if (pixels && width == mrxs->tile_width && height == mrxs->tile_height && channels_in_file == 4) {
+				// success
+				result = pixels;
+			} else {
+				if (pixels) free(pixels);
+				result = NULL;
+			}
+		} else {
+			console_print_error("mrxs_decode_tile_to_bgra(): unknown or unsupported image format: %d\n", mrxs_level->image_format);
+		}
+	}
+	return (u32*)result;
 }
 
+// Assemble an output tile from the parts of the stored images that overlap it, each copied once to its position.
+// Where camera images overlap, the one listed last wins. Gaps between the camera images get the fill color.
 u8* mrxs_decode_tile_to_bgra(mrxs_t* mrxs, i32 level, i32 tile_index) {
-	u8* result = NULL;
-	if (level >= 0 && level < mrxs->level_count) {
-		mrxs_level_t* mrxs_level = mrxs->levels + level;
-		if (tile_index >= 0 && tile_index < mrxs_level->width_in_tiles * mrxs_level->height_in_tiles) {
-			mrxs_tile_t* tile = mrxs_level->tiles + tile_index;
-			mrxs_hier_entry_t hier_entry = tile->hier_entry;
-			if (mrxs->dat_file_handles && hier_entry.file < mrxs->dat_count) {
-				file_handle_t file_handle = mrxs->dat_file_handles[hier_entry.file];
-				if (file_handle) {
-					u8* compressed_tile_data = (u8*)arena_push_size(&local_thread_memory->temp_arena, hier_entry.length);
-					size_t bytes_read = file_handle_read_at_offset(compressed_tile_data, file_handle, hier_entry.offset, hier_entry.length);
-					if (bytes_read == hier_entry.length) {
-						if (mrxs_level->image_format == MRXS_IMAGE_FORMAT_JPEG) {
-							// JPEG compression
-							i32 width = 0;
-							i32 height = 0;
-							i32 channels_in_file = 0;
-							u8* pixels = jpeg_decode_image(compressed_tile_data, hier_entry.length, &width, &height, &channels_in_file);
-							if (pixels && width == mrxs->tile_width && height == mrxs->tile_height && channels_in_file == 4) {
-								// success
-								result = pixels;
-							} else {
-								if (pixels) free(pixels);
-								result = NULL;
-							}
-						} else {
-							console_print_error("mrxs_decode_tile_to_bgra(): unknown or unsupported image format: %d\n", mrxs_level->image_format);
-						}
-					}
-				}
+	if (!(level >= 0 && level < mrxs->level_count)) {
+		return NULL;
+	}
+	mrxs_level_t* mrxs_level = mrxs->levels + level;
+	if (!(tile_index >= 0 && tile_index < mrxs_level->width_in_tiles * mrxs_level->height_in_tiles)) {
+		return NULL;
+	}
+	i32 tile_width = mrxs_level->tile_width;
+	i32 tile_height = mrxs_level->tile_height;
+	size_t tile_size = (size_t)tile_width * tile_height * sizeof(u32);
+
+	i32 cached = mrxs_image_cache_acquire(mrxs->output_tile_cache, level, tile_index);
+	if (cached >= 0) {
+		u8* result = malloc(tile_size);
+		memcpy(result, mrxs->output_tile_cache->entries[cached].pixels, tile_size);
+		mrxs_image_cache_release(mrxs->output_tile_cache, cached);
+		return result;
+	}
+
+	i32 first_source = mrxs_level->tile_source_offsets[tile_index];
+	i32 end_source = mrxs_level->tile_source_offsets[tile_index + 1];
+	if (first_source == end_source) {
+		return NULL; // empty
+	}
+
+	u32 bgr = mrxs_level->image_fill_color_bgr;
+	u32 fill_color = 0xFF000000 | ((bgr & 0xFF) << 16) | (bgr & 0xFF00) | ((bgr >> 16) & 0xFF);
+	u32* pixels = malloc(tile_size);
+	for (i32 i = 0; i < tile_width * tile_height; ++i) {
+		pixels[i] = fill_color;
+	}
+
+	i32 tile_x = (tile_index % mrxs_level->width_in_tiles) * tile_width;
+	i32 tile_y = (tile_index / mrxs_level->width_in_tiles) * tile_height;
+	bool any_decoded = false;
+	for (i32 source_index = first_source; source_index < end_source; ++source_index) {
+		mrxs_source_t* source = mrxs_level->sources + source_index;
+
+		// Neighbouring output tiles need the same stored images, so keep the decoded images around for a while.
+		u32* image = NULL;
+		u32* uncached_image = NULL;
+		i32 cache_entry = mrxs_image_cache_acquire(mrxs->source_image_cache, level, source->image_index);
+		if (cache_entry >= 0) {
+			image = mrxs->source_image_cache->entries[cache_entry].pixels;
+		} else {
+			image = mrxs_decode_stored_image(mrxs, level, source->image_index);
+			if (!image) continue;
+			cache_entry = mrxs_image_cache_insert(mrxs->source_image_cache, level, source->image_index, image);
+			if (cache_entry < 0) {
+				uncached_image = image;
 			}
 		}
+		any_decoded = true;
+
+		i32 x0 = MAX(tile_x, source->dest_x);
+		i32 y0 = MAX(tile_y, source->dest_y);
+		i32 x1 = MIN(tile_x + tile_width, source->dest_x + source->width);
+		i32 y1 = MIN(tile_y + tile_height, source->dest_y + source->height);
+		for (i32 y = y0; y < y1; ++y) {
+			u32* dest_row = pixels + (y - tile_y) * tile_width + (x0 - tile_x);
+			u32* src_row = image + (source->src_y + y - source->dest_y) * mrxs->tile_width + (source->src_x + x0 - source->dest_x);
+			memcpy(dest_row, src_row, (x1 - x0) * sizeof(u32));
+		}
+
+		if (cache_entry >= 0) {
+			mrxs_image_cache_release(mrxs->source_image_cache, cache_entry);
+		} else if (uncached_image) {
+			free(uncached_image);
+		}
 	}
-	return result;
+
+	if (!any_decoded) {
+		free(pixels);
+		return NULL;
+	}
+	u32* copy = malloc(tile_size);
+	memcpy(copy, pixels, tile_size);
+	i32 inserted = mrxs_image_cache_insert(mrxs->output_tile_cache, level, tile_index, copy);
+	if (inserted >= 0) {
+		mrxs_image_cache_release(mrxs->output_tile_cache, inserted);
+	} else {
+		free(copy);
+	}
+	return (u8*)pixels;
 }
 
 // Set the work queue to submit parallel jobs to
@@ -530,6 +993,24 @@ void mrxs_destroy(mrxs_t* mrxs) {
 			}
 		}
 		free(mrxs->dat_file_handles);
+		free((void*)mrxs->dat_file_states);
+		free(mrxs->dat_directory);
+		benaphore_destroy(&mrxs->dat_open_lock);
+	}
+	for (i32 i = 0; i < COUNT(mrxs->levels); ++i) {
+		mrxs_level_t* level = mrxs->levels + i;
+		if (level->images) free(level->images);
+		if (level->sources) free(level->sources);
+		if (level->tile_source_offsets) free(level->tile_source_offsets);
+	}
+	if (mrxs->camera_positions) {
+		free(mrxs->camera_positions);
+	}
+	if (mrxs->source_image_cache) {
+		mrxs_image_cache_destroy(mrxs->source_image_cache);
+	}
+	if (mrxs->output_tile_cache) {
+		mrxs_image_cache_destroy(mrxs->output_tile_cache);
 	}
 	memrw_destroy(&mrxs->string_pool);
 	if (mrxs->dat_filenames) {
@@ -24,6 +24,7 @@ extern "C" {
 
 #include "common.h"
 #include "platform.h" // for file_handle_t
+#include "benaphore.h"
 
 enum mrxs_section_enum {
     MRXS_SECTION_UNKNOWN = 0,
@@ -50,6 +51,7 @@ enum mrxs_nonhier_enum {
     MRXS_NONHIER_STITCHING_LAYER,
     MRXS_NONHIER_STITCHING_INTENSITY_LAYER,
     MRXS_NONHIER_VIMSLIDE_HISTOGRAM_DATA,
+    MRXS_NONHIER_VIMSLIDE_POSITION_BUFFER,
 };
 
 enum mrxs_hier_val_enum {
@@ -85,15 +87,36 @@ typedef struct mrxs_nonhier_entry_t {
 } mrxs_nonhier_entry_t;
 #pragma pack(pop)
 
+// One of the stored images (camera images, or downsampled combinations of camera images for the higher levels).
 typedef struct mrxs_tile_t {
 	mrxs_hier_entry_t hier_entry;
 } mrxs_tile_t;
 
+// A rectangle from a stored image, placed at the true (camera) position where it belongs in the level.
+// Stored images at the higher levels contain several camera images, each of which is placed separately.
+typedef struct mrxs_source_t {
+	i32 image_index;
+	i32 src_x;
+	i32 src_y;
+	i32 width;
+	i32 height;
+	i32 dest_x; // in pixels of this level
+	i32 dest_y;
+} mrxs_source_t;
+
 typedef struct mrxs_level_t {
 //    i32 level;
     const char* section_name;
     i32 hier_val_index;
-	mrxs_tile_t* tiles;
+	mrxs_tile_t* images; // regular grid of stored images, as listed in Index.dat
+	i32 width_in_images;
+	i32 height_in_images;
+	// The stored images are composited into a regular grid of output tiles.
+	// Output tile i is assembled from sources[tile_source_offsets[i]] up to sources[tile_source_offsets[i+1]].
+	mrxs_source_t* sources;
+	i32* tile_source_offsets;
+	i32 width_in_pixels;
+	i32 height_in_pixels;
 	i32 width_in_tiles;
 	i32 height_in_tiles;
 	i32 tile_width;
@@ -136,11 +159,35 @@ typedef struct mrxs_nonhier_t {
 	bool is_ini_section_parsed;
 } mrxs_nonhier_t;
 
+enum mrxs_dat_file_state_enum {
+	MRXS_DAT_FILE_NOT_OPENED = 0,
+	MRXS_DAT_FILE_OPEN,
+	MRXS_DAT_FILE_FAILED,
+};
+
+typedef struct mrxs_cached_image_t {
+	i32 level;
+	i32 index;
+	u32* pixels;
+	i32 refcount;
+	u64 last_used;
+} mrxs_cached_image_t;
+
+// Small LRU cache of decoded images, shared by the worker threads.
+typedef struct mrxs_image_cache_t {
+	benaphore_t lock;
+	mrxs_cached_image_t entries[64];
+	u64 use_counter;
+} mrxs_image_cache_t;
+
 typedef struct mrxs_t {
     memrw_t string_pool; // NOTE: need destroy
     const char* index_dat_filename;
     const char** dat_filenames; // NOTE: need free
-	file_handle_t* dat_file_handles; // NOTE: need free
+    char* dat_directory; // NOTE: need free
+	file_handle_t* dat_file_handles; // NOTE: need free; opened on first use
+	volatile u8* dat_file_states; // NOTE: need free
+	benaphore_t dat_open_lock;
     i32 dat_count;
     i32 hier_count;
     i32 nonhier_count;
@@ -149,6 +196,16 @@ typedef struct mrxs_t {
     i32 slide_zoom_level_hier_index;
     i32 base_width_in_tiles;
     i32 base_height_in_tiles;
+	i32 camera_image_divisions; // camera images consist of this many stored images per side at the base level
+	i32 camera_count_x;
+	i32 camera_count_y;
+	i32* camera_positions; // NOTE: need free; x and y (in pixels at the base level) for each camera image
+	bool has_camera_positions;
+	i32 width_in_pixels;
+	i32 height_in_pixels;
+	mrxs_image_cache_t* source_image_cache; // NOTE: need destroy; decoded stored images
+	mrxs_image_cache_t* output_tile_cache; // NOTE: need destroy; assembled output tiles
+	i64 index_entry_count;
 	i32 level_count;
 	mrxs_level_t levels[16];
 	i32 tile_width;
@@ -75,12 +75,27 @@ static inline bool atomic_compare_exchange(volatile i32* destination, i32 exchan
 	return (read_value == comparand);
 }
 
+static inline i64 atomic_add_i64(volatile i64* x, i64 amount) {
+	return InterlockedAdd64((volatile LONG64*)x, amount);
+}
+
+static inline bool atomic_compare_exchange_i64(volatile i64* destination, i64 exchange, i64 comparand) {
+	i64 read_value = InterlockedCompareExchange64((volatile LONG64*)destination, exchange, comparand);
+	return (read_value == comparand);
+}
+
 static inline u32 bit_scan_forward(u32 x) {
 	unsigned long first_bit = 0;
 	_BitScanForward(&first_bit, x);
 	return (u32) first_bit;
 }
 
+static inline u32 bit_scan_reverse_u64(u64 x) {
+	unsigned long last_bit = 0;
+	_BitScanReverse64(&last_bit, x);
+	return (u32) last_bit;
+}
+
 #elif APPLE
 #define OSATOMIC_USE_INLINED 1
 #include <libkern/OSAtomic.h>
@@ -109,10 +124,23 @@ static inline bool atomic_compare_exchange(volatile i32* destination, i32 exchan
 	return result;
 }
 
+static inline i64 atomic_add_i64(volatile i64* x, i64 amount) {
+	return OSAtomicAdd64(amount, (volatile int64_t*)x);
+}
+
+static inline bool atomic_compare_exchange_i64(volatile i64* destination, i64 exchange, i64 comparand) {
+	bool result = OSAtomicCompareAndSwap64(comparand, exchange, (volatile int64_t*)destination);
+	return result;
+}
+
 static inline u32 bit_scan_forward(u32 x) {
 	return __builtin_ctz(x);
 }
 
+static inline u32 bit_scan_reverse_u64(u64 x) {
+	return 63 - __builtin_clzll(x);
+}
+
 #else
 //TODO: implement
 #define write_barrier
@@ -139,6 +167,15 @@ static inline bool atomic_compare_exchange(volatile i32* destination, i32 exchan
     return (read_value == comparand);
 }
 
+static inline i64 atomic_add_i64(volatile i64* x, i64 amount) {
+	return __sync_add_and_fetch(x, amount);
+}
+
+static inline bool atomic_compare_exchange_i64(volatile i64* destination, i64 exchange, i64 comparand) {
+	i64 read_value = __sync_val_compare_and_swap(destination, comparand, exchange);
+	return (read_value == comparand);
+}
+
 static inline u32 atomic_or(volatile u32* x, u32 mask) {
 	return __sync_or_and_fetch(x, mask);
 }
@@ -147,6 +184,10 @@ static inline u32 bit_scan_forward(u32 x) {
 	return _bit_scan_forward(x);
 }
 
+static inline u32 bit_scan_reverse_u64(u64 x) {
+	return 63 - __builtin_clzll(x);
+}
+
 #endif
 
 // see:
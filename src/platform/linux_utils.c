@@ -28,6 +28,8 @@
 #include "common.h"
 #include "platform.h"
 
+#include <sys/mman.h>
+
 int platform_stat(const char* filename, struct stat* st) {
 	return stat(filename, st);
 }
@@ -104,3 +106,32 @@ size_t file_handle_read_at_offset(void* dest, file_handle_t file_handle, u64 off
 	size_t bytes_read = pread(file_handle, dest, bytes_to_read, offset);
 	return bytes_read;
 }
+
+bool file_map_for_reading(const char* filename, mapped_file_t* mapped_file) {
+	memset(mapped_file, 0, sizeof(*mapped_file));
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+	bool success = false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			mapped_file->data = (u8*)data;
+			mapped_file->size = st.st_size;
+			success = true;
+		} else {
+			console_print_error("Error: could not memory-map file '%s'\n", filename);
+		}
+	}
+	close(fd); // the mapping stays valid after closing the file descriptor
+	return success;
+}
+
+void file_unmap(mapped_file_t* mapped_file) {
+	if (mapped_file->data) {
+		munmap(mapped_file->data, mapped_file->size);
+	}
+	memset(mapped_file, 0, sizeof(*mapped_file));
+}
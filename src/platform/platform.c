@@ -111,6 +111,31 @@ u64 file_read_at_offset(void* dest, file_stream_t fp, u64 offset, u64 num_bytes)
 	return result;
 }
 
+semaphore_handle_t platform_semaphore_create(i32 initial_count) {
+#if WINDOWS
+	return CreateSemaphoreA(NULL, initial_count, 1e6, NULL);
+#else
+	// macOS does not support unnamed semaphores (sem_init), so create a named one and remove the name right away
+	static i32 counter;
+	char semaphore_name[64];
+	snprintf(semaphore_name, sizeof(semaphore_name), "/slidescape%d_%d", (i32)getpid(), atomic_increment(&counter));
+	sem_t* semaphore = sem_open(semaphore_name, O_CREAT | O_EXCL, 0644, initial_count);
+	if (semaphore == SEM_FAILED) {
+		return NULL;
+	}
+	sem_unlink(semaphore_name);
+	return semaphore;
+#endif
+}
+
+void platform_semaphore_destroy(semaphore_handle_t semaphore) {
+#if WINDOWS
+	CloseHandle(semaphore);
+#else
+	sem_close(semaphore);
+#endif
+}
+
 bool file_exists(const char* filename) {
 	return (access(filename, F_OK) != -1);
 }
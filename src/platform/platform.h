@@ -98,6 +98,16 @@ typedef struct {
 	arena_t temp_arena;
 } thread_memory_t;
 
+// Read-only view of an entire file, mapped into memory
+typedef struct mapped_file_t {
+	u8* data;
+	u64 size;
+#if WINDOWS
+	HANDLE file_handle;
+	HANDLE mapping_handle;
+#endif
+} mapped_file_t;
+
 typedef struct system_info_t {
     u32 os_page_size;
     u64 page_alignment_mask;
@@ -133,6 +143,8 @@ static inline void platform_semaphore_wait(semaphore_handle_t semaphore) {
 
 #endif
 
+semaphore_handle_t platform_semaphore_create(i32 initial_count);
+void platform_semaphore_destroy(semaphore_handle_t semaphore);
 u8* platform_alloc(size_t size);
 mem_t* platform_allocate_mem_buffer(size_t capacity);
 mem_t* platform_read_entire_file(const char* filename);
@@ -153,6 +165,8 @@ void file_stream_close(file_stream_t file_stream);
 file_handle_t open_file_handle_for_simultaneous_access(const char* filename);
 void file_handle_close(file_handle_t file_handle);
 size_t file_handle_read_at_offset(void* dest, file_handle_t file_handle, u64 offset, size_t bytes_to_read);
+bool file_map_for_reading(const char* filename, mapped_file_t* mapped_file);
+void file_unmap(mapped_file_t* mapped_file);
 
 
 bool file_exists(const char* filename);
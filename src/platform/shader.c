@@ -131,7 +131,9 @@ void write_stringified_shaders() {
 
 #endif
 
-void load_shader(u32 shader, const char* source_filename) {
+// The defines (if not NULL) are inserted directly after the #version line, so that one source file can be compiled
+// into several variants.
+void load_shader_with_defines(u32 shader, const char* source_filename, const char* defines) {
 	mem_t* shader_source_file = platform_read_entire_file(source_filename);
 	const char* shader_source = NULL;
 	bool32 source_from_file = false;
@@ -142,12 +144,24 @@ void load_shader(u32 shader, const char* source_filename) {
 
 #ifdef STRINGIFY_SHADERS
 		const char* stripped_filename = one_past_last_slash(source_filename, MAX_SHADER_FILENAME);
-
-		ASSERT(shader_count < COUNT(shader_filenames));
-		shader_sources[shader_count] = strdup(shader_source);
-		strncpy(shader_filenames[shader_count], stripped_filename, MAX_SHADER_FILENAME);
-#endif
+		char source_name_temp[MAX_SHADER_FILENAME] = {0};
+		strncpy(source_name_temp, stripped_filename, MAX_SHADER_FILENAME - 1);
+		dots_to_underscores(source_name_temp, MAX_SHADER_FILENAME);
+		bool is_already_stringified = false;
+		for (i32 i = 0; i < shader_count; ++i) {
+			if (strncmp(shader_filenames[i], source_name_temp, MAX_SHADER_FILENAME) == 0) {
+				is_already_stringified = true; // the same source may be compiled with different defines
+			}
+		}
+		if (!is_already_stringified) {
+			ASSERT(shader_count < COUNT(shader_filenames));
+			shader_sources[shader_count] = strdup(shader_source);
+			strncpy(shader_filenames[shader_count], source_name_temp, MAX_SHADER_FILENAME);
+			++shader_count;
+		}
+#else
 		++shader_count;
+#endif
 	} else {
 		are_any_shader_sources_missing = true;
 		const char* stripped_filename = one_past_last_slash(source_filename, MAX_SHADER_FILENAME);
@@ -166,8 +180,18 @@ void load_shader(u32 shader, const char* source_filename) {
 		console_print_error("Could not locate the shader source for %s.\n", source_filename);
 	}
 
-	const char* sources[] = { shader_source, };
-	glShaderSource(shader, COUNT(sources), sources, NULL);
+	const char* sources[] = { shader_source, "", "" };
+	i32 lengths[] = { -1, 0, 0 }; // -1 means null-terminated
+	const char* after_version_line = (defines && shader_source) ? strchr(shader_source, '\n') : NULL;
+	if (after_version_line) {
+		++after_version_line;
+		lengths[0] = (i32)(after_version_line - shader_source);
+		sources[1] = defines;
+		lengths[1] = -1;
+		sources[2] = after_version_line;
+		lengths[2] = -1;
+	}
+	glShaderSource(shader, COUNT(sources), sources, lengths);
 	free(shader_source_file);
 	glCompileShader(shader);
 
@@ -185,12 +209,16 @@ void load_shader(u32 shader, const char* source_filename) {
 
 }
 
-u32 load_basic_shader_program(const char* vert_filename, const char* frag_filename) {
+void load_shader(u32 shader, const char* source_filename) {
+	load_shader_with_defines(shader, source_filename, NULL);
+}
+
+u32 load_shader_program_with_defines(const char* vert_filename, const char* frag_filename, const char* defines) {
 	u32 vertex_shader = glCreateShader(GL_VERTEX_SHADER);
 	u32 fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
 
-	load_shader(vertex_shader, vert_filename);
-	load_shader(fragment_shader, frag_filename);
+	load_shader_with_defines(vertex_shader, vert_filename, defines);
+	load_shader_with_defines(fragment_shader, frag_filename, defines);
 
 	u32 shader_program = glCreateProgram();
 
@@ -215,6 +243,10 @@ u32 load_basic_shader_program(const char* vert_filename, const char* frag_filena
 	return shader_program;
 }
 
+u32 load_basic_shader_program(const char* vert_filename, const char* frag_filename) {
+	return load_shader_program_with_defines(vert_filename, frag_filename, NULL);
+}
+
 i32 get_attrib(u32 program, const char *name) {
 	i32 attribute = glGetAttribLocation(program, name);
 	if(attribute == -1)
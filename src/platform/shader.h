@@ -35,7 +35,9 @@ void write_stringified_shaders();
 #endif
 
 void load_shader(u32 shader, const char* source_filename);
+void load_shader_with_defines(u32 shader, const char* source_filename, const char* defines);
 u32 load_basic_shader_program(const char* vert_filename, const char* frag_filename);
+u32 load_shader_program_with_defines(const char* vert_filename, const char* frag_filename, const char* defines);
 i32 get_attrib(u32 program, const char *name);
 i32 get_uniform(u32 program, const char *name);
 
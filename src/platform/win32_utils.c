@@ -176,6 +176,53 @@ size_t file_handle_read_at_offset(void* dest, file_handle_t file_handle, u64 off
 	return bytes_read;
 }
 
+bool file_map_for_reading(const char* filename, mapped_file_t* mapped_file) {
+	memset(mapped_file, 0, sizeof(*mapped_file));
+	size_t filename_len = strlen(filename) + 1;
+	wchar_t* wide_filename = win32_string_widen(filename, filename_len, (wchar_t*) alloca(2 * filename_len));
+	HANDLE file_handle = CreateFileW(wide_filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file_handle == INVALID_HANDLE_VALUE) {
+		win32_diagnostic_verbose("CreateFileW");
+		return false;
+	}
+	LARGE_INTEGER filesize = {0};
+	if (!GetFileSizeEx(file_handle, &filesize) || filesize.QuadPart == 0) {
+		CloseHandle(file_handle);
+		return false;
+	}
+	HANDLE mapping_handle = CreateFileMappingW(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping_handle == NULL) {
+		win32_diagnostic("CreateFileMappingW");
+		CloseHandle(file_handle);
+		return false;
+	}
+	void* data = MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+	if (data == NULL) {
+		win32_diagnostic("MapViewOfFile");
+		CloseHandle(mapping_handle);
+		CloseHandle(file_handle);
+		return false;
+	}
+	mapped_file->data = (u8*)data;
+	mapped_file->size = filesize.QuadPart;
+	mapped_file->file_handle = file_handle;
+	mapped_file->mapping_handle = mapping_handle;
+	return true;
+}
+
+void file_unmap(mapped_file_t* mapped_file) {
+	if (mapped_file->data) {
+		UnmapViewOfFile(mapped_file->data);
+	}
+	if (mapped_file->mapping_handle) {
+		CloseHandle(mapped_file->mapping_handle);
+	}
+	if (mapped_file->file_handle) {
+		CloseHandle(mapped_file->file_handle);
+	}
+	memset(mapped_file, 0, sizeof(*mapped_file));
+}
+
 int platform_stat(const char* filename, struct stat* st) {
 	size_t filename_len = strlen(filename) + 1;
 	wchar_t* wide_filename = win32_string_widen(filename, filename_len, (wchar_t*) alloca(2 * filename_len));
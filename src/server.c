@@ -76,89 +76,251 @@
 
 #include "tiff.h"
 #include "stringutils.h"
+#include "metrics.h"
+
+
+#if LINUX
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#elif WINDOWS
+#include <winsock2.h>
+#define poll WSAPoll // requires _WIN32_WINNT >= 0x0600
+#else
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
 
-#define MAX_NUM_THREADS 16
-#define SERVER_VERBOSE 1
-
-typedef struct {
-	mbedtls_net_context client_fd;
-	int thread_complete;
-	const mbedtls_ssl_config *config;
-} thread_info_t;
-
-typedef struct {
-	int active;
-	thread_info_t   data;
-	pthread_t       thread;
-} pthread_info_t;
-
-static thread_info_t    base_info;
-static pthread_info_t   threads[MAX_NUM_THREADS];
-
-typedef struct {
-	thread_info_t *thread_info;
-	mbedtls_net_context *client_fd;
-	long int thread_id;
-	mbedtls_ssl_context ssl;
-} server_connection_t;
-
-bool ssl_send(server_connection_t* connection, u8* buf, i32 send_size) {
-	/*
-	 * 7. Write the 200 Response
-	 */
-	mbedtls_printf( "  [ #%ld ]  > Write to client:\n", connection->thread_id );
-	i32 ret = 1;
-
-	u8* send_buffer_pos = buf;
-	u32 send_size_remaining = (u32)send_size;
-
-	bool32 sent = false;
-	i32 bytes_written = 0;
-	i32 total_bytes_written = 0;
-
-//	len = sprintf( (char *) buf, HTTP_RESPONSE,
-//	               mbedtls_ssl_get_ciphersuite( &connection.ssl ) );
-
-	while (!sent) {
-		while( ( ret = mbedtls_ssl_write( &connection->ssl, send_buffer_pos, send_size_remaining ) ) <= 0 )
-		{
-			if( ret == MBEDTLS_ERR_NET_CONN_RESET )
-			{
-				mbedtls_printf( "  [ #%ld ]  failed: peer closed the connection\n",
-				                connection->thread_id );
-				return false;
-			}
-
-			if( ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE )
-			{
-				mbedtls_printf( "  [ #%ld ]  failed: mbedtls_ssl_write returned -0x%04x\n",
-				                connection->thread_id, ret );
-				return false;
-			}
-		}
+#if !WINDOWS
+#include <signal.h>
+#include <sys/uio.h> // preadv
+#endif
 
-		bytes_written = ret;
-		total_bytes_written += bytes_written;
-		send_buffer_pos += bytes_written;
-		send_size_remaining -= bytes_written;
-		if (total_bytes_written >= send_size) {
-			sent = true;
-		}
+#define SERVER_VERBOSE 0
+#define SERVER_USE_SENDFILE LINUX // in plaintext mode, stream file ranges to the socket without copying them through user space
+#define SERVER_DEFAULT_PORT "2000"
+#define SERVER_DEFAULT_WORKER_COUNT 8
+#define SERVER_DEFAULT_MAX_CONNECTIONS 256
+#define SERVER_MAX_CONNECTIONS_LIMIT 4096
+#define SERVER_MAX_QUEUED_JOBS 64 // when this many requests are waiting for a worker, stop reading new requests
+#define SERVER_MAX_REQUEST_SIZE 8192
+#define SERVER_MAX_REQUESTS_PER_CONNECTION 10000
+#define SERVER_KEEP_ALIVE_TIMEOUT 15 // seconds
+#define SERVER_MAX_EVENTS 64
+#define SLIDE_CACHE_CAPACITY 64
+#define SLIDE_CACHE_REVALIDATE_INTERVAL 1 // seconds; how long to trust a cached slide before checking the file again
+#define BLOCK_CACHE_BLOCK_SIZE KILOBYTES(64)
+#define BLOCK_CACHE_DEFAULT_SIZE 64 // megabytes
+
+// Connections are handled by a single event loop thread (TLS handshakes, reading requests, writing responses).
+// Once a complete request has been read, the connection is handed to a fixed pool of worker threads that
+// do the disk reads and assemble the response, after which it is handed back to the event loop for writing.
+typedef enum connection_state_enum {
+	CONNECTION_HANDSHAKE,
+	CONNECTION_READING_REQUEST,
+	CONNECTION_WAITING_FOR_WORKER, // request is complete, but the job queue is full
+	CONNECTION_PROCESSING,         // owned by a worker thread
+	CONNECTION_WRITING_RESPONSE,
+	CONNECTION_CLOSING,
+} connection_state_enum;
+
+enum server_event_flags_enum {
+	SERVER_EVENT_READ = 0x1,
+	SERVER_EVENT_WRITE = 0x2,
+};
 
-	}
+// Requests are counted and timed separately for each kind of API call.
+typedef enum server_command_enum {
+	SERVER_COMMAND_SLIDE,     // a single chunk of a slide
+	SERVER_COMMAND_BATCH,     // several chunks of a slide at once
+	SERVER_COMMAND_HEADER,
+	SERVER_COMMAND_SLIDE_SET,
+	SERVER_COMMAND_OTHER,     // test pages, metrics, malformed or unknown requests
+	SERVER_COMMAND_COUNT,
+} server_command_enum;
+
+static const char* server_command_names[SERVER_COMMAND_COUNT] = {
+	[SERVER_COMMAND_SLIDE] = "slide",
+	[SERVER_COMMAND_BATCH] = "batch",
+	[SERVER_COMMAND_HEADER] = "header",
+	[SERVER_COMMAND_SLIDE_SET] = "slide_set",
+	[SERVER_COMMAND_OTHER] = "other",
+};
 
+typedef struct cached_slide_t cached_slide_t;
+
+typedef struct file_range_t {
+	i64 offset;
+	i64 size;
+} file_range_t;
+
+// The response is sent in two parts: first the contents of 'buffer' (the HTTP headers, and usually also the body),
+// then, if 'slide' is set, the listed byte ranges of the slide file (using sendfile() in plaintext mode).
+typedef struct server_response_t {
+	memrw_t buffer;
+	bool allow_sendfile;
+	cached_slide_t* slide;
+	file_range_t ranges[16];
+	i32 range_count;
+	i64 range_bytes;
+	i32 chunk_count;
+	server_command_enum command;
+	i32 status;
+} server_response_t;
+
+typedef struct server_connection_t server_connection_t;
+struct server_connection_t {
+	i32 slot;
+	i64 id;
+	mbedtls_net_context client_fd;
+	mbedtls_ssl_context ssl;
+	connection_state_enum state;
+	u32 wanted_events;
+	time_t last_activity;
+	i32 requests_served;
+	bool keep_alive;
+	char request[SERVER_MAX_REQUEST_SIZE + 1];
+	i32 request_bytes_received;
+	i32 request_length;
+	i64 request_received_clock;
+	server_response_t response;
+	u64 response_bytes_sent;
+	i32 response_range_index;
+	i64 response_range_bytes_sent;
+	bool is_corked;
+	server_connection_t* next;
+};
 
-	mbedtls_printf( "  [ #%ld ]  %d bytes written\n=====\n\n=====\n",
-	                connection->thread_id, total_bytes_written);
-	return true;
-}
+typedef struct server_t {
+	const mbedtls_ssl_config* ssl_config; // NULL in plaintext mode
+	bool use_sendfile;
+	mbedtls_net_context* listen_fd;
+	bool is_accepting_paused;
+	i32 max_connections;
+	i32 connection_count;
+	i64 total_connections_accepted;
+	i32 metrics_log_interval; // seconds; 0 means don't print the metrics periodically
+	server_connection_t** connections;
+	i32 worker_count;
+	pthread_t* workers;
+	// Job queue (event loop -> workers)
+	pthread_mutex_t job_mutex;
+	pthread_cond_t job_available;
+	server_connection_t* jobs[SERVER_MAX_QUEUED_JOBS];
+	i32 job_read_index;
+	i32 job_count;
+	i32 jobs_in_flight; // only accessed by the event loop thread
+	// Requests that could not be queued yet (backpressure)
+	server_connection_t* waiting_first;
+	server_connection_t* waiting_last;
+	// Completed jobs (workers -> event loop)
+	pthread_mutex_t completion_mutex;
+	server_connection_t* completed;
+#if LINUX
+	int epoll_fd;
+	int wake_fd;
+#endif
+} server_t;
+
+static server_t server;
+
+// Cache of recently used slides, shared by the worker threads.
+// Keeps the file open (for reading chunks with pread), and keeps the serialized TIFF header around, so that
+// requests don't need to reopen and re-parse the file. Entries are checked against the file's size, inode and
+// modification time, at most once every SLIDE_CACHE_REVALIDATE_INTERVAL seconds.
+struct cached_slide_t {
+	u64 id; // unique for each time a file is opened, so that blocks of a changed file are never mixed up
+	char* path;
+	file_handle_t fd;
+	i64 filesize;
+	i64 mtime_ns;
+	u64 inode;
+	char etag[64];
+	bool has_header;
+	memrw_t header; // serialized TIFF header; only created when first requested
+	i32 refcount;
+	bool is_removed; // no longer in the cache, destroy when the last reference is released
+	u64 last_used;
+	time_t last_validated;
+};
 
+typedef struct slide_cache_t {
+	pthread_mutex_t mutex;
+	cached_slide_t* entries[SLIDE_CACHE_CAPACITY];
+	i32 entry_count;
+	u64 use_counter;
+	u64 slide_id_counter;
+} slide_cache_t;
+
+static slide_cache_t slide_cache;
+
+// Cache of recently read, fixed-size blocks of slide files, shared by the worker threads (used when the data is
+// copied into the response, i.e. not in sendfile mode). Requests read whole blocks, so a single read also covers
+// the neighbouring tiles, which are usually adjacent in the file. If several requests need the same block at the
+// same time (e.g. many viewers looking at the same region during a presentation), only one of them reads it.
+typedef struct cached_block_t cached_block_t;
+struct cached_block_t {
+	u64 slide_id;
+	i64 index;
+	u8* data;
+	i64 size; // less than BLOCK_CACHE_BLOCK_SIZE for the last block of a file
+	i32 refcount;
+	bool is_loading; // a worker is reading this block; others wait for block_cache.block_loaded
+	bool is_valid;
+	bool is_hashed;
+	cached_block_t* hash_next;
+	cached_block_t* lru_prev; // blocks are only in the LRU list while they are not in use
+	cached_block_t* lru_next;
+};
 
-static char identity_str[0xFF] = {0};
+typedef struct block_cache_t {
+	pthread_mutex_t mutex;
+	pthread_cond_t block_loaded;
+	cached_block_t* blocks;
+	i32 block_count; // 0 if the cache is disabled
+	cached_block_t** hash_table;
+	u32 hash_mask;
+	cached_block_t lru; // sentinel; lru.lru_next is the least recently used block
+} block_cache_t;
+
+static block_cache_t block_cache;
+
+typedef struct command_metrics_t {
+	volatile i64 requests;
+	volatile i64 errors; // responses with status >= 400
+	volatile i64 bytes_sent;
+	latency_histogram_t latency; // from receiving the complete request until the last byte of the response was sent
+} command_metrics_t;
+
+// Counters exposed on /metrics (and optionally printed periodically). They are updated without locking by the
+// event loop and the worker threads.
+typedef struct server_metrics_t {
+	i64 start_clock;
+	command_metrics_t commands[SERVER_COMMAND_COUNT];
+	volatile i64 slide_cache_hits;
+	volatile i64 slide_cache_misses;
+	volatile i64 slide_cache_revalidations;
+	volatile i64 slide_cache_invalidations;
+	volatile i64 slide_cache_evictions;
+	volatile i64 header_cache_hits;
+	volatile i64 header_cache_misses;
+	volatile i64 chunk_reads;
+	volatile i64 chunk_bytes_read;
+	volatile i64 block_cache_hits;
+	volatile i64 block_cache_shared_reads;
+	volatile i64 block_cache_misses;
+	volatile i64 block_cache_evictions;
+	volatile i64 disk_reads;
+	volatile i64 disk_bytes_read;
+} server_metrics_t;
+
+static server_metrics_t metrics;
 
-pthread_cond_t semaphore_work_available;
-pthread_mutex_t work_mutex;
-volatile int work_available = -1;
 
 //https://stackoverflow.com/questions/1157209/is-there-an-alternative-sleep-function-in-c-to-milliseconds
 int msleep(long msec) {
@@ -210,6 +372,8 @@ typedef struct http_request_t {
 	char* method_name;
 	char* uri;
 	char* protocol;
+	char* if_none_match;
+	bool keep_alive;
 } http_request_t;
 
 http_request_t* parse_http_headers(const char* http_headers, u64 size) {
@@ -244,12 +408,30 @@ http_request_t* parse_http_headers(const char* http_headers, u64 size) {
 	result->uri = uri;
 	result->protocol = protocol;
 
+	// HTTP/1.1 connections are persistent, unless the client sends 'Connection: close'.
+	result->keep_alive = (strcmp(protocol, "HTTP/1.1") == 0);
+	for (size_t i = 1; i < num_lines; ++i) {
+		const char* line = lines[i];
+		if (strncasecmp(line, "Connection:", 11) == 0) {
+			const char* value = line + 11;
+			while (*value == ' ') ++value;
+			if (strncasecmp(value, "close", 5) == 0) {
+				result->keep_alive = false;
+			} else if (strncasecmp(value, "keep-alive", 10) == 0) {
+				result->keep_alive = true;
+			}
+		} else if (strncasecmp(line, "If-None-Match:", 14) == 0) {
+			char* value = lines[i] + 14;
+			while (*value == ' ') ++value;
+			result->if_none_match = value;
+		}
+	}
+
 	goto cleanup;
 	fail:
 	printf("Error: malformed HTTP headers\n");
 	free(result);
-	return NULL;
-
+	result = NULL;
 
 	cleanup:
 	if (lines) free(lines);
@@ -321,300 +503,825 @@ void locate_file_prepend_env(const char* base_filename, const char* env, char* p
 	strcpy(path_buffer, base_filename);
 }
 
-bool server_send_test(server_connection_t* connection) {
-	bool32 success = false;
+static i64 get_mtime_ns(struct stat* st) {
+#if LINUX
+	return (i64)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#else
+	return (i64)st->st_mtime * 1000000000;
+#endif
+}
 
-	mem_t* file_mem = platform_read_entire_file("test_google.html");
-	if (file_mem) {
-		success = ssl_send(connection, file_mem->data, file_mem->len);
-		free(file_mem);
+static void cached_slide_destroy(cached_slide_t* slide) {
+	file_handle_close(slide->fd);
+	if (slide->has_header) {
+		memrw_destroy(&slide->header);
 	}
+	free(slide->path);
+	free(slide);
+}
 
-	return success;
+// Note: the slide cache functions below expect the caller to hold slide_cache.mutex.
+static cached_slide_t* slide_cache_find(const char* path) {
+	for (i32 i = 0; i < slide_cache.entry_count; ++i) {
+		cached_slide_t* slide = slide_cache.entries[i];
+		if (strcmp(slide->path, path) == 0) {
+			return slide;
+		}
+	}
+	return NULL;
+}
+
+static void slide_cache_remove(cached_slide_t* slide) {
+	for (i32 i = 0; i < slide_cache.entry_count; ++i) {
+		if (slide_cache.entries[i] == slide) {
+			slide_cache.entries[i] = slide_cache.entries[--slide_cache.entry_count];
+			break;
+		}
+	}
+	if (slide->refcount == 0) {
+		cached_slide_destroy(slide);
+	} else {
+		slide->is_removed = true;
+	}
+}
+
+static void slide_cache_insert(cached_slide_t* slide) {
+	if (slide_cache.entry_count == SLIDE_CACHE_CAPACITY) {
+		// Evict the least recently used slide, preferably one that is not in use.
+		cached_slide_t* victim = NULL;
+		for (i32 i = 0; i < slide_cache.entry_count; ++i) {
+			cached_slide_t* entry = slide_cache.entries[i];
+			if (!victim || (entry->refcount == 0 && victim->refcount > 0) ||
+			    ((entry->refcount == 0) == (victim->refcount == 0) && entry->last_used < victim->last_used)) {
+				victim = entry;
+			}
+		}
+		metrics_counter_add(&metrics.slide_cache_evictions, 1);
+		slide_cache_remove(victim);
+	}
+	slide->id = ++slide_cache.slide_id_counter;
+	slide_cache.entries[slide_cache.entry_count++] = slide;
 }
 
+static cached_slide_t* slide_cache_use(cached_slide_t* slide, time_t now) {
+	++slide->refcount;
+	slide->last_used = ++slide_cache.use_counter;
+	slide->last_validated = now;
+	return slide;
+}
 
-bool32 execute_slide_set_api_call(server_connection_t* connection, slide_api_call_t *call) {
-	bool32 success = false;
+// Returns the slide at 'path' with a reference added (release it with slide_cache_release()), or NULL if the file can't be opened.
+cached_slide_t* slide_cache_acquire(const char* path) {
+	time_t now = time(NULL);
+	pthread_mutex_lock(&slide_cache.mutex);
+	cached_slide_t* slide = slide_cache_find(path);
+	if (slide && now - slide->last_validated < SLIDE_CACHE_REVALIDATE_INTERVAL) {
+		slide_cache_use(slide, now);
+		metrics_counter_add(&metrics.slide_cache_hits, 1);
+		pthread_mutex_unlock(&slide_cache.mutex);
+		return slide;
+	}
+	pthread_mutex_unlock(&slide_cache.mutex);
+
+	// Check whether the file still exists and is unchanged (without holding the lock).
+	struct stat st;
+	bool exists = (platform_stat(path, &st) == 0);
+
+	pthread_mutex_lock(&slide_cache.mutex);
+	slide = slide_cache_find(path);
+	if (slide) {
+		metrics_counter_add(&metrics.slide_cache_revalidations, 1);
+		if (exists && slide->filesize == st.st_size && slide->inode == (u64)st.st_ino && slide->mtime_ns == get_mtime_ns(&st)) {
+			slide_cache_use(slide, now);
+			metrics_counter_add(&metrics.slide_cache_hits, 1);
+			pthread_mutex_unlock(&slide_cache.mutex);
+			return slide;
+		}
+		metrics_counter_add(&metrics.slide_cache_invalidations, 1);
+		slide_cache_remove(slide);
+	}
+	if (exists) {
+		metrics_counter_add(&metrics.slide_cache_misses, 1);
+	}
+	pthread_mutex_unlock(&slide_cache.mutex);
+	if (!exists) {
+		return NULL;
+	}
 
-	char path_buffer[2048];
-	path_buffer[0] = '\0';
-	locate_file_prepend_env(call->filename, "SLIDES_DIR", path_buffer, sizeof(path_buffer));
-	mem_t* file_mem = platform_read_entire_file(path_buffer);
-	if (file_mem) {
-		success = ssl_send(connection, file_mem->data, file_mem->len);
-		free(file_mem);
+	file_handle_t fd = open_file_handle_for_simultaneous_access(path);
+	if (!fd) {
+		return NULL;
+	}
+	cached_slide_t* new_slide = calloc(1, sizeof(cached_slide_t));
+	new_slide->path = strdup(path);
+	new_slide->fd = fd;
+	new_slide->filesize = st.st_size;
+	new_slide->inode = st.st_ino;
+	new_slide->mtime_ns = get_mtime_ns(&st);
+	snprintf(new_slide->etag, sizeof(new_slide->etag), "\"%llx-%llx-%llx\"", new_slide->inode, new_slide->filesize, new_slide->mtime_ns);
+
+	pthread_mutex_lock(&slide_cache.mutex);
+	slide = slide_cache_find(path);
+	if (slide) {
+		// Another worker opened the same slide in the meantime.
+		slide_cache_use(slide, now);
+		pthread_mutex_unlock(&slide_cache.mutex);
+		cached_slide_destroy(new_slide);
+		return slide;
 	}
+	slide_cache_use(new_slide, now);
+	slide_cache_insert(new_slide);
+	pthread_mutex_unlock(&slide_cache.mutex);
+	return new_slide;
+}
 
-	return success;
+void slide_cache_release(cached_slide_t* slide, i64 chunk_reads, i64 chunk_bytes_read) {
+	metrics_counter_add(&metrics.chunk_reads, chunk_reads);
+	metrics_counter_add(&metrics.chunk_bytes_read, chunk_bytes_read);
+	pthread_mutex_lock(&slide_cache.mutex);
+	--slide->refcount;
+	if (slide->refcount == 0 && slide->is_removed) {
+		cached_slide_destroy(slide);
+	}
+	pthread_mutex_unlock(&slide_cache.mutex);
 }
 
-bool32 execute_slide_api_call(server_connection_t* connection, slide_api_call_t *call) {
-	if (!call || !call->command) return false;
-	bool32 success = false;
+// Makes sure the serialized TIFF header is available in slide->header (parsing the file on first use).
+bool cached_slide_load_header(cached_slide_t* slide) {
+	pthread_mutex_lock(&slide_cache.mutex);
+	bool has_header = slide->has_header;
+	if (has_header) {
+		metrics_counter_add(&metrics.header_cache_hits, 1);
+	} else {
+		metrics_counter_add(&metrics.header_cache_misses, 1);
+	}
+	pthread_mutex_unlock(&slide_cache.mutex);
+	if (has_header) {
+		return true;
+	}
 
-	if (strcmp(call->command, "slide_set") == 0) {
-		success = execute_slide_set_api_call(connection, call);
+	tiff_t tiff = {0};
+	if (!open_tiff_file(&tiff, slide->path)) {
+		fprintf(stderr, "Couldn't open TIFF file %s\n", slide->path);
+		return false;
 	}
-	else if (strcmp(call->command, "test") == 0) {
-		success = server_send_test(connection);
+	memrw_t header = {0};
+	tiff_serialize(&tiff, &header);
+	tiff_destroy(&tiff);
+
+	pthread_mutex_lock(&slide_cache.mutex);
+	if (!slide->has_header) {
+		slide->header = header;
+		slide->has_header = true;
+	} else {
+		memrw_destroy(&header);
 	}
+	pthread_mutex_unlock(&slide_cache.mutex);
+	return true;
+}
 
-	else if (strcmp(call->command, "slide") == 0) {
-		// If the SLIDES_DIR environment variable is set, load slides from there
-		char path_buffer[2048];
-		path_buffer[0] = '\0';
-		locate_file_prepend_env(call->filename, "SLIDES_DIR", path_buffer, sizeof(path_buffer));
-		const char* ext = get_file_extension(path_buffer);
-		if (strcasecmp(ext, "tiff") != 0) {
-			// TODO: search for files with this pattern
-			size_t path_len = strlen(path_buffer);
-			snprintf(path_buffer + path_len, sizeof(path_buffer) - path_len, ".tiff");
-		}
+static void block_cache_init(i64 size) {
+	pthread_mutex_init(&block_cache.mutex, NULL);
+	pthread_cond_init(&block_cache.block_loaded, NULL);
+	block_cache.lru.lru_prev = &block_cache.lru;
+	block_cache.lru.lru_next = &block_cache.lru;
+	block_cache.block_count = (i32)(size / BLOCK_CACHE_BLOCK_SIZE);
+	if (block_cache.block_count == 0) {
+		return;
+	}
+	u32 hash_size = next_pow2(2 * block_cache.block_count);
+	block_cache.hash_table = calloc(hash_size, sizeof(cached_block_t*));
+	block_cache.hash_mask = hash_size - 1;
+	block_cache.blocks = calloc(block_cache.block_count, sizeof(cached_block_t));
+	for (i32 i = 0; i < block_cache.block_count; ++i) {
+		cached_block_t* block = block_cache.blocks + i;
+		block->lru_prev = block_cache.lru.lru_prev;
+		block->lru_next = &block_cache.lru;
+		block_cache.lru.lru_prev->lru_next = block;
+		block_cache.lru.lru_prev = block;
+	}
+}
 
-		char* parameter1 = call->parameter1;
-		char* parameter2 = call->parameter2;
-		// is the client requesting TIFF header and metadata?
-		if (parameter1 && strcmp(parameter1, "header") == 0) {
-			if (file_exists(path_buffer)) {
-
-				tiff_t tiff = {0};
-				if (open_tiff_file(&tiff, path_buffer)) {
-					memrw_t payload_buffer = {};
-					tiff_serialize(&tiff, &payload_buffer);
-
-					// rewrite the HTTP headers at the start, the Content-Length now isn't correct
-					char http_headers[4096];
-					snprintf(http_headers, sizeof(http_headers),
-					         "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-type: application/octet-stream\r\nContent-length: %-16llu\r\n\r\n",
-					         payload_buffer.used_size);
-					u64 http_headers_size = strlen(http_headers);
-
-					u64 send_size = http_headers_size + payload_buffer.used_size;
-					u8* send_buffer = malloc(send_size);
-					memcpy(send_buffer, http_headers, http_headers_size);
-					memcpy(send_buffer + http_headers_size, payload_buffer.data, payload_buffer.used_size);
-					success = ssl_send(connection, send_buffer, send_size);
-
-//				    tls_close_notify(context);
-//				    send_pending(client_sock, context);
-					free(send_buffer);
-					memrw_destroy(&payload_buffer);
-					tiff_destroy(&tiff);
-				} else {
-					fprintf(stderr, "Couldn't open TIFF file %s\n", path_buffer);
-					success = false;
-				}
+static u32 block_cache_hash(u64 slide_id, i64 index) {
+	u64 hash = (slide_id * 0x9E3779B97F4A7C15ULL) ^ ((u64)index * 0xC2B2AE3D27D4EB4FULL);
+	return (u32)(hash >> 32) & block_cache.hash_mask;
+}
 
+static void block_cache_unhash(cached_block_t* block) {
+	cached_block_t** link = block_cache.hash_table + block_cache_hash(block->slide_id, block->index);
+	while (*link != block) {
+		link = &(*link)->hash_next;
+	}
+	*link = block->hash_next;
+	block->hash_next = NULL;
+	block->is_hashed = false;
+}
 
+// Returns the block with a reference added, or NULL if every block is in use. If the block wasn't cached yet,
+// 'must_load' is set and the caller has to read it and then call block_cache_finish_loading().
+// Must be called with block_cache.mutex held.
+static cached_block_t* block_cache_acquire_locked(u64 slide_id, i64 index, bool* must_load) {
+	*must_load = false;
+	u32 hash = block_cache_hash(slide_id, index);
+	for (cached_block_t* block = block_cache.hash_table[hash]; block; block = block->hash_next) {
+		if (block->slide_id == slide_id && block->index == index) {
+			if (block->refcount++ == 0) {
+				block->lru_prev->lru_next = block->lru_next;
+				block->lru_next->lru_prev = block->lru_prev;
+			}
+			if (block->is_loading) {
+				metrics_counter_add(&metrics.block_cache_shared_reads, 1);
 			} else {
-				fprintf(stderr, "Couldn't open file %s\n", path_buffer);
-				success = false;
+				metrics_counter_add(&metrics.block_cache_hits, 1);
 			}
+			return block;
 		}
-		else if (parameter1 && parameter2){
-
-			// try to interpret as batch
-			i32 batch_size = (call->par_count - 2) / 2; // minus two, because 'command' and 'filename' are also counted
-			ASSERT(batch_size >= 1);
-			i64* chunk_offsets = alloca(batch_size * sizeof(i64));
-			i64* chunk_sizes = alloca(batch_size * sizeof(i64));
-			i64 total_size = 0;
-			for (i32 i = 0; i < batch_size; ++i) {
-				// try to interpret the parameters as numbers
-				chunk_offsets[i] = atoll(call->pars[2+2*i]);
-				chunk_sizes[i] = atoll(call->pars[3+2*i]);
-				total_size += chunk_sizes[i];
-			}
-
-
-			if (total_size > 0) {
-
-				FILE* fp = fopen64(path_buffer, "rb");
-				if (fp) {
-					struct stat st;
-					if (fstat(fileno(fp), &st) == 0) {
-						i64 filesize = st.st_size;
-
-						char http_headers[4096];
-						snprintf(http_headers, sizeof(http_headers),
-						         "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-type: application/octet-stream\r\nContent-length: %llu\r\n\r\n",
-						         total_size);
-						u64 http_headers_size = strlen(http_headers);
-
-						u64 send_size = http_headers_size + total_size;
-						u8* send_buffer = malloc(send_size);
-						memcpy(send_buffer, http_headers, http_headers_size);
-						u8* data_buffer = send_buffer + http_headers_size;
-						u8* data_buffer_pos = data_buffer;
-
-						bool32 ok = true;
-
-						for (i32 i = 0; i < batch_size; ++i) {
-							// try to interpret the parameters as numbers
-							i64 requested_offset = chunk_offsets[i];
-							i64 requested_size = chunk_sizes[i];
-							fseeko64(fp, requested_offset, SEEK_SET);
-							ok = ok && (fread(data_buffer_pos, requested_size, 1, fp) == 1);
-							if (!ok) {
-								printf("Error reading from %s\n", call->filename);
-							}
-							data_buffer_pos += requested_size;
-						}
-
-						if (ok) {
-
-							ssl_send(connection, send_buffer, send_size);
-
-						}
-						free(send_buffer);
-					}
-					fclose(fp);
-				}
+	}
+	cached_block_t* block = block_cache.lru.lru_next;
+	if (block == &block_cache.lru) {
+		return NULL;
+	}
+	block->lru_prev->lru_next = block->lru_next;
+	block->lru_next->lru_prev = block->lru_prev;
+	if (block->is_hashed) {
+		metrics_counter_add(&metrics.block_cache_evictions, 1);
+		block_cache_unhash(block);
+	}
+	if (!block->data) {
+		block->data = malloc(BLOCK_CACHE_BLOCK_SIZE);
+	}
+	block->slide_id = slide_id;
+	block->index = index;
+	block->size = 0;
+	block->refcount = 1;
+	block->is_loading = true;
+	block->is_valid = false;
+	block->hash_next = block_cache.hash_table[hash];
+	block_cache.hash_table[hash] = block;
+	block->is_hashed = true;
+	metrics_counter_add(&metrics.block_cache_misses, 1);
+	*must_load = true;
+	return block;
+}
 
-			}
+// Must be called with block_cache.mutex held.
+static void block_cache_release_locked(cached_block_t* block) {
+	ASSERT(block->refcount > 0);
+	if (--block->refcount == 0) {
+		if (block->is_hashed) {
+			// Most recently used: insert at the back of the LRU list.
+			block->lru_prev = block_cache.lru.lru_prev;
+			block->lru_next = &block_cache.lru;
+		} else {
+			// Not worth keeping (the read failed): reuse this block first.
+			block->lru_prev = &block_cache.lru;
+			block->lru_next = block_cache.lru.lru_next;
 		}
-	} else {
-		printf("Slide API: unknown command %s\n", call->command);
-	};
-	return success;
+		block->lru_prev->lru_next = block;
+		block->lru_next->lru_prev = block;
+	}
 }
 
+// Must be called with block_cache.mutex held. Wakes up any workers waiting for the block.
+static void block_cache_finish_loading_locked(cached_block_t* block, bool is_valid) {
+	block->is_loading = false;
+	block->is_valid = is_valid;
+	if (!is_valid && block->is_hashed) {
+		block_cache_unhash(block);
+	}
+}
 
+// Read a run of consecutive blocks with a single system call.
+static bool slide_read_blocks(cached_slide_t* slide, cached_block_t** blocks, i32 block_count) {
+	i64 offset = blocks[0]->index * BLOCK_CACHE_BLOCK_SIZE;
+	i64 total_size = 0;
+	for (i32 i = 0; i < block_count; ++i) {
+		blocks[i]->size = MIN(BLOCK_CACHE_BLOCK_SIZE, slide->filesize - blocks[i]->index * BLOCK_CACHE_BLOCK_SIZE);
+		total_size += blocks[i]->size;
+	}
+	metrics_counter_add(&metrics.disk_reads, 1);
+#if !WINDOWS
+	struct iovec* iov = alloca(block_count * sizeof(struct iovec));
+	for (i32 i = 0; i < block_count; ++i) {
+		iov[i].iov_base = blocks[i]->data;
+		iov[i].iov_len = blocks[i]->size;
+	}
+	ssize_t bytes_read = preadv(slide->fd, iov, block_count, offset);
+	if (bytes_read == total_size) {
+		metrics_counter_add(&metrics.disk_bytes_read, total_size);
+		return true;
+	}
+	// Short read (or an error): retry block by block.
+#endif
+	for (i32 i = 0; i < block_count; ++i) {
+		size_t block_bytes_read = file_handle_read_at_offset(blocks[i]->data, slide->fd, blocks[i]->index * BLOCK_CACHE_BLOCK_SIZE, blocks[i]->size);
+		if (block_bytes_read != (size_t)blocks[i]->size) {
+			return false;
+		}
+	}
+	metrics_counter_add(&metrics.disk_bytes_read, total_size);
+	return true;
+}
 
+// Read the chunks one after another into 'dest', without the block cache.
+// Chunks that directly follow each other in the file are read together.
+static bool slide_read_chunks_direct(cached_slide_t* slide, i32 chunk_count, i64* offsets, i64* sizes, u8* dest) {
+	for (i32 i = 0; i < chunk_count; ) {
+		i64 offset = offsets[i];
+		i64 size = sizes[i];
+		for (++i; i < chunk_count && offsets[i] == offset + size; ++i) {
+			size += sizes[i];
+		}
+		metrics_counter_add(&metrics.disk_reads, 1);
+		size_t bytes_read = file_handle_read_at_offset(dest, slide->fd, offset, size);
+		if (bytes_read != (size_t)size) {
+			return false;
+		}
+		metrics_counter_add(&metrics.disk_bytes_read, size);
+		dest += size;
+	}
+	return true;
+}
 
-#if 0
-void* worker_thread(void* arg_ptr) {
+static int compare_i64(const void* a, const void* b) {
+	i64 x = *(const i64*)a;
+	i64 y = *(const i64*)b;
+	return (x > y) - (x < y);
+}
 
-	for (;;) {
-		/* thread code blocks here until work is available */
-		pthread_mutex_lock(&work_mutex);
-		while (work_available <= 0) {
-			pthread_cond_wait(&semaphore_work_available, &work_mutex);
+// Read the chunks one after another into 'dest', going through the block cache. Returns false on a read error.
+static bool slide_read_chunks(cached_slide_t* slide, i32 chunk_count, i64* offsets, i64* sizes, u8* dest) {
+	// Collect the blocks that are needed (overlapping chunks and chunks sharing a block only need them once).
+	i32 max_needed = 0;
+	for (i32 i = 0; i < chunk_count; ++i) {
+		if (sizes[i] > 0) {
+			max_needed += (i32)((offsets[i] + sizes[i] - 1) / BLOCK_CACHE_BLOCK_SIZE - offsets[i] / BLOCK_CACHE_BLOCK_SIZE + 1);
 		}
-		pthread_mutex_unlock(&work_mutex);
-		/* proceed with thread execution */
-
-		int client_socket = work_available;
-		work_available = 0;
+	}
+	// Very large requests would push everything else out of the cache (or might not fit at all).
+	if (max_needed == 0 || max_needed > block_cache.block_count / 8) {
+		return slide_read_chunks_direct(slide, chunk_count, offsets, sizes, dest);
+	}
+	i64* needed = alloca(max_needed * sizeof(i64));
+	i32 needed_count = 0;
+	for (i32 i = 0; i < chunk_count; ++i) {
+		if (sizes[i] > 0) {
+			for (i64 index = offsets[i] / BLOCK_CACHE_BLOCK_SIZE; index <= (offsets[i] + sizes[i] - 1) / BLOCK_CACHE_BLOCK_SIZE; ++index) {
+				needed[needed_count++] = index;
+			}
+		}
+	}
+	qsort(needed, needed_count, sizeof(i64), compare_i64);
+	i32 unique_count = 1;
+	for (i32 i = 1; i < needed_count; ++i) {
+		if (needed[i] != needed[unique_count - 1]) {
+			needed[unique_count++] = needed[i];
+		}
+	}
+	needed_count = unique_count;
+
+	cached_block_t** blocks = alloca(needed_count * sizeof(cached_block_t*));
+	bool* must_load = alloca(needed_count * sizeof(bool));
+	i32 acquired_count = 0;
+	pthread_mutex_lock(&block_cache.mutex);
+	for (; acquired_count < needed_count; ++acquired_count) {
+		blocks[acquired_count] = block_cache_acquire_locked(slide->id, needed[acquired_count], must_load + acquired_count);
+		if (!blocks[acquired_count]) break;
+	}
+	if (acquired_count < needed_count) {
+		// All blocks are in use by other requests: give back what we have and bypass the cache.
+		for (i32 i = 0; i < acquired_count; ++i) {
+			if (must_load[i]) {
+				block_cache_finish_loading_locked(blocks[i], false);
+			}
+			block_cache_release_locked(blocks[i]);
+		}
+		pthread_cond_broadcast(&block_cache.block_loaded);
+		pthread_mutex_unlock(&block_cache.mutex);
+		return slide_read_chunks_direct(slide, chunk_count, offsets, sizes, dest);
+	}
+	pthread_mutex_unlock(&block_cache.mutex);
+
+	// Read the blocks that this request is responsible for, one read per run of consecutive blocks.
+	// Blocks that other requests are reading are only waited for after this, so that no two requests can end up
+	// waiting for each other.
+	bool* load_ok = alloca(needed_count * sizeof(bool));
+	bool any_loaded = false;
+	for (i32 i = 0; i < needed_count; ) {
+		if (!must_load[i]) {
+			++i;
+			continue;
+		}
+		i32 run_start = i;
+		for (++i; i < needed_count && must_load[i] && needed[i] == needed[i-1] + 1; ++i);
+		bool ok = slide_read_blocks(slide, blocks + run_start, i - run_start);
+		for (i32 j = run_start; j < i; ++j) {
+			load_ok[j] = ok;
+		}
+		any_loaded = true;
+	}
 
-		connection_handler(&client_socket);
+	bool* is_valid = alloca(needed_count * sizeof(bool));
+	pthread_mutex_lock(&block_cache.mutex);
+	if (any_loaded) {
+		for (i32 i = 0; i < needed_count; ++i) {
+			if (must_load[i]) {
+				block_cache_finish_loading_locked(blocks[i], load_ok[i]);
+			}
+		}
+		pthread_cond_broadcast(&block_cache.block_loaded);
+	}
+	for (i32 i = 0; i < needed_count; ++i) {
+		while (blocks[i]->is_loading) {
+			pthread_cond_wait(&block_cache.block_loaded, &block_cache.mutex);
+		}
+		is_valid[i] = blocks[i]->is_valid;
+	}
+	pthread_mutex_unlock(&block_cache.mutex);
+
+	// Assemble the chunks (the blocks can't change while we hold a reference).
+	// A block can be invalid because the request that was loading it gave up (the cache was exhausted), or because
+	// its read failed. Either way, that part of the chunk is read directly: cache pressure should never fail a request.
+	bool success = true;
+	for (i32 i = 0; i < chunk_count && success; ++i) {
+		i64 offset = offsets[i];
+		i64 end = offsets[i] + sizes[i];
+		i32 block_pos = 0;
+		while (offset < end) {
+			i64 index = offset / BLOCK_CACHE_BLOCK_SIZE;
+			while (needed[block_pos] != index) ++block_pos;
+			cached_block_t* block = blocks[block_pos];
+			i64 offset_in_block = offset - index * BLOCK_CACHE_BLOCK_SIZE;
+			i64 copy_size;
+			if (is_valid[block_pos]) {
+				copy_size = MIN(end - offset, block->size - offset_in_block);
+				memcpy(dest, block->data + offset_in_block, copy_size);
+			} else {
+				copy_size = MIN(end - offset, BLOCK_CACHE_BLOCK_SIZE - offset_in_block);
+				metrics_counter_add(&metrics.disk_reads, 1);
+				size_t bytes_read = file_handle_read_at_offset(dest, slide->fd, offset, copy_size);
+				if (bytes_read != (size_t)copy_size) {
+					success = false;
+					break;
+				}
+				metrics_counter_add(&metrics.disk_bytes_read, copy_size);
+			}
+			dest += copy_size;
+			offset += copy_size;
+		}
+	}
 
+	pthread_mutex_lock(&block_cache.mutex);
+	for (i32 i = 0; i < needed_count; ++i) {
+		block_cache_release_locked(blocks[i]);
+	}
+	pthread_mutex_unlock(&block_cache.mutex);
+	return success;
+}
 
-//	pthread_cond_signal(&semaphore_work_grabbed);
+static const char* http_status_text(i32 status) {
+	switch (status) {
+		case 200: return "OK";
+		case 304: return "Not Modified";
+		case 400: return "Bad Request";
+		case 404: return "Not Found";
+		case 416: return "Range Not Satisfiable";
+		case 431: return "Request Header Fields Too Large";
+		case 500: return "Internal Server Error";
+		default: return "Unknown";
 	}
+}
 
-	return 0;
+// 'extra_headers' (optional) should consist of complete lines, each terminated by "\r\n".
+void server_write_response_headers_ex(memrw_t* response, i32 status, const char* content_type, u64 content_length,
+                                      bool keep_alive, const char* extra_headers) {
+	memrw_printf(response, "HTTP/1.1 %d %s\r\nConnection: %s\r\nContent-type: %s\r\nContent-length: %llu\r\n%s\r\n",
+	             status, http_status_text(status), keep_alive ? "keep-alive" : "close", content_type, content_length,
+	             extra_headers ? extra_headers : "");
 }
 
-// https://stackoverflow.com/questions/21405204/multithread-server-client-implementation-in-c
+void server_write_response_headers(memrw_t* response, i32 status, u64 content_length, bool keep_alive) {
+	server_write_response_headers_ex(response, status, "application/octet-stream", content_length, keep_alive, NULL);
+}
 
-typedef struct {
-	i32 client_socket;
-	pthread_cond_t cond;
-} thread_data_t;
+// Reserve space for the response body directly after the headers, so that data can be read straight into it.
+u8* server_reserve_response_body(memrw_t* response, u64 size) {
+	memrw_maybe_grow(response, response->used_size + size);
+	u8* body = response->data + response->used_size;
+	response->used_size += size;
+	response->cursor = response->used_size;
+	return body;
+}
 
-int main2(int argc , char *argv[]) {
-	int socket_desc , client_sock , read_size;
-	socklen_t c;
-	struct sockaddr_in server , client;
-	char client_message[0xFFFF];
+i32 server_send_file(memrw_t* response, const char* filename, bool keep_alive) {
+	mem_t* file_mem = platform_read_entire_file(filename);
+	if (!file_mem) {
+		return 404;
+	}
+	server_write_response_headers(response, 200, file_mem->len, keep_alive);
+	memrw_write(file_mem->data, response, file_mem->len);
+	free(file_mem);
+	return 200;
+}
 
-#ifdef _WIN32
-	WSADATA wsaData;
-	WSAStartup(MAKEWORD(2, 2), &wsaData);
-#else
-	signal(SIGPIPE, SIG_IGN);
-#endif
+i32 server_send_test(memrw_t* response, bool keep_alive) {
+	return server_send_file(response, "test_google.html", keep_alive);
+}
 
-	tls_init();
+i32 execute_slide_set_api_call(memrw_t* response, slide_api_call_t *call, bool keep_alive) {
+	if (!call->filename) return 400;
+	char path_buffer[2048];
+	path_buffer[0] = '\0';
+	locate_file_prepend_env(call->filename, "SLIDES_DIR", path_buffer, sizeof(path_buffer));
+	return server_send_file(response, path_buffer, keep_alive);
+}
 
-	pthread_t threads[MAX_NUM_THREADS] = {0};
+// Note: the gauges are read without synchronization, so they may be slightly out of date.
+void server_write_metrics(memrw_t* out) {
+	pthread_mutex_lock(&slide_cache.mutex);
+	i32 slide_cache_entry_count = slide_cache.entry_count;
+	pthread_mutex_unlock(&slide_cache.mutex);
+
+	char labels[64];
+	metrics_write_family(out, "slideserver_requests_total", "counter", "Requests answered, by API command.");
+	for (i32 i = 0; i < SERVER_COMMAND_COUNT; ++i) {
+		snprintf(labels, sizeof(labels), "command=\"%s\"", server_command_names[i]);
+		metrics_write_sample(out, "slideserver_requests_total", labels, metrics.commands[i].requests);
+	}
+	metrics_write_family(out, "slideserver_request_errors_total", "counter", "Requests answered with a 4xx or 5xx status, by API command.");
+	for (i32 i = 0; i < SERVER_COMMAND_COUNT; ++i) {
+		snprintf(labels, sizeof(labels), "command=\"%s\"", server_command_names[i]);
+		metrics_write_sample(out, "slideserver_request_errors_total", labels, metrics.commands[i].errors);
+	}
+	metrics_write_family(out, "slideserver_response_bytes_total", "counter", "Bytes sent in responses (including HTTP headers), by API command.");
+	for (i32 i = 0; i < SERVER_COMMAND_COUNT; ++i) {
+		snprintf(labels, sizeof(labels), "command=\"%s\"", server_command_names[i]);
+		metrics_write_sample(out, "slideserver_response_bytes_total", labels, metrics.commands[i].bytes_sent);
+	}
+	metrics_write_family(out, "slideserver_request_duration_seconds", "summary", "Time from receiving a request until its response was sent, by API command.");
+	for (i32 i = 0; i < SERVER_COMMAND_COUNT; ++i) {
+		snprintf(labels, sizeof(labels), "command=\"%s\"", server_command_names[i]);
+		metrics_write_latency_summary(out, "slideserver_request_duration_seconds", labels, &metrics.commands[i].latency);
+	}
+	metrics_write_family(out, "slideserver_request_duration_max_seconds", "gauge", "Slowest request since the server started, by API command.");
+	for (i32 i = 0; i < SERVER_COMMAND_COUNT; ++i) {
+		snprintf(labels, sizeof(labels), "command=\"%s\"", server_command_names[i]);
+		metrics_write_sample_float(out, "slideserver_request_duration_max_seconds", labels, (double)metrics.commands[i].latency.max * 1e-6);
+	}
 
-	pthread_cond_init(&semaphore_work_available, NULL);
-	pthread_mutex_init(&work_mutex, NULL);
+	metrics_write_family(out, "slideserver_connections_open", "gauge", "Currently open client connections.");
+	metrics_write_sample(out, "slideserver_connections_open", NULL, server.connection_count);
+	metrics_write_family(out, "slideserver_connections_accepted_total", "counter", "Client connections accepted.");
+	metrics_write_sample(out, "slideserver_connections_accepted_total", NULL, server.total_connections_accepted);
+	metrics_write_family(out, "slideserver_requests_in_flight", "gauge", "Requests queued for or being processed by a worker thread.");
+	metrics_write_sample(out, "slideserver_requests_in_flight", NULL, server.jobs_in_flight);
+
+	metrics_write_family(out, "slideserver_slide_cache_entries", "gauge", "Slides currently held open in the slide cache.");
+	metrics_write_sample(out, "slideserver_slide_cache_entries", NULL, slide_cache_entry_count);
+	metrics_write_family(out, "slideserver_slide_cache_hits_total", "counter", "Slide lookups served from the slide cache.");
+	metrics_write_sample(out, "slideserver_slide_cache_hits_total", NULL, metrics.slide_cache_hits);
+	metrics_write_family(out, "slideserver_slide_cache_misses_total", "counter", "Slide lookups that had to open the file.");
+	metrics_write_sample(out, "slideserver_slide_cache_misses_total", NULL, metrics.slide_cache_misses);
+	metrics_write_family(out, "slideserver_slide_cache_revalidations_total", "counter", "Cached slides checked against the file on disk.");
+	metrics_write_sample(out, "slideserver_slide_cache_revalidations_total", NULL, metrics.slide_cache_revalidations);
+	metrics_write_family(out, "slideserver_slide_cache_invalidations_total", "counter", "Cached slides dropped because the file changed or disappeared.");
+	metrics_write_sample(out, "slideserver_slide_cache_invalidations_total", NULL, metrics.slide_cache_invalidations);
+	metrics_write_family(out, "slideserver_slide_cache_evictions_total", "counter", "Cached slides dropped to make room for others.");
+	metrics_write_sample(out, "slideserver_slide_cache_evictions_total", NULL, metrics.slide_cache_evictions);
+	metrics_write_family(out, "slideserver_header_cache_hits_total", "counter", "TIFF header requests served from the cache.");
+	metrics_write_sample(out, "slideserver_header_cache_hits_total", NULL, metrics.header_cache_hits);
+	metrics_write_family(out, "slideserver_header_cache_misses_total", "counter", "TIFF header requests that had to parse the file.");
+	metrics_write_sample(out, "slideserver_header_cache_misses_total", NULL, metrics.header_cache_misses);
+	metrics_write_family(out, "slideserver_chunk_reads_total", "counter", "Chunks of slide files sent to clients.");
+	metrics_write_sample(out, "slideserver_chunk_reads_total", NULL, metrics.chunk_reads);
+	metrics_write_family(out, "slideserver_chunk_bytes_read_total", "counter", "Bytes of slide files sent to clients.");
+	metrics_write_sample(out, "slideserver_chunk_bytes_read_total", NULL, metrics.chunk_bytes_read);
+
+	metrics_write_family(out, "slideserver_block_cache_hits_total", "counter", "Blocks of slide files found in the block cache.");
+	metrics_write_sample(out, "slideserver_block_cache_hits_total", NULL, metrics.block_cache_hits);
+	metrics_write_family(out, "slideserver_block_cache_shared_reads_total", "counter", "Blocks that were already being read for another request.");
+	metrics_write_sample(out, "slideserver_block_cache_shared_reads_total", NULL, metrics.block_cache_shared_reads);
+	metrics_write_family(out, "slideserver_block_cache_misses_total", "counter", "Blocks that had to be read from disk.");
+	metrics_write_sample(out, "slideserver_block_cache_misses_total", NULL, metrics.block_cache_misses);
+	metrics_write_family(out, "slideserver_block_cache_evictions_total", "counter", "Blocks dropped from the block cache to make room for others.");
+	metrics_write_sample(out, "slideserver_block_cache_evictions_total", NULL, metrics.block_cache_evictions);
+	metrics_write_family(out, "slideserver_disk_reads_total", "counter", "Read calls on slide files (not counting sendfile).");
+	metrics_write_sample(out, "slideserver_disk_reads_total", NULL, metrics.disk_reads);
+	metrics_write_family(out, "slideserver_disk_bytes_read_total", "counter", "Bytes read from slide files (not counting sendfile).");
+	metrics_write_sample(out, "slideserver_disk_bytes_read_total", NULL, metrics.disk_bytes_read);
+
+	metrics_write_family(out, "slideserver_uptime_seconds", "gauge", "Time since the server started.");
+	metrics_write_sample_float(out, "slideserver_uptime_seconds", NULL, get_seconds_elapsed(metrics.start_clock, get_clock()));
+}
 
-	pthread_mutex_lock(&work_mutex);
+i32 server_send_metrics(memrw_t* response, bool keep_alive) {
+	memrw_t body = {0};
+	server_write_metrics(&body);
+	server_write_response_headers_ex(response, 200, "text/plain; version=0.0.4", body.used_size, keep_alive, NULL);
+	memrw_write(body.data, response, body.used_size);
+	memrw_destroy(&body);
+	return 200;
+}
 
-	for (i64 i = 1; i < COUNT(threads); ++i) {
-		if (pthread_create(threads + i, NULL, &worker_thread, (void*)i) != 0) {
-			fprintf(stderr, "Error creating thread\n");
-			return 1;
-		}
+i32 execute_slide_header_api_call(memrw_t* response, http_request_t* request, cached_slide_t* slide) {
+	if (!cached_slide_load_header(slide)) {
+		return 500;
 	}
-
-	socket_desc = socket(AF_INET , SOCK_STREAM , 0);
-	if (socket_desc == -1) {
-		printf("Could not create socket");
-		return 1;
+	char etag_header[128];
+	snprintf(etag_header, sizeof(etag_header), "ETag: %s\r\n", slide->etag);
+	if (request->if_none_match && strcmp(request->if_none_match, slide->etag) == 0) {
+		// The client already has this version of the header.
+		server_write_response_headers_ex(response, 304, "application/octet-stream", 0, request->keep_alive, etag_header);
+		return 304;
 	}
+	server_write_response_headers_ex(response, 200, "application/octet-stream", slide->header.used_size, request->keep_alive, etag_header);
+	memrw_write(slide->header.data, response, slide->header.used_size);
+	return 200;
+}
 
-	int port = 2000;
-	if (argc > 1) {
-		port = atoi(argv[1]);
-		if (port <= 0)
-			port = 2000;
+i32 execute_slide_batch_api_call(server_response_t* response, http_request_t* request, slide_api_call_t* call, cached_slide_t* slide) {
+	i32 batch_size = (call->par_count - 2) / 2; // minus two, because 'command' and 'filename' are also counted
+	ASSERT(batch_size >= 1);
+	i64* chunk_offsets = alloca(batch_size * sizeof(i64));
+	i64* chunk_sizes = alloca(batch_size * sizeof(i64));
+	i64 total_size = 0;
+	i32 status = 200;
+	for (i32 i = 0; i < batch_size; ++i) {
+		// try to interpret the parameters as numbers
+		chunk_offsets[i] = atoll(call->pars[2+2*i]);
+		chunk_sizes[i] = atoll(call->pars[3+2*i]);
+		if (chunk_offsets[i] < 0 || chunk_sizes[i] < 0) {
+			status = 400;
+			goto done;
+		}
+		if (chunk_offsets[i] > slide->filesize || chunk_sizes[i] > slide->filesize - chunk_offsets[i]) {
+			status = 416;
+			goto done;
+		}
+		total_size += chunk_sizes[i];
+	}
+	if (total_size == 0) {
+		status = 400;
+		goto done;
 	}
-	server.sin_family = AF_INET;
-	server.sin_addr.s_addr = INADDR_ANY;
-	server.sin_port = htons(port);
-
-	int enable = 1;
-	int timeout = 5000;
-	setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, (char*)&enable, sizeof(int));
-	setsockopt(socket_desc, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(int));
-	setsockopt(socket_desc, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(int));
 
-	if( bind(socket_desc,(struct sockaddr *)&server , sizeof(server)) < 0) {
-		perror("bind failed. Error");
-		return 1;
+	server_write_response_headers(&response->buffer, 200, total_size, request->keep_alive);
+
+	if (response->allow_sendfile) {
+		// Leave it to the event loop to send the chunks straight from the page cache.
+		// Chunks that directly follow each other in the file (neighbouring tiles, usually) are sent as one range.
+		i32 range_count = 0;
+		for (i32 i = 0; i < batch_size; ++i) {
+			file_range_t* last_range = response->ranges + range_count - 1;
+			if (range_count > 0 && last_range->offset + last_range->size == chunk_offsets[i]) {
+				last_range->size += chunk_sizes[i];
+			} else if (range_count < COUNT(response->ranges)) {
+				response->ranges[range_count++] = (file_range_t){ .offset = chunk_offsets[i], .size = chunk_sizes[i] };
+			} else {
+				range_count = 0; // too fragmented, copy instead
+				break;
+			}
+		}
+		if (range_count > 0) {
+			// The response keeps the reference to the slide until it has been sent.
+			response->range_count = range_count;
+			response->range_bytes = total_size;
+			response->chunk_count = batch_size;
+			response->slide = slide;
+			return 200;
+		}
 	}
 
-	listen(socket_desc , 3);
+	// Read the chunks straight into the response buffer (which is reused across requests on the same connection).
+	u8* data_buffer = server_reserve_response_body(&response->buffer, total_size);
+	if (!slide_read_chunks(slide, batch_size, chunk_offsets, chunk_sizes, data_buffer)) {
+		printf("Error reading from %s\n", call->filename);
+		status = 500;
+	}
 
-	c = sizeof(struct sockaddr_in);
+	done:
+	// Every exit that does not hand the slide over to the response must release it here.
+	slide_cache_release(slide, (status == 200) ? batch_size : 0, (status == 200) ? total_size : 0);
+	return status;
+}
 
-	/*struct TLSContext **/server_context = tls_create_context(1, TLS_V13);
+// Assembles the response (headers and payload) into 'response'. Returns the HTTP status code.
+i32 execute_slide_api_call(server_response_t* response, http_request_t* request, slide_api_call_t *call) {
+	if (!call || !call->command) return 400;
+	i32 status = 400;
 
-	// Note: to generate certificates for local testing:
-	// https://letsencrypt.org/docs/certificates-for-localhost/
-	if (!load_keys(server_context, "testcert/fullchain.pem", "testcert/privkey.pem")) {
-		exit(1);
+	if (strcmp(call->command, "slide_set") == 0) {
+		status = execute_slide_set_api_call(&response->buffer, call, request->keep_alive);
+	}
+	else if (strcmp(call->command, "test") == 0) {
+		status = server_send_test(&response->buffer, request->keep_alive);
+	}
+	else if (strcmp(call->command, "metrics") == 0 || strcmp(call->command, "stats") == 0) {
+		status = server_send_metrics(&response->buffer, request->keep_alive);
 	}
 
-	fprintf(stderr, "Listening on port %d\n", port);
+	else if (strcmp(call->command, "slide") == 0) {
+		if (!call->filename) return 400;
+		// If the SLIDES_DIR environment variable is set, load slides from there
+		char path_buffer[2048];
+		path_buffer[0] = '\0';
+		locate_file_prepend_env(call->filename, "SLIDES_DIR", path_buffer, sizeof(path_buffer));
+		const char* ext = get_file_extension(path_buffer);
+		if (strcasecmp(ext, "tiff") != 0) {
+			// TODO: search for files with this pattern
+			size_t path_len = strlen(path_buffer);
+			snprintf(path_buffer + path_len, sizeof(path_buffer) - path_len, ".tiff");
+		}
 
-	while (1) {
-		identity_str[0] = 0;
+		char* parameter1 = call->parameter1;
+		char* parameter2 = call->parameter2;
+		if (!parameter1) return 400;
 
-		client_sock = accept(socket_desc, (struct sockaddr *)&client, &c);
-		if (client_sock < 0) {
-			perror("accept failed");
-			return 1;
+		cached_slide_t* slide = slide_cache_acquire(path_buffer);
+		if (!slide) {
+			fprintf(stderr, "Couldn't open file %s\n", path_buffer);
+			return 404;
 		}
-
-		work_available = client_sock;
-		while (work_available) {
-			pthread_mutex_unlock(&work_mutex);
-			pthread_cond_signal(&semaphore_work_available);
-			msleep(1);
-//			pthread_mutex_lock(&work_mutex);
-//			printf("waiting for someone to grab the work\n");
+		// is the client requesting TIFF header and metadata?
+		if (strcmp(parameter1, "header") == 0) {
+			status = execute_slide_header_api_call(&response->buffer, request, slide);
+			slide_cache_release(slide, 0, 0);
+		} else if (parameter2) {
+			// try to interpret as batch (releases the slide)
+			status = execute_slide_batch_api_call(response, request, call, slide);
+		} else {
+			slide_cache_release(slide, 0, 0);
 		}
+	} else {
+		printf("Slide API: unknown command %s\n", call->command);
+	};
+	return status;
+}
 
+static server_command_enum server_get_command_type(slide_api_call_t* call) {
+	if (!call || !call->command) {
+		return SERVER_COMMAND_OTHER;
+	} else if (strcmp(call->command, "slide_set") == 0) {
+		return SERVER_COMMAND_SLIDE_SET;
+	} else if (strcmp(call->command, "slide") == 0 && call->parameter1) {
+		if (strcmp(call->parameter1, "header") == 0) {
+			return SERVER_COMMAND_HEADER;
+		}
+		i32 batch_size = (call->par_count - 2) / 2;
+		return (batch_size > 1) ? SERVER_COMMAND_BATCH : SERVER_COMMAND_SLIDE;
 	}
-	tls_destroy_context(server_context);
-	return 0;
+	return SERVER_COMMAND_OTHER;
 }
 
+// Prepare the response for reuse by the next request on the same connection.
+void server_response_reset(server_response_t* response) {
+	memrw_rewind(&response->buffer);
+	if (response->slide) {
+		slide_cache_release(response->slide, response->chunk_count, response->range_bytes);
+		response->slide = NULL;
+	}
+	response->range_count = 0;
+	response->range_bytes = 0;
+	response->chunk_count = 0;
+}
 
-
-
-
+// Called on a worker thread: parse the request at the start of the connection's request buffer and assemble the response.
+void server_process_request(server_connection_t* connection) {
+	server_response_t* response = &connection->response;
+	server_response_reset(response);
+	response->allow_sendfile = server.use_sendfile;
+	connection->response_bytes_sent = 0;
+	connection->response_range_index = 0;
+	connection->response_range_bytes_sent = 0;
+	response->command = SERVER_COMMAND_OTHER;
+
+	i32 status = 400;
+	http_request_t* request = parse_http_headers(connection->request, connection->request_length);
+	if (request) {
+#if SERVER_VERBOSE
+		fprintf(stderr, "[connection %lld] Received request: %s\n", connection->id, request->uri);
 #endif
+		connection->keep_alive = request->keep_alive && (connection->requests_served + 1 < SERVER_MAX_REQUESTS_PER_CONNECTION);
+		request->keep_alive = connection->keep_alive;
+		slide_api_call_t* call = interpret_api_request(request);
+		if (call) {
+			response->command = server_get_command_type(call);
+			status = execute_slide_api_call(response, request, call);
+			free(call);
+		}
+		free(request);
+	} else {
+		fprintf(stderr, "[connection %lld] Warning: bad request\n", connection->id);
+		connection->keep_alive = false;
+	}
 
-
-
+	if (status >= 400) {
+		// Discard anything that may have been written already, and respond with only the status.
+		server_response_reset(response);
+		server_write_response_headers(&response->buffer, status, 0, connection->keep_alive);
+	}
+	response->status = status;
+}
 
 
 mbedtls_threading_mutex_t debug_mutex;
@@ -636,200 +1343,578 @@ static void my_mutexed_debug( void *ctx, int level,
 }
 
 
+// Event notification: epoll on Linux, poll() elsewhere.
+// Connections are registered 'one-shot': after an event is reported, the connection needs to be re-armed
+// with server_connection_arm() before it is reported again. While a worker owns a connection, it stays disarmed.
 
-static void *handle_ssl_connection( void *data )
-{
-	int ret, len;
-//	thread_info_t *thread_info = (thread_info_t *) data;
-//	mbedtls_net_context *client_fd = &thread_info->client_fd;
-//	long int thread_id = (long int) pthread_self();
-	unsigned char buf[1024];
-//	mbedtls_ssl_context ssl;
-
-	server_connection_t connection = {};
-	connection.thread_info = (thread_info_t *) data;
-	connection.client_fd = &connection.thread_info->client_fd;
-	connection.thread_id = (long int) pthread_self();
+static void server_connection_arm(server_connection_t* connection, u32 events) {
+	connection->wanted_events = events;
+#if LINUX
+	struct epoll_event event = {0};
+	event.events = EPOLLONESHOT | ((events & SERVER_EVENT_READ) ? EPOLLIN : 0) | ((events & SERVER_EVENT_WRITE) ? EPOLLOUT : 0);
+	event.data.ptr = connection;
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, connection->client_fd.fd, &event);
+#endif
+}
 
-	/* Make sure memory references are valid */
-	mbedtls_ssl_init( &connection.ssl );
+static void server_set_accepting_paused(bool paused) {
+	if (server.is_accepting_paused == paused) return;
+	server.is_accepting_paused = paused;
+#if LINUX
+	struct epoll_event event = {0};
+	event.events = paused ? 0 : EPOLLIN;
+	event.data.ptr = server.listen_fd;
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, server.listen_fd->fd, &event);
+#endif
+}
 
-	mbedtls_printf( "  [ #%ld ]  Setting up SSL/TLS data\n", connection.thread_id );
+static void server_wake_event_loop() {
+#if LINUX
+	u64 value = 1;
+	ssize_t bytes_written = write(server.wake_fd, &value, sizeof(value));
+	(void)bytes_written;
+#endif
+}
 
-	/*
-	 * 4. Get the SSL context ready
-	 */
-	if( ( ret = mbedtls_ssl_setup( &connection.ssl, connection.thread_info->config ) ) != 0 )
-	{
-		mbedtls_printf( "  [ #%ld ]  failed: mbedtls_ssl_setup returned -0x%04x\n",
-		                connection.thread_id, -ret );
-		goto thread_exit;
+typedef struct server_event_t {
+	void* ptr; // either a server_connection_t*, or the listening socket
+	u32 events;
+} server_event_t;
+
+static i32 server_wait_for_events(server_event_t* events, i32 max_events, i32 timeout_ms) {
+	i32 event_count = 0;
+#if LINUX
+	struct epoll_event epoll_events[SERVER_MAX_EVENTS];
+	i32 ready_count = epoll_wait(server.epoll_fd, epoll_events, MIN(max_events, SERVER_MAX_EVENTS), timeout_ms);
+	for (i32 i = 0; i < ready_count; ++i) {
+		struct epoll_event* e = epoll_events + i;
+		if (e->data.ptr == &server.wake_fd) {
+			u64 value;
+			ssize_t bytes_read = read(server.wake_fd, &value, sizeof(value));
+			(void)bytes_read;
+			continue;
+		}
+		// Errors and hangups are picked up by the next read/write attempt, so treat them as readiness.
+		u32 flags = 0;
+		if (e->events & (EPOLLIN | EPOLLERR | EPOLLHUP)) flags |= SERVER_EVENT_READ;
+		if (e->events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) flags |= SERVER_EVENT_WRITE;
+		events[event_count++] = (server_event_t){ .ptr = e->data.ptr, .events = flags };
 	}
-
-	mbedtls_ssl_set_bio( &connection.ssl, connection.client_fd, mbedtls_net_send, mbedtls_net_recv, NULL );
-
-	/*
-	 * 5. Handshake
-	 */
-	mbedtls_printf( "  [ #%ld ]  Performing the SSL/TLS handshake\n", connection.thread_id );
-
-	while( ( ret = mbedtls_ssl_handshake( &connection.ssl ) ) != 0 )
-	{
-		if( ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE )
-		{
-			mbedtls_printf( "  [ #%ld ]  failed: mbedtls_ssl_handshake returned -0x%04x\n",
-			                connection.thread_id, -ret );
-			goto thread_exit;
+#else
+	// Without a wake-up file descriptor, we need to poll more frequently while workers are busy.
+	if (server.jobs_in_flight > 0) {
+		timeout_ms = MIN(timeout_ms, 1);
+	}
+	struct pollfd* fds = alloca((server.max_connections + 1) * sizeof(struct pollfd));
+	void** ptrs = alloca((server.max_connections + 1) * sizeof(void*));
+	i32 fd_count = 0;
+	if (!server.is_accepting_paused) {
+		fds[fd_count] = (struct pollfd){ .fd = server.listen_fd->fd, .events = POLLIN };
+		ptrs[fd_count++] = server.listen_fd;
+	}
+	for (i32 i = 0; i < server.max_connections; ++i) {
+		server_connection_t* connection = server.connections[i];
+		if (connection && connection->wanted_events) {
+			short poll_events = ((connection->wanted_events & SERVER_EVENT_READ) ? POLLIN : 0) |
+			                    ((connection->wanted_events & SERVER_EVENT_WRITE) ? POLLOUT : 0);
+			fds[fd_count] = (struct pollfd){ .fd = connection->client_fd.fd, .events = poll_events };
+			ptrs[fd_count++] = connection;
+		}
+	}
+	i32 ready_count = poll(fds, fd_count, timeout_ms);
+	for (i32 i = 0; i < fd_count && ready_count > 0 && event_count < max_events; ++i) {
+		short revents = fds[i].revents;
+		if (revents == 0) continue;
+		u32 flags = 0;
+		if (revents & (POLLIN | POLLERR | POLLHUP)) flags |= SERVER_EVENT_READ;
+		if (revents & (POLLOUT | POLLERR | POLLHUP)) flags |= SERVER_EVENT_WRITE;
+		if (ptrs[i] != server.listen_fd) {
+			((server_connection_t*)ptrs[i])->wanted_events = 0; // one-shot
 		}
+		events[event_count++] = (server_event_t){ .ptr = ptrs[i], .events = flags };
 	}
+#endif
+	return event_count;
+}
 
-	mbedtls_printf( "  [ #%ld ]  ok\n", connection.thread_id );
+// Worker pool
 
-	/*
-	 * 6. Read the HTTP Request
-	 */
-	mbedtls_printf( "  [ #%ld ]  < Read from client\n", connection.thread_id );
+static void* server_worker_thread(void* arg) {
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&server.job_mutex);
+		while (server.job_count == 0) {
+			pthread_cond_wait(&server.job_available, &server.job_mutex);
+		}
+		server_connection_t* connection = server.jobs[server.job_read_index];
+		server.job_read_index = (server.job_read_index + 1) % SERVER_MAX_QUEUED_JOBS;
+		--server.job_count;
+		pthread_mutex_unlock(&server.job_mutex);
+
+		server_process_request(connection);
+
+		pthread_mutex_lock(&server.completion_mutex);
+		connection->next = server.completed;
+		server.completed = connection;
+		pthread_mutex_unlock(&server.completion_mutex);
+		server_wake_event_loop();
+	}
+	return NULL;
+}
 
-	do
-	{
-		len = sizeof( buf ) - 1;
-		memset( buf, 0, sizeof( buf ) );
-		ret = mbedtls_ssl_read( &connection.ssl, buf, len );
+static bool server_submit_job(server_connection_t* connection) {
+	bool submitted = false;
+	pthread_mutex_lock(&server.job_mutex);
+	if (server.job_count < SERVER_MAX_QUEUED_JOBS) {
+		connection->state = CONNECTION_PROCESSING;
+		i32 write_index = (server.job_read_index + server.job_count) % SERVER_MAX_QUEUED_JOBS;
+		server.jobs[write_index] = connection;
+		++server.job_count;
+		++server.jobs_in_flight;
+		submitted = true;
+		pthread_cond_signal(&server.job_available);
+	}
+	pthread_mutex_unlock(&server.job_mutex);
+	return submitted;
+}
 
-		if( ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE )
-			continue;
+static void server_submit_waiting_jobs() {
+	while (server.waiting_first) {
+		server_connection_t* connection = server.waiting_first;
+		if (!server_submit_job(connection)) break;
+		server.waiting_first = connection->next;
+		if (!server.waiting_first) server.waiting_last = NULL;
+		connection->next = NULL;
+	}
+}
 
-		if( ret <= 0 )
-		{
-			switch( ret )
-			{
-				case MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY:
-					mbedtls_printf( "  [ #%ld ]  connection was closed gracefully\n",
-					                connection.thread_id );
-					goto thread_exit;
-
-				case MBEDTLS_ERR_NET_CONN_RESET:
-					mbedtls_printf( "  [ #%ld ]  connection was reset by peer\n",
-					                connection.thread_id );
-					goto thread_exit;
-
-				default:
-					mbedtls_printf( "  [ #%ld ]  mbedtls_ssl_read returned -0x%04x\n",
-					                connection.thread_id, -ret );
-					goto thread_exit;
-			}
-		}
+// Connection state machine (event loop thread only)
 
-		len = ret;
-		mbedtls_printf( "  [ #%ld ]  %d bytes read\n=====\n%s\n=====\n",
-		                connection.thread_id, len, (char *) buf );
+// In plaintext mode (e.g. behind a TLS-terminating reverse proxy) we talk to the socket directly.
+// mbedtls_net_recv() and mbedtls_net_send() report a would-block condition the same way as the TLS functions.
+static i32 server_connection_recv(server_connection_t* connection, u8* buf, size_t len) {
+	if (!server.ssl_config) {
+		return mbedtls_net_recv(&connection->client_fd, buf, len);
+	}
+	return mbedtls_ssl_read(&connection->ssl, buf, len);
+}
 
-		if( ret > 0 )
-			break;
+static i32 server_connection_send(server_connection_t* connection, const u8* buf, size_t len) {
+	if (!server.ssl_config) {
+		return mbedtls_net_send(&connection->client_fd, buf, len);
 	}
-	while( 1 );
+	return mbedtls_ssl_write(&connection->ssl, buf, len);
+}
 
-	// TODO: assemble chunks into request buffer
-	http_request_t* request = parse_http_headers((char *) buf, len);
-	if (!request) {
-		fprintf(stderr, "[thread %d] Warning: bad request\n", connection.thread_id);
-	} else {
-		fprintf(stderr, "[thread %d] Received request: %s\n", connection.thread_id, request->uri);
-		slide_api_call_t* call = interpret_api_request(request);
-		if (call) {
-			if (execute_slide_api_call(&connection, call)) {
-				// success!
-			}
+#if SERVER_USE_SENDFILE
+static i32 server_connection_sendfile(server_connection_t* connection, file_handle_t fd, i64 offset, i64 size) {
+	off_t file_offset = offset;
+	ssize_t bytes_sent = sendfile(connection->client_fd.fd, fd, &file_offset, (size_t)MIN(size, 0x7FFFF000));
+	if (bytes_sent < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return MBEDTLS_ERR_SSL_WANT_WRITE;
 		}
+		return MBEDTLS_ERR_NET_SEND_FAILED;
+	} else if (bytes_sent == 0) {
+		return MBEDTLS_ERR_NET_SEND_FAILED; // the file was truncated?
 	}
+	return (i32)bytes_sent;
+}
 
-	// write
-//	bool send_ok = ssl_send(&connection, buf, len);
-//	if (!send_ok) goto thread_exit;
-
-	mbedtls_printf( "  [ #%ld ]  . Closing the connection...", connection.thread_id );
+// While corked, the kernel only sends full segments, so the headers and the start of the file data are coalesced.
+static void server_connection_set_cork(server_connection_t* connection, bool enable) {
+	int value = enable;
+	setsockopt(connection->client_fd.fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+	connection->is_corked = enable;
+}
+#endif
 
-	while( ( ret = mbedtls_ssl_close_notify( &connection.ssl ) ) < 0 )
-	{
-		if( ret != MBEDTLS_ERR_SSL_WANT_READ &&
-		    ret != MBEDTLS_ERR_SSL_WANT_WRITE )
-		{
-			mbedtls_printf( "  [ #%ld ]  failed: mbedtls_ssl_close_notify returned -0x%04x\n",
-			                connection.thread_id, ret );
-			goto thread_exit;
-		}
+static void server_close_connection(server_connection_t* connection) {
+	ASSERT(connection->state != CONNECTION_PROCESSING && connection->state != CONNECTION_WAITING_FOR_WORKER);
+#if SERVER_VERBOSE
+	fprintf(stderr, "[connection %lld] closed after %d requests\n", connection->id, connection->requests_served);
+#endif
+#if LINUX
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, connection->client_fd.fd, NULL);
+#endif
+	mbedtls_net_free(&connection->client_fd);
+	mbedtls_ssl_free(&connection->ssl);
+	server_response_reset(&connection->response);
+	memrw_destroy(&connection->response.buffer);
+	server.connections[connection->slot] = NULL;
+	--server.connection_count;
+	free(connection);
+	if (server.connection_count < server.max_connections) {
+		server_set_accepting_paused(false);
 	}
+}
 
-	mbedtls_printf( " ok\n" );
+// If mbedTLS could not make progress without blocking, wait for the socket to become ready.
+static bool server_connection_would_block(server_connection_t* connection, i32 ret) {
+	if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
+		server_connection_arm(connection, SERVER_EVENT_READ);
+		return true;
+	} else if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+		server_connection_arm(connection, SERVER_EVENT_WRITE);
+		return true;
+	}
+	return false;
+}
 
-	ret = 0;
+// Check if a complete request has arrived; if so, hand it over to the worker pool.
+static bool server_try_dispatch_request(server_connection_t* connection) {
+	char* end_of_headers = strstr(connection->request, "\r\n\r\n");
+	if (!end_of_headers) {
+		return false;
+	}
+	connection->request_length = (i32)(end_of_headers + 4 - connection->request);
+	connection->request_received_clock = get_clock();
+	connection->state = CONNECTION_WAITING_FOR_WORKER;
+	if (!server.waiting_first && server_submit_job(connection)) {
+		return true;
+	}
+	// The job queue is full: park the connection without reading further, so that TCP flow control pushes back on the client.
+	connection->next = NULL;
+	if (server.waiting_last) {
+		server.waiting_last->next = connection;
+	} else {
+		server.waiting_first = connection;
+	}
+	server.waiting_last = connection;
+	return true;
+}
 
-	thread_exit:
+static void server_record_request_metrics(server_connection_t* connection) {
+	server_response_t* response = &connection->response;
+	command_metrics_t* command_metrics = metrics.commands + response->command;
+	i64 elapsed_us = (get_clock() - connection->request_received_clock) / 1000;
+	metrics_counter_add(&command_metrics->requests, 1);
+	if (response->status >= 400) {
+		metrics_counter_add(&command_metrics->errors, 1);
+	}
+	metrics_counter_add(&command_metrics->bytes_sent, response->buffer.used_size + response->range_bytes);
+	latency_histogram_record(&command_metrics->latency, elapsed_us);
+}
 
-#ifdef MBEDTLS_ERROR_C
-	if( ret != 0 )
-	{
-		char error_buf[100];
-		mbedtls_strerror( ret, error_buf, 100 );
-		mbedtls_printf("  [ #%ld ]  Last error was: -0x%04x - %s\n\n",
-		               connection.thread_id, -ret, error_buf );
+// Remove the request that was just answered from the request buffer (the client may already have sent the next one).
+static void server_finish_request(server_connection_t* connection) {
+	i32 leftover = connection->request_bytes_received - connection->request_length;
+	if (leftover > 0) {
+		memmove(connection->request, connection->request + connection->request_length, leftover);
 	}
+	connection->request_bytes_received = leftover;
+	connection->request[leftover] = '\0';
+	connection->request_length = 0;
+	server_response_reset(&connection->response);
+	connection->response_bytes_sent = 0;
+	++connection->requests_served;
+	// Don't hold on to very large response buffers while the connection is idle.
+	if (connection->response.buffer.capacity > MEGABYTES(4)) {
+		memrw_destroy(&connection->response.buffer);
+	}
+}
+
+static void server_drive_connection(server_connection_t* connection) {
+	for (;;) {
+		i32 ret;
+		switch (connection->state) {
+			case CONNECTION_HANDSHAKE: {
+				ret = mbedtls_ssl_handshake(&connection->ssl);
+				if (ret == 0) {
+					connection->state = CONNECTION_READING_REQUEST;
+					continue;
+				}
+				if (server_connection_would_block(connection, ret)) return;
+#if SERVER_VERBOSE
+				fprintf(stderr, "[connection %lld] mbedtls_ssl_handshake returned -0x%04x\n", connection->id, -ret);
 #endif
+				server_close_connection(connection);
+				return;
+			}
 
-	mbedtls_net_free( connection.client_fd );
-	mbedtls_ssl_free( &connection.ssl );
+			case CONNECTION_READING_REQUEST: {
+				if (server_try_dispatch_request(connection)) return;
+				i32 bytes_free = SERVER_MAX_REQUEST_SIZE - connection->request_bytes_received;
+				if (bytes_free <= 0) {
+					fprintf(stderr, "[connection %lld] Warning: request too large\n", connection->id);
+					server_response_reset(&connection->response);
+					server_write_response_headers(&connection->response.buffer, 431, 0, false);
+					connection->response.command = SERVER_COMMAND_OTHER;
+					connection->response.status = 431;
+					connection->request_received_clock = get_clock();
+					connection->keep_alive = false;
+					connection->state = CONNECTION_WRITING_RESPONSE;
+					continue;
+				}
+				ret = server_connection_recv(connection, (u8*)connection->request + connection->request_bytes_received, bytes_free);
+				if (ret > 0) {
+					connection->request_bytes_received += ret;
+					connection->request[connection->request_bytes_received] = '\0';
+					connection->last_activity = time(NULL);
+					continue;
+				}
+				if (server_connection_would_block(connection, ret)) return;
+				// The peer closed the connection (ret == 0 or MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY), or there was an error
+				server_close_connection(connection);
+				return;
+			}
 
-	connection.thread_info->thread_complete = 1;
+			case CONNECTION_WRITING_RESPONSE: {
+				server_response_t* response = &connection->response;
+				u64 bytes_left = response->buffer.used_size - connection->response_bytes_sent;
+				if (bytes_left > 0) {
+					ret = server_connection_send(connection, response->buffer.data + connection->response_bytes_sent, bytes_left);
+					if (ret > 0) {
+						connection->response_bytes_sent += ret;
+						connection->last_activity = time(NULL);
+						continue;
+					}
+					if (server_connection_would_block(connection, ret)) return;
+					server_close_connection(connection);
+					return;
+				}
+#if SERVER_USE_SENDFILE
+				if (connection->response_range_index < response->range_count) {
+					file_range_t* range = response->ranges + connection->response_range_index;
+					ret = server_connection_sendfile(connection, response->slide->fd, range->offset + connection->response_range_bytes_sent,
+					                                 range->size - connection->response_range_bytes_sent);
+					if (ret > 0) {
+						connection->response_range_bytes_sent += ret;
+						if (connection->response_range_bytes_sent == range->size) {
+							++connection->response_range_index;
+							connection->response_range_bytes_sent = 0;
+						}
+						connection->last_activity = time(NULL);
+						continue;
+					}
+					if (server_connection_would_block(connection, ret)) return;
+					server_close_connection(connection);
+					return;
+				}
+				if (connection->is_corked) {
+					server_connection_set_cork(connection, false); // flush
+				}
+#endif
+				server_record_request_metrics(connection);
+				bool keep_alive = connection->keep_alive;
+				server_finish_request(connection);
+				connection->state = keep_alive ? CONNECTION_READING_REQUEST : CONNECTION_CLOSING;
+				continue;
+			}
+
+			case CONNECTION_CLOSING: {
+				if (!server.ssl_config) {
+					server_close_connection(connection);
+					return;
+				}
+				ret = mbedtls_ssl_close_notify(&connection->ssl);
+				if (ret < 0 && server_connection_would_block(connection, ret)) return;
+				server_close_connection(connection);
+				return;
+			}
 
-	return( NULL );
+			default: return; // a worker is (or will be) busy with this connection
+		}
+	}
 }
 
-static int thread_create( mbedtls_net_context *client_fd )
-{
-	int ret, i;
+static i32 server_find_free_slot() {
+	for (i32 i = 0; i < server.max_connections; ++i) {
+		if (server.connections[i] == NULL) {
+			return i;
+		}
+	}
+	return -1;
+}
 
-	/*
-	 * Find in-active or finished thread slot
-	 */
-	for( i = 0; i < MAX_NUM_THREADS; i++ )
-	{
-		if( threads[i].active == 0 )
+static void server_accept_connections() {
+	while (server.connection_count < server.max_connections) {
+		mbedtls_net_context client_fd;
+		mbedtls_net_init(&client_fd);
+		i32 ret = mbedtls_net_accept(server.listen_fd, &client_fd, NULL, 0, NULL);
+		if (ret != 0) {
+			if (ret != MBEDTLS_ERR_SSL_WANT_READ) {
+				mbedtls_printf("  [ main ] failed: mbedtls_net_accept returned -0x%04x\n", -ret);
+			}
 			break;
+		}
+		mbedtls_net_set_nonblock(&client_fd);
+		int enable = 1;
+		setsockopt(client_fd.fd, IPPROTO_TCP, TCP_NODELAY, (char*)&enable, sizeof(enable));
+
+		server_connection_t* connection = calloc(1, sizeof(server_connection_t));
+		connection->slot = server_find_free_slot();
+		ASSERT(connection->slot >= 0);
+		connection->id = ++server.total_connections_accepted;
+		connection->client_fd = client_fd;
+		connection->last_activity = time(NULL);
+		mbedtls_ssl_init(&connection->ssl);
+		if (server.ssl_config) {
+			if ((ret = mbedtls_ssl_setup(&connection->ssl, server.ssl_config)) != 0) {
+				mbedtls_printf("  [ main ] failed: mbedtls_ssl_setup returned -0x%04x\n", -ret);
+				mbedtls_ssl_free(&connection->ssl);
+				mbedtls_net_free(&connection->client_fd);
+				free(connection);
+				break;
+			}
+			mbedtls_ssl_set_bio(&connection->ssl, &connection->client_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+		}
+		server.connections[connection->slot] = connection;
+		++server.connection_count;
+
+#if LINUX
+		struct epoll_event event = {0};
+		event.events = EPOLLONESHOT; // disarmed until the handshake asks for input
+		event.data.ptr = connection;
+		epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, connection->client_fd.fd, &event);
+#endif
+		connection->state = server.ssl_config ? CONNECTION_HANDSHAKE : CONNECTION_READING_REQUEST;
+		server_drive_connection(connection);
+	}
+	if (server.connection_count >= server.max_connections) {
+		// Leave new connections in the kernel's listen backlog until a slot frees up.
+		server_set_accepting_paused(true);
+	}
+}
 
-		if( threads[i].data.thread_complete == 1 )
-		{
-			mbedtls_printf( "  [ main ]  Cleaning up thread %d\n", i );
-			pthread_join(threads[i].thread, NULL );
-			memset( &threads[i], 0, sizeof(pthread_info_t) );
-			break;
+// Close connections that have been idle for too long (also covers stalled handshakes and clients that stopped reading).
+static void server_close_idle_connections(time_t now) {
+	for (i32 i = 0; i < server.max_connections; ++i) {
+		server_connection_t* connection = server.connections[i];
+		if (connection && connection->state != CONNECTION_PROCESSING && connection->state != CONNECTION_WAITING_FOR_WORKER) {
+			if (now - connection->last_activity > SERVER_KEEP_ALIVE_TIMEOUT) {
+				server_close_connection(connection);
+			}
 		}
 	}
+}
 
-	if( i == MAX_NUM_THREADS )
-		return( -1 );
+static void server_handle_completed_jobs() {
+	pthread_mutex_lock(&server.completion_mutex);
+	server_connection_t* connection = server.completed;
+	server.completed = NULL;
+	pthread_mutex_unlock(&server.completion_mutex);
+
+	while (connection) {
+		server_connection_t* next = connection->next;
+		connection->next = NULL;
+		--server.jobs_in_flight;
+		connection->state = CONNECTION_WRITING_RESPONSE;
+#if SERVER_USE_SENDFILE
+		if (connection->response.range_count > 0) {
+			server_connection_set_cork(connection, true);
+		}
+#endif
+		connection->last_activity = time(NULL);
+		server_drive_connection(connection);
+		connection = next;
+	}
+}
 
-	/*
-	 * Fill thread-info for thread
-	 */
-	memcpy( &threads[i].data, &base_info, sizeof(base_info) );
-	threads[i].active = 1;
-	memcpy( &threads[i].data.client_fd, client_fd, sizeof( mbedtls_net_context ) );
+// Pass NULL for 'ssl_config' to serve plain HTTP.
+static bool server_init(mbedtls_net_context* listen_fd, const mbedtls_ssl_config* ssl_config, bool use_sendfile, i32 worker_count,
+                        i32 max_connections, i64 block_cache_size) {
+	server.listen_fd = listen_fd;
+	server.ssl_config = ssl_config;
+	server.use_sendfile = (ssl_config == NULL) && use_sendfile && SERVER_USE_SENDFILE;
+	server.max_connections = max_connections;
+	server.connections = calloc(max_connections, sizeof(server_connection_t*));
+	pthread_mutex_init(&server.job_mutex, NULL);
+	pthread_cond_init(&server.job_available, NULL);
+	pthread_mutex_init(&server.completion_mutex, NULL);
+	pthread_mutex_init(&slide_cache.mutex, NULL);
+	block_cache_init(block_cache_size);
+	metrics.start_clock = get_clock();
+
+	// mbedtls_net_bind() uses a listen backlog of only 10, which overflows when a whole classroom connects at once.
+	listen(listen_fd->fd, SOMAXCONN);
+	mbedtls_net_set_nonblock(listen_fd);
+
+#if LINUX
+	server.epoll_fd = epoll_create1(0);
+	server.wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (server.epoll_fd < 0 || server.wake_fd < 0) {
+		perror("Error initializing the event loop");
+		return false;
+	}
+	struct epoll_event event = {0};
+	event.events = EPOLLIN;
+	event.data.ptr = listen_fd;
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listen_fd->fd, &event);
+	event.data.ptr = &server.wake_fd;
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.wake_fd, &event);
+#endif
 
-	if( ( ret = pthread_create( &threads[i].thread, NULL, handle_ssl_connection,
-	                            &threads[i].data ) ) != 0 )
-	{
-		return( ret );
+	server.worker_count = worker_count;
+	server.workers = calloc(worker_count, sizeof(pthread_t));
+	for (i32 i = 0; i < worker_count; ++i) {
+		if (pthread_create(server.workers + i, NULL, server_worker_thread, NULL) != 0) {
+			fprintf(stderr, "Error creating worker thread\n");
+			return false;
+		}
 	}
+	return true;
+}
 
-	return( 0 );
+static void server_log_metrics(time_t now) {
+	memrw_t out = {0};
+	memrw_printf(&out, "# slideserver metrics at %lld\n", (i64)now);
+	server_write_metrics(&out);
+	fwrite(out.data, 1, out.used_size, stdout);
+	fflush(stdout);
+	memrw_destroy(&out);
 }
 
+static void server_run() {
+	server_event_t events[SERVER_MAX_EVENTS];
+	time_t last_idle_check = time(NULL);
+	time_t last_metrics_log = last_idle_check;
+	for (;;) {
+		i32 event_count = server_wait_for_events(events, SERVER_MAX_EVENTS, 1000);
+		for (i32 i = 0; i < event_count; ++i) {
+			if (events[i].ptr == server.listen_fd) {
+				server_accept_connections();
+			} else {
+				server_drive_connection((server_connection_t*)events[i].ptr);
+			}
+		}
+		server_handle_completed_jobs();
+		server_submit_waiting_jobs();
+
+		time_t now = time(NULL);
+		if (now != last_idle_check) {
+			server_close_idle_connections(now);
+			last_idle_check = now;
+		}
+		if (server.metrics_log_interval > 0 && now - last_metrics_log >= server.metrics_log_interval) {
+			server_log_metrics(now);
+			last_metrics_log = now;
+		}
+	}
+}
 
 
-int main( void )
+static void print_usage() {
+	fprintf(stderr, "Usage: slideserver [--port <port>] [--workers <count>] [--max-connections <count>] [--plain [--no-sendfile]]\n"
+	                "                   [--block-cache <megabytes>] [--metrics-interval <seconds>]\n"
+	                "  --plain        serve plain HTTP instead of HTTPS (e.g. behind a TLS-terminating reverse proxy)\n"
+	                "  --no-sendfile  in plaintext mode, copy file data through user space instead of using sendfile()\n"
+	                "  --block-cache  memory for caching recently read parts of slides (default %d MB, 0 to disable)\n"
+	                "  --metrics-interval  print the server metrics (also available at /metrics) to stdout every so many seconds\n",
+	        BLOCK_CACHE_DEFAULT_SIZE);
+}
+
+int main( int argc, char** argv )
 {
 	int ret;
-	mbedtls_net_context listen_fd, client_fd;
+	mbedtls_net_context listen_fd;
+	const char* port = SERVER_DEFAULT_PORT;
+	i32 worker_count = SERVER_DEFAULT_WORKER_COUNT;
+	i32 max_connections = SERVER_DEFAULT_MAX_CONNECTIONS;
+	bool is_plaintext = false;
+	bool use_sendfile = true;
+	i32 metrics_log_interval = 0;
+	i32 block_cache_megabytes = BLOCK_CACHE_DEFAULT_SIZE;
 	const char pers[] = "ssl_pthread_server";
 
 	mbedtls_entropy_context entropy;
@@ -845,6 +1930,35 @@ int main( void )
 	mbedtls_ssl_cache_context cache;
 #endif
 
+	for (i32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+			port = argv[++i];
+		} else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+			i32 value = atoi(argv[++i]);
+			worker_count = CLAMP(value, 1, 256);
+		} else if (strcmp(argv[i], "--max-connections") == 0 && i + 1 < argc) {
+			i32 value = atoi(argv[++i]);
+			max_connections = CLAMP(value, 1, SERVER_MAX_CONNECTIONS_LIMIT);
+		} else if (strcmp(argv[i], "--plain") == 0) {
+			is_plaintext = true;
+		} else if (strcmp(argv[i], "--no-sendfile") == 0) {
+			use_sendfile = false;
+		} else if (strcmp(argv[i], "--block-cache") == 0 && i + 1 < argc) {
+			i32 value = atoi(argv[++i]);
+			block_cache_megabytes = CLAMP(value, 0, 65536);
+		} else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc) {
+			i32 value = atoi(argv[++i]);
+			metrics_log_interval = MAX(value, 0);
+		} else {
+			print_usage();
+			return 1;
+		}
+	}
+
+#if !WINDOWS
+	signal(SIGPIPE, SIG_IGN); // a client disconnecting while we are writing should not terminate the server
+#endif
+
 #if defined(MBEDTLS_MEMORY_BUFFER_ALLOC_C)
 	mbedtls_memory_buffer_alloc_init( alloc_buf, sizeof(alloc_buf) );
 #endif
@@ -858,14 +1972,10 @@ int main( void )
 
 	mbedtls_ssl_config_init( &conf );
 	mbedtls_ctr_drbg_init( &ctr_drbg );
-	memset( threads, 0, sizeof(threads) );
 	mbedtls_net_init( &listen_fd );
-	mbedtls_net_init( &client_fd );
 
 	mbedtls_mutex_init( &debug_mutex );
 
-	base_info.config = &conf;
-
 	/*
 	 * We use only a single entropy source that is used in all the threads.
 	 */
@@ -964,10 +2074,10 @@ int main( void )
 	/*
 	 * 2. Setup the listening TCP socket
 	 */
-	mbedtls_printf( "  . Bind on https://localhost:2000/ ..." );
+	mbedtls_printf( "  . Bind on %s://localhost:%s/ ...", is_plaintext ? "http" : "https", port );
 	fflush( stdout );
 
-	if( ( ret = mbedtls_net_bind( &listen_fd, NULL, "2000", MBEDTLS_NET_PROTO_TCP ) ) != 0 )
+	if( ( ret = mbedtls_net_bind( &listen_fd, NULL, port, MBEDTLS_NET_PROTO_TCP ) ) != 0 )
 	{
 		mbedtls_printf( " failed\n  ! mbedtls_net_bind returned %d\n\n", ret );
 		goto exit;
@@ -975,40 +2085,19 @@ int main( void )
 
 	mbedtls_printf( " ok\n" );
 
-	reset:
-#ifdef MBEDTLS_ERROR_C
-	if( ret != 0 )
-	{
-		char error_buf[100];
-		mbedtls_strerror( ret, error_buf, 100 );
-		mbedtls_printf( "  [ main ]  Last error was: -0x%04x - %s\n", -ret, error_buf );
-	}
-#endif
-
 	/*
-	 * 3. Wait until a client connects
+	 * 3. Serve connections from the event loop
 	 */
-	mbedtls_printf( "  [ main ]  Waiting for a remote connection\n" );
-
-	if( ( ret = mbedtls_net_accept( &listen_fd, &client_fd,
-	                                NULL, 0, NULL ) ) != 0 )
-	{
-		mbedtls_printf( "  [ main ] failed: mbedtls_net_accept returned -0x%04x\n", ret );
+	if (!server_init(&listen_fd, is_plaintext ? NULL : &conf, use_sendfile, worker_count, max_connections,
+	                 MEGABYTES((i64)block_cache_megabytes))) {
+		ret = 1;
 		goto exit;
 	}
-
-	mbedtls_printf( "  [ main ]  ok\n" );
-	mbedtls_printf( "  [ main ]  Creating a new thread\n" );
-
-	if( ( ret = thread_create( &client_fd ) ) != 0 )
-	{
-		mbedtls_printf( "  [ main ]  failed: thread_create returned %d\n", ret );
-		mbedtls_net_free( &client_fd );
-		goto reset;
-	}
-
+	server.metrics_log_interval = metrics_log_interval;
+	mbedtls_printf( "  [ main ]  Serving with %d worker threads, at most %d connections%s\n", worker_count, max_connections,
+	                is_plaintext ? (server.use_sendfile ? " (plaintext, sendfile)" : " (plaintext)") : "" );
+	server_run();
 	ret = 0;
-	goto reset;
 
 	exit:
 	mbedtls_x509_crt_free( &srvcert );
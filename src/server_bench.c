@@ -0,0 +1,594 @@
+/*
+  Slidescape, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2024  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Load generator for slideserver.
+// Simulates a number of viewers browsing the same slide (panning and zooming, requesting the tiles that come
+// into view in batches, the same way the viewer does), or replays a recorded trace of request URIs.
+// Each simulated viewer uses its own connection, so this also measures the cost of TLS handshakes when
+// running with --close (which is how the viewer currently talks to the server).
+
+#ifndef IS_SERVER
+#define IS_SERVER 1
+#endif
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/error.h"
+
+#define STB_SPRINTF_IMPLEMENTATION // normally implemented by ImGui, but the server doesn't have that
+#include "common.h"
+#include "platform.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "tiff.h"
+#include "stringutils.h"
+
+#define BENCH_VIEWPORT_WIDTH 1920
+#define BENCH_VIEWPORT_HEIGHT 1080
+#define BENCH_MAX_BATCH_SIZE 15 // the viewer's URI buffer does not fit many more
+
+typedef struct bench_options_t {
+	const char* hostname;
+	const char* port;
+	const char* slide_name;
+	i32 client_count;
+	float duration;
+	i32 batch_size;
+	i32 think_time_ms;
+	bool close_after_each_request;
+	bool plaintext;
+	char** trace; // request URIs to replay
+	i32 trace_length;
+	FILE* record_fp;
+	pthread_mutex_t record_mutex;
+} bench_options_t;
+
+typedef struct bench_connection_t {
+	mbedtls_net_context server_fd;
+	mbedtls_ssl_context ssl;
+	bool is_open;
+} bench_connection_t;
+
+typedef struct bench_client_t {
+	i32 index;
+	pthread_t thread;
+	bench_options_t* options;
+	tiff_t* tiff;
+	mbedtls_ssl_config* ssl_config;
+	bench_connection_t connection;
+	u32 rng_state;
+	memrw_t response;
+	// results
+	float* latencies; // in milliseconds
+	i32 latency_count;
+	i32 latency_capacity;
+	i64 bytes_received;
+	i64 tiles_received;
+	i32 connections_opened;
+	i32 errors;
+} bench_client_t;
+
+static u32 bench_random(bench_client_t* client) {
+	// xorshift32
+	u32 x = client->rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	client->rng_state = x;
+	return x;
+}
+
+static float bench_random_float(bench_client_t* client) {
+	return (float)(bench_random(client) & 0xFFFFFF) / (float)0x1000000;
+}
+
+static void bench_disconnect(bench_client_t* client) {
+	bench_connection_t* connection = &client->connection;
+	if (connection->is_open) {
+		if (!client->options->plaintext) {
+			mbedtls_ssl_close_notify(&connection->ssl);
+			mbedtls_ssl_free(&connection->ssl);
+		}
+		mbedtls_net_free(&connection->server_fd);
+		connection->is_open = false;
+	}
+}
+
+static bool bench_connect(bench_client_t* client) {
+	bench_connection_t* connection = &client->connection;
+	mbedtls_net_init(&connection->server_fd);
+	i32 ret = mbedtls_net_connect(&connection->server_fd, client->options->hostname, client->options->port, MBEDTLS_NET_PROTO_TCP);
+	if (ret != 0) {
+		fprintf(stderr, "[client %d] mbedtls_net_connect returned -0x%04x\n", client->index, -ret);
+		return false;
+	}
+	if (!client->options->plaintext) {
+		mbedtls_ssl_init(&connection->ssl);
+		if ((ret = mbedtls_ssl_setup(&connection->ssl, client->ssl_config)) != 0) {
+			fprintf(stderr, "[client %d] mbedtls_ssl_setup returned -0x%04x\n", client->index, -ret);
+			mbedtls_ssl_free(&connection->ssl);
+			mbedtls_net_free(&connection->server_fd);
+			return false;
+		}
+		mbedtls_ssl_set_bio(&connection->ssl, &connection->server_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+		while ((ret = mbedtls_ssl_handshake(&connection->ssl)) != 0) {
+			if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+				fprintf(stderr, "[client %d] mbedtls_ssl_handshake returned -0x%04x\n", client->index, -ret);
+				mbedtls_ssl_free(&connection->ssl);
+				mbedtls_net_free(&connection->server_fd);
+				return false;
+			}
+		}
+	}
+	connection->is_open = true;
+	++client->connections_opened;
+	return true;
+}
+
+static i32 bench_send(bench_client_t* client, const u8* data, size_t len) {
+	if (client->options->plaintext) {
+		return mbedtls_net_send(&client->connection.server_fd, data, len);
+	}
+	return mbedtls_ssl_write(&client->connection.ssl, data, len);
+}
+
+static i32 bench_recv(bench_client_t* client, u8* data, size_t len) {
+	if (client->options->plaintext) {
+		return mbedtls_net_recv(&client->connection.server_fd, data, len);
+	}
+	return mbedtls_ssl_read(&client->connection.ssl, data, len);
+}
+
+static i64 bench_find_end_of_headers(const u8* data, u64 size) {
+	for (u64 i = 0; i + 4 <= size; ++i) {
+		if (memcmp(data + i, "\r\n\r\n", 4) == 0) {
+			return (i64)(i + 4);
+		}
+	}
+	return 0;
+}
+
+static i64 bench_parse_content_length(const char* headers, i64 headers_length) {
+	const char* pos = headers;
+	const char* end = headers + headers_length;
+	while (pos < end) {
+		if (strncasecmp(pos, "Content-length:", 15) == 0) {
+			return atoll(pos + 15);
+		}
+		const char* next_line = memchr(pos, '\n', end - pos);
+		if (!next_line) break;
+		pos = next_line + 1;
+	}
+	return -1;
+}
+
+// Sends a single request and reads the complete response. Returns the HTTP status code, or 0 on failure.
+static i32 bench_request(bench_client_t* client, const char* uri, i64* content_length_out) {
+	bench_options_t* options = client->options;
+	bool retried = false;
+	retry:
+	if (!client->connection.is_open && !bench_connect(client)) {
+		return 0;
+	}
+
+	char request[8192];
+	i32 request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+	                           uri, options->hostname, options->close_after_each_request ? "Connection: close\r\n" : "");
+	i32 bytes_sent = 0;
+	while (bytes_sent < request_len) {
+		i32 ret = bench_send(client, (u8*)request + bytes_sent, request_len - bytes_sent);
+		if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) continue;
+		if (ret <= 0) {
+			bench_disconnect(client);
+			// The server may have closed an idle keep-alive connection; try once more on a fresh one.
+			if (!retried) { retried = true; goto retry; }
+			return 0;
+		}
+		bytes_sent += ret;
+	}
+
+	memrw_t* response = &client->response;
+	memrw_rewind(response);
+	i64 headers_length = 0;
+	i64 content_length = -1;
+	i32 status = 0;
+	for (;;) {
+		if (headers_length > 0 && (i64)response->used_size >= headers_length + content_length) {
+			break; // complete
+		}
+		memrw_maybe_grow(response, response->used_size + KILOBYTES(64));
+		i32 ret = bench_recv(client, response->data + response->used_size, response->capacity - response->used_size);
+		if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) continue;
+		if (ret <= 0) {
+			bench_disconnect(client);
+			if (response->used_size == 0 && !retried) { retried = true; goto retry; }
+			return 0;
+		}
+		response->used_size += ret;
+		if (headers_length == 0) {
+			headers_length = bench_find_end_of_headers(response->data, response->used_size);
+			if (headers_length > 0) {
+				status = atoi((char*)response->data + 9); // skip "HTTP/1.1 "
+				content_length = bench_parse_content_length((char*)response->data, headers_length);
+				if (content_length < 0) {
+					fprintf(stderr, "[client %d] response without Content-length\n", client->index);
+					bench_disconnect(client);
+					return 0;
+				}
+			}
+		}
+	}
+	if (options->close_after_each_request) {
+		bench_disconnect(client);
+	}
+	if (content_length_out) *content_length_out = content_length;
+	return status;
+}
+
+static void bench_record_latency(bench_client_t* client, float ms) {
+	if (client->latency_count == client->latency_capacity) {
+		client->latency_capacity = MAX(1024, client->latency_capacity * 2);
+		client->latencies = realloc(client->latencies, client->latency_capacity * sizeof(float));
+	}
+	client->latencies[client->latency_count++] = ms;
+}
+
+static bool bench_timed_request(bench_client_t* client, const char* uri, i32 tile_count) {
+	i64 start = get_clock();
+	i64 content_length = 0;
+	i32 status = bench_request(client, uri, &content_length);
+	float ms = get_seconds_elapsed(start, get_clock()) * 1000.0f;
+	if (status != 200) {
+		++client->errors;
+		return false;
+	}
+	bench_record_latency(client, ms);
+	client->bytes_received += content_length;
+	client->tiles_received += tile_count;
+	if (client->options->record_fp) {
+		pthread_mutex_lock(&client->options->record_mutex);
+		fprintf(client->options->record_fp, "%s\n", uri);
+		pthread_mutex_unlock(&client->options->record_mutex);
+	}
+	if (client->options->think_time_ms > 0) {
+		platform_sleep(client->options->think_time_ms);
+	}
+	return true;
+}
+
+// A simulated viewer: pans around and occasionally zooms, requesting the tiles that come into view.
+static void bench_simulate_viewer(bench_client_t* client, i64 end_clock) {
+	tiff_t* tiff = client->tiff;
+	bench_options_t* options = client->options;
+	i32 level_count = (i32)tiff->level_image_ifd_count;
+
+	char uri[8192];
+	snprintf(uri, sizeof(uri), "/slide/%s/header", options->slide_name);
+	bench_timed_request(client, uri, 0);
+
+	// Remember which tiles this viewer already has, like the viewer's tile cache.
+	u8** tile_cached = calloc(level_count, sizeof(u8*));
+	for (i32 level = 0; level < level_count; ++level) {
+		tile_cached[level] = calloc(tiff->level_images_ifd[level].tile_count, 1);
+	}
+
+	i32 level = level_count / 2;
+	tiff_ifd_t* ifd = tiff->level_images_ifd + level;
+	float center_x = bench_random_float(client) * ifd->image_width;
+	float center_y = bench_random_float(client) * ifd->image_height;
+	float direction = bench_random_float(client) * 6.2832f;
+
+	while (get_clock() < end_clock) {
+		// Move the viewport: mostly panning in a slowly changing direction, sometimes zooming in or out.
+		float r = bench_random_float(client);
+		if (r < 0.1f && level > 0) {
+			--level;
+			center_x *= 2.0f;
+			center_y *= 2.0f;
+		} else if (r < 0.15f && level < level_count - 1) {
+			++level;
+			center_x *= 0.5f;
+			center_y *= 0.5f;
+		} else {
+			direction += (bench_random_float(client) - 0.5f) * 1.0f;
+			center_x += cosf(direction) * BENCH_VIEWPORT_WIDTH * 0.25f;
+			center_y += sinf(direction) * BENCH_VIEWPORT_HEIGHT * 0.25f;
+		}
+		ifd = tiff->level_images_ifd + level;
+		center_x = CLAMP(center_x, 0.0f, (float)ifd->image_width);
+		center_y = CLAMP(center_y, 0.0f, (float)ifd->image_height);
+		if (center_x <= 0.0f || center_x >= ifd->image_width || center_y <= 0.0f || center_y >= ifd->image_height) {
+			direction += 3.1416f; // bounce off the edge of the slide
+		}
+		if (ifd->tile_width == 0 || ifd->tile_height == 0) continue;
+
+		i32 tile_x0 = MAX(0, (i32)((center_x - BENCH_VIEWPORT_WIDTH / 2) / ifd->tile_width));
+		i32 tile_y0 = MAX(0, (i32)((center_y - BENCH_VIEWPORT_HEIGHT / 2) / ifd->tile_height));
+		i32 tile_x1 = MIN((i32)ifd->width_in_tiles - 1, (i32)((center_x + BENCH_VIEWPORT_WIDTH / 2) / ifd->tile_width));
+		i32 tile_y1 = MIN((i32)ifd->height_in_tiles - 1, (i32)((center_y + BENCH_VIEWPORT_HEIGHT / 2) / ifd->tile_height));
+
+		i32 batch_count = 0;
+		i32 uri_len = 0;
+		for (i32 tile_y = tile_y0; tile_y <= tile_y1; ++tile_y) {
+			for (i32 tile_x = tile_x0; tile_x <= tile_x1; ++tile_x) {
+				i32 tile_index = tile_y * ifd->width_in_tiles + tile_x;
+				if (tile_cached[level][tile_index]) continue;
+				tile_cached[level][tile_index] = 1;
+				u64 size = ifd->tile_byte_counts[tile_index];
+				if (size == 0) continue; // empty (background) tile
+				if (batch_count == 0) {
+					uri_len = snprintf(uri, sizeof(uri), "/slide/%s", options->slide_name);
+				}
+				uri_len += snprintf(uri + uri_len, sizeof(uri) - uri_len, "/%llu/%llu", ifd->tile_offsets[tile_index], size);
+				++batch_count;
+				if (batch_count == options->batch_size) {
+					bench_timed_request(client, uri, batch_count);
+					batch_count = 0;
+				}
+			}
+		}
+		if (batch_count > 0) {
+			bench_timed_request(client, uri, batch_count);
+		}
+	}
+
+	for (i32 i = 0; i < level_count; ++i) {
+		free(tile_cached[i]);
+	}
+	free(tile_cached);
+}
+
+static void bench_replay_trace(bench_client_t* client, i64 end_clock) {
+	bench_options_t* options = client->options;
+	// Each client walks through the trace from a different starting point.
+	i32 pos = (i32)(((i64)client->index * options->trace_length) / options->client_count);
+	while (get_clock() < end_clock) {
+		const char* uri = options->trace[pos];
+		i32 tile_count = 0;
+		for (const char* c = uri; *c; ++c) {
+			if (*c == '/') ++tile_count;
+		}
+		tile_count = MAX(0, (tile_count - 2) / 2); // '/slide/<name>' followed by pairs of '/<offset>/<size>'
+		bench_timed_request(client, uri, tile_count);
+		pos = (pos + 1) % options->trace_length;
+	}
+}
+
+static i64 bench_end_clock;
+
+static void* bench_client_thread(void* arg) {
+	bench_client_t* client = (bench_client_t*)arg;
+	if (client->options->trace_length > 0) {
+		bench_replay_trace(client, bench_end_clock);
+	} else {
+		bench_simulate_viewer(client, bench_end_clock);
+	}
+	bench_disconnect(client);
+	return NULL;
+}
+
+static int compare_floats(const void* a, const void* b) {
+	float x = *(const float*)a;
+	float y = *(const float*)b;
+	return (x > y) - (x < y);
+}
+
+static bool bench_load_trace(bench_options_t* options, const char* filename) {
+	mem_t* file_mem = platform_read_entire_file(filename);
+	if (!file_mem) {
+		fprintf(stderr, "Could not read trace file %s\n", filename);
+		return false;
+	}
+	char* text = calloc(1, file_mem->len + 1);
+	memcpy(text, file_mem->data, file_mem->len);
+	free(file_mem);
+	size_t line_count = 0;
+	char** lines = split_into_lines(text, &line_count);
+	options->trace = calloc(line_count + 1, sizeof(char*));
+	for (size_t i = 0; i < line_count; ++i) {
+		if (lines[i][0] == '/') {
+			options->trace[options->trace_length++] = lines[i];
+		}
+	}
+	free(lines);
+	if (options->trace_length == 0) {
+		fprintf(stderr, "Trace file %s does not contain any requests\n", filename);
+		return false;
+	}
+	return true;
+}
+
+static void print_usage() {
+	fprintf(stderr,
+	        "Usage: slideserver_bench <slide.tiff> [options]\n"
+	        "       slideserver_bench --trace <file> [options]\n"
+	        "Options:\n"
+	        "  --host <hostname>    server to connect to (default: localhost)\n"
+	        "  --port <port>        (default: 2000)\n"
+	        "  --name <name>        name of the slide on the server (default: file name of <slide.tiff>)\n"
+	        "  --clients <count>    number of simulated viewers (default: 60)\n"
+	        "  --duration <sec>     (default: 10)\n"
+	        "  --batch <count>      maximum number of tiles per request (default: %d)\n"
+	        "  --think <ms>         pause after each request (default: 0)\n"
+	        "  --close              open a new connection for each request\n"
+	        "  --plain              connect using plain HTTP (for a server started with --plain)\n"
+	        "  --trace <file>       replay the request URIs in <file> (one per line)\n"
+	        "  --record <file>      write the simulated requests to <file>, for later replay\n",
+	        BENCH_MAX_BATCH_SIZE);
+}
+
+int main(int argc, char** argv) {
+	bench_options_t options = {
+		.hostname = "localhost",
+		.port = "2000",
+		.client_count = 60,
+		.duration = 10.0f,
+		.batch_size = BENCH_MAX_BATCH_SIZE,
+	};
+	const char* slide_filename = NULL;
+	const char* trace_filename = NULL;
+	const char* record_filename = NULL;
+
+	for (i32 i = 1; i < argc; ++i) {
+		const char* arg = argv[i];
+		bool has_value = (i + 1 < argc);
+		if (strcmp(arg, "--host") == 0 && has_value) {
+			options.hostname = argv[++i];
+		} else if (strcmp(arg, "--port") == 0 && has_value) {
+			options.port = argv[++i];
+		} else if (strcmp(arg, "--name") == 0 && has_value) {
+			options.slide_name = argv[++i];
+		} else if (strcmp(arg, "--clients") == 0 && has_value) {
+			i32 value = atoi(argv[++i]);
+			options.client_count = MAX(1, value);
+		} else if (strcmp(arg, "--duration") == 0 && has_value) {
+			options.duration = (float)atof(argv[++i]);
+		} else if (strcmp(arg, "--batch") == 0 && has_value) {
+			i32 value = atoi(argv[++i]);
+			options.batch_size = CLAMP(value, 1, BENCH_MAX_BATCH_SIZE);
+		} else if (strcmp(arg, "--think") == 0 && has_value) {
+			i32 value = atoi(argv[++i]);
+			options.think_time_ms = MAX(0, value);
+		} else if (strcmp(arg, "--close") == 0) {
+			options.close_after_each_request = true;
+		} else if (strcmp(arg, "--plain") == 0) {
+			options.plaintext = true;
+		} else if (strcmp(arg, "--trace") == 0 && has_value) {
+			trace_filename = argv[++i];
+		} else if (strcmp(arg, "--record") == 0 && has_value) {
+			record_filename = argv[++i];
+		} else if (arg[0] != '-' && !slide_filename) {
+			slide_filename = arg;
+		} else {
+			print_usage();
+			return 1;
+		}
+	}
+
+	tiff_t tiff = {0};
+	if (trace_filename) {
+		if (!bench_load_trace(&options, trace_filename)) return 1;
+	} else if (slide_filename) {
+		if (!open_tiff_file(&tiff, slide_filename) || tiff.level_image_ifd_count == 0) {
+			fprintf(stderr, "Could not open %s as a tiled TIFF file\n", slide_filename);
+			return 1;
+		}
+		if (!options.slide_name) {
+			options.slide_name = one_past_last_slash(slide_filename, (i32)strlen(slide_filename));
+		}
+		if (record_filename) {
+			options.record_fp = fopen(record_filename, "w");
+			if (!options.record_fp) {
+				fprintf(stderr, "Could not open %s for writing\n", record_filename);
+				return 1;
+			}
+			pthread_mutex_init(&options.record_mutex, NULL);
+		}
+	} else {
+		print_usage();
+		return 1;
+	}
+
+#if WINDOWS
+	win32_init_timer();
+#endif
+
+	// The clients share a TLS configuration (read-only after setup) and random number generator.
+	mbedtls_entropy_context entropy;
+	mbedtls_ctr_drbg_context ctr_drbg;
+	mbedtls_ssl_config ssl_config;
+	mbedtls_entropy_init(&entropy);
+	mbedtls_ctr_drbg_init(&ctr_drbg);
+	mbedtls_ssl_config_init(&ssl_config);
+	const char pers[] = "slideserver_bench";
+	if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const u8*)pers, strlen(pers)) != 0 ||
+	    mbedtls_ssl_config_defaults(&ssl_config, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+		fprintf(stderr, "Failed to initialize mbedTLS\n");
+		return 1;
+	}
+	mbedtls_ssl_conf_authmode(&ssl_config, MBEDTLS_SSL_VERIFY_NONE); // the server uses a test certificate
+	mbedtls_ssl_conf_rng(&ssl_config, mbedtls_ctr_drbg_random, &ctr_drbg);
+
+	printf("Running %d clients against %s:%s for %g seconds (%s, %s)...\n", options.client_count, options.hostname, options.port,
+	       options.duration, trace_filename ? "trace replay" : "simulated viewers",
+	       options.close_after_each_request ? "new connection per request" : "keep-alive");
+
+	bench_client_t* clients = calloc(options.client_count, sizeof(bench_client_t));
+	i64 start_clock = get_clock();
+	bench_end_clock = start_clock + (i64)(options.duration * 1e9f);
+	for (i32 i = 0; i < options.client_count; ++i) {
+		bench_client_t* client = clients + i;
+		client->index = i;
+		client->options = &options;
+		client->tiff = &tiff;
+		client->ssl_config = &ssl_config;
+		client->rng_state = 0x9E3779B9u * (u32)(i + 1);
+		if (pthread_create(&client->thread, NULL, bench_client_thread, client) != 0) {
+			fprintf(stderr, "Error creating client thread\n");
+			return 1;
+		}
+	}
+
+	i64 total_requests = 0;
+	i64 total_bytes = 0;
+	i64 total_tiles = 0;
+	i64 total_connections = 0;
+	i64 total_errors = 0;
+	for (i32 i = 0; i < options.client_count; ++i) {
+		bench_client_t* client = clients + i;
+		pthread_join(client->thread, NULL);
+		total_requests += client->latency_count;
+		total_bytes += client->bytes_received;
+		total_tiles += client->tiles_received;
+		total_connections += client->connections_opened;
+		total_errors += client->errors;
+	}
+	float seconds = get_seconds_elapsed(start_clock, get_clock());
+
+	float* latencies = malloc(MAX(1, total_requests) * sizeof(float));
+	i64 latency_count = 0;
+	for (i32 i = 0; i < options.client_count; ++i) {
+		memcpy(latencies + latency_count, clients[i].latencies, clients[i].latency_count * sizeof(float));
+		latency_count += clients[i].latency_count;
+	}
+	qsort(latencies, latency_count, sizeof(float), compare_floats);
+#define PERCENTILE(p) (latency_count > 0 ? latencies[MIN(latency_count - 1, (i64)((p) * latency_count))] : 0.0f)
+
+	printf("requests:    %lld (%.1f/s), %lld errors\n", total_requests, total_requests / seconds, total_errors);
+	printf("tiles:       %lld (%.1f/s)\n", total_tiles, total_tiles / seconds);
+	printf("throughput:  %.1f MB/s\n", (total_bytes / seconds) / (1024.0 * 1024.0));
+	printf("connections: %lld\n", total_connections);
+	printf("latency:     p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+	       PERCENTILE(0.5), PERCENTILE(0.9), PERCENTILE(0.99), latency_count > 0 ? latencies[latency_count - 1] : 0.0f);
+
+	if (options.record_fp) {
+		fclose(options.record_fp);
+	}
+	return 0;
+}
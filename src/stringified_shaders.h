@@ -22,12 +22,20 @@ const char stringified_shader_source__basic_vert[] =
 const char stringified_shader_source__basic_frag[] = 
 	"#version 330 core\n"
 	"\n"
+	"// The tile shader uses this as well, with TEXTURE_ARRAY defined (tiles are stored as layers of texture arrays).\n"
+	"#ifdef TEXTURE_ARRAY\n"
+	"in VS_OUT {\n"
+	"    vec3 tex_coord;\n"
+	"} fs_in;\n"
+	"uniform sampler2DArray the_texture;\n"
+	"#else\n"
 	"in VS_OUT {\n"
 	"    vec2 tex_coord;\n"
 	"} fs_in;\n"
+	"uniform sampler2D the_texture;\n"
+	"#endif\n"
 	"\n"
 	"uniform vec3 bg_color;\n"
-	"uniform sampler2D the_texture;\n"
 	"uniform float black_level;\n"
 	"uniform float white_level;\n"
 	"uniform vec3 transparent_color;\n"
@@ -92,17 +100,90 @@ const char stringified_shader_source__finalblit_frag[] =
 	"    fragColor = vec4((1.0f-t_final) * p0.rgb + t_final * p1.rgb, alpha);\n"
 	"}\n";
 
-const char* stringified_shader_sources[4] = {
+const char stringified_shader_source__annotation_vert[] = 
+	"#version 330 core\n"
+	"\n"
+	"layout (location = 0) in vec2 pos;\n"
+	"layout (location = 1) in vec2 offset;\n"
+	"layout (location = 2) in float span;\n"
+	"\n"
+	"uniform mat4 projection_view_matrix;\n"
+	"uniform float pixel_width; // world units per screen point\n"
+	"uniform float line_thickness; // in screen points; zero for fill areas\n"
+	"uniform float min_span_in_pixels; // smaller annotations are not drawn\n"
+	"\n"
+	"void main() {\n"
+	"    float span_in_pixels = span / pixel_width;\n"
+	"    float thickness = line_thickness;\n"
+	"    if (span_in_pixels < 2.0f) {\n"
+	"        // Zoomed out too far to make out any details: draw thinner lines\n"
+	"        thickness = clamp(span_in_pixels, 1.0f, 2.0f) * 0.3f * thickness;\n"
+	"    }\n"
+	"    vec2 world_pos = pos + offset * (0.5f * thickness * pixel_width);\n"
+	"    if (span_in_pixels < min_span_in_pixels) {\n"
+	"        gl_Position = vec4(2.0f, 2.0f, 2.0f, 1.0f); // outside the clip volume -> discarded\n"
+	"    } else {\n"
+	"        gl_Position = projection_view_matrix * vec4(world_pos, 0.0f, 1.0f);\n"
+	"    }\n"
+	"}\n";
+
+const char stringified_shader_source__annotation_frag[] = 
+	"#version 330 core\n"
+	"\n"
+	"uniform vec4 color;\n"
+	"\n"
+	"out vec4 fragColor;\n"
+	"\n"
+	"void main() {\n"
+	"    fragColor = color;\n"
+	"}\n";
+
+const char stringified_shader_source__tile_vert[] = 
+	"#version 330 core\n"
+	"\n"
+	"layout (location = 0) in vec3 pos;\n"
+	"layout (location = 1) in vec2 tex_coord;\n"
+	"layout (location = 2) in vec2 tile_pos; // per instance: tile_x, tile_y\n"
+	"layout (location = 3) in float layer; // per instance: layer in the texture array\n"
+	"\n"
+	"out VS_OUT {\n"
+	"    vec3 tex_coord;\n"
+	"} vs_out;\n"
+	"\n"
+	"uniform mat4 projection_view_matrix;\n"
+	"uniform vec2 level_origin;\n"
+	"uniform vec2 tile_side;\n"
+	"uniform bool use_deformation;\n"
+	"uniform sampler2D deformation_field; // displacement per grid point (in um)\n"
+	"uniform vec2 deformation_field_extent; // grid size * grid spacing (in um)\n"
+	"\n"
+	"void main() {\n"
+	"    vec2 world_pos = level_origin + (tile_pos + pos.xy) * tile_side;\n"
+	"    if (use_deformation) {\n"
+	"        // bilinear interpolation between the grid points (which sit at the texel centers)\n"
+	"        world_pos += textureLod(deformation_field, world_pos / deformation_field_extent, 0.0f).xy;\n"
+	"    }\n"
+	"    gl_Position = projection_view_matrix * vec4(world_pos, pos.z, 1.0f);\n"
+	"    vs_out.tex_coord = vec3(tex_coord, layer);\n"
+	"}\n";
+
+const char* stringified_shader_sources[7] = {
 	stringified_shader_source__basic_vert,
 	stringified_shader_source__basic_frag,
 	stringified_shader_source__finalblit_vert,
 	stringified_shader_source__finalblit_frag,
+	stringified_shader_source__annotation_vert,
+	stringified_shader_source__annotation_frag,
+	stringified_shader_source__tile_vert,
 };
 
-const char* stringified_shader_source_names[4] = {
+const char* stringified_shader_source_names[7] = {
 	"basic_vert",
 	"basic_frag",
 	"finalblit_vert",
 	"finalblit_frag",
+	"annotation_vert",
+	"annotation_frag",
+	"tile_vert",
 };
 
@@ -27,6 +27,7 @@
 
 #include "common.h"
 #include "platform.h" // for console_print_error
+#include "intrinsics.h" // for bswap_64()
 
 #ifdef __cplusplus
 extern "C" {
@@ -1203,6 +1204,153 @@ bad:
 	return (0);
 }
 
+/*
+ * Whole-buffer LZW decoder (not part of libtiff).
+ *
+ * Instead of a code table with linked lists of characters that have to be walked (in reverse) for each code,
+ * every string is recorded as the position in the output where a copy of it can be found: the string for a new code
+ * is the previous string plus the first character of the current one, and these are already in the output back to back.
+ * Outputting a string is then a forward copy within the output buffer, like an LZ77 match. Codes are fetched from a
+ * 64-bit bit buffer that is refilled with a single 8-byte load. Because nothing needs to be cleared between strips,
+ * there is no state to allocate.
+ *
+ * Handles both regular and old-style (bit-reversed) codes. Returns the number of bytes written (decoding stops at
+ * CODE_EOI, at the end of the input or when the output is full), or -1 if the data is corrupt.
+ */
+typedef struct lzw_string_t {
+	uint32 offset; /* position in the output where a copy of the string starts */
+	uint32 length;
+} lzw_string_t;
+
+/* is_compat is a compile-time constant at both call sites, so that the compiler generates a separate loop for each. */
+FORCE_INLINE int64 LZWDecodeBufferImpl(const uint8* src, size_t src_size, uint8* dest, size_t dest_size, const int is_compat)
+{
+	lzw_string_t strings[1 << BITS_MAX];
+	const uint8* bp = src;
+	const uint8* bp_end = src + src_size;
+	uint8* op = dest;
+	uint8* op_end = dest + dest_size;
+	/* Old-style codes are LSB-first, and switch to a wider code one code later. */
+	const int early_change = is_compat ? 0 : 1;
+	uint64 bitbuf = 0;
+	int bitcount = 0;
+	int nbits = BITS_MIN;
+	int free_ent = CODE_FIRST;
+	uint8* prev = NULL; /* output position of the previous string (NULL right after CODE_CLEAR) */
+	uint32 prev_length = 0;
+
+	for (;;) {
+		if (bitcount < nbits) {
+			if (bp_end - bp >= 8) {
+				/* Bits that don't fit in a whole byte are loaded again by the next refill (same bits, so harmless). */
+				uint64 w;
+				memcpy(&w, bp, sizeof(w));
+				int nbytes = (63 - bitcount) >> 3;
+				if (is_compat) {
+					bitbuf |= w << bitcount;
+				} else {
+					bitbuf |= bswap_64(w) >> bitcount;
+				}
+				bp += nbytes;
+				bitcount += nbytes << 3;
+			} else {
+				while (bitcount <= 56 && bp < bp_end) {
+					if (is_compat) {
+						bitbuf |= (uint64)(*bp++) << bitcount;
+					} else {
+						bitbuf |= (uint64)(*bp++) << (56 - bitcount);
+					}
+					bitcount += 8;
+				}
+				if (bitcount < nbits) {
+					break; /* strip not terminated with CODE_EOI */
+				}
+			}
+		}
+		int code;
+		if (is_compat) {
+			code = (int)(bitbuf & MAXCODE(nbits));
+			bitbuf >>= nbits;
+		} else {
+			code = (int)(bitbuf >> (64 - nbits));
+			bitbuf <<= nbits;
+		}
+		bitcount -= nbits;
+
+		if (code == CODE_CLEAR) {
+			free_ent = CODE_FIRST;
+			nbits = BITS_MIN;
+			prev = NULL;
+			continue;
+		}
+		if (code == CODE_EOI || op == op_end) {
+			break;
+		}
+		if (prev == NULL) {
+			if (code >= 256) {
+				return -1; /* corrupted LZW table */
+			}
+			prev = op;
+			prev_length = 1;
+			*op++ = (uint8)code;
+			continue;
+		}
+		if (code > free_ent) {
+			return -1; /* corrupted LZW table */
+		}
+		if (free_ent < (1 << BITS_MAX)) {
+			strings[free_ent].offset = (uint32)(prev - dest);
+			strings[free_ent].length = prev_length + 1;
+			++free_ent;
+			if (free_ent + early_change > MAXCODE(nbits) && nbits < BITS_MAX) {
+				++nbits;
+			}
+		}
+
+		uint8* start = op;
+		if (code < 256) {
+			*op++ = (uint8)code;
+			prev_length = 1;
+		} else {
+			/* If code is the entry that was just added, the copy overlaps its own output by one byte (KwKwK case). */
+			lzw_string_t string = strings[code];
+			const uint8* from = dest + string.offset;
+			size_t length = string.length;
+			if (length > (size_t)(op_end - op)) {
+				length = (size_t)(op_end - op);
+			}
+			if (op - from >= 8 && (size_t)(op_end - op) >= length + 7) {
+				uint8* copy_end = op + length;
+				do {
+					uint64 v;
+					memcpy(&v, from, sizeof(v));
+					memcpy(op, &v, sizeof(v));
+					op += 8;
+					from += 8;
+				} while (op < copy_end);
+				op = copy_end;
+			} else {
+				for (size_t i = 0; i < length; ++i) {
+					op[i] = from[i];
+				}
+				op += length;
+			}
+			prev_length = string.length;
+		}
+		prev = start;
+	}
+	return (int64)(op - dest);
+}
+
+int64 LZWDecodeBuffer(const uint8* src, size_t src_size, uint8* dest, size_t dest_size)
+{
+	if (src_size >= 2 && src[0] == 0 && (src[1] & 0x1)) {
+		return LZWDecodeBufferImpl(src, src_size, dest, dest_size, 1);
+	} else {
+		return LZWDecodeBufferImpl(src, src_size, dest, dest_size, 0);
+	}
+}
+
 /*
  * Copyright (c) 1985, 1986 The Regents of the University of California.
  * All rights reserved.
@@ -27,8 +27,10 @@
 
 #include "tiff.h"
 #include "tif_lzw.h"
+#include "deflate_decoder.h"
 #include "remote.h"
 #include "jpeg_decoder.h"
+#include "pixel_convert.h"
 
 u32 get_tiff_field_size(u16 data_type) {
 	u32 size = 0;
@@ -492,7 +494,7 @@ bool tiff_read_ifd(tiff_t* tiff, tiff_ifd_t* ifd, u64* next_ifd_offset) {
 					free(tags);
 					return false; // failed
 				}
-			}
+			} break;
 			case TIFF_TAG_X_RESOLUTION: {
 				tiff_rational_t resolution = tiff_read_field_rational(tiff, tag);
 				ifd->x_resolution = resolution;
@@ -688,6 +690,162 @@ bool tiff_read_ifd(tiff_t* tiff, tiff_ifd_t* ifd, u64* next_ifd_offset) {
 	return true; // success
 }
 
+#if !IS_SERVER
+static tiff_strip_cache_t* tiff_strip_cache_create() {
+	tiff_strip_cache_t* cache = (tiff_strip_cache_t*)calloc(1, sizeof(tiff_strip_cache_t));
+	cache->lock = benaphore_create();
+	return cache;
+}
+
+static void tiff_strip_cache_destroy(tiff_strip_cache_t* cache) {
+	for (i32 i = 0; i < COUNT(cache->entries); ++i) {
+		if (cache->entries[i].pixels) {
+			free(cache->entries[i].pixels);
+		}
+	}
+	benaphore_destroy(&cache->lock);
+	free(cache);
+}
+
+// Returns the index of the entry with a reference added, or -1 if the strip is not cached.
+static i32 tiff_strip_cache_acquire(tiff_strip_cache_t* cache, i64 unit_index) {
+	i32 result = -1;
+	benaphore_lock(&cache->lock);
+	for (i32 i = 0; i < COUNT(cache->entries); ++i) {
+		tiff_cached_strip_t* entry = cache->entries + i;
+		if (entry->pixels && entry->unit_index == unit_index) {
+			++entry->refcount;
+			entry->last_used = ++cache->use_counter;
+			result = i;
+			break;
+		}
+	}
+	benaphore_unlock(&cache->lock);
+	return result;
+}
+
+static void tiff_strip_cache_release(tiff_strip_cache_t* cache, i32 entry_index) {
+	benaphore_lock(&cache->lock);
+	--cache->entries[entry_index].refcount;
+	benaphore_unlock(&cache->lock);
+}
+
+// Hands 'pixels' over to the cache, evicting least recently used strips that are not in use until it fits within
+// TIFF_STRIP_CACHE_MAX_BYTES. Returns the index of the entry with a reference added; if there is no room (or another
+// thread got there first), returns -1 and the caller keeps ownership of 'pixels'.
+static i32 tiff_strip_cache_insert(tiff_strip_cache_t* cache, i64 unit_index, u32* pixels, u64 size_in_bytes) {
+	i32 result = -1;
+	if (size_in_bytes > TIFF_STRIP_CACHE_MAX_BYTES) {
+		return result;
+	}
+	benaphore_lock(&cache->lock);
+	for (;;) {
+		tiff_cached_strip_t* free_entry = NULL;
+		tiff_cached_strip_t* victim = NULL;
+		bool already_cached = false;
+		for (i32 i = 0; i < COUNT(cache->entries); ++i) {
+			tiff_cached_strip_t* entry = cache->entries + i;
+			if (!entry->pixels) {
+				free_entry = entry;
+			} else if (entry->unit_index == unit_index) {
+				already_cached = true;
+				break;
+			} else if (entry->refcount == 0 && (!victim || entry->last_used < victim->last_used)) {
+				victim = entry;
+			}
+		}
+		if (already_cached) {
+			break;
+		}
+		if (free_entry && cache->total_bytes + size_in_bytes <= TIFF_STRIP_CACHE_MAX_BYTES) {
+			free_entry->unit_index = unit_index;
+			free_entry->pixels = pixels;
+			free_entry->size_in_bytes = size_in_bytes;
+			free_entry->refcount = 1;
+			free_entry->last_used = ++cache->use_counter;
+			cache->total_bytes += size_in_bytes;
+			result = (i32)(free_entry - cache->entries);
+			break;
+		}
+		if (!victim) {
+			break; // everything is in use
+		}
+		free(victim->pixels);
+		victim->pixels = NULL;
+		cache->total_bytes -= victim->size_in_bytes;
+	}
+	benaphore_unlock(&cache->lock);
+	return result;
+}
+#endif
+
+static u32 tiff_virtual_level_size(u32 size, i32 level) {
+	return (u32)(((u64)size + (1ull << level) - 1) >> level);
+}
+
+// Set up a stripped image to be read as tiles of TIFF_VIRTUAL_TILE_SIZE (see tiff_decode_tile()).
+static void tiff_init_virtual_tiling(tiff_t* tiff, tiff_ifd_t* ifd) {
+	if (ifd->rows_per_strip == 0 || ifd->rows_per_strip > ifd->image_height) {
+		ifd->rows_per_strip = ifd->image_height; // RowsPerStrip defaults to 2**32-1 (the whole image in one strip)
+	}
+	tiff->level_image_ifd_count = 1;
+	ifd->downsample_level = 0;
+	ifd->downsample_factor = 1.0f;
+	ifd->tile_width = TIFF_VIRTUAL_TILE_SIZE;
+	ifd->tile_height = TIFF_VIRTUAL_TILE_SIZE;
+	ifd->width_in_tiles = (ifd->image_width + ifd->tile_width - 1) / ifd->tile_width;
+	ifd->height_in_tiles = (ifd->image_height + ifd->tile_height - 1) / ifd->tile_height;
+	ifd->um_per_pixel_x = tiff->mpp_x;
+	ifd->um_per_pixel_y = tiff->mpp_y;
+	ifd->x_tile_side_in_um = ifd->um_per_pixel_x * (float)ifd->tile_width;
+	ifd->y_tile_side_in_um = ifd->um_per_pixel_y * (float)ifd->tile_height;
+
+	// Uncompressed strips can be read partially, so (large) uncompressed strips are split up into smaller units.
+	u32 unit_rows = ifd->rows_per_strip;
+	if (ifd->compression == TIFF_COMPRESSION_NONE) {
+		u64 row_size = (u64)ATLEAST(ifd->image_width, 1) * BYTES_PER_PIXEL;
+		unit_rows = (u32)ATMOST(ATLEAST(MEGABYTES(4) / row_size, 1), ifd->rows_per_strip);
+	}
+	tiff->strip_unit_rows = ATLEAST(unit_rows, 1);
+	tiff->strip_units_per_strip = (ifd->rows_per_strip + tiff->strip_unit_rows - 1) / tiff->strip_unit_rows;
+
+	// Downsample until the whole image fits in a single tile.
+	i32 level_count = 1;
+	while (level_count < TIFF_MAX_VIRTUAL_LEVELS) {
+		if (tiff_virtual_level_size(ifd->image_width, level_count - 1) <= TIFF_VIRTUAL_TILE_SIZE &&
+		    tiff_virtual_level_size(ifd->image_height, level_count - 1) <= TIFF_VIRTUAL_TILE_SIZE) {
+			break;
+		}
+		++level_count;
+	}
+	tiff->max_downsample_level = level_count - 1;
+
+#if !IS_SERVER
+	if (!tiff->strip_cache) {
+		tiff->strip_cache = tiff_strip_cache_create();
+	}
+	if (!tiff->virtual_pyramid) {
+		tiff->virtual_pyramid = (tiff_virtual_pyramid_t*)calloc(1, sizeof(tiff_virtual_pyramid_t));
+		tiff->virtual_pyramid->build_lock = benaphore_create();
+	}
+	tiff_virtual_pyramid_t* pyramid = tiff->virtual_pyramid;
+	pyramid->level_count = level_count;
+	// Only build the levels that fit in the memory budget, starting from the smallest one.
+	pyramid->first_level = level_count;
+	u64 total_bytes = 0;
+	for (i32 level = level_count - 1; level >= 1; --level) {
+		tiff_virtual_level_t* virtual_level = pyramid->levels + level;
+		virtual_level->width = tiff_virtual_level_size(ifd->image_width, level);
+		virtual_level->height = tiff_virtual_level_size(ifd->image_height, level);
+		total_bytes += (u64)virtual_level->width * virtual_level->height * BYTES_PER_PIXEL;
+		if (total_bytes > TIFF_VIRTUAL_PYRAMID_MAX_BYTES) {
+			break;
+		}
+		pyramid->first_level = level;
+	}
+#endif
+}
+
 // Calculate various derived values (better name for this procedure??)
 void tiff_post_init(tiff_t* tiff) {
 	// TODO: make more robust
@@ -827,8 +985,11 @@ void tiff_post_init(tiff_t* tiff) {
 
 
 		}
-	} else {
+	} else if (!main_image->is_ndpi && main_image->strip_count > 0 && main_image->strip_offsets && main_image->strip_byte_counts) {
 		// In this case the main image is a regular image consisting of strips, not tiles.
+		// It is presented as a tiled image, with downsampled levels built in the background.
+		tiff_init_virtual_tiling(tiff, main_image);
+	} else {
 		tiff->level_image_ifd_count = 1;
 		tiff->max_downsample_level = 0;
 		main_image->downsample_level = 0;
@@ -1013,6 +1174,10 @@ memrw_t* tiff_serialize(tiff_t* tiff, memrw_t* buffer) {
 		uncompressed_size += ifd->jpeg_tables_length;
 		uncompressed_size += ifd->tile_count * sizeof(ifd->tile_offsets[0]);
 		uncompressed_size += ifd->tile_count * sizeof(ifd->tile_byte_counts[0]);
+		if (!ifd->is_tiled && ifd->strip_count > 0) {
+			uncompressed_size += sizeof(serial_block_t) + sizeof(tiff_serial_strips_t);
+			uncompressed_size += ifd->strip_count * (sizeof(ifd->strip_offsets[0]) + sizeof(ifd->strip_byte_counts[0]));
+		}
 	}
 	uncompressed_size += tiff->ifd_count * sizeof(tiff_serial_ifd_t);
 
@@ -1053,6 +1218,22 @@ memrw_t* tiff_serialize(tiff_t* tiff, memrw_t* buffer) {
 		memrw_push_tiff_block(buffer, SERIAL_BLOCK_TIFF_JPEG_TABLES, i, ifd->jpeg_tables_length);
 		memrw_push_back(buffer, ifd->jpeg_tables, ifd->jpeg_tables_length);
 
+		// Stripped images are read through virtual tiles, which need the strip layout.
+		if (!ifd->is_tiled && ifd->strip_count > 0) {
+			tiff_serial_strips_t serial_strips = {
+				.strip_count = ifd->strip_count,
+				.rows_per_strip = ifd->rows_per_strip,
+				.samples_per_pixel = ifd->samples_per_pixel,
+				.predictor = ifd->predictor,
+			};
+			u64 strip_offsets_size = ifd->strip_count * sizeof(ifd->strip_offsets[0]);
+			u64 strip_byte_counts_size = ifd->strip_count * sizeof(ifd->strip_byte_counts[0]);
+			memrw_push_tiff_block(buffer, SERIAL_BLOCK_TIFF_STRIPS, i, sizeof(serial_strips) + strip_offsets_size + strip_byte_counts_size);
+			memrw_push_back(buffer, &serial_strips, sizeof(serial_strips));
+			memrw_push_back(buffer, ifd->strip_offsets, strip_offsets_size);
+			memrw_push_back(buffer, ifd->strip_byte_counts, strip_byte_counts_size);
+		}
+
 	}
 
 	memrw_push_tiff_block(buffer, SERIAL_BLOCK_TERMINATOR, 0, 0);
@@ -1216,6 +1397,7 @@ bool32 tiff_deserialize(tiff_t* tiff, u8* buffer, u64 buffer_size) {
 		ifd->tile_width = serial_ifd->tile_width;
 		ifd->tile_height = serial_ifd->tile_height;
 		ifd->tile_count = serial_ifd->tile_count;
+		ifd->is_tiled = (ifd->tile_count > 0);
 		ifd->tile_offsets = NULL; // set later
 		ifd->tile_byte_counts = NULL; // set later
 		ifd->image_description = NULL; // set later
@@ -1295,6 +1477,27 @@ bool32 tiff_deserialize(tiff_t* tiff, u8* buffer, u64 buffer_size) {
 				referenced_ifd->jpeg_tables[block->length] = 0;
 				referenced_ifd->jpeg_tables_length = block->length;
 			} break;
+			case SERIAL_BLOCK_TIFF_STRIPS: {
+				if (referenced_ifd->strip_offsets || block->length < sizeof(tiff_serial_strips_t)) {
+					console_print_error("tiff_deserialize(): invalid strips block for IFD %u\n", block->index);
+					goto failed;
+				}
+				tiff_serial_strips_t* serial_strips = (tiff_serial_strips_t*) block_content;
+				u64 strip_count = serial_strips->strip_count;
+				u64 array_size = strip_count * sizeof(u64);
+				if (strip_count == 0 || block->length != sizeof(tiff_serial_strips_t) + 2 * array_size) {
+					console_print_error("tiff_deserialize(): invalid strips block for IFD %u\n", block->index);
+					goto failed;
+				}
+				referenced_ifd->strip_count = strip_count;
+				referenced_ifd->rows_per_strip = serial_strips->rows_per_strip;
+				referenced_ifd->samples_per_pixel = serial_strips->samples_per_pixel;
+				referenced_ifd->predictor = serial_strips->predictor;
+				referenced_ifd->strip_offsets = (u64*) malloc(array_size);
+				memcpy(referenced_ifd->strip_offsets, block_content + sizeof(tiff_serial_strips_t), array_size);
+				referenced_ifd->strip_byte_counts = (u64*) malloc(array_size);
+				memcpy(referenced_ifd->strip_byte_counts, block_content + sizeof(tiff_serial_strips_t) + array_size, array_size);
+			} break;
 			case SERIAL_BLOCK_TERMINATOR: {
 				// Reached the end
 #if REMOTE_CLIENT_VERBOSE
@@ -1350,7 +1553,21 @@ void tiff_destroy(tiff_t* tiff) {
 		if (ifd->jpeg_tables) free(ifd->jpeg_tables);
 		if (ifd->reference_black_white) free(ifd->reference_black_white);
         if (ifd->ndpi_optimization_markers) free(ifd->ndpi_optimization_markers);
+		if (ifd->strip_offsets) free(ifd->strip_offsets);
+		if (ifd->strip_byte_counts) free(ifd->strip_byte_counts);
+	}
+#if !IS_SERVER
+	if (tiff->strip_cache) {
+		tiff_strip_cache_destroy(tiff->strip_cache);
+	}
+	if (tiff->virtual_pyramid) {
+		for (i32 i = 0; i < COUNT(tiff->virtual_pyramid->levels); ++i) {
+			if (tiff->virtual_pyramid->levels[i].pixels) free(tiff->virtual_pyramid->levels[i].pixels);
+		}
+		benaphore_destroy(&tiff->virtual_pyramid->build_lock);
+		free(tiff->virtual_pyramid);
 	}
+#endif
 	// TODO: fix this, choose either stretchy_buffer or regular malloc, not both...
 	if (tiff->is_remote) {
 		free(tiff->ifds);
@@ -1394,495 +1611,608 @@ u32 lut[] = {
 	MAKE_BGRA(100, 234, 249, 255)
 };
 
+// Expand the color lookup table to all 256 possible index values (out-of-range values map to the first color),
+// so that convert_indexed_to_bgra() can do the lookups without bounds checks.
 // TODO: move this somewhere appropriate?
-static inline u32 lookup_color_from_lut(u8 index) {
-	if (index >= COUNT(lut)) {
-		index = 0;
+static void get_expanded_color_lut(u32* expanded_lut, bool semi_transparent) {
+	for (i32 i = 0; i < 256; ++i) {
+		u32 color = lut[(i < COUNT(lut)) ? i : 0];
+		if (semi_transparent) {
+			color = BGRA_SET_ALPHA(color, 128); // TODO: make color lookup tables configurable
+		}
+		expanded_lut[i] = color;
 	}
-	u32 color = lut[index];
-	return color;
 }
 
-// from libtiff: horizontal predictor decoder
-static int horAcc8(u32 stride, uint8* cp0, u32 cc) {
-    unsigned char* cp = (unsigned char*) cp0;
-    if((cc%stride)!=0) {
-//        TIFFErrorExt(tif->tif_clientdata, "horAcc8",
-//                     "%s", "(cc%stride)!=0");
-        return 0;
-    }
-    if (cc > stride) {
-        /*
-         * Pipeline the most common cases.
-         */
-        if (stride == 3)  {
-            unsigned int cr = cp[0];
-            unsigned int cg = cp[1];
-            unsigned int cb = cp[2];
-            cc -= 3;
-            cp += 3;
-            while (cc>0) {
-                cp[0] = (unsigned char) ((cr += cp[0]) & 0xff);
-                cp[1] = (unsigned char) ((cg += cp[1]) & 0xff);
-                cp[2] = (unsigned char) ((cb += cp[2]) & 0xff);
-                cc -= 3;
-                cp += 3;
-            }
-        } else if (stride == 4)  {
-            unsigned int cr = cp[0];
-            unsigned int cg = cp[1];
-            unsigned int cb = cp[2];
-            unsigned int ca = cp[3];
-            cc -= 4;
-            cp += 4;
-            while (cc>0) {
-                cp[0] = (unsigned char) ((cr += cp[0]) & 0xff);
-                cp[1] = (unsigned char) ((cg += cp[1]) & 0xff);
-                cp[2] = (unsigned char) ((cb += cp[2]) & 0xff);
-                cp[3] = (unsigned char) ((ca += cp[3]) & 0xff);
-                cc -= 4;
-                cp += 4;
-            }
-        } else  {
-            cc -= stride;
-            do {
-                for (i32 i = 0; i < stride; ++i) {
-                    cp[stride] = (unsigned char) ((cp[stride] + *cp) & 0xff);
-                    cp++;
-                }
-                cc -= stride;
-            } while (cc>0);
-        }
-    }
-    return 1;
+// Grayscale lookup table, taking into account MinIsWhite/MinIsBlack, bilevel images and SMaxSampleValue rescaling.
+static void get_grayscale_lut(tiff_ifd_t* ifd, u32* expanded_lut) {
+	u8 output_for_min_value = 0;
+	u8 output_for_max_value = 255;
+	if (ifd->color_space == TIFF_PHOTOMETRIC_MINISWHITE) {
+		output_for_min_value = 255;
+		output_for_max_value = 0;
+	}
+	bool is_bilevel = ifd->max_sample_value == 1 && ifd->min_sample_value == 0;
+	for (i32 i = 0; i < 256; ++i) {
+		u8 value;
+		if (is_bilevel) {
+			value = i ? output_for_max_value : output_for_min_value;
+		} else {
+			i32 rescaled = i;
+			if (ifd->max_sample_value > 0 /*0: assume not set*/ && ifd->max_sample_value != 255) {
+				// resample
+				rescaled = (i32)ATMOST((i64)i * 255 / ifd->max_sample_value, 255);
+			}
+			value = (output_for_min_value == 0) ? (u8)rescaled : (u8)(255 - rescaled);
+		}
+		expanded_lut[i] = MAKE_BGRA(value, value, value, 255);
+	}
 }
 
-
-u8* tiff_decode_tile(i32 logical_thread_index, tiff_t* tiff, tiff_ifd_t* level_ifd, i32 tile_index, i32 level, i32 tile_x, i32 tile_y) {
-
-	u16 compression = level_ifd->compression;
-	u8* jpeg_tables = level_ifd->jpeg_tables;
-	u64 jpeg_tables_length = level_ifd->jpeg_tables_length;
-
-	u64 tile_offset = 0;
-	u64 compressed_tile_size_in_bytes = 0;
-	u8* compressed_tile_data = NULL;
-	u8** compressed_strip_data = NULL;
-	bool failed = false;
-
-	if (level_ifd->is_tiled) {
-		tile_offset = level_ifd->tile_offsets[tile_index];
-		compressed_tile_size_in_bytes = level_ifd->tile_byte_counts[tile_index];
-
-		// Some tiles apparently contain no data (not even an empty/dummy JPEG stream like some other tiles have).
-		// We need to check for this situation and chicken out if this is the case.
-		if (tile_offset == 0 || compressed_tile_size_in_bytes == 0) {
-#if DO_DEBUG
-			console_print("thread %d: tile level %d, tile %d (%d, %d) appears to be empty\n", logical_thread_index, level, tile_index, tile_x, tile_y);
-#endif
-			return NULL;
+// Undo the horizontal differencing predictor (Predictor=2) for one row of 8-bit samples, in place.
+// Each sample gets the value of the same sample in the previous pixel added to it, so this is a prefix sum with a
+// stride of samples_per_pixel. The SIMD paths do the prefix sum within a register using shifts (log2 steps), and
+// then add the last pixel of the previous register.
+static void undo_horizontal_predictor_u8(u8* row, u32 width, u32 samples_per_pixel) {
+	u32 i = 0; // pixels done
+#if defined(__ARM_NEON)
+	uint8x16_t zero = vdupq_n_u8(0);
+	if (samples_per_pixel == 4) {
+		uint8x16_t carry = zero;
+		for (; i + 4 <= width; i += 4) {
+			uint8x16_t x = vld1q_u8(row + i * 4);
+			x = vaddq_u8(x, vextq_u8(zero, x, 12));
+			x = vaddq_u8(x, vextq_u8(zero, x, 8));
+			x = vaddq_u8(x, carry);
+			vst1q_u8(row + i * 4, x);
+			carry = vreinterpretq_u8_u32(vdupq_n_u32(vgetq_lane_u32(vreinterpretq_u32_u8(x), 3)));
 		}
+	} else if (samples_per_pixel == 1) {
+		uint8x16_t carry = zero;
+		for (; i + 16 <= width; i += 16) {
+			uint8x16_t x = vld1q_u8(row + i);
+			x = vaddq_u8(x, vextq_u8(zero, x, 15));
+			x = vaddq_u8(x, vextq_u8(zero, x, 14));
+			x = vaddq_u8(x, vextq_u8(zero, x, 12));
+			x = vaddq_u8(x, vextq_u8(zero, x, 8));
+			x = vaddq_u8(x, carry);
+			vst1q_u8(row + i, x);
+			carry = vdupq_n_u8(vgetq_lane_u8(x, 15));
+		}
+	}
+#elif defined(__SSSE3__)
+	__m128i carry = _mm_setzero_si128();
+	if (samples_per_pixel == 4) {
+		for (; i + 4 <= width; i += 4) {
+			__m128i x = _mm_loadu_si128((__m128i*)(row + i * 4));
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+			x = _mm_add_epi8(x, carry);
+			_mm_storeu_si128((__m128i*)(row + i * 4), x);
+			carry = _mm_shuffle_epi32(x, 0xFF);
+		}
+	} else if (samples_per_pixel == 3) {
+		// 5 pixels (15 bytes) per step; the 16th byte belongs to the next step and must be stored back unchanged.
+		__m128i last_byte = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1);
+		__m128i broadcast_last_pixel = _mm_setr_epi8(12, 13, 14, 12, 13, 14, 12, 13, 14, 12, 13, 14, 12, 13, 14, -1);
+		for (; i + 6 <= width; i += 5) {
+			__m128i original = _mm_loadu_si128((__m128i*)(row + i * 3));
+			__m128i x = _mm_add_epi8(original, _mm_slli_si128(original, 3));
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 12));
+			x = _mm_add_epi8(x, carry);
+			x = _mm_or_si128(_mm_andnot_si128(last_byte, x), _mm_and_si128(last_byte, original));
+			_mm_storeu_si128((__m128i*)(row + i * 3), x);
+			carry = _mm_shuffle_epi8(x, broadcast_last_pixel);
+		}
+	} else if (samples_per_pixel == 1) {
+		__m128i broadcast_last_byte = _mm_set1_epi8(15);
+		for (; i + 16 <= width; i += 16) {
+			__m128i x = _mm_loadu_si128((__m128i*)(row + i));
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+			x = _mm_add_epi8(x, carry);
+			_mm_storeu_si128((__m128i*)(row + i), x);
+			carry = _mm_shuffle_epi8(x, broadcast_last_byte);
+		}
+	}
+#endif
+	// Remaining pixels (and other sample counts): continue from the last pixel that was done.
+	u64 sample_count = (u64)width * samples_per_pixel;
+	for (u64 s = MAX((u64)i, 1) * samples_per_pixel; s < sample_count; ++s) {
+		row[s] = (u8)(row[s] + row[s - samples_per_pixel]);
+	}
+}
 
-		// TODO: optimize allocation
-		compressed_tile_data = (u8*)malloc(compressed_tile_size_in_bytes);
-
-		if (!tiff->is_remote) {
-			file_handle_read_at_offset(compressed_tile_data, tiff->file_handle, tile_offset, compressed_tile_size_in_bytes);
-		} else {
-			console_print_verbose("[thread %d] remote tile requested: level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
-
-			i32 bytes_read = 0;
-			u8* read_buffer = download_remote_chunk(tiff->location.hostname, tiff->location.portno, tiff->location.filename,
-			                                        tile_offset, compressed_tile_size_in_bytes, &bytes_read, logical_thread_index);
-			if (read_buffer && bytes_read > 0) {
-				i64 content_offset = find_end_of_http_headers(read_buffer, bytes_read);
-				i64 content_length = bytes_read - content_offset;
-				u8* content = read_buffer + content_offset;
-
-				if (content_length >= compressed_tile_size_in_bytes) {
-					memcpy(compressed_tile_data, content, compressed_tile_size_in_bytes);
-				} else {
-					failed = true;
-				}
+#if !IS_SERVER // the server only needs to parse and serialize TIFF headers
 
-			} else {
-				failed = true;
-			}
-			if (read_buffer) {
-				free(read_buffer);
-			}
-			if (failed) {
-				console_print_error("[thread %d] failed to read from remote level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
-                free(compressed_tile_data);
-				return NULL;
-			}
+// Reads part of the file (or downloads it, for remote files) into a newly allocated buffer. Returns NULL on failure.
+static u8* tiff_read_chunk(i32 logical_thread_index, tiff_t* tiff, u64 offset, u64 size) {
+	if (size == 0) {
+		return NULL;
+	}
+	u8* chunk = (u8*)malloc(size);
+	bool failed = false;
+	if (!tiff->is_remote) {
+		size_t bytes_read = file_handle_read_at_offset(chunk, tiff->file_handle, offset, size);
+		if (bytes_read != size) {
+			failed = true;
 		}
-
 	} else {
-		// image is not tiled
-
-
-		if (!tiff->is_remote) {
-
-			if (level_ifd->strip_count > 0) {
-				ASSERT(level_ifd->strip_offsets);
-				ASSERT(level_ifd->strip_byte_counts);
-				if (level_ifd->strip_count == 1) {
-					compressed_tile_size_in_bytes = level_ifd->strip_byte_counts[0];
-					compressed_tile_data = (u8*)malloc(compressed_tile_size_in_bytes);
-					size_t bytes_read = file_handle_read_at_offset(compressed_tile_data, tiff->file_handle, level_ifd->strip_offsets[0], compressed_tile_size_in_bytes);
-					if (bytes_read != compressed_tile_size_in_bytes) {
-						failed = true;
-					}
-				} else {
-					compressed_strip_data = (u8**)alloca(level_ifd->strip_count * sizeof(u8**));
-					memset(compressed_strip_data, 0, level_ifd->strip_count * sizeof(u8**));
-					for (i32 i = 0; i < level_ifd->strip_count; ++i) {
-						u64 strip_offset = level_ifd->strip_offsets[i];
-						u64 strip_byte_count = level_ifd->strip_byte_counts[i];
-						compressed_strip_data[i] = (u8*)malloc(strip_byte_count);
-						size_t bytes_read = file_handle_read_at_offset(compressed_strip_data[i], tiff->file_handle, strip_offset, strip_byte_count);
-						if (bytes_read != strip_byte_count) {
-							failed = true;
-						}
-					}
-				}
-
+		i32 bytes_read = 0;
+		u8* read_buffer = download_remote_chunk(tiff->location.hostname, tiff->location.portno, tiff->location.filename,
+		                                        offset, size, &bytes_read, logical_thread_index);
+		if (read_buffer && bytes_read > 0) {
+			i64 content_offset = find_end_of_http_headers(read_buffer, bytes_read);
+			i64 content_length = bytes_read - content_offset;
+			u8* content = read_buffer + content_offset;
+
+			if (content_length >= size) {
+				memcpy(chunk, content, size);
 			} else {
-				failed = true; // no tiles and no strips?
+				failed = true;
 			}
 
 		} else {
 			failed = true;
 		}
+		if (read_buffer) {
+			free(read_buffer);
+		}
+	}
+	if (failed) {
+		free(chunk);
+		return NULL;
+	}
+	return chunk;
+}
 
-		if (failed) {
-			if (compressed_tile_data) {
-				free(compressed_tile_data);
-				compressed_tile_data = NULL;
-			}
-			if (compressed_strip_data) {
-				for (i32 i = 0; i < level_ifd->strip_count; ++i) {
-					free(compressed_strip_data[i]);
-					compressed_strip_data[i] = NULL;
-				}
-			}
-			return NULL;
+// Convert samples (1, 3 or 4 per pixel) to BGRA. The samples may be located at the tail end of the destination.
+static void tiff_convert_samples_to_bgra(tiff_ifd_t* ifd, u8* samples, u32* pixels, u64 pixel_count) {
+	if (ifd->samples_per_pixel == 4) {
+		convert_swap_red_blue((u32*)samples, pixels, pixel_count);
+	} else if (ifd->samples_per_pixel == 3) {
+
+		// NOTE: Some TIFFs should actually be treated as palettized, but still set PhotometricInterpretation to TIFF_PHOTOMETRIC_RGB.
+		// (as an example, the TIFF masks from the Kaggle challenge do this)
+		// However, in that case they will still probably have set SMaxSampleValue to a low value (the number of colors/categories used).
+		// We can use this fact to guess that we still want to treat the image as palettized / using a color lookup table.
+		bool palettized = ifd->color_space == TIFF_PHOTOMETRIC_PALETTE || (ifd->max_sample_value > 0 && ifd->max_sample_value < 64);
+
+		if (palettized) {
+			u32 expanded_lut[256];
+			get_expanded_color_lut(expanded_lut, true);
+			convert_indexed_to_bgra(samples, 3, pixels, pixel_count, expanded_lut); // only the red channel is being used
+		} else {
+			convert_rgb_to_bgra(samples, pixels, pixel_count, 255);
+		}
+	} else {
+		// Single-sample image: either palettized (same guess as above), or grayscale.
+		bool palettized = ifd->color_space == TIFF_PHOTOMETRIC_PALETTE || (ifd->max_sample_value > 1 && ifd->max_sample_value < 64);
+		u32 expanded_lut[256];
+		if (palettized) {
+			get_expanded_color_lut(expanded_lut, false);
+		} else {
+			get_grayscale_lut(ifd, expanded_lut);
 		}
+		convert_indexed_to_bgra(samples, 1, pixels, pixel_count, expanded_lut);
 	}
-	// We should have either a compressed tile, or one or more compressed strips
-	ASSERT(compressed_tile_data != NULL || compressed_strip_data[0] != NULL);
+}
 
-	// Now decompress
-	if (compressed_tile_data || compressed_strip_data)  {
-//		console_print_verbose("[thread %d] loading tile: level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
-
-		size_t pixel_memory_size = level_ifd->tile_width * level_ifd->tile_height * BYTES_PER_PIXEL;
-		u8* pixel_memory = (u8*)malloc(pixel_memory_size);
-
-		// Take into account either tiled or multi-strip TIFF files
-		u8** compressed_streams;
-		u64* compressed_stream_sizes;
-		i32 compressed_stream_count;
-		if (compressed_tile_data) {
-			compressed_streams = &compressed_tile_data;
-			compressed_stream_sizes = &compressed_tile_size_in_bytes;
-			compressed_stream_count = 1;
-		} else if (level_ifd->strip_count > 0 && compressed_strip_data) {
-			compressed_streams = compressed_strip_data;
-			compressed_stream_sizes = level_ifd->strip_byte_counts;
-			compressed_stream_count = level_ifd->strip_count;
+// Decode a single compressed tile or strip to BGRA (width * height pixels).
+static bool tiff_decode_stream(tiff_ifd_t* ifd, u8* compressed_stream, u64 compressed_stream_size, u8* pixel_memory_dest, u32 width, u32 height) {
+	u16 compression = ifd->compression;
+	if (compression == TIFF_COMPRESSION_JPEG) {
+		if (compressed_stream_size < 2) {
+			return false;
+		}
+		if (compressed_stream[0] == 0xFF && compressed_stream[1] == 0xD9) {
+			// JPEG stream is empty
+			memset(pixel_memory_dest, 0xFF, (u64)width * height * sizeof(u32));
+			return true;
+		} else if (ifd->is_ndpi) {
+			return jpeg_decode_ndpi_image(compressed_stream, compressed_stream_size, ifd->image_width, ifd->image_height, NULL);
 		} else {
-			goto decompression_failed;
+			return jpeg_decode_tile(ifd->jpeg_tables, ifd->jpeg_tables_length, compressed_stream, compressed_stream_size,
+			                        pixel_memory_dest, (ifd->color_space == TIFF_PHOTOMETRIC_YCBCR));
 		}
+	} else if (compression == TIFF_COMPRESSION_LZW || compression == TIFF_COMPRESSION_ADOBE_DEFLATE || compression == TIFF_COMPRESSION_DEFLATE) {
 
-		u8* decompressed = NULL; // allocated later if needed
+//		i64 start = get_clock();
 
-		for (i32 compressed_stream_index = 0; compressed_stream_index < compressed_stream_count; ++compressed_stream_index) {
+		u32 samples_per_pixel = ifd->samples_per_pixel;
+		if (!(samples_per_pixel == 1 || samples_per_pixel == 3 || samples_per_pixel == 4)) {
+			console_print_error("TIFF decompression: unexpected number of samples per pixel (%d)\n", samples_per_pixel);
+			return false;
+		}
+		if (ifd->predictor > 1 && ifd->predictor != 2 /* PREDICTOR_HORIZONTAL */) {
+			console_print_error("TIFF decompression: unsupported predictor operator (%d)\n", ifd->predictor);
+			return false;
+		}
 
-			u8* compressed_stream = compressed_streams[compressed_stream_index];
-			u64 compressed_stream_size = compressed_stream_sizes[compressed_stream_index];
-			ASSERT(compressed_stream_size >= 2);
+		// Decompress straight into the tail end of the destination pixels; the conversion to BGRA below
+		// expands the samples in place, front to back, so the writes never overtake the reads.
+		u64 pixel_count = (u64)width * height;
+		size_t decompressed_size = pixel_count * samples_per_pixel;
+		u8* decompressed = pixel_memory_dest + pixel_count * BYTES_PER_PIXEL - decompressed_size;
 
-			u8* pixel_memory_dest = pixel_memory;
-			if (compressed_stream_index > 0 && level_ifd->strip_count > 0) {
-				u64 row_offset = (u64)level_ifd->rows_per_strip * compressed_stream_index;
-				if (row_offset >= level_ifd->tile_height) {
-					goto decompression_failed; // out of bounds
-				}
-				pixel_memory_dest += row_offset * level_ifd->tile_width * BYTES_PER_PIXEL;
+		if (compression == TIFF_COMPRESSION_LZW) {
+			if (LZWDecodeBuffer(compressed_stream, compressed_stream_size, decompressed, decompressed_size) != (i64)decompressed_size) {
+				console_print_error("LZW decompression failed\n");
+				return false;
 			}
+		} else {
+			size_t bytes_written = 0;
+			if (!deflate_decode(compressed_stream, compressed_stream_size, decompressed, decompressed_size, true, &bytes_written) || bytes_written != decompressed_size) {
+				console_print_error("Deflate decompression failed\n");
+				return false;
+			}
+		}
 
-			u32 decompressed_height;
-			if (level_ifd->strip_count > 0) {
-				decompressed_height = level_ifd->rows_per_strip;
-				if ((compressed_stream_index + 1) * decompressed_height > level_ifd->tile_height) {
-					// last strip height may be less, if the total height is not a multiple of rows_per_strip
-					decompressed_height = level_ifd->tile_height % level_ifd->rows_per_strip;
-				}
-				if (decompressed_height == 0 || decompressed_height > level_ifd->tile_height) {
-					goto decompression_failed;
-				}
-			} else {
-				decompressed_height = level_ifd->tile_height;
+		if (ifd->predictor == 2) {
+			// horizontal differencing
+			for (u32 y = 0; y < height; ++y) {
+				u8* scanline = decompressed + (u64)y * width * samples_per_pixel;
+				undo_horizontal_predictor_u8(scanline, width, samples_per_pixel);
 			}
+		}
 
-			if (compression == TIFF_COMPRESSION_JPEG) {
-				if (compressed_stream[0] == 0xFF && compressed_stream[1] == 0xD9) {
-					// JPEG stream is empty
-					memset(pixel_memory_dest, 0xFF, level_ifd->tile_width * decompressed_height * sizeof(u32));
-				} else {
-					bool success = false;
-					if (level_ifd->is_ndpi) {
-						success = jpeg_decode_ndpi_image(compressed_stream, compressed_stream_size, level_ifd->image_width, level_ifd->image_height, NULL);
-					} else {
-						success = jpeg_decode_tile(jpeg_tables, jpeg_tables_length, compressed_stream,
-						                           compressed_stream_size,
-						                           pixel_memory_dest, (level_ifd->color_space == TIFF_PHOTOMETRIC_YCBCR));
-					}
-					if (success) {
-//		                console_print_verbose("thread %d: successfully decoded level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
-						continue; // success
-					} else {
-						console_print_error("thread %d: failed to decode level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
-						goto decompression_failed;
-					}
-				}
-			} else if (level_ifd->compression == TIFF_COMPRESSION_LZW) {
-
-//			    i64 start = get_clock();
-
-				size_t decompressed_size = level_ifd->tile_width * decompressed_height * level_ifd->samples_per_pixel;
-				decompressed = (u8*)malloc(decompressed_size);
-
-				PseudoTIFF tif = {};
-				tif.tif_rawdata = compressed_stream;
-				tif.tif_rawcp = compressed_stream;
-				tif.tif_rawdatasize = compressed_stream_size;
-				tif.tif_rawcc = compressed_stream_size;
-				LZWSetupDecode(&tif);
-				LZWPreDecode(&tif, 0);
-				// Check for old bit-reversed codes.
-				int decode_success = 0;
-				if (tif.tif_rawcc >= 2 && tif.tif_rawdata[0] == 0 && (tif.tif_rawdata[1] & 0x1)) {
-					decode_success = LZWDecodeCompat(&tif, decompressed, decompressed_size, 0);
-				} else {
-					decode_success = LZWDecode(&tif, decompressed, decompressed_size, 0);
-				}
-				if (!decode_success) {
-					console_print_error("LZW decompression failed\n");
-					goto decompression_failed;
-				}
+//		i64 decode_end = get_clock();
+//		console_print_verbose("decode took %g ms\n", 1000.0f * get_seconds_elapsed(start, decode_end));
 
-				if (level_ifd->predictor > 1) {
-					if (level_ifd->predictor == 2 /* PREDICTOR_HORIZONTAL */ && level_ifd->samples_per_pixel <= 8) {
-						// horizontal differencing
-						u32 samples = level_ifd->samples_per_pixel;
-						u32 subpixels_per_scanline = level_ifd->tile_width * samples;
-						for (u32 y = 0; y < decompressed_height; ++y) {
-							u8* scanline = decompressed + y * subpixels_per_scanline;
-							horAcc8(samples, scanline, subpixels_per_scanline);
-						}
-					} else {
-						console_print_error("LZW decoding failed: unsupported predictor operator (%d)\n", level_ifd->predictor);
-						goto decompression_failed;
-					}
-				}
+		tiff_convert_samples_to_bgra(ifd, decompressed, (u32*)pixel_memory_dest, pixel_count);
+		return true;
 
-//			    i64 decode_end = get_clock();
-//			    console_print_verbose("[thread %d] decode  level %d, tile %d (%d, %d) took %g ms\n", logical_thread_index, level, tile_index, tile_x, tile_y, 1000.0f * get_seconds_elapsed(start, decode_end));
-
-				// Convert RGB to BGRA
-				if (level_ifd->samples_per_pixel == 4) {
-					// TODO: convert RGBA to BGRA
-					console_print_error("LZW decompression: RGBA to BGRA conversion not implemented, assuming already in BGRA\n");
-					memcpy(pixel_memory_dest, decompressed, decompressed_size);
-					free(decompressed);
-					decompressed = NULL;
-					continue; // success
-				} else if (level_ifd->samples_per_pixel == 3) {
-
-					// NOTE: Some TIFFs should actually be treated as palettized, but still set PhotometricInterpretation to TIFF_PHOTOMETRIC_RGB.
-					// (as an example, the TIFF masks from the Kaggle challenge do this)
-					// However, in that case they will still probably have set SMaxSampleValue to a low value (the number of colors/categories used).
-					// We can use this fact to guess that we still want to treat the image as palettized / using a color lookup table.
-					bool palettized = level_ifd->color_space == TIFF_PHOTOMETRIC_PALETTE || (level_ifd->max_sample_value > 0 && level_ifd->max_sample_value < 64);
-
-					u64 pixel_count = level_ifd->tile_width * decompressed_height;
-					i32 source_pos = 0;
-					u32* pixels = (u32*)pixel_memory_dest;
-
-					// TODO: vectorize: https://stackoverflow.com/questions/7194452/fast-vectorized-conversion-from-rgb-to-bgra
-					if (palettized) {
-						for (u64 i = 0; i < pixel_count; ++i) {
-							u8 r = decompressed[source_pos]; // only the red channel is being used
-//						    u8 g = decompressed[source_pos+1];
-//					    	u8 b = decompressed[source_pos+2];
-//					    	pixels[i]=(r<<16) | (g<<8) | b | (0xff << 24);
-							u32 color = lookup_color_from_lut(r);
-							color = BGRA_SET_ALPHA(color, 128); // TODO: make color lookup tables configurable
-							pixels[i] = color;
-							source_pos+=3;
-						}
-					} else {
-						for (u64 i = 0; i < pixel_count; ++i) {
-							// TODO: optimize?
-							u8 r = decompressed[source_pos];
-							u8 g = decompressed[source_pos+1];
-							u8 b = decompressed[source_pos+2];
-							pixels[i] = MAKE_BGRA(r, g, b, 255);
-							source_pos+=3;
-						}
-					}
+	} else if (compression == TIFF_COMPRESSION_NONE) {
+		u32 samples_per_pixel = ifd->samples_per_pixel;
+		if (!(samples_per_pixel == 1 || samples_per_pixel == 3 || samples_per_pixel == 4)) {
+			console_print_error("TIFF: unexpected number of samples per pixel (%d)\n", samples_per_pixel);
+			return false;
+		}
+		u64 pixel_count = (u64)width * height;
+		u64 available_pixel_count = MIN(pixel_count, compressed_stream_size / samples_per_pixel);
+		tiff_convert_samples_to_bgra(ifd, compressed_stream, (u32*)pixel_memory_dest, available_pixel_count);
+		if (available_pixel_count < pixel_count) {
+			memset(pixel_memory_dest + available_pixel_count * BYTES_PER_PIXEL, 0, (pixel_count - available_pixel_count) * BYTES_PER_PIXEL);
+		}
+		return true;
+	} else {
+		console_print_error("unsupported TIFF compression method (compression=%d)\n", compression);
+		return false;
+	}
+}
 
-					free(decompressed);
-					decompressed = NULL;
-//				    console_print_verbose("[thread %d] swizzle level %d, tile %d (%d, %d) took %g ms\n", logical_thread_index, level, tile_index, tile_x, tile_y, 1000.0f * get_seconds_elapsed(decode_end, get_clock()));
-					continue; // success
-				} else if (level_ifd->samples_per_pixel == 1) {
-
-
-					// Grayscale image
-					u64 pixel_count = level_ifd->tile_width * decompressed_height;
-					i32 source_pos = 0;
-					u32* pixels = (u32*)pixel_memory_dest;
-
-					// assume palettized
-					for (u64 i = 0; i < pixel_count; ++i) {
-						u8 r = decompressed[source_pos]; // only the red channel is being used
-//						u8 g = decompressed[source_pos+1];
-//					    u8 b = decompressed[source_pos+2];
-//					    pixels[i]=(r<<16) | (g<<8) | b | (0xff << 24);
-						u32 color = lookup_color_from_lut(r);
-//                      color = BGRA_SET_ALPHA(color, 128); // TODO: make color lookup tables configurable
-						pixels[i] = color;
-						source_pos+=1;
-					}
+// Stripped images are read in units of tiff->strip_unit_rows rows (whole strips, unless uncompressed).
+// Returns false if the unit lies outside of the image.
+static bool tiff_get_strip_unit(tiff_t* tiff, tiff_ifd_t* ifd, i64 unit_index, u32* first_row, u32* row_count) {
+	i64 strip_index = unit_index / tiff->strip_units_per_strip;
+	u32 row_in_strip = (u32)(unit_index % tiff->strip_units_per_strip) * tiff->strip_unit_rows;
+	if (strip_index >= (i64)ifd->strip_count) {
+		return false;
+	}
+	u64 row = (u64)strip_index * ifd->rows_per_strip + row_in_strip;
+	if (row >= ifd->image_height) {
+		return false;
+	}
+	*first_row = (u32)row;
+	*row_count = MIN(tiff->strip_unit_rows, ifd->rows_per_strip - row_in_strip);
+	*row_count = MIN(*row_count, ifd->image_height - *first_row);
+	return true;
+}
 
-					/*u8 output_for_min_value = 0;
-					u8 output_for_max_value = 255;
-					if (level_ifd->color_space == TIFF_PHOTOMETRIC_MINISBLACK) {
-						// no action
-					} else if (level_ifd->color_space == TIFF_PHOTOMETRIC_MINISWHITE) {
-						output_for_min_value = 255;
-						output_for_max_value = 0;
-					} else {
-						// Issue warning? PhotometricInterpretation missing
-					}
+static i64 tiff_get_strip_unit_index_for_row(tiff_t* tiff, tiff_ifd_t* ifd, u32 row) {
+	i64 strip_index = row / ifd->rows_per_strip;
+	u32 row_in_strip = row % ifd->rows_per_strip;
+	return strip_index * tiff->strip_units_per_strip + row_in_strip / tiff->strip_unit_rows;
+}
 
-					bool is_bilevel = level_ifd->max_sample_value == 1 && level_ifd->min_sample_value == 0;
+// Read and decode one unit of a stripped image to BGRA (image_width pixels per row).
+static u32* tiff_decode_strip_unit(i32 logical_thread_index, tiff_t* tiff, tiff_ifd_t* ifd, i64 unit_index) {
+	u32 first_row = 0;
+	u32 row_count = 0;
+	if (!tiff_get_strip_unit(tiff, ifd, unit_index, &first_row, &row_count)) {
+		return NULL;
+	}
+	i64 strip_index = unit_index / tiff->strip_units_per_strip;
+	u64 offset = ifd->strip_offsets[strip_index];
+	u64 size = ifd->strip_byte_counts[strip_index];
+	if (ifd->compression == TIFF_COMPRESSION_NONE) {
+		// Only read the rows that are part of this unit.
+		u64 row_size = (u64)ifd->image_width * ifd->samples_per_pixel;
+		u64 start = (u64)(first_row - strip_index * ifd->rows_per_strip) * row_size;
+		if (start >= size) {
+			return NULL;
+		}
+		offset += start;
+		size = MIN(size - start, row_count * row_size);
+	}
+	u8* compressed = tiff_read_chunk(logical_thread_index, tiff, offset, size);
+	if (!compressed) {
+		console_print_error("thread %d: failed to read strip %lld\n", logical_thread_index, strip_index);
+		return NULL;
+	}
+	u32* pixels = (u32*)malloc((u64)ifd->image_width * row_count * BYTES_PER_PIXEL);
+	bool success = tiff_decode_stream(ifd, compressed, size, (u8*)pixels, ifd->image_width, row_count);
+	free(compressed);
+	if (!success) {
+		console_print_error("thread %d: failed to decode strip %lld\n", logical_thread_index, strip_index);
+		free(pixels);
+		return NULL;
+	}
+	return pixels;
+}
 
-					if (is_bilevel) {
-						for (u64 i = 0; i < pixel_count; ++i) {
-							u8 r = decompressed[source_pos];
-							r = r ? output_for_max_value : output_for_min_value;
-							u32 color = MAKE_BGRA(r, r, r, 255);
-							pixels[i] = color;
-							source_pos+=1;
-						}
-					} else {
-						if (level_ifd->max_sample_value == 0 *//*assume not set*//* || level_ifd->max_sample_value == 255) {
-						// output raw value as RGB value
-						for (u64 i = 0; i < pixel_count; ++i) {
-							u8 r = decompressed[source_pos];
-							u32 color = MAKE_BGRA(r, r, r, 255);
-							pixels[i] = color;
-							source_pos+=1;
-						}
-					} else {
-						// resample
-						float convert_factor = (1.0f / (float)level_ifd->max_sample_value) * 255.0f;
-						for (u64 i = 0; i < pixel_count; ++i) {
-							u8 r = decompressed[source_pos];
-							r = (u8)((float)r * convert_factor);
-							u32 color = MAKE_BGRA(r, r, r, 255);
-							pixels[i] = color;
-							source_pos+=1;
-						}
-					}
+// Copy a virtual tile out of the band of (cached) strips that covers it.
+static u8* tiff_decode_stripped_tile(i32 logical_thread_index, tiff_t* tiff, tiff_ifd_t* ifd, i32 tile_x, i32 tile_y) {
+	u32 tile_size = TIFF_VIRTUAL_TILE_SIZE;
+	u64 x0 = (u64)tile_x * tile_size;
+	u64 y0 = (u64)tile_y * tile_size;
+	if (tile_x < 0 || tile_y < 0 || x0 >= ifd->image_width || y0 >= ifd->image_height || tiff->strip_units_per_strip == 0) {
+		return NULL;
+	}
+	u32 tile_width_in_image = (u32)MIN(tile_size, ifd->image_width - x0);
+	u32 y1 = (u32)MIN(y0 + tile_size, ifd->image_height);
+	size_t pixel_memory_size = (size_t)tile_size * tile_size * BYTES_PER_PIXEL;
+	bool is_partial_tile = (tile_width_in_image < tile_size || y1 - y0 < tile_size);
+	u32* pixels = (u32*)(is_partial_tile ? calloc(1, pixel_memory_size) : malloc(pixel_memory_size));
+
+	tiff_strip_cache_t* cache = tiff->strip_cache;
+	u32 y = (u32)y0;
+	while (y < y1) {
+		i64 unit_index = tiff_get_strip_unit_index_for_row(tiff, ifd, y);
+		u32 unit_first_row = 0;
+		u32 unit_row_count = 0;
+		if (!tiff_get_strip_unit(tiff, ifd, unit_index, &unit_first_row, &unit_row_count)) {
+			// Not enough strips to cover the image: leave the remaining rows empty.
+			if (!is_partial_tile) {
+				memset(pixels + (u64)(y - y0) * tile_size, 0, (u64)(y0 + tile_size - y) * tile_size * BYTES_PER_PIXEL);
+			}
+			break;
+		}
+		u32* unit_pixels = NULL;
+		i32 cache_entry = cache ? tiff_strip_cache_acquire(cache, unit_index) : -1;
+		if (cache_entry >= 0) {
+			unit_pixels = cache->entries[cache_entry].pixels;
+		} else {
+			unit_pixels = tiff_decode_strip_unit(logical_thread_index, tiff, ifd, unit_index);
+			if (!unit_pixels) {
+				free(pixels);
+				return NULL;
+			}
+			if (cache) {
+				u64 unit_size = (u64)ifd->image_width * unit_row_count * BYTES_PER_PIXEL;
+				cache_entry = tiff_strip_cache_insert(cache, unit_index, unit_pixels, unit_size);
+			}
+		}
+		u32 rows_to_copy = MIN(y1, unit_first_row + unit_row_count) - y;
+		for (u32 i = 0; i < rows_to_copy; ++i) {
+			u32* src = unit_pixels + (u64)(y + i - unit_first_row) * ifd->image_width + x0;
+			u32* dest = pixels + (u64)(y + i - y0) * tile_size;
+			memcpy(dest, src, tile_width_in_image * BYTES_PER_PIXEL);
+		}
+		if (cache_entry >= 0) {
+			tiff_strip_cache_release(cache, cache_entry);
+		} else {
+			free(unit_pixels);
+		}
+		y += rows_to_copy;
+	}
+	return (u8*)pixels;
+}
 
-				}*/
+bool tiff_is_virtual_tile_ready(tiff_t* tiff, i32 level, i32 tile_y) {
+	if (level == 0) {
+		return true;
+	}
+	tiff_virtual_pyramid_t* pyramid = tiff->virtual_pyramid;
+	if (!pyramid || level < pyramid->first_level || level >= pyramid->level_count || tile_y < 0) {
+		return false;
+	}
+	tiff_virtual_level_t* virtual_level = pyramid->levels + level;
+	u32 rows_needed = (u32)MIN((u64)(tile_y + 1) * TIFF_VIRTUAL_TILE_SIZE, virtual_level->height);
+	i32 rows_done = virtual_level->rows_done;
+	read_barrier;
+	return (u32)rows_done >= rows_needed;
+}
 
-					free(decompressed);
-					decompressed = NULL;
-					continue; // success
-				} else {
-					console_print_error("LZW decompression: unexpected number of samples per pixel (%d)\n", level_ifd->samples_per_pixel);
-					goto decompression_failed;
-				}
+static u8* tiff_decode_virtual_level_tile(tiff_t* tiff, i32 level, i32 tile_x, i32 tile_y) {
+	if (!tiff_is_virtual_tile_ready(tiff, level, tile_y)) {
+		return NULL;
+	}
+	tiff_virtual_level_t* virtual_level = tiff->virtual_pyramid->levels + level;
+	u32 tile_size = TIFF_VIRTUAL_TILE_SIZE;
+	u64 x0 = (u64)tile_x * tile_size;
+	u64 y0 = (u64)tile_y * tile_size;
+	if (tile_x < 0 || x0 >= virtual_level->width || y0 >= virtual_level->height) {
+		return NULL;
+	}
+	u32 copy_width = (u32)MIN(tile_size, virtual_level->width - x0);
+	u32 copy_height = (u32)MIN(tile_size, virtual_level->height - y0);
+	u32* pixels = (u32*)calloc(1, (size_t)tile_size * tile_size * BYTES_PER_PIXEL);
+	for (u32 i = 0; i < copy_height; ++i) {
+		memcpy(pixels + (u64)i * tile_size, virtual_level->pixels + (y0 + i) * virtual_level->width + x0, copy_width * BYTES_PER_PIXEL);
+	}
+	return (u8*)pixels;
+}
 
-			} else if (level_ifd->compression == TIFF_COMPRESSION_NONE) {
-				u8* uncompressed = (u8*)compressed_stream;
-				u64 pixel_count = level_ifd->tile_width * decompressed_height;
-				i32 source_pos = 0;
-				if (level_ifd->samples_per_pixel == 4) {
-					console_print_error("LZW decompression: RGBA to BGRA conversion not implemented, assuming already in BGRA\n");
-					memcpy(pixel_memory_dest, uncompressed, pixel_count * compressed_stream_size);
-				} else if (level_ifd->samples_per_pixel == 3) {
-					u32* pixels = (u32*)pixel_memory_dest;
-					for (u64 i = 0; i < pixel_count; ++i) {
-						u8 r = uncompressed[source_pos]; // only the red channel is being used
-						u8 g = uncompressed[source_pos+1];
-						u8 b = uncompressed[source_pos+2];
-						pixels[i] = MAKE_BGRA(r, g, b, 255);
-						source_pos+=3;
-					}
-					continue;
-				} else {
-					goto decompression_failed;
-				}
-			} else {
-				console_print_error("\"thread %d: failed to decode level %d, tile %d (%d, %d): unsupported TIFF compression method (compression=%d)\n", logical_thread_index, level, tile_index, tile_x, tile_y, compression);
-				goto decompression_failed;
+// Publish a finished row of a virtual level. Every two rows, the next level gets a row (averaging 2x2 pixels).
+static void tiff_virtual_pyramid_finish_row(tiff_virtual_pyramid_t* pyramid, i32 level, u32 row) {
+	tiff_virtual_level_t* virtual_level = pyramid->levels + level;
+	write_barrier;
+	virtual_level->rows_done = (i32)(row + 1);
+	if (level + 1 >= pyramid->level_count || ((row & 1) == 0 && row + 1 < virtual_level->height)) {
+		return;
+	}
+	tiff_virtual_level_t* next_level = virtual_level + 1;
+	u32 next_row = row / 2;
+	u32* row0 = virtual_level->pixels + (u64)(row & ~1u) * virtual_level->width;
+	u32* row1 = (row & 1) ? row0 + virtual_level->width : row0; // an odd last row is repeated
+	u32* dest = next_level->pixels + (u64)next_row * next_level->width;
+	for (u32 x = 0; x < next_level->width; ++x) {
+		u32 x0 = 2 * x;
+		u32 x1 = MIN(x0 + 1, virtual_level->width - 1);
+		u32 p[4] = {row0[x0], row0[x1], row1[x0], row1[x1]};
+		// Average two channels at a time, in separate 16-bit lanes.
+		u32 sum_br = 0x00020002; // rounding
+		u32 sum_ga = 0x00020002;
+		for (i32 i = 0; i < 4; ++i) {
+			sum_br += p[i] & 0x00FF00FF;
+			sum_ga += (p[i] >> 8) & 0x00FF00FF;
+		}
+		dest[x] = ((sum_br >> 2) & 0x00FF00FF) | (((sum_ga >> 2) & 0x00FF00FF) << 8);
+	}
+	tiff_virtual_pyramid_finish_row(pyramid, level + 1, next_row);
+}
+
+// Build the downsampled levels of a stripped image, in a single pass over the strips (top to bottom).
+// The first level that is built is box-filtered from level 0, and each next level is halved from the one before.
+// Rows are published as soon as they are done, see tiff_is_virtual_tile_ready().
+bool tiff_build_virtual_pyramid(tiff_t* tiff, i32 logical_thread_index, bool* cancel) {
+	tiff_virtual_pyramid_t* pyramid = tiff->virtual_pyramid;
+	if (!pyramid) {
+		return false;
+	}
+	benaphore_lock(&pyramid->build_lock);
+	if (pyramid->is_built || pyramid->first_level >= pyramid->level_count) {
+		benaphore_unlock(&pyramid->build_lock);
+		return true;
+	}
+	tiff_ifd_t* ifd = tiff->main_image_ifd;
+	bool success = true;
+	for (i32 level = pyramid->first_level; level < pyramid->level_count; ++level) {
+		tiff_virtual_level_t* virtual_level = pyramid->levels + level;
+		if (!virtual_level->pixels) {
+			virtual_level->pixels = (u32*)calloc(1, (size_t)virtual_level->width * virtual_level->height * BYTES_PER_PIXEL);
+			if (!virtual_level->pixels) {
+				success = false;
 			}
 		}
+		virtual_level->rows_done = 0;
+	}
 
-		ASSERT(pixel_memory);
+	i64 start = get_clock();
+	i32 shift = pyramid->first_level;
+	u32 block_size = 1u << shift;
+	tiff_virtual_level_t* base = pyramid->levels + pyramid->first_level;
+	u64* sums = (u64*)calloc((size_t)base->width * 4, sizeof(u64));
+	u32 rows_in_block = 0;
+	u32 output_row = 0;
+	i64 unit_count = (i64)ifd->strip_count * tiff->strip_units_per_strip;
+	for (i64 unit_index = 0; success && unit_index < unit_count && output_row < base->height; ++unit_index) {
+		if (cancel && *(volatile bool*)cancel) {
+			success = false;
+			break;
+		}
+		u32 first_row = 0;
+		u32 row_count = 0;
+		if (!tiff_get_strip_unit(tiff, ifd, unit_index, &first_row, &row_count)) {
+			continue;
+		}
+		u32* unit_pixels = NULL;
+		i32 cache_entry = tiff_strip_cache_acquire(tiff->strip_cache, unit_index);
+		if (cache_entry >= 0) {
+			unit_pixels = tiff->strip_cache->entries[cache_entry].pixels;
+		} else {
+			unit_pixels = tiff_decode_strip_unit(logical_thread_index, tiff, ifd, unit_index); // might fail: rows stay blank
+		}
 
-		if (false) { decompression_failed:
-			// We'll return NULL in case of failure
-			if (pixel_memory) {
-				free(pixel_memory);
-				pixel_memory = NULL;
+		for (u32 i = 0; i < row_count; ++i) {
+			if (unit_pixels) {
+				u32* src = unit_pixels + (u64)i * ifd->image_width;
+				for (u32 x = 0; x < ifd->image_width; ++x) {
+					u32 p = src[x];
+					u64* sum = sums + (x >> shift) * 4;
+					sum[0] += p & 0xFF;
+					sum[1] += (p >> 8) & 0xFF;
+					sum[2] += (p >> 16) & 0xFF;
+					sum[3] += p >> 24;
+				}
+			}
+			++rows_in_block;
+			if (rows_in_block == block_size || first_row + i + 1 == ifd->image_height) {
+				u32* dest = base->pixels + (u64)output_row * base->width;
+				for (u32 x = 0; x < base->width; ++x) {
+					u32 columns_in_block = MIN(block_size, ifd->image_width - (x << shift));
+					u64 count = (u64)columns_in_block * rows_in_block;
+					u64* sum = sums + x * 4;
+					u32 c[4];
+					for (i32 j = 0; j < 4; ++j) {
+						c[j] = (u32)((sum[j] + count / 2) / count);
+					}
+					dest[x] = c[0] | (c[1] << 8) | (c[2] << 16) | (c[3] << 24);
+				}
+				memset(sums, 0, (size_t)base->width * 4 * sizeof(u64));
+				tiff_virtual_pyramid_finish_row(pyramid, pyramid->first_level, output_row);
+				rows_in_block = 0;
+				++output_row;
 			}
 		}
 
-		// Cleanup
-		if (compressed_tile_data) {
-			free(compressed_tile_data);
+		if (cache_entry >= 0) {
+			tiff_strip_cache_release(tiff->strip_cache, cache_entry);
+		} else if (unit_pixels) {
+			free(unit_pixels);
 		}
-		if (compressed_strip_data) {
-			for (i32 i = 0; i < level_ifd->strip_count; ++i) {
-				free(compressed_strip_data[i]);
-			}
+	}
+	free(sums);
+
+	if (success) {
+		write_barrier;
+		pyramid->is_built = true;
+		console_print_verbose("[thread %d] built %d downsampled levels for stripped TIFF in %g seconds\n", logical_thread_index,
+		                      pyramid->level_count - pyramid->first_level, get_seconds_elapsed(start, get_clock()));
+	}
+	benaphore_unlock(&pyramid->build_lock);
+	return success;
+}
+
+u8* tiff_decode_tile(i32 logical_thread_index, tiff_t* tiff, tiff_ifd_t* level_ifd, i32 tile_index, i32 level, i32 tile_x, i32 tile_y) {
+
+	if (!level_ifd->is_tiled) {
+		if (tiff->strip_units_per_strip == 0) {
+			console_print_error("thread %d: failed to decode level %d, tile %d (%d, %d): image has no tiles or strips\n", logical_thread_index, level, tile_index, tile_x, tile_y);
+			return NULL;
 		}
-		if (decompressed) {
-			free(decompressed);
+		if (level > 0) {
+			return tiff_decode_virtual_level_tile(tiff, level, tile_x, tile_y);
+		} else {
+			return tiff_decode_stripped_tile(logical_thread_index, tiff, level_ifd, tile_x, tile_y);
 		}
+	}
 
-		return pixel_memory;
+	u64 tile_offset = level_ifd->tile_offsets[tile_index];
+	u64 compressed_tile_size_in_bytes = level_ifd->tile_byte_counts[tile_index];
+
+	// Some tiles apparently contain no data (not even an empty/dummy JPEG stream like some other tiles have).
+	// We need to check for this situation and chicken out if this is the case.
+	if (tile_offset == 0 || compressed_tile_size_in_bytes == 0) {
+#if DO_DEBUG
+		console_print("thread %d: tile level %d, tile %d (%d, %d) appears to be empty\n", logical_thread_index, level, tile_index, tile_x, tile_y);
+#endif
+		return NULL;
+	}
 
+	if (tiff->is_remote) {
+		console_print_verbose("[thread %d] remote tile requested: level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
+	}
+	u8* compressed_tile_data = tiff_read_chunk(logical_thread_index, tiff, tile_offset, compressed_tile_size_in_bytes);
+	if (!compressed_tile_data) {
+		console_print_error("[thread %d] failed to read level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
+		return NULL;
 	}
-	ASSERT(!"should not reach this code");
-	return NULL;
 
-	// Trim the tile (replace with transparent color) if it extends beyond the image size
-	// TODO: anti-alias edge?
-/*	i32 new_tile_height = level_image->tile_height;
-	i32 pitch = level_image->tile_width * BYTES_PER_PIXEL;
-	if (tile_y_excess > 0) {
-		i32 excess_rows = (int)((tile_y_excess / level_image->y_tile_side_in_um) * level_image->tile_height);
-		ASSERT(excess_rows >= 0);
-		new_tile_height = level_image->tile_height - excess_rows;
-		memset(pixel_memory + (new_tile_height * pitch), 0, excess_rows * pitch);
+	// Now decompress
+//	console_print_verbose("[thread %d] loading tile: level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
+	size_t pixel_memory_size = level_ifd->tile_width * level_ifd->tile_height * BYTES_PER_PIXEL;
+	u8* pixel_memory = (u8*)malloc(pixel_memory_size);
+	if (!tiff_decode_stream(level_ifd, compressed_tile_data, compressed_tile_size_in_bytes, pixel_memory, level_ifd->tile_width, level_ifd->tile_height)) {
+		console_print_error("thread %d: failed to decode level %d, tile %d (%d, %d)\n", logical_thread_index, level, tile_index, tile_x, tile_y);
+		free(pixel_memory);
+		pixel_memory = NULL;
 	}
-	if (tile_x_excess > 0) {
-		i32 excess_pixels = (int)((tile_x_excess / level_image->x_tile_side_in_um) * level_image->tile_width);
-		ASSERT(excess_pixels >= 0);
-		i32 new_tile_width = level_image->tile_width - excess_pixels;
-		for (i32 row = 0; row < new_tile_height; ++row) {
-			u8* write_pos = pixel_memory + (row * pitch) + (new_tile_width * BYTES_PER_PIXEL);
-			memset(write_pos, 0, excess_pixels * BYTES_PER_PIXEL);
-		}
-	}*/
+	free(compressed_tile_data);
+	return pixel_memory;
 }
+#endif // !IS_SERVER
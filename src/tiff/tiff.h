@@ -26,6 +26,7 @@ extern "C" {
 #include "common.h"
 #include "platform.h"
 #include "intrinsics.h"
+#include "benaphore.h"
 
 #ifndef IS_SERVER
 #define IS_SERVER 0
@@ -193,6 +194,7 @@ enum tiff_compression_enum {
 	TIFF_COMPRESSION_OJPEG = 6, // old-style JPEG -> ignore
 	TIFF_COMPRESSION_JPEG = 7,
 	TIFF_COMPRESSION_ADOBE_DEFLATE = 8,
+	TIFF_COMPRESSION_DEFLATE = 32946, // obsolete code for Deflate, still written by some software
 	TIFF_COMPRESSION_JP2000 = 34712,
 };
 
@@ -291,6 +293,49 @@ typedef struct tiff_ifd_t {
 } tiff_ifd_t;
 
 
+// Stripped (non-tiled) images are presented as if they were tiled, using tiles of this size.
+#define TIFF_VIRTUAL_TILE_SIZE 512
+#define TIFF_STRIP_CACHE_MAX_BYTES MEGABYTES(256)
+#define TIFF_VIRTUAL_PYRAMID_MAX_BYTES MEGABYTES(256)
+#define TIFF_MAX_VIRTUAL_LEVELS 16
+
+// A strip of a stripped image, decoded to BGRA (image_width pixels per row). Uncompressed strips are split up into
+// smaller units that can be read separately, so that huge single-strip images can still be cached piecemeal.
+typedef struct tiff_cached_strip_t {
+	i64 unit_index;
+	u32* pixels;
+	u64 size_in_bytes;
+	i32 refcount;
+	u64 last_used;
+} tiff_cached_strip_t;
+
+// LRU cache of decoded strips, shared by the worker threads. A row of virtual tiles is copied out of the band of
+// strips that covers it, so while panning horizontally the same strips are reused.
+typedef struct tiff_strip_cache_t {
+	benaphore_t lock;
+	tiff_cached_strip_t entries[256];
+	u64 total_bytes;
+	u64 use_counter;
+} tiff_strip_cache_t;
+
+typedef struct tiff_virtual_level_t {
+	u32 width;
+	u32 height;
+	u32* pixels; // BGRA
+	volatile i32 rows_done; // published while the pyramid is being built
+} tiff_virtual_level_t;
+
+// Downsampled levels for stripped images, built in the background in a single pass over the strips.
+// Only the levels that fit within TIFF_VIRTUAL_PYRAMID_MAX_BYTES are built; below first_level, tiles are taken
+// from level 0 instead.
+typedef struct tiff_virtual_pyramid_t {
+	i32 level_count; // including level 0 (which is not stored here)
+	i32 first_level;
+	tiff_virtual_level_t levels[TIFF_MAX_VIRTUAL_LEVELS];
+	benaphore_t build_lock;
+	volatile bool is_built;
+} tiff_virtual_pyramid_t;
+
 typedef struct network_location_t {
 	i32 portno;
 	const char* hostname;
@@ -325,6 +370,12 @@ struct tiff_t {
 	float mpp_x;
 	float mpp_y;
 	i32 max_downsample_level;
+	u32 strip_unit_rows; // rows per separately decodable unit of a stripped image (see tiff_cached_strip_t)
+	u32 strip_units_per_strip;
+#if !IS_SERVER
+	tiff_strip_cache_t* strip_cache; // only for stripped images
+	tiff_virtual_pyramid_t* virtual_pyramid; // only for stripped images
+#endif
 };
 
 #pragma pack(push, 1)
@@ -370,6 +421,13 @@ typedef struct {
 //	tiff_tile_t* tiles;
 } tiff_serial_ifd_t;
 
+typedef struct {
+	u64 strip_count;
+	u32 rows_per_strip;
+	u16 samples_per_pixel;
+	u16 predictor;
+} tiff_serial_strips_t;
+
 enum serial_block_type_enum {
 	SERIAL_BLOCK_LZ4_COMPRESSED_DATA = 4444,
 	SERIAL_BLOCK_TIFF_HEADER_AND_META = 9001, // using ridiculous numbers to make invalid file structure easier to detect
@@ -378,6 +436,7 @@ enum serial_block_type_enum {
 	SERIAL_BLOCK_TIFF_TILE_OFFSETS = 9004,
 	SERIAL_BLOCK_TIFF_TILE_BYTE_COUNTS = 9005,
 	SERIAL_BLOCK_TIFF_JPEG_TABLES = 9006,
+	SERIAL_BLOCK_TIFF_STRIPS = 9007, // tiff_serial_strips_t, followed by the strip offsets and strip byte counts
 	SERIAL_BLOCK_TERMINATOR = 800,
 };
 
@@ -396,6 +455,8 @@ i64 find_end_of_http_headers(u8* str, u64 len);
 bool32 tiff_deserialize(tiff_t* tiff, u8* buffer, u64 buffer_size);
 void tiff_destroy(tiff_t* tiff);
 u8* tiff_decode_tile(i32 logical_thread_index, tiff_t* tiff, tiff_ifd_t* level_ifd, i32 tile_index, i32 level, i32 tile_x, i32 tile_y);
+bool tiff_build_virtual_pyramid(tiff_t* tiff, i32 logical_thread_index, bool* cancel);
+bool tiff_is_virtual_tile_ready(tiff_t* tiff, i32 level, i32 tile_y);
 double tiff_rational_to_float(tiff_rational_t rational);
 tiff_rational_t float_to_tiff_rational(double x);
 
@@ -0,0 +1,400 @@
+/*
+  Slidescape, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2024  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Whole-buffer Deflate decoder, using the same general approach as libdeflate:
+// - a 64-bit bit buffer that is refilled with a single unaligned load, so that one refill covers a whole
+//   length/distance pair (at most 15 + 5 + 15 + 13 = 48 bits);
+// - table-driven Huffman decoding, where one lookup gives the symbol, its codeword length and the number of extra bits
+//   (codewords longer than the primary table size go through a second-level subtable);
+// - matches are copied 8 bytes at a time when they don't overlap too closely and there is enough room left.
+
+#include "common.h"
+#include "deflate_decoder.h"
+
+#define DEFLATE_MAX_CODEWORD_LENGTH 15
+#define DEFLATE_NUM_LITLEN_SYMBOLS 288
+#define DEFLATE_NUM_DIST_SYMBOLS 32
+#define DEFLATE_NUM_PRECODE_SYMBOLS 19
+
+#define DEFLATE_LITLEN_TABLE_BITS 11
+#define DEFLATE_DIST_TABLE_BITS 8
+#define DEFLATE_PRECODE_TABLE_BITS 7
+
+// Worst case: the primary table, plus a subtable (sized for the longest codeword) for each symbol that doesn't fit.
+#define DEFLATE_LITLEN_TABLE_SIZE ((1 << DEFLATE_LITLEN_TABLE_BITS) + DEFLATE_NUM_LITLEN_SYMBOLS * (1 << (DEFLATE_MAX_CODEWORD_LENGTH - DEFLATE_LITLEN_TABLE_BITS)))
+#define DEFLATE_DIST_TABLE_SIZE ((1 << DEFLATE_DIST_TABLE_BITS) + DEFLATE_NUM_DIST_SYMBOLS * (1 << (DEFLATE_MAX_CODEWORD_LENGTH - DEFLATE_DIST_TABLE_BITS)))
+#define DEFLATE_PRECODE_TABLE_SIZE (1 << DEFLATE_PRECODE_TABLE_BITS)
+
+// Decode table entries:
+// bits 0-7:   number of bits to consume (the codeword length, or the primary table bits for a subtable pointer)
+// bits 8-12:  number of extra bits (lengths and distances), or the number of index bits (subtable pointer)
+// bits 13-15: flags
+// bits 16-31: literal value, length or distance base, or subtable offset
+// An entry of zero is invalid (lengths and distances are never zero, literals have the literal flag set).
+#define DEFLATE_ENTRY_LITERAL 0x2000
+#define DEFLATE_ENTRY_END_OF_BLOCK 0x4000
+#define DEFLATE_ENTRY_SUBTABLE 0x8000
+#define DEFLATE_ENTRY(value, extra_bits, flags) (((u32)(value) << 16) | ((u32)(extra_bits) << 8) | (u32)(flags))
+
+typedef struct deflate_tables_t {
+	u32 litlen[DEFLATE_LITLEN_TABLE_SIZE];
+	u32 dist[DEFLATE_DIST_TABLE_SIZE];
+	u32 precode[DEFLATE_PRECODE_TABLE_SIZE];
+} deflate_tables_t;
+
+typedef struct deflate_bitstream_t {
+	const u8* next;
+	const u8* end;
+	u64 bitbuf;
+	i32 bitsleft;
+	i32 overread; // number of zero bytes 'read' past the end of the input
+} deflate_bitstream_t;
+
+static const u16 deflate_length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const u8 deflate_length_extra_bits[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const u16 deflate_dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+	6145, 8193, 12289, 16385, 24577
+};
+static const u8 deflate_dist_extra_bits[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const u8 deflate_precode_order[DEFLATE_NUM_PRECODE_SYMBOLS] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static inline u64 deflate_load_u64_le(const u8* p) {
+	u64 v;
+	memcpy(&v, p, sizeof(v)); // NOTE: assumes a little-endian CPU
+	return v;
+}
+
+// Make sure that at least 48 bits are available.
+static inline void deflate_refill(deflate_bitstream_t* bs) {
+	if (bs->bitsleft >= 48) return;
+	if (bs->end - bs->next >= 8) {
+		// Bits above bitsleft that don't fit in a whole byte are loaded again by the next refill (same bits, so harmless).
+		bs->bitbuf |= deflate_load_u64_le(bs->next) << bs->bitsleft;
+		i32 bytes = (63 - bs->bitsleft) >> 3;
+		bs->next += bytes;
+		bs->bitsleft += bytes << 3;
+	} else {
+		while (bs->bitsleft <= 56) {
+			if (bs->next < bs->end) {
+				bs->bitbuf |= (u64)(*bs->next++) << bs->bitsleft;
+			} else {
+				bs->overread++;
+			}
+			bs->bitsleft += 8;
+		}
+	}
+}
+
+static inline u32 deflate_pop_bits(deflate_bitstream_t* bs, i32 count) {
+	u32 bits = (u32)(bs->bitbuf & ((1ull << count) - 1));
+	bs->bitbuf >>= count;
+	bs->bitsleft -= count;
+	return bits;
+}
+
+static inline u32 deflate_decode_entry(deflate_bitstream_t* bs, const u32* table, i32 table_bits) {
+	u32 entry = table[bs->bitbuf & ((1u << table_bits) - 1)];
+	if (entry & DEFLATE_ENTRY_SUBTABLE) {
+		bs->bitbuf >>= table_bits;
+		bs->bitsleft -= table_bits;
+		entry = table[(entry >> 16) + (bs->bitbuf & ((1u << ((entry >> 8) & 0x1F)) - 1))];
+	}
+	u32 length = entry & 0xFF;
+	bs->bitbuf >>= length;
+	bs->bitsleft -= length;
+	return entry;
+}
+
+// Build a decode table from canonical Huffman codeword lengths. entry_templates give the entry for each symbol
+// (without the codeword length). Incomplete codes are allowed (unused entries stay invalid), oversubscribed codes are not.
+static bool deflate_build_table(u32* table, i32 table_bits, i32 max_table_size, const u8* lens, i32 symbol_count, const u32* entry_templates) {
+	u16 count[DEFLATE_MAX_CODEWORD_LENGTH + 1] = {0};
+	for (i32 sym = 0; sym < symbol_count; ++sym) {
+		count[lens[sym]]++;
+	}
+	count[0] = 0;
+
+	i32 max_len = 0;
+	i32 left = 1;
+	for (i32 len = 1; len <= DEFLATE_MAX_CODEWORD_LENGTH; ++len) {
+		left <<= 1;
+		left -= count[len];
+		if (left < 0) return false; // oversubscribed
+		if (count[len]) max_len = len;
+	}
+
+	u16 next_code[DEFLATE_MAX_CODEWORD_LENGTH + 1];
+	u32 code = 0;
+	for (i32 len = 1; len <= DEFLATE_MAX_CODEWORD_LENGTH; ++len) {
+		code = (code + count[len - 1]) << 1;
+		next_code[len] = (u16)code;
+	}
+
+	i32 primary_size = 1 << table_bits;
+	memset(table, 0, primary_size * sizeof(u32));
+	i32 subtable_bits = max_len - table_bits;
+	i32 next_subtable = primary_size;
+
+	for (i32 sym = 0; sym < symbol_count; ++sym) {
+		i32 len = lens[sym];
+		if (len == 0) continue;
+		// Deflate codes are packed starting with the most significant bit, so the table is indexed by the reversed codeword.
+		u32 codeword = next_code[len]++;
+		u32 reversed = 0;
+		for (i32 i = 0; i < len; ++i) {
+			reversed = (reversed << 1) | ((codeword >> i) & 1);
+		}
+		if (len <= table_bits) {
+			u32 entry = entry_templates[sym] | (u32)len;
+			for (u32 i = reversed; i < (u32)primary_size; i += (1u << len)) {
+				table[i] = entry;
+			}
+		} else {
+			u32 prefix = reversed & (primary_size - 1);
+			if (!(table[prefix] & DEFLATE_ENTRY_SUBTABLE)) {
+				if (next_subtable + (1 << subtable_bits) > max_table_size) return false;
+				table[prefix] = DEFLATE_ENTRY(next_subtable, subtable_bits, DEFLATE_ENTRY_SUBTABLE) | (u32)table_bits;
+				memset(table + next_subtable, 0, (1 << subtable_bits) * sizeof(u32));
+				next_subtable += 1 << subtable_bits;
+			}
+			u32* subtable = table + (table[prefix] >> 16);
+			i32 sub_len = len - table_bits;
+			u32 entry = entry_templates[sym] | (u32)sub_len;
+			for (u32 i = reversed >> table_bits; i < (1u << subtable_bits); i += (1u << sub_len)) {
+				subtable[i] = entry;
+			}
+		}
+	}
+	return true;
+}
+
+static bool deflate_build_litlen_and_dist_tables(deflate_tables_t* tables, const u8* litlen_lens, i32 litlen_count, const u8* dist_lens, i32 dist_count) {
+	u32 litlen_templates[DEFLATE_NUM_LITLEN_SYMBOLS];
+	u32 dist_templates[DEFLATE_NUM_DIST_SYMBOLS];
+	for (i32 i = 0; i < 256; ++i) {
+		litlen_templates[i] = DEFLATE_ENTRY(i, 0, DEFLATE_ENTRY_LITERAL);
+	}
+	litlen_templates[256] = DEFLATE_ENTRY(0, 0, DEFLATE_ENTRY_END_OF_BLOCK);
+	for (i32 i = 0; i < 29; ++i) {
+		litlen_templates[257 + i] = DEFLATE_ENTRY(deflate_length_base[i], deflate_length_extra_bits[i], 0);
+	}
+	litlen_templates[286] = litlen_templates[287] = 0; // invalid
+	for (i32 i = 0; i < 30; ++i) {
+		dist_templates[i] = DEFLATE_ENTRY(deflate_dist_base[i], deflate_dist_extra_bits[i], 0);
+	}
+	dist_templates[30] = dist_templates[31] = 0; // invalid
+	return deflate_build_table(tables->litlen, DEFLATE_LITLEN_TABLE_BITS, DEFLATE_LITLEN_TABLE_SIZE, litlen_lens, litlen_count, litlen_templates) &&
+	       deflate_build_table(tables->dist, DEFLATE_DIST_TABLE_BITS, DEFLATE_DIST_TABLE_SIZE, dist_lens, dist_count, dist_templates);
+}
+
+static bool deflate_read_dynamic_tables(deflate_bitstream_t* bs, deflate_tables_t* tables) {
+	u32 precode_templates[DEFLATE_NUM_PRECODE_SYMBOLS];
+	for (i32 i = 0; i < DEFLATE_NUM_PRECODE_SYMBOLS; ++i) {
+		precode_templates[i] = DEFLATE_ENTRY(i, 0, DEFLATE_ENTRY_LITERAL);
+	}
+
+	deflate_refill(bs);
+	i32 litlen_count = (i32)deflate_pop_bits(bs, 5) + 257;
+	i32 dist_count = (i32)deflate_pop_bits(bs, 5) + 1;
+	i32 precode_count = (i32)deflate_pop_bits(bs, 4) + 4;
+	if (litlen_count > 286 || dist_count > 30) return false;
+
+	u8 precode_lens[DEFLATE_NUM_PRECODE_SYMBOLS] = {0};
+	for (i32 i = 0; i < precode_count; ++i) {
+		deflate_refill(bs);
+		precode_lens[deflate_precode_order[i]] = (u8)deflate_pop_bits(bs, 3);
+	}
+	if (!deflate_build_table(tables->precode, DEFLATE_PRECODE_TABLE_BITS, DEFLATE_PRECODE_TABLE_SIZE, precode_lens, DEFLATE_NUM_PRECODE_SYMBOLS, precode_templates)) {
+		return false;
+	}
+
+	u8 lens[DEFLATE_NUM_LITLEN_SYMBOLS + DEFLATE_NUM_DIST_SYMBOLS];
+	i32 total_count = litlen_count + dist_count;
+	i32 i = 0;
+	while (i < total_count) {
+		deflate_refill(bs);
+		if (bs->overread > 8) return false;
+		u32 entry = deflate_decode_entry(bs, tables->precode, DEFLATE_PRECODE_TABLE_BITS);
+		if (!(entry & DEFLATE_ENTRY_LITERAL)) return false;
+		u32 sym = entry >> 16;
+		if (sym < 16) {
+			lens[i++] = (u8)sym;
+			continue;
+		}
+		u8 value = 0;
+		i32 repeat;
+		if (sym == 16) {
+			if (i == 0) return false;
+			value = lens[i - 1];
+			repeat = 3 + (i32)deflate_pop_bits(bs, 2);
+		} else if (sym == 17) {
+			repeat = 3 + (i32)deflate_pop_bits(bs, 3);
+		} else {
+			repeat = 11 + (i32)deflate_pop_bits(bs, 7);
+		}
+		if (i + repeat > total_count) return false;
+		memset(lens + i, value, repeat);
+		i += repeat;
+	}
+	if (lens[256] == 0) return false; // there must be an end-of-block code
+	return deflate_build_litlen_and_dist_tables(tables, lens, litlen_count, lens + litlen_count, dist_count);
+}
+
+static bool deflate_build_fixed_tables(deflate_tables_t* tables) {
+	u8 lens[DEFLATE_NUM_LITLEN_SYMBOLS + DEFLATE_NUM_DIST_SYMBOLS];
+	i32 i = 0;
+	for (; i < 144; ++i) lens[i] = 8;
+	for (; i < 256; ++i) lens[i] = 9;
+	for (; i < 280; ++i) lens[i] = 7;
+	for (; i < 288; ++i) lens[i] = 8;
+	for (; i < 288 + 32; ++i) lens[i] = 5;
+	return deflate_build_litlen_and_dist_tables(tables, lens, DEFLATE_NUM_LITLEN_SYMBOLS, lens + DEFLATE_NUM_LITLEN_SYMBOLS, DEFLATE_NUM_DIST_SYMBOLS);
+}
+
+bool deflate_decode(const u8* src, size_t src_size, u8* dest, size_t dest_size, bool has_zlib_header, size_t* bytes_written) {
+	if (bytes_written) *bytes_written = 0;
+	if (has_zlib_header) {
+		if (src_size < 2) return false;
+		u8 cmf = src[0];
+		u8 flg = src[1];
+		if ((cmf & 0x0F) != 8 || (cmf >> 4) > 7 || (((u32)cmf << 8) | flg) % 31 != 0 || (flg & 0x20) /* preset dictionary */) {
+			return false;
+		}
+		src += 2;
+		src_size -= 2;
+	}
+
+	deflate_tables_t tables; // ~44 KB on the stack
+	deflate_bitstream_t bs = {.next = src, .end = src + src_size};
+	u8* op = dest;
+	u8* op_end = dest + dest_size;
+	bool is_final_block = false;
+	bool success = true;
+
+	while (!is_final_block && op < op_end) {
+		deflate_refill(&bs);
+		if (bs.overread > 8) { success = false; break; }
+		is_final_block = deflate_pop_bits(&bs, 1);
+		u32 block_type = deflate_pop_bits(&bs, 2);
+
+		if (block_type == 0) {
+			// Stored block: discard the remaining bits of the current byte, and return any whole bytes still in the bit buffer.
+			deflate_pop_bits(&bs, bs.bitsleft & 7);
+			i32 unread_bytes = (bs.bitsleft >> 3) - bs.overread;
+			if (unread_bytes < 0) { success = false; break; }
+			bs.next -= unread_bytes;
+			bs.bitbuf = 0;
+			bs.bitsleft = 0;
+			bs.overread = 0;
+			if (bs.end - bs.next < 4) { success = false; break; }
+			u16 len = (u16)(bs.next[0] | (bs.next[1] << 8));
+			u16 nlen = (u16)(bs.next[2] | (bs.next[3] << 8));
+			bs.next += 4;
+			if (len != (u16)~nlen || bs.end - bs.next < len) { success = false; break; }
+			size_t copy_size = MIN((size_t)len, (size_t)(op_end - op));
+			memcpy(op, bs.next, copy_size);
+			op += copy_size;
+			bs.next += len;
+			continue;
+		} else if (block_type == 1) {
+			if (!deflate_build_fixed_tables(&tables)) { success = false; break; }
+		} else if (block_type == 2) {
+			if (!deflate_read_dynamic_tables(&bs, &tables)) { success = false; break; }
+		} else {
+			success = false;
+			break;
+		}
+
+		for (;;) {
+			deflate_refill(&bs);
+			if (bs.overread > 8) { success = false; goto done; }
+			u32 entry = deflate_decode_entry(&bs, tables.litlen, DEFLATE_LITLEN_TABLE_BITS);
+			if (entry & DEFLATE_ENTRY_LITERAL) {
+				// Literals tend to come in runs; after a refill there are enough bits for a second codeword.
+				if (op == op_end) goto done; // output is full
+				*op++ = (u8)(entry >> 16);
+				entry = deflate_decode_entry(&bs, tables.litlen, DEFLATE_LITLEN_TABLE_BITS);
+				if (entry & DEFLATE_ENTRY_LITERAL) {
+					if (op == op_end) goto done;
+					*op++ = (u8)(entry >> 16);
+					continue;
+				}
+			}
+			if (entry & DEFLATE_ENTRY_END_OF_BLOCK) {
+				break;
+			}
+			u32 length = entry >> 16;
+			if (length == 0) { success = false; goto done; }
+			if (bs.bitsleft < 5 + 15 + 13) deflate_refill(&bs);
+			length += deflate_pop_bits(&bs, (entry >> 8) & 0x1F);
+
+			entry = deflate_decode_entry(&bs, tables.dist, DEFLATE_DIST_TABLE_BITS);
+			u32 distance = entry >> 16;
+			if (distance == 0) { success = false; goto done; }
+			distance += deflate_pop_bits(&bs, (entry >> 8) & 0x1F);
+			if (distance > (size_t)(op - dest)) { success = false; goto done; }
+
+			bool is_truncated = false;
+			if (length > (size_t)(op_end - op)) {
+				length = (u32)(op_end - op);
+				is_truncated = true;
+			}
+			const u8* match = op - distance;
+			if (distance >= 8 && (size_t)(op_end - op) >= length + 8) {
+				// Copy 8 bytes at a time; this may write up to 7 bytes past the end of the match, which is fine
+				// because there is room, and those bytes will be overwritten later.
+				u8* copy_end = op + length;
+				do {
+					u64 v;
+					memcpy(&v, match, 8);
+					memcpy(op, &v, 8);
+					op += 8;
+					match += 8;
+				} while (op < copy_end);
+				op = copy_end;
+			} else if (distance == 1) {
+				memset(op, *match, length);
+				op += length;
+			} else {
+				for (u32 i = 0; i < length; ++i) {
+					op[i] = match[i];
+				}
+				op += length;
+			}
+			if (is_truncated) goto done;
+		}
+	}
+
+	// If we needed more zero padding than there are unused bytes left in the bit buffer, the input was truncated.
+	if (success && op < op_end && bs.overread > (bs.bitsleft >> 3)) {
+		success = false;
+	}
+
+	done:
+	if (bytes_written) *bytes_written = (size_t)(op - dest);
+	return success;
+}
@@ -0,0 +1,35 @@
+/*
+  Slidescape, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2024  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// Decompresses a complete Deflate stream (RFC 1951), optionally wrapped in a zlib header (RFC 1950), in one go.
+// Because the whole output buffer is available, matches are copied directly from the output (no sliding window).
+// Decoding stops when the end of the stream is reached or when dest is full, whichever comes first.
+// Returns false if the stream is corrupt or truncated. The zlib Adler-32 checksum is not verified.
+bool deflate_decode(const u8* src, size_t src_size, u8* dest, size_t dest_size, bool has_zlib_header, size_t* bytes_written);
+
+#ifdef __cplusplus
+}
+#endif
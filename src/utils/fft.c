@@ -0,0 +1,422 @@
+/*
+  Slidescape, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2024  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "intrinsics.h"
+#include "fft.h"
+
+// Stockham autosort FFT, see:
+// Govindaraju et al., High Performance Discrete Fourier Transforms on Graphics Processors (2008)
+//
+// The 2D transforms work on two columns at a time, so that each butterfly operates on a vector of two complex numbers
+// (one SSE register). The rows are transformed the same way, after a transpose.
+
+#define FFT_MAX_STAGES 32
+#define FFT_MAX_CACHED_PLANS 16
+
+typedef struct fft_plan_t {
+	i32 n;
+	i32 stage_count;
+	i32 radices[FFT_MAX_STAGES];
+	i32 twiddle_offsets[FFT_MAX_STAGES];
+	float* twiddles; // for each stage: for each k in [0, Ns): for each r in [1, R): (re, im)
+	u64 last_used;
+} fft_plan_t;
+
+typedef struct fft_thread_cache_t {
+	fft_plan_t plans[FFT_MAX_CACHED_PLANS];
+	i32 plan_count;
+	u64 use_counter;
+	void* scratch_raw[FFT_SCRATCH_SLOT_COUNT];
+	void* scratch[FFT_SCRATCH_SLOT_COUNT];
+	size_t scratch_size[FFT_SCRATCH_SLOT_COUNT];
+} fft_thread_cache_t;
+
+static THREAD_LOCAL fft_thread_cache_t* fft_thread_cache;
+
+#if defined(__SSE2__)
+
+typedef __m128 cvec_t; // two complex numbers: (re0, im0, re1, im1)
+
+static inline cvec_t cvec_load(const float* p) { return _mm_loadu_ps(p); }
+static inline void cvec_store(float* p, cvec_t a) { _mm_storeu_ps(p, a); }
+static inline cvec_t cvec_load_single(const float* p) { return _mm_castpd_ps(_mm_load_sd((const double*)p)); }
+static inline void cvec_store_single(float* p, cvec_t a) { _mm_store_sd((double*)p, _mm_castps_pd(a)); }
+static inline cvec_t cvec_add(cvec_t a, cvec_t b) { return _mm_add_ps(a, b); }
+static inline cvec_t cvec_sub(cvec_t a, cvec_t b) { return _mm_sub_ps(a, b); }
+static inline cvec_t cvec_scale(cvec_t a, float s) { return _mm_mul_ps(a, _mm_set1_ps(s)); }
+static inline cvec_t cvec_conj(cvec_t a) { return _mm_xor_ps(a, _mm_setr_ps(0.0f, -0.0f, 0.0f, -0.0f)); }
+
+// (re, im) * -i = (im, -re)
+static inline cvec_t cvec_mul_minus_i(cvec_t a) {
+	cvec_t swapped = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+	return _mm_xor_ps(swapped, _mm_setr_ps(0.0f, -0.0f, 0.0f, -0.0f));
+}
+
+// Multiply both complex numbers by the same complex factor w = (re, im)
+static inline cvec_t cvec_mul(cvec_t a, const float* w) {
+	cvec_t swapped = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+	cvec_t t = _mm_mul_ps(swapped, _mm_set1_ps(w[1]));
+	t = _mm_xor_ps(t, _mm_setr_ps(-0.0f, 0.0f, -0.0f, 0.0f));
+	return _mm_add_ps(_mm_mul_ps(a, _mm_set1_ps(w[0])), t);
+}
+
+#else
+
+typedef struct cvec_t {
+	float v[4];
+} cvec_t;
+
+static inline cvec_t cvec_load(const float* p) { cvec_t r = {{p[0], p[1], p[2], p[3]}}; return r; }
+static inline void cvec_store(float* p, cvec_t a) { p[0] = a.v[0]; p[1] = a.v[1]; p[2] = a.v[2]; p[3] = a.v[3]; }
+static inline cvec_t cvec_load_single(const float* p) { cvec_t r = {{p[0], p[1], 0.0f, 0.0f}}; return r; }
+static inline void cvec_store_single(float* p, cvec_t a) { p[0] = a.v[0]; p[1] = a.v[1]; }
+static inline cvec_t cvec_add(cvec_t a, cvec_t b) { cvec_t r; for (i32 i = 0; i < 4; ++i) r.v[i] = a.v[i] + b.v[i]; return r; }
+static inline cvec_t cvec_sub(cvec_t a, cvec_t b) { cvec_t r; for (i32 i = 0; i < 4; ++i) r.v[i] = a.v[i] - b.v[i]; return r; }
+static inline cvec_t cvec_scale(cvec_t a, float s) { cvec_t r; for (i32 i = 0; i < 4; ++i) r.v[i] = a.v[i] * s; return r; }
+static inline cvec_t cvec_conj(cvec_t a) { cvec_t r = {{a.v[0], -a.v[1], a.v[2], -a.v[3]}}; return r; }
+static inline cvec_t cvec_mul_minus_i(cvec_t a) { cvec_t r = {{a.v[1], -a.v[0], a.v[3], -a.v[2]}}; return r; }
+static inline cvec_t cvec_mul(cvec_t a, const float* w) {
+	cvec_t r = {{a.v[0] * w[0] - a.v[1] * w[1], a.v[0] * w[1] + a.v[1] * w[0],
+	             a.v[2] * w[0] - a.v[3] * w[1], a.v[2] * w[1] + a.v[3] * w[0]}};
+	return r;
+}
+
+#endif
+
+// Smallest even size >= n that only has factors 2, 3 and 5.
+i32 fft_next_fast_size(i32 n) {
+	if (n <= 2) return 2;
+	for (i32 size = n + (n & 1); ; size += 2) {
+		i32 m = size;
+		while (m % 2 == 0) m /= 2;
+		while (m % 3 == 0) m /= 3;
+		while (m % 5 == 0) m /= 5;
+		if (m == 1) return size;
+	}
+}
+
+static fft_thread_cache_t* fft_get_thread_cache() {
+	if (!fft_thread_cache) {
+		fft_thread_cache = calloc(1, sizeof(fft_thread_cache_t));
+	}
+	return fft_thread_cache;
+}
+
+// Scratch memory that persists between calls on the same thread (64-byte aligned).
+void* fft_get_scratch(i32 slot, size_t size) {
+	ASSERT(slot >= 0 && slot < FFT_SCRATCH_SLOT_COUNT);
+	fft_thread_cache_t* cache = fft_get_thread_cache();
+	if (cache->scratch_size[slot] < size) {
+		free(cache->scratch_raw[slot]);
+		cache->scratch_raw[slot] = malloc(size + 63);
+		cache->scratch[slot] = (void*)(((uintptr_t)cache->scratch_raw[slot] + 63) & ~(uintptr_t)63);
+		cache->scratch_size[slot] = size;
+	}
+	return cache->scratch[slot];
+}
+
+void fft_release_scratch() {
+	fft_thread_cache_t* cache = fft_thread_cache;
+	if (cache) {
+		for (i32 slot = 0; slot < FFT_SCRATCH_SLOT_COUNT; ++slot) {
+			free(cache->scratch_raw[slot]);
+			cache->scratch_raw[slot] = NULL;
+			cache->scratch[slot] = NULL;
+			cache->scratch_size[slot] = 0;
+		}
+	}
+}
+
+static void fft_plan_init(fft_plan_t* plan, i32 n) {
+	memset(plan, 0, sizeof(*plan));
+	plan->n = n;
+	i32 m = n;
+	while (m % 4 == 0) { plan->radices[plan->stage_count++] = 4; m /= 4; }
+	while (m % 2 == 0) { plan->radices[plan->stage_count++] = 2; m /= 2; }
+	while (m % 3 == 0) { plan->radices[plan->stage_count++] = 3; m /= 3; }
+	while (m % 5 == 0) { plan->radices[plan->stage_count++] = 5; m /= 5; }
+	if (m != 1) {
+		fatal_error("FFT size has factors other than 2, 3 and 5");
+	}
+
+	i32 twiddle_count = 0;
+	i32 Ns = 1;
+	for (i32 stage = 0; stage < plan->stage_count; ++stage) {
+		i32 R = plan->radices[stage];
+		plan->twiddle_offsets[stage] = twiddle_count;
+		twiddle_count += Ns * (R - 1);
+		Ns *= R;
+	}
+	plan->twiddles = malloc(MAX(1, twiddle_count) * 2 * sizeof(float));
+	Ns = 1;
+	for (i32 stage = 0; stage < plan->stage_count; ++stage) {
+		i32 R = plan->radices[stage];
+		float* w = plan->twiddles + 2 * plan->twiddle_offsets[stage];
+		for (i32 k = 0; k < Ns; ++k) {
+			double angle = -2.0 * 3.14159265358979323846 * (double)k / (double)(Ns * R);
+			for (i32 r = 1; r < R; ++r) {
+				*w++ = (float)cos(angle * r);
+				*w++ = (float)sin(angle * r);
+			}
+		}
+		Ns *= R;
+	}
+}
+
+static fft_plan_t* fft_get_plan(i32 n) {
+	fft_thread_cache_t* cache = fft_get_thread_cache();
+	++cache->use_counter;
+	fft_plan_t* least_recently_used = NULL;
+	for (i32 i = 0; i < cache->plan_count; ++i) {
+		fft_plan_t* plan = cache->plans + i;
+		if (plan->n == n) {
+			plan->last_used = cache->use_counter;
+			return plan;
+		}
+		if (!least_recently_used || plan->last_used < least_recently_used->last_used) {
+			least_recently_used = plan;
+		}
+	}
+	fft_plan_t* plan = NULL;
+	if (cache->plan_count < FFT_MAX_CACHED_PLANS) {
+		plan = cache->plans + cache->plan_count++;
+	} else {
+		plan = least_recently_used;
+		free(plan->twiddles);
+	}
+	fft_plan_init(plan, n);
+	plan->last_used = cache->use_counter;
+	return plan;
+}
+
+static void fft_stage(fft_plan_t* plan, i32 stage, i32 Ns, const cvec_t* in, cvec_t* out) {
+	i32 R = plan->radices[stage];
+	i32 m = plan->n / R;
+	const float* twiddles = plan->twiddles + 2 * plan->twiddle_offsets[stage];
+	switch (R) {
+		case 2: {
+			for (i32 base = 0; base < m; base += Ns) {
+				for (i32 k = 0; k < Ns; ++k) {
+					i32 j = base + k;
+					const float* w = twiddles + 2 * k;
+					cvec_t v0 = in[j];
+					cvec_t v1 = cvec_mul(in[j + m], w);
+					cvec_t* dst = out + base * 2 + k;
+					dst[0] = cvec_add(v0, v1);
+					dst[Ns] = cvec_sub(v0, v1);
+				}
+			}
+		} break;
+		case 3: {
+			const float s = -0.86602540378443864676f; // -sin(2*pi/3)
+			for (i32 base = 0; base < m; base += Ns) {
+				for (i32 k = 0; k < Ns; ++k) {
+					i32 j = base + k;
+					const float* w = twiddles + 4 * k;
+					cvec_t v0 = in[j];
+					cvec_t v1 = cvec_mul(in[j + m], w);
+					cvec_t v2 = cvec_mul(in[j + 2 * m], w + 2);
+					cvec_t sum = cvec_add(v1, v2);
+					cvec_t t1 = cvec_sub(v0, cvec_scale(sum, 0.5f));
+					// -i * sin(2*pi/3) * (v1 - v2)
+					cvec_t t2 = cvec_mul_minus_i(cvec_scale(cvec_sub(v1, v2), -s));
+					cvec_t* dst = out + base * 3 + k;
+					dst[0] = cvec_add(v0, sum);
+					dst[Ns] = cvec_add(t1, t2);
+					dst[2 * Ns] = cvec_sub(t1, t2);
+				}
+			}
+		} break;
+		case 4: {
+			for (i32 base = 0; base < m; base += Ns) {
+				for (i32 k = 0; k < Ns; ++k) {
+					i32 j = base + k;
+					const float* w = twiddles + 6 * k;
+					cvec_t v0 = in[j];
+					cvec_t v1 = cvec_mul(in[j + m], w);
+					cvec_t v2 = cvec_mul(in[j + 2 * m], w + 2);
+					cvec_t v3 = cvec_mul(in[j + 3 * m], w + 4);
+					cvec_t a0 = cvec_add(v0, v2);
+					cvec_t a1 = cvec_sub(v0, v2);
+					cvec_t a2 = cvec_add(v1, v3);
+					cvec_t a3 = cvec_mul_minus_i(cvec_sub(v1, v3));
+					cvec_t* dst = out + base * 4 + k;
+					dst[0] = cvec_add(a0, a2);
+					dst[Ns] = cvec_add(a1, a3);
+					dst[2 * Ns] = cvec_sub(a0, a2);
+					dst[3 * Ns] = cvec_sub(a1, a3);
+				}
+			}
+		} break;
+		case 5: {
+			const float c1 = 0.30901699437494742410f;  // cos(2*pi/5)
+			const float c2 = -0.80901699437494742410f; // cos(4*pi/5)
+			const float s1 = 0.95105651629515357212f;  // sin(2*pi/5)
+			const float s2 = 0.58778525229247312917f;  // sin(4*pi/5)
+			for (i32 base = 0; base < m; base += Ns) {
+				for (i32 k = 0; k < Ns; ++k) {
+					i32 j = base + k;
+					const float* w = twiddles + 8 * k;
+					cvec_t v0 = in[j];
+					cvec_t v1 = cvec_mul(in[j + m], w);
+					cvec_t v2 = cvec_mul(in[j + 2 * m], w + 2);
+					cvec_t v3 = cvec_mul(in[j + 3 * m], w + 4);
+					cvec_t v4 = cvec_mul(in[j + 4 * m], w + 6);
+					cvec_t a1 = cvec_add(v1, v4);
+					cvec_t b1 = cvec_sub(v1, v4);
+					cvec_t a2 = cvec_add(v2, v3);
+					cvec_t b2 = cvec_sub(v2, v3);
+					cvec_t t1 = cvec_add(v0, cvec_add(cvec_scale(a1, c1), cvec_scale(a2, c2)));
+					cvec_t t2 = cvec_add(v0, cvec_add(cvec_scale(a1, c2), cvec_scale(a2, c1)));
+					cvec_t u1 = cvec_mul_minus_i(cvec_add(cvec_scale(b1, s1), cvec_scale(b2, s2)));
+					cvec_t u2 = cvec_mul_minus_i(cvec_sub(cvec_scale(b1, s2), cvec_scale(b2, s1)));
+					cvec_t* dst = out + base * 5 + k;
+					dst[0] = cvec_add(v0, cvec_add(a1, a2));
+					dst[Ns] = cvec_add(t1, u1);
+					dst[2 * Ns] = cvec_add(t2, u2);
+					dst[3 * Ns] = cvec_sub(t2, u2);
+					dst[4 * Ns] = cvec_sub(t1, u1);
+				}
+			}
+		} break;
+		default: {
+			fatal_error("unsupported FFT radix");
+		} break;
+	}
+}
+
+// Returns the buffer (buf0 or buf1) that contains the result.
+static cvec_t* fft_execute(fft_plan_t* plan, cvec_t* buf0, cvec_t* buf1) {
+	cvec_t* in = buf0;
+	cvec_t* out = buf1;
+	i32 Ns = 1;
+	for (i32 stage = 0; stage < plan->stage_count; ++stage) {
+		fft_stage(plan, stage, Ns, in, out);
+		Ns *= plan->radices[stage];
+		cvec_t* temp = in;
+		in = out;
+		out = temp;
+	}
+	return in;
+}
+
+#define FFT_COLUMN_BLOCK 8 // columns gathered at a time (one 64-byte cache line per row)
+
+// Transform each column (of length rows) of a rows x cols array of complex numbers, two columns at a time.
+static void fft_columns(float* data, i32 rows, i32 cols) {
+	fft_plan_t* plan = fft_get_plan(rows);
+	const i32 vectors_per_block = FFT_COLUMN_BLOCK / 2;
+	cvec_t* gathered = fft_get_scratch(FFT_SCRATCH_WORK, (vectors_per_block + 1) * rows * sizeof(cvec_t));
+	cvec_t* temp = gathered + vectors_per_block * rows;
+	size_t row_stride = 2 * cols;
+	i32 col = 0;
+	for (; col + FFT_COLUMN_BLOCK <= cols; col += FFT_COLUMN_BLOCK) {
+		// Gather a block of columns; reading along the columns one pair at a time would thrash the cache
+		float* src = data + 2 * col;
+		for (i32 y = 0; y < rows; ++y) {
+			float* row = src + y * row_stride;
+			for (i32 v = 0; v < vectors_per_block; ++v) {
+				gathered[v * rows + y] = cvec_load(row + 4 * v);
+			}
+		}
+		for (i32 v = 0; v < vectors_per_block; ++v) {
+			cvec_t* result = fft_execute(plan, gathered + v * rows, temp);
+			if (result != gathered + v * rows) {
+				memcpy(gathered + v * rows, result, rows * sizeof(cvec_t));
+			}
+		}
+		for (i32 y = 0; y < rows; ++y) {
+			float* row = src + y * row_stride;
+			for (i32 v = 0; v < vectors_per_block; ++v) {
+				cvec_store(row + 4 * v, gathered[v * rows + y]);
+			}
+		}
+	}
+	// Remaining columns
+	cvec_t* buf0 = gathered;
+	cvec_t* buf1 = temp;
+	for (; col + 2 <= cols; col += 2) {
+		float* src = data + 2 * col;
+		for (i32 y = 0; y < rows; ++y) {
+			buf0[y] = cvec_load(src + y * row_stride);
+		}
+		cvec_t* result = fft_execute(plan, buf0, buf1);
+		for (i32 y = 0; y < rows; ++y) {
+			cvec_store(src + y * row_stride, result[y]);
+		}
+	}
+	if (col < cols) {
+		// odd number of columns: transform the last one on its own
+		float* src = data + 2 * col;
+		for (i32 y = 0; y < rows; ++y) {
+			buf0[y] = cvec_load_single(src + y * row_stride);
+		}
+		cvec_t* result = fft_execute(plan, buf0, buf1);
+		for (i32 y = 0; y < rows; ++y) {
+			cvec_store_single(src + y * row_stride, result[y]);
+		}
+	}
+}
+
+// Transpose a rows x cols array of complex numbers (blocked, for cache efficiency).
+static void fft_transpose(const float* src, float* dst, i32 rows, i32 cols) {
+	const i32 block = 16;
+	const u64* s = (const u64*)src; // one complex number = 8 bytes
+	u64* d = (u64*)dst;
+	for (i32 y0 = 0; y0 < rows; y0 += block) {
+		i32 y1 = MIN(rows, y0 + block);
+		for (i32 x0 = 0; x0 < cols; x0 += block) {
+			i32 x1 = MIN(cols, x0 + block);
+			for (i32 y = y0; y < y1; ++y) {
+				for (i32 x = x0; x < x1; ++x) {
+					d[(i64)x * rows + y] = s[(i64)y * cols + x];
+				}
+			}
+		}
+	}
+}
+
+static void fft_conjugate(float* data, i64 count) {
+	i64 i = 0;
+	for (; i + 2 <= count; i += 2) {
+		cvec_store(data + 2 * i, cvec_conj(cvec_load(data + 2 * i)));
+	}
+	for (; i < count; ++i) {
+		data[2 * i + 1] = -data[2 * i + 1];
+	}
+}
+
+// Forward 2D transform of an h x w array of complex numbers (data is overwritten).
+// The result is stored transposed: transposed_out[kx * h + ky].
+void fft_2d_forward(float* data, i32 w, i32 h, float* transposed_out) {
+	fft_columns(data, h, w);
+	fft_transpose(data, transposed_out, h, w);
+	fft_columns(transposed_out, w, h);
+}
+
+// Inverse (unnormalized) 2D transform of a transposed spectrum, as produced by fft_2d_forward() (transposed_data is overwritten).
+// The result is an h x w array of complex numbers.
+void fft_2d_inverse(float* transposed_data, i32 w, i32 h, float* out) {
+	// inverse FFT(x) = conj(FFT(conj(x)))
+	fft_conjugate(transposed_data, (i64)w * h);
+	fft_columns(transposed_data, w, h);
+	fft_transpose(transposed_data, out, w, h);
+	fft_columns(out, h, w);
+	fft_conjugate(out, (i64)w * h);
+}
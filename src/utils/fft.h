@@ -0,0 +1,47 @@
+/*
+  Slidescape, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2024  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// Mixed-radix (2, 3, 4, 5) complex FFT.
+// Complex numbers are stored as interleaved (re, im) pairs of floats.
+// Plans and scratch memory are cached per thread, so repeated transforms of the same size do not allocate.
+
+enum fft_scratch_slot_enum {
+	FFT_SCRATCH_WORK = 0, // used internally by the 2D transforms
+	FFT_SCRATCH_USER_0 = 1,
+	FFT_SCRATCH_USER_1 = 2,
+	FFT_SCRATCH_USER_2 = 3,
+	FFT_SCRATCH_SLOT_COUNT,
+};
+
+i32 fft_next_fast_size(i32 n);
+void* fft_get_scratch(i32 slot, size_t size);
+void fft_release_scratch();
+void fft_2d_forward(float* data, i32 w, i32 h, float* transposed_out);
+void fft_2d_inverse(float* transposed_data, i32 w, i32 h, float* out);
+
+#ifdef __cplusplus
+}
+#endif
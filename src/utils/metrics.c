@@ -0,0 +1,114 @@
+/*
+  Slidescape, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2024  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "metrics.h"
+
+static i32 latency_histogram_get_bucket_index(i64 value) {
+	if (value < LATENCY_HISTOGRAM_SUB_BUCKET_COUNT) {
+		return (i32)MAX(value, 0);
+	}
+	if (value >= (1LL << LATENCY_HISTOGRAM_MAX_VALUE_BITS)) {
+		return LATENCY_HISTOGRAM_BUCKET_COUNT - 1;
+	}
+	i32 highest_bit = (i32)bit_scan_reverse_u64((u64)value);
+	i32 shift = highest_bit - LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+	i32 sub_bucket = (i32)(value >> shift) - LATENCY_HISTOGRAM_SUB_BUCKET_COUNT; // the bits below the highest bit
+	return (shift + 1) * LATENCY_HISTOGRAM_SUB_BUCKET_COUNT + sub_bucket;
+}
+
+// The largest value that ends up in this bucket.
+static i64 latency_histogram_get_bucket_upper_bound(i32 index) {
+	if (index < LATENCY_HISTOGRAM_SUB_BUCKET_COUNT) {
+		return index;
+	}
+	i32 shift = index / LATENCY_HISTOGRAM_SUB_BUCKET_COUNT - 1;
+	i64 mantissa = LATENCY_HISTOGRAM_SUB_BUCKET_COUNT + index % LATENCY_HISTOGRAM_SUB_BUCKET_COUNT;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void latency_histogram_record(latency_histogram_t* histogram, i64 value) {
+	metrics_counter_add(histogram->buckets + latency_histogram_get_bucket_index(value), 1);
+	metrics_counter_add(&histogram->count, 1);
+	metrics_counter_add(&histogram->sum, value);
+	i64 max = histogram->max;
+	while (value > max) {
+		if (atomic_compare_exchange_i64(&histogram->max, value, max)) break;
+		max = histogram->max;
+	}
+}
+
+// Returns the value below which 'percentile' (0-100) percent of the recorded values fall, or 0 if the histogram is empty.
+i64 latency_histogram_get_percentile(latency_histogram_t* histogram, float percentile) {
+	i64 total = 0;
+	for (i32 i = 0; i < LATENCY_HISTOGRAM_BUCKET_COUNT; ++i) {
+		total += histogram->buckets[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	i64 rank = (i64)ceil((double)percentile / 100.0 * (double)total);
+	rank = CLAMP(rank, 1, total);
+	i64 cumulative = 0;
+	for (i32 i = 0; i < LATENCY_HISTOGRAM_BUCKET_COUNT; ++i) {
+		cumulative += histogram->buckets[i];
+		if (cumulative >= rank) {
+			// Don't report more than the largest value actually seen.
+			return MIN(latency_histogram_get_bucket_upper_bound(i), histogram->max);
+		}
+	}
+	return histogram->max;
+}
+
+void metrics_write_family(memrw_t* out, const char* name, const char* type, const char* help) {
+	memrw_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_write_sample(memrw_t* out, const char* name, const char* labels, i64 value) {
+	if (labels) {
+		memrw_printf(out, "%s{%s} %lld\n", name, labels, value);
+	} else {
+		memrw_printf(out, "%s %lld\n", name, value);
+	}
+}
+
+void metrics_write_sample_float(memrw_t* out, const char* name, const char* labels, double value) {
+	if (labels) {
+		memrw_printf(out, "%s{%s} %.6f\n", name, labels, value);
+	} else {
+		memrw_printf(out, "%s %.6f\n", name, value);
+	}
+}
+
+// Writes the histogram as a summary (a few quantiles, the sum and the count), in seconds.
+void metrics_write_latency_summary(memrw_t* out, const char* name, const char* labels, latency_histogram_t* histogram) {
+	static const char* quantile_names[] = {"0.5", "0.9", "0.99", "0.999"};
+	static const float percentiles[] = {50.0f, 90.0f, 99.0f, 99.9f};
+	const char* separator = labels ? "," : "";
+	if (!labels) labels = "";
+	for (i32 i = 0; i < COUNT(percentiles); ++i) {
+		i64 value = latency_histogram_get_percentile(histogram, percentiles[i]);
+		memrw_printf(out, "%s{%s%squantile=\"%s\"} %.6f\n", name, labels, separator, quantile_names[i], (double)value * 1e-6);
+	}
+	char suffixed_name[256];
+	const char* sample_labels = labels[0] ? labels : NULL;
+	snprintf(suffixed_name, sizeof(suffixed_name), "%s_sum", name);
+	metrics_write_sample_float(out, suffixed_name, sample_labels, (double)histogram->sum * 1e-6);
+	snprintf(suffixed_name, sizeof(suffixed_name), "%s_count", name);
+	metrics_write_sample(out, suffixed_name, sample_labels, histogram->count);
+}
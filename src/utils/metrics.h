@@ -0,0 +1,62 @@
+/*
+  Slidescape, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2024  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+#include "intrinsics.h"
+#include "memrw.h"
+
+// Latency histogram with log-linear buckets (like HdrHistogram): values below 2^LATENCY_HISTOGRAM_SUB_BUCKET_BITS
+// each get their own bucket; above that, every power of two is split into 2^LATENCY_HISTOGRAM_SUB_BUCKET_BITS equal
+// buckets, so that percentiles are accurate to within 1/16th (6.25%) of the value.
+// Values are in microseconds; values of 2^40 us (about 12 days) or more are clamped.
+#define LATENCY_HISTOGRAM_SUB_BUCKET_BITS 4
+#define LATENCY_HISTOGRAM_SUB_BUCKET_COUNT (1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS)
+#define LATENCY_HISTOGRAM_MAX_VALUE_BITS 40
+#define LATENCY_HISTOGRAM_BUCKET_COUNT ((LATENCY_HISTOGRAM_MAX_VALUE_BITS - LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1) * LATENCY_HISTOGRAM_SUB_BUCKET_COUNT)
+
+// Can be updated from any thread without locking. Readers get an approximate snapshot (the count and the sum
+// may be a few values ahead of or behind the buckets), which is good enough for monitoring.
+typedef struct latency_histogram_t {
+	volatile i64 buckets[LATENCY_HISTOGRAM_BUCKET_COUNT];
+	volatile i64 count;
+	volatile i64 sum;
+	volatile i64 max;
+} latency_histogram_t;
+
+static inline void metrics_counter_add(volatile i64* counter, i64 amount) {
+	atomic_add_i64(counter, amount);
+}
+
+void latency_histogram_record(latency_histogram_t* histogram, i64 value);
+i64 latency_histogram_get_percentile(latency_histogram_t* histogram, float percentile);
+
+// Output in the Prometheus text exposition format. 'labels' may be NULL, or e.g. "command=\"batch\"".
+void metrics_write_family(memrw_t* out, const char* name, const char* type, const char* help);
+void metrics_write_sample(memrw_t* out, const char* name, const char* labels, i64 value);
+void metrics_write_sample_float(memrw_t* out, const char* name, const char* labels, double value);
+void metrics_write_latency_summary(memrw_t* out, const char* name, const char* labels, latency_histogram_t* histogram);
+
+#ifdef __cplusplus
+};
+#endif
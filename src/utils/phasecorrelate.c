@@ -22,6 +22,8 @@
 #include <tgmath.h>
 #include <complex.h>
 #include "minfft.h"
+#include "fft.h"
+#include "timerutils.h"
 
 #include "phasecorrelate.h"
 
@@ -156,79 +158,36 @@ static void fftshift_f(real_t* restrict src, real_t* restrict dst, i32 w, i32 h)
 // https://en.wikipedia.org/wiki/Phase_correlation
 // https://sthoduka.github.io/imreg_fmt/docs/phase-correlation/
 
-v2f phase_correlate(buffer2d_t* src1, buffer2d_t* src2, buffer2d_t* window, float background, float* response, i32 offset_limit) {
-
-//	debug_create_luminance_png(src1->data, src1->w, src1->h, 1.0f, "patch1_Y.png");
-//	debug_create_luminance_png(src2->data, src2->w, src2->h, 1.0f, "patch2_Y.png");
-
-	// Add padding
-	i32 smallest_h = MIN(src1->h, src2->h);
-	i32 smallest_w = MIN(src1->w, src2->w);
-	i32 largest_h = MAX(src1->h, src2->h);
-	i32 largest_w = MAX(src1->w, src2->w);
-	i32 h = (i32)next_pow2(largest_h /*+ smallest_h*/);
-	i32 w = (i32)next_pow2(largest_w /*+ smallest_w*/);
-
+// Reference implementation using minfft (power-of-two sizes only, separate transforms for both images).
+// Kept for comparison, see phase_correlate_benchmark().
+static void phase_correlation_surface_minfft(buffer2d_t* src1, buffer2d_t* src2, float background, i32 w, i32 h, real_t* C_shifted) {
 	buffer2d_t padded1 = {};
 	buffer2d_t padded2 = {};
-	buffer2d_t padded_win = {};
 
-	if(h != src1->h || w != src1->w) {
-        // TODO: fix memory leak
+	bool need_padding = (h != src1->h || w != src1->w || h != src2->h || w != src2->w);
+	if (need_padding) {
 		copy_make_border(src1, &padded1, 0, h - src1->h, 0, w - src1->w, background);
 		copy_make_border(src2, &padded2, 0, h - src2->h, 0, w - src2->w, background);
-
-		if(window) {
-			copy_make_border(window, &padded_win, 0, h - window->h, 0, w - window->w, background);
-		}
 	} else {
 		padded1 = *src1;
 		padded2 = *src2;
-		if (window) {
-			padded_win = *window;
-		}
 	}
 
 	ASSERT(padded1.w == w && padded1.h == h);
 	ASSERT(padded2.w == w && padded2.h == h);
 
-	// perform window multiplication if available
-	if (window) {
-//		buffer2d_multiply() // TODO: not implemented
-	}
-
-	// execute phase correlation equation
-	// Reference: http://en.wikipedia.org/wiki/Phase_correlation
-
-	size_t size = padded1.h * padded1.w * sizeof(minfft_cmpl);
+	i32 fft_w = w / 2 + 1;
+	size_t size = h * fft_w * sizeof(minfft_cmpl);
 	minfft_cmpl* FFT1 = calloc(1, size);
 	minfft_cmpl* FFT2 = calloc(1, size);
 	minfft_cmpl* P = calloc(1, size);
 	real_t* C = calloc(1, w * h * sizeof(real_t));
-	real_t* C_shifted = calloc(1, w * h * sizeof(real_t));
-
-	bool check = false;
-	bool create_debug_pngs = false;
-
-	if (create_debug_pngs) {
-		debug_create_luminance_png(padded1.data, padded1.w, padded1.h, 1.0f, "patch1_Y.png");
-		debug_create_luminance_png(padded2.data, padded2.w, padded2.h, 1.0f, "patch2_Y.png");
-	}
 
 	minfft_aux* a = minfft_mkaux_realdft_2d(h, w); // prepare aux data
 	minfft_realdft(padded1.data, FFT1, a);
 	minfft_realdft(padded2.data, FFT2, a);
-	i32 fft_w = w / 2 + 1;
-
-	real_t scale = 1.0f / (real_t)(w * h);
-
-	if (create_debug_pngs) {
-		debug_create_magnitude_plot(FFT1, fft_w, h, 1.0f, "dft1.png");
-		debug_create_magnitude_plot(FFT2, fft_w, h, 1.0f, "dft2.png");
-	}
 
 	// calculate cross-power spectrum
-
 	for (i32 y = 0; y < h; ++y) {
 		minfft_cmpl* src_row1 = FFT1 + y * fft_w;
 		minfft_cmpl* src_row2 = FFT2 + y * fft_w;
@@ -244,13 +203,91 @@ v2f phase_correlate(buffer2d_t* src1, buffer2d_t* src2, buffer2d_t* window, floa
 
 	minfft_invrealdft(P, C, a);
 	fftshift_f(C, C_shifted, w, h);
-	if (create_debug_pngs) debug_create_luminance_png(C, w, h, 10.0f * scale, "phasecorr_real.png");
-	if (create_debug_pngs) debug_create_luminance_png(C_shifted, w, h, 10.0f * scale, "phasecorr_real_shifted.png");
+
+	libc_free(a);
+	if (need_padding) {
+		free(padded1.data);
+		free(padded2.data);
+	}
+	free(FFT1);
+	free(FFT2);
+	free(P);
+	free(C);
+}
+
+// Computes the (unnormalized, fftshifted) phase correlation surface.
+// Both images are real, so they are packed into a single complex image z = a + ib, which needs only one forward FFT.
+// The two spectra can be recovered afterwards using the symmetry of real signals:
+// A[k] = (Z[k] + conj(Z[-k])) / 2
+// B[k] = (Z[k] - conj(Z[-k])) / 2i
+static void phase_correlation_surface(buffer2d_t* src1, buffer2d_t* src2, float background, i32 w, i32 h, real_t* C_shifted) {
+	i32 count = w * h;
+	float* Z = fft_get_scratch(FFT_SCRATCH_USER_0, count * 2 * sizeof(float));
+	float* spectrum = fft_get_scratch(FFT_SCRATCH_USER_1, count * 2 * sizeof(float));
+
+	for (i32 y = 0; y < h; ++y) {
+		float* row = Z + y * w * 2;
+		real_t* row1 = (y < src1->h) ? src1->data + y * src1->w : NULL;
+		real_t* row2 = (y < src2->h) ? src2->data + y * src2->w : NULL;
+		i32 w1 = row1 ? src1->w : 0;
+		i32 w2 = row2 ? src2->w : 0;
+		for (i32 x = 0; x < w; ++x) {
+			row[2 * x] = (x < w1) ? row1[x] : background;
+			row[2 * x + 1] = (x < w2) ? row2[x] : background;
+		}
+	}
+
+	fft_2d_forward(Z, w, h, spectrum);
+
+	// calculate cross-power spectrum (the spectrum is stored transposed, i.e. index = kx * h + ky)
+	float* P = Z;
+	for (i32 kx = 0; kx < w; ++kx) {
+		i32 neg_kx = (kx == 0) ? 0 : w - kx;
+		float* column = spectrum + kx * h * 2;
+		float* neg_column = spectrum + neg_kx * h * 2;
+		float* dst_column = P + kx * h * 2;
+		for (i32 ky = 0; ky < h; ++ky) {
+			i32 neg_ky = (ky == 0) ? 0 : h - ky;
+			float z_re = column[2 * ky];
+			float z_im = column[2 * ky + 1];
+			float zn_re = neg_column[2 * neg_ky];
+			float zn_im = -neg_column[2 * neg_ky + 1]; // conjugate
+			float a_re = 0.5f * (z_re + zn_re);
+			float a_im = 0.5f * (z_im + zn_im);
+			float b_re = 0.5f * (z_im - zn_im);
+			float b_im = -0.5f * (z_re - zn_re);
+			// p = a * conj(b)
+			float p_re = a_re * b_re + a_im * b_im;
+			float p_im = a_im * b_re - a_re * b_im;
+			float inv_magnitude = 1.0f / (sqrtf(p_re * p_re + p_im * p_im) + 0.0001f);
+			dst_column[2 * ky] = p_re * inv_magnitude;
+			dst_column[2 * ky + 1] = p_im * inv_magnitude;
+		}
+	}
+
+	float* C = spectrum;
+	fft_2d_inverse(P, w, h, C);
+
+	// take the real part, and swap quadrants
+	i32 h_half = h / 2;
+	i32 w_half = w / 2;
+	for (i32 y = 0; y < h; ++y) {
+		float* src_row = C + y * w * 2;
+		real_t* dst_row = C_shifted + ((y + h_half) % h) * w;
+		for (i32 x = 0; x < w_half; ++x) {
+			dst_row[x + w_half] = src_row[2 * x];
+			dst_row[x] = src_row[2 * (x + w_half)];
+		}
+	}
+}
+
+static v2f phase_correlation_find_peak(real_t* C_shifted, i32 w, i32 h, float* response, i32 offset_limit) {
+	real_t scale = 1.0f / (real_t)(w * h);
 
     // find highest and second highest peak
 	real_t highest = 0.0f;
     real_t lowest = -0.01f;
-	v2i peak = {};//find_highest_peak(C_shifted, w, h, &highest);
+	v2i peak = {};
     real_t second_highest = 0.0f;
     v2i second_highest_peak = {};
 
@@ -346,22 +383,79 @@ v2f phase_correlate(buffer2d_t* src1, buffer2d_t* src2, buffer2d_t* window, floa
     v2f peak_exact = {(float)peak.x + dx, (float)peak.y + dy};
     highest *= scale;
     if (response) *response = highest;
-	console_print("Phase correlation: highest peak (%d, %d), value = %g, ratio between peaks = %g; dist between peaks = %g; subpixel shift (%g, %g)\n", peak.x, peak.y, highest, ratio_between_peaks, distance_between_peaks, peak_exact.x, peak_exact.y);
-
-	if (check) {
-        // NOTE: the inverse DFT should give the original grayscale image back (sanity check)
-		minfft_invrealdft(FFT1, padded1.data, a);
-		minfft_invrealdft(FFT2, padded2.data, a);
-		if (create_debug_pngs) debug_create_luminance_png(padded1.data, w, h, scale, "patch1_Y_check.png");
-		if (create_debug_pngs) debug_create_luminance_png(padded2.data, w, h, scale, "patch2_Y_check.png");
+	console_print_verbose("Phase correlation: highest peak (%d, %d), value = %g, ratio between peaks = %g; dist between peaks = %g; subpixel shift (%g, %g)\n", peak.x, peak.y, highest, ratio_between_peaks, distance_between_peaks, peak_exact.x, peak_exact.y);
+	return peak_exact;
+}
+
+v2f phase_correlate(buffer2d_t* src1, buffer2d_t* src2, buffer2d_t* window, float background, float* response, i32 offset_limit) {
+	// NOTE: window multiplication is not implemented
+	(void)window;
+
+	// Pad to a size that the FFT can handle efficiently (not necessarily a power of two)
+	i32 h = fft_next_fast_size(MAX(src1->h, src2->h));
+	i32 w = fft_next_fast_size(MAX(src1->w, src2->w));
+
+	real_t* C_shifted = fft_get_scratch(FFT_SCRATCH_USER_2, w * h * sizeof(real_t));
+	phase_correlation_surface(src1, src2, background, w, h, C_shifted);
+	v2f peak_exact = phase_correlation_find_peak(C_shifted, w, h, response, offset_limit);
+	// Large buffers are not worth keeping around for every worker thread
+	if (w * h > 1024 * 1024) {
+		fft_release_scratch();
 	}
+	return peak_exact;
+}
 
-    libc_free(a);
-    free(FFT1);
-    free(FFT2);
-    free(P);
-    free(C);
-    free(C_shifted);
+// Compare the FFT backend against the minfft reference implementation.
+void phase_correlate_benchmark(i32 size, i32 iterations) {
+	size = ATLEAST(16, size);
+	iterations = ATLEAST(1, iterations);
+	i32 shift_x = size / 16;
+	i32 shift_y = -size / 32;
+
+	// Textured test image, and a shifted copy
+	buffer2d_t src1 = {size, size, malloc(size * size * sizeof(real_t))};
+	buffer2d_t src2 = {size, size, malloc(size * size * sizeof(real_t))};
+	u32 rng = 12345;
+	real_t* noise = malloc(size * size * sizeof(real_t));
+	for (i32 i = 0; i < size * size; ++i) {
+		rng = rng * 1664525u + 1013904223u;
+		noise[i] = (real_t)(rng >> 8) / (real_t)(1 << 24);
+	}
+	for (i32 y = 0; y < size; ++y) {
+		for (i32 x = 0; x < size; ++x) {
+			src1.data[y * size + x] = noise[y * size + x];
+			i32 sx = x - shift_x;
+			i32 sy = y - shift_y;
+			src2.data[y * size + x] = (sx >= 0 && sx < size && sy >= 0 && sy < size) ? noise[sy * size + sx] : 1.0f;
+		}
+	}
+	free(noise);
 
-	return peak_exact;
+	i32 w_pow2 = (i32)next_pow2(size);
+	real_t* C_minfft = malloc(w_pow2 * w_pow2 * sizeof(real_t));
+	i64 start = get_clock();
+	for (i32 i = 0; i < iterations; ++i) {
+		phase_correlation_surface_minfft(&src1, &src2, 1.0f, w_pow2, w_pow2, C_minfft);
+	}
+	float seconds_minfft = get_seconds_elapsed(start, get_clock());
+
+	i32 w_fast = fft_next_fast_size(size);
+	real_t* C_fast = malloc(w_fast * w_fast * sizeof(real_t));
+	start = get_clock();
+	for (i32 i = 0; i < iterations; ++i) {
+		phase_correlation_surface(&src1, &src2, 1.0f, w_fast, w_fast, C_fast);
+	}
+	float seconds_fast = get_seconds_elapsed(start, get_clock());
+
+	console_print("Phase correlation benchmark (%dx%d, %d iterations):\n", size, size, iterations);
+	console_print("  minfft (%dx%d): %g ms per call\n", w_pow2, w_pow2, seconds_minfft * 1000.0f / iterations);
+	phase_correlation_find_peak(C_minfft, w_pow2, w_pow2, NULL, 0);
+	console_print("  fft (%dx%d): %g ms per call\n", w_fast, w_fast, seconds_fast * 1000.0f / iterations);
+	phase_correlation_find_peak(C_fast, w_fast, w_fast, NULL, 0);
+	console_print("  expected shift: (%d, %d)\n", -shift_x, -shift_y);
+
+	free(C_minfft);
+	free(C_fast);
+	free(src1.data);
+	free(src2.data);
 }
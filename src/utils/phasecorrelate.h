@@ -34,6 +34,7 @@ typedef struct buffer2d_t {
 
 
 v2f phase_correlate(buffer2d_t* src1, buffer2d_t* src2, buffer2d_t* window, float background, float* response, i32 offset_limit);
+void phase_correlate_benchmark(i32 size, i32 iterations);
 
 #ifdef __cplusplus
 }
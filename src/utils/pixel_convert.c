@@ -0,0 +1,365 @@
+/*
+  Slidescape, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2024  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include "intrinsics.h"
+#include "mathutils.h"
+#include "pixel_convert.h"
+#include "timerutils.h"
+
+// Scalar versions, used for the remaining pixels after the SIMD loops (and as a reference by pixel_convert_benchmark()).
+
+static void convert_rgb_to_bgra_scalar(const u8* src, u32* dest, i64 pixel_count, u8 alpha) {
+	for (i64 i = 0; i < pixel_count; ++i) {
+		const u8* s = src + i * 3;
+		dest[i] = MAKE_BGRA(s[0], s[1], s[2], alpha);
+	}
+}
+
+static void convert_swap_red_blue_scalar(const u32* src, u32* dest, i64 pixel_count) {
+	for (i64 i = 0; i < pixel_count; ++i) {
+		u32 p = src[i];
+		dest[i] = ((p & 0xFF) << 16) | ((p >> 16) & 0xFF) | (p & 0xFF00FF00);
+	}
+}
+
+static void convert_gray_to_bgra_scalar(const u8* src, u32* dest, i64 pixel_count) {
+	for (i64 i = 0; i < pixel_count; ++i) {
+		u8 g = src[i];
+		dest[i] = MAKE_BGRA(g, g, g, 255);
+	}
+}
+
+static void convert_indexed_to_bgra_scalar(const u8* src, i32 src_pixel_stride, u32* dest, i64 pixel_count, const u32* lut) {
+	for (i64 i = 0; i < pixel_count; ++i) {
+		dest[i] = lut[*src];
+		src += src_pixel_stride;
+	}
+}
+
+static void convert_bgra_to_f32_y_scalar(const u32* src, float* dest, i64 pixel_count) {
+	for (i64 i = 0; i < pixel_count; ++i) {
+		u32 p = src[i];
+		u32 sum = (p & 0xFF) + ((p >> 16) & 0xFF) + (((p >> 8) & 0xFF) << 1);
+		dest[i] = (float)sum * (1.0f / 1020.0f);
+	}
+}
+
+static i64 convert_fill_empty_bgra_scalar(u32* pixels, i64 pixel_count, u32 fill_color) {
+	i64 nonempty_count = 0;
+	for (i64 i = 0; i < pixel_count; ++i) {
+		u32 p = pixels[i];
+		nonempty_count += (p != 0);
+		pixels[i] = p ? p : fill_color;
+	}
+	return nonempty_count;
+}
+
+void convert_rgb_to_bgra(const u8* src, u32* dest, i64 pixel_count, u8 alpha) {
+	i64 i = 0;
+#if defined(__ARM_NEON)
+	uint8x16_t a = vdupq_n_u8(alpha);
+	for (; i + 16 <= pixel_count; i += 16) {
+		uint8x16x3_t rgb = vld3q_u8(src + i * 3);
+		uint8x16x4_t bgra;
+		bgra.val[0] = rgb.val[2];
+		bgra.val[1] = rgb.val[1];
+		bgra.val[2] = rgb.val[0];
+		bgra.val[3] = a;
+		vst4q_u8((u8*)(dest + i), bgra);
+	}
+#elif defined(__SSSE3__)
+	// https://stackoverflow.com/questions/7194452/fast-vectorized-conversion-from-rgb-to-bgra
+	// 16 pixels = 48 bytes = 3 loads; each group of 4 pixels (12 bytes) gets shuffled into 16 bytes of BGRA.
+	__m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	__m128i a = _mm_set1_epi32((i32)((u32)alpha << 24u));
+	for (; i + 16 <= pixel_count; i += 16) {
+		const u8* s = src + i * 3;
+		__m128i p0 = _mm_loadu_si128((__m128i*)(s));
+		__m128i p1 = _mm_loadu_si128((__m128i*)(s + 16));
+		__m128i p2 = _mm_loadu_si128((__m128i*)(s + 32));
+		__m128i q0 = p0;                         // bytes 0..11
+		__m128i q1 = _mm_alignr_epi8(p1, p0, 12); // bytes 12..23
+		__m128i q2 = _mm_alignr_epi8(p2, p1, 8);  // bytes 24..35
+		__m128i q3 = _mm_srli_si128(p2, 4);       // bytes 36..47
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_or_si128(_mm_shuffle_epi8(q0, shuffle), a));
+		_mm_storeu_si128((__m128i*)(dest + i + 4), _mm_or_si128(_mm_shuffle_epi8(q1, shuffle), a));
+		_mm_storeu_si128((__m128i*)(dest + i + 8), _mm_or_si128(_mm_shuffle_epi8(q2, shuffle), a));
+		_mm_storeu_si128((__m128i*)(dest + i + 12), _mm_or_si128(_mm_shuffle_epi8(q3, shuffle), a));
+	}
+#endif
+	convert_rgb_to_bgra_scalar(src + i * 3, dest + i, pixel_count - i, alpha);
+}
+
+void convert_swap_red_blue(const u32* src, u32* dest, i64 pixel_count) {
+	i64 i = 0;
+#if defined(__ARM_NEON)
+	uint32x4_t b_mask = vdupq_n_u32(0x000000FF);
+	uint32x4_t r_mask = vdupq_n_u32(0x00FF0000);
+	uint32x4_t ga_mask = vdupq_n_u32(0xFF00FF00);
+	for (; i + 4 <= pixel_count; i += 4) {
+		uint32x4_t p = vld1q_u32(src + i);
+		uint32x4_t b = vandq_u32(p, b_mask);
+		uint32x4_t r = vandq_u32(p, r_mask);
+		uint32x4_t br_swapped = vorrq_u32(vshlq_n_u32(b, 16), vshrq_n_u32(r, 16));
+		vst1q_u32(dest + i, vorrq_u32(vandq_u32(p, ga_mask), br_swapped));
+	}
+#elif defined(__SSE2__)
+	__m128i b_mask = _mm_set1_epi32(0x000000FF);
+	__m128i r_mask = _mm_set1_epi32(0x00FF0000);
+	__m128i ga_mask = _mm_set1_epi32((i32)0xFF00FF00);
+	for (; i + 4 <= pixel_count; i += 4) {
+		__m128i p = _mm_loadu_si128((__m128i*)(src + i));
+		__m128i b = _mm_and_si128(p, b_mask);
+		__m128i r = _mm_and_si128(p, r_mask);
+		__m128i br_swapped = _mm_or_si128(_mm_slli_epi32(b, 16), _mm_srli_epi32(r, 16));
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_or_si128(_mm_and_si128(p, ga_mask), br_swapped));
+	}
+#endif
+	convert_swap_red_blue_scalar(src + i, dest + i, pixel_count - i);
+}
+
+void convert_gray_to_bgra(const u8* src, u32* dest, i64 pixel_count) {
+	i64 i = 0;
+#if defined(__ARM_NEON)
+	uint8x16_t a = vdupq_n_u8(255);
+	for (; i + 16 <= pixel_count; i += 16) {
+		uint8x16_t g = vld1q_u8(src + i);
+		uint8x16x4_t bgra;
+		bgra.val[0] = g;
+		bgra.val[1] = g;
+		bgra.val[2] = g;
+		bgra.val[3] = a;
+		vst4q_u8((u8*)(dest + i), bgra);
+	}
+#elif defined(__SSE2__)
+	__m128i a = _mm_set1_epi8(-1);
+	for (; i + 16 <= pixel_count; i += 16) {
+		__m128i g = _mm_loadu_si128((__m128i*)(src + i));
+		__m128i gg_lo = _mm_unpacklo_epi8(g, g); // GG GG GG...
+		__m128i ga_lo = _mm_unpacklo_epi8(g, a); // GA GA GA...
+		__m128i gg_hi = _mm_unpackhi_epi8(g, g);
+		__m128i ga_hi = _mm_unpackhi_epi8(g, a);
+		_mm_storeu_si128((__m128i*)(dest + i), _mm_unpacklo_epi16(gg_lo, ga_lo)); // GGGA GGGA...
+		_mm_storeu_si128((__m128i*)(dest + i + 4), _mm_unpackhi_epi16(gg_lo, ga_lo));
+		_mm_storeu_si128((__m128i*)(dest + i + 8), _mm_unpacklo_epi16(gg_hi, ga_hi));
+		_mm_storeu_si128((__m128i*)(dest + i + 12), _mm_unpackhi_epi16(gg_hi, ga_hi));
+	}
+#endif
+	convert_gray_to_bgra_scalar(src + i, dest + i, pixel_count - i);
+}
+
+void convert_indexed_to_bgra(const u8* src, i32 src_pixel_stride, u32* dest, i64 pixel_count, const u32* lut) {
+	// NOTE: there is no gather instruction below AVX2, so this is a plain (unrolled) table lookup.
+	// Because the table has 256 entries, the loads are independent and the loop is limited by the stores.
+	i64 i = 0;
+	const u8* s = src;
+	for (; i + 4 <= pixel_count; i += 4) {
+		u32 c0 = lut[s[0]];
+		u32 c1 = lut[s[src_pixel_stride]];
+		u32 c2 = lut[s[2 * src_pixel_stride]];
+		u32 c3 = lut[s[3 * src_pixel_stride]];
+		dest[i] = c0;
+		dest[i + 1] = c1;
+		dest[i + 2] = c2;
+		dest[i + 3] = c3;
+		s += 4 * src_pixel_stride;
+	}
+	convert_indexed_to_bgra_scalar(s, src_pixel_stride, dest + i, pixel_count - i, lut);
+}
+
+void convert_bgra_to_f32_y(const u32* src, float* dest, i64 pixel_count) {
+	i64 i = 0;
+#if defined(__ARM_NEON)
+	uint32x4_t mask = vdupq_n_u32(0xFF);
+	float32x4_t scale = vdupq_n_f32(1.0f / 1020.0f);
+	for (; i + 4 <= pixel_count; i += 4) {
+		uint32x4_t p = vld1q_u32(src + i);
+		uint32x4_t b = vandq_u32(p, mask);
+		uint32x4_t g = vandq_u32(vshrq_n_u32(p, 8), mask);
+		uint32x4_t r = vandq_u32(vshrq_n_u32(p, 16), mask);
+		uint32x4_t sum = vaddq_u32(vaddq_u32(r, b), vshlq_n_u32(g, 1));
+		vst1q_f32(dest + i, vmulq_f32(vcvtq_f32_u32(sum), scale));
+	}
+#elif defined(__SSE2__)
+	__m128i mask = _mm_set1_epi32(0xFF);
+	__m128 scale = _mm_set1_ps(1.0f / 1020.0f);
+	for (; i + 4 <= pixel_count; i += 4) {
+		__m128i p = _mm_loadu_si128((__m128i*)(src + i));
+		__m128i b = _mm_and_si128(p, mask);
+		__m128i g = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+		__m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), mask);
+		__m128i sum = _mm_add_epi32(_mm_add_epi32(r, b), _mm_slli_epi32(g, 1));
+		_mm_storeu_ps(dest + i, _mm_mul_ps(_mm_cvtepi32_ps(sum), scale));
+	}
+#endif
+	convert_bgra_to_f32_y_scalar(src + i, dest + i, pixel_count - i);
+}
+
+i64 convert_fill_empty_bgra(u32* pixels, i64 pixel_count, u32 fill_color) {
+	i64 i = 0;
+	i64 empty_count = 0;
+#if defined(__ARM_NEON)
+	uint32x4_t fill = vdupq_n_u32(fill_color);
+	uint32x4_t zero = vdupq_n_u32(0);
+	uint32x4_t empty_counts = vdupq_n_u32(0);
+	for (; i + 4 <= pixel_count; i += 4) {
+		uint32x4_t p = vld1q_u32(pixels + i);
+		uint32x4_t is_empty = vceqq_u32(p, zero);
+		vst1q_u32(pixels + i, vorrq_u32(p, vandq_u32(is_empty, fill)));
+		empty_counts = vsubq_u32(empty_counts, is_empty); // is_empty is all ones (-1) for empty pixels
+	}
+	empty_count = (i64)vgetq_lane_u32(empty_counts, 0) + vgetq_lane_u32(empty_counts, 1) +
+	              vgetq_lane_u32(empty_counts, 2) + vgetq_lane_u32(empty_counts, 3);
+#elif defined(__SSE2__)
+	__m128i fill = _mm_set1_epi32((i32)fill_color);
+	__m128i zero = _mm_setzero_si128();
+	__m128i empty_counts = _mm_setzero_si128();
+	for (; i + 4 <= pixel_count; i += 4) {
+		__m128i p = _mm_loadu_si128((__m128i*)(pixels + i));
+		__m128i is_empty = _mm_cmpeq_epi32(p, zero);
+		_mm_storeu_si128((__m128i*)(pixels + i), _mm_or_si128(p, _mm_and_si128(is_empty, fill)));
+		empty_counts = _mm_sub_epi32(empty_counts, is_empty); // is_empty is all ones (-1) for empty pixels
+	}
+	u32 lanes[4];
+	_mm_storeu_si128((__m128i*)lanes, empty_counts);
+	empty_count = (i64)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+	i64 nonempty_count = (i - empty_count) + convert_fill_empty_bgra_scalar(pixels + i, pixel_count - i, fill_color);
+	return nonempty_count;
+}
+
+// Check the SIMD conversions against the scalar versions, for all widths up to a few SIMD blocks (so that every
+// possible tail length is covered) and with unaligned source and destination pointers. Returns the number of mismatches.
+static i32 pixel_convert_check(void) {
+	enum { max_width = 67, max_misalignment = 3, guard = 4 };
+	u8 src_bytes[(max_width + 1) * 4 + 16];
+	u32 lut[256];
+	u32 rng = 12345;
+	for (i32 i = 0; i < COUNT(src_bytes); ++i) {
+		rng = rng * 1664525u + 1013904223u;
+		// Include some zero bytes, so that convert_fill_empty_bgra() has empty pixels to fill
+		src_bytes[i] = (rng >> 24) < 64 ? 0 : (u8)(rng >> 16);
+	}
+	for (i32 i = 0; i < 256; ++i) {
+		lut[i] = MAKE_BGRA(i, 255 - i, i / 2, 255);
+	}
+
+	u32 expected[max_width + guard];
+	u32 actual_storage[max_width + guard + 1];
+	float expected_y[max_width + guard];
+	float actual_y_storage[max_width + guard + 1];
+	i32 mismatch_count = 0;
+	for (i32 width = 0; width <= max_width; ++width) {
+		for (i32 misalignment = 0; misalignment <= max_misalignment; ++misalignment) {
+			const u8* src = src_bytes + misalignment;
+			u32* actual = actual_storage + (misalignment & 1); // also test unaligned destinations
+			float* actual_y = actual_y_storage + (misalignment & 1);
+			u32 src_u32[max_width];
+			memcpy(src_u32, src, width * sizeof(u32));
+			const char* failed = NULL;
+
+#define PIXEL_CONVERT_CHECK(name, call_expected, call_actual) \
+			memset(expected, 0xCD, sizeof(expected)); memset(actual, 0xCD, sizeof(expected)); \
+			call_expected; call_actual; \
+			if (!failed && memcmp(expected, actual, sizeof(expected)) != 0) failed = name;
+
+			PIXEL_CONVERT_CHECK("convert_rgb_to_bgra", convert_rgb_to_bgra_scalar(src, expected, width, 200),
+			                    convert_rgb_to_bgra(src, actual, width, 200));
+			PIXEL_CONVERT_CHECK("convert_swap_red_blue", convert_swap_red_blue_scalar(src_u32, expected, width),
+			                    convert_swap_red_blue(src_u32, actual, width));
+			PIXEL_CONVERT_CHECK("convert_gray_to_bgra", convert_gray_to_bgra_scalar(src, expected, width),
+			                    convert_gray_to_bgra(src, actual, width));
+			PIXEL_CONVERT_CHECK("convert_indexed_to_bgra", convert_indexed_to_bgra_scalar(src, 3, expected, width, lut),
+			                    convert_indexed_to_bgra(src, 3, actual, width, lut));
+			i64 expected_count = 0, actual_count = 0;
+			PIXEL_CONVERT_CHECK("convert_fill_empty_bgra",
+			                    memcpy(expected, src_u32, width * sizeof(u32)); expected_count = convert_fill_empty_bgra_scalar(expected, width, 0xFF0000FF),
+			                    memcpy(actual, src_u32, width * sizeof(u32)); actual_count = convert_fill_empty_bgra(actual, width, 0xFF0000FF));
+			if (!failed && expected_count != actual_count) failed = "convert_fill_empty_bgra (count)";
+#undef PIXEL_CONVERT_CHECK
+
+			memset(expected_y, 0xCD, sizeof(expected_y));
+			memset(actual_y, 0xCD, sizeof(expected_y));
+			convert_bgra_to_f32_y_scalar(src_u32, expected_y, width);
+			convert_bgra_to_f32_y(src_u32, actual_y, width);
+			if (!failed && memcmp(expected_y, actual_y, sizeof(expected_y)) != 0) failed = "convert_bgra_to_f32_y";
+
+			if (failed) {
+				console_print_error("  %s: SIMD output differs from scalar (width %d, misalignment %d)\n", failed, width, misalignment);
+				++mismatch_count;
+			}
+		}
+	}
+	return mismatch_count;
+}
+
+// Console command: pixel_convert_benchmark [pixel_count]
+void pixel_convert_benchmark(i32 pixel_count, i32 iterations) {
+	pixel_count = ATLEAST(16, pixel_count);
+	iterations = ATLEAST(1, iterations);
+	console_print("Pixel conversion benchmark (%d pixels, %d iterations):\n", pixel_count, iterations);
+	i32 mismatch_count = pixel_convert_check();
+	console_print("  check against scalar code (widths 0..67, unaligned pointers): %s\n", mismatch_count == 0 ? "OK" : "FAILED");
+
+	u8* src = malloc(pixel_count * 4);
+	u32* dest = malloc(pixel_count * sizeof(u32));
+	float* dest_y = malloc(pixel_count * sizeof(float));
+	u32 lut[256];
+	for (i32 i = 0; i < 256; ++i) {
+		lut[i] = MAKE_BGRA(i, i, i, 255);
+	}
+	u32 rng = 12345;
+	for (i32 i = 0; i < pixel_count * 4; ++i) {
+		rng = rng * 1664525u + 1013904223u;
+		src[i] = (u8)(rng >> 16);
+	}
+	memset(dest, 0, pixel_count * sizeof(u32)); // touch the pages, so that the first measurement is not penalized
+	memset(dest_y, 0, pixel_count * sizeof(float));
+
+	// Time both the SIMD and the scalar version of each conversion
+#define PIXEL_CONVERT_TIME(name, call_simd, call_scalar) { \
+		i64 start = get_clock(); \
+		for (i32 i = 0; i < iterations; ++i) { call_simd; } \
+		float seconds_simd = get_seconds_elapsed(start, get_clock()); \
+		start = get_clock(); \
+		for (i32 i = 0; i < iterations; ++i) { call_scalar; } \
+		float seconds_scalar = get_seconds_elapsed(start, get_clock()); \
+		console_print("  %-24s %8.1f Mpixels/s (scalar: %8.1f Mpixels/s)\n", name, \
+		              (double)pixel_count * iterations / (1e6 * ATLEAST(1e-9f, seconds_simd)), \
+		              (double)pixel_count * iterations / (1e6 * ATLEAST(1e-9f, seconds_scalar))); \
+	}
+
+	PIXEL_CONVERT_TIME("convert_rgb_to_bgra", convert_rgb_to_bgra(src, dest, pixel_count, 255),
+	                   convert_rgb_to_bgra_scalar(src, dest, pixel_count, 255));
+	PIXEL_CONVERT_TIME("convert_swap_red_blue", convert_swap_red_blue((u32*)src, dest, pixel_count),
+	                   convert_swap_red_blue_scalar((u32*)src, dest, pixel_count));
+	PIXEL_CONVERT_TIME("convert_gray_to_bgra", convert_gray_to_bgra(src, dest, pixel_count),
+	                   convert_gray_to_bgra_scalar(src, dest, pixel_count));
+	PIXEL_CONVERT_TIME("convert_indexed_to_bgra", convert_indexed_to_bgra(src, 1, dest, pixel_count, lut),
+	                   convert_indexed_to_bgra_scalar(src, 1, dest, pixel_count, lut));
+	PIXEL_CONVERT_TIME("convert_bgra_to_f32_y", convert_bgra_to_f32_y((u32*)src, dest_y, pixel_count),
+	                   convert_bgra_to_f32_y_scalar((u32*)src, dest_y, pixel_count));
+	PIXEL_CONVERT_TIME("convert_fill_empty_bgra", convert_fill_empty_bgra(dest, pixel_count, 0xFFFFFFFF),
+	                   convert_fill_empty_bgra_scalar(dest, pixel_count, 0xFFFFFFFF));
+#undef PIXEL_CONVERT_TIME
+
+	free(src);
+	free(dest);
+	free(dest_y);
+}
@@ -0,0 +1,55 @@
+/*
+  Slidescape, a whole-slide image viewer for digital pathology.
+  Copyright (C) 2019-2024  Pieter Valkema
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+// Pixel format conversions shared by the image backends.
+// All functions use SSE2/SSSE3 or NEON where available and fall back to scalar code for the remaining pixels.
+// BGRA pixels are stored as u32 values in the same layout as MAKE_BGRA() (i.e. bytes B, G, R, A in memory).
+
+// Packed 8-bit RGB (3 bytes per pixel) to BGRA, with the given alpha value.
+void convert_rgb_to_bgra(const u8* src, u32* dest, i64 pixel_count, u8 alpha);
+
+// Swaps the R and B channels, so this converts BGRA to RGBA as well as RGBA to BGRA. src and dest may be the same.
+void convert_swap_red_blue(const u32* src, u32* dest, i64 pixel_count);
+
+// 8-bit grayscale to opaque BGRA.
+void convert_gray_to_bgra(const u8* src, u32* dest, i64 pixel_count);
+
+// Color lookup for palettized images: dest[i] = lut[src[i * src_pixel_stride]].
+// The lookup table must have 256 entries, so that no bounds checks are needed.
+void convert_indexed_to_bgra(const u8* src, i32 src_pixel_stride, u32* dest, i64 pixel_count, const u32* lut);
+
+// BGRA (or RGBA) to luminance in the range 0..1, using Y = (R + 2G + B) / 4 (same as f32_rgb_to_f32_y()).
+void convert_bgra_to_f32_y(const u32* src, float* dest, i64 pixel_count);
+
+// Replaces fully transparent (zero) pixels with fill_color. Returns the number of pixels that were nonzero.
+i64 convert_fill_empty_bgra(u32* pixels, i64 pixel_count, u32 fill_color);
+
+// Checks the SIMD code paths against the scalar code, and measures the throughput of each conversion.
+void pixel_convert_benchmark(i32 pixel_count, i32 iterations);
+
+#ifdef __cplusplus
+}
+#endif